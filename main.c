@@ -1,6 +1,54 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <ur_management.h>
+#include <ur_logs.h>
+#include <ur_uci.h>
+#include <ur_term.h>
+#include <ur_upgrade.h>
+#include <ur_flight.h>
+#include <ur_history.h>
+#include <ur_tls.h>
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options] [ip] [port]\n"
+        "  -a <dir> serve public/ and templates/ from dir instead of the built-in copy\n"
+        "  -c <n>   maximum concurrent connections (default %d)\n"
+        "  -p <n>   maximum connections per client address (default %d)\n"
+        "  -b <n>   listen backlog (default %d)\n"
+        "  -H <s>   request header timeout in seconds (default %d)\n"
+        "  -B <s>   request body progress timeout in seconds (default %d)\n"
+        "  -k <s>   keep-alive idle timeout in seconds (default %d)\n"
+        "  -w <s>   response write stall timeout in seconds (default %d)\n"
+        "  -L <f>   system log file for /api/logs (default " LOG_DEFAULT_FILE ")\n"
+        "  -u <dir> UCI configuration for /api/config (default " UCI_DEFAULT_DIR ")\n"
+        "  -m <kb>  memory for terminal history across sessions (default %d)\n"
+        "  -r <pct> scale the per-client rate limits (default 100, 0 turns them off)\n"
+        "  -M <f>   keep metrics history in the ring file f, e.g. under /tmp\n"
+        "  -S <s>   seconds between syncs of the history file (default %d)\n"
+        "  -n <n>   lower the priority of commands by n\n"
+        "  -X <mb>  limit the address space of each command\n"
+        "  -G <dir> run commands in this cgroup\n"
+        "  -F <f>   aggregate the peers listed in f (host[:port] [name] per line) under /api/fleet\n"
+        "  -C <f>   serve HTTPS with the PEM certificate chain in f\n"
+        "  -K <f>   private key for -C, if not in the same file\n"
+        "  -T <n>   HTTPS port (default %d)\n"
+        "  -e       use epoll even where io_uring is available\n"
+        "  -s       serve the dashboard as a static shell filled in by /api/batch\n"
+        "SIGUSR2 restarts into the binary on disk without dropping connections.\n",
+        prog, DEFAULT_MAX_CONNECTIONS, DEFAULT_MAX_CONNECTIONS_PER_IP,
+        DEFAULT_LISTEN_BACKLOG, DEFAULT_HEADER_TIMEOUT, DEFAULT_BODY_TIMEOUT,
+        DEFAULT_KEEPALIVE_TIMEOUT, DEFAULT_WRITE_TIMEOUT, TERM_MEMORY_DEFAULT / 1024,
+        HISTORY_SYNC_DEFAULT, DEFAULT_TLS_PORT);
+#ifdef UR_HAVE_FLIGHT
+    fprintf(stderr, "SIGUSR1 writes the recent requests to " FLIGHT_DUMP_FILE
+                    ", also served as /api/admin/flight.\n");
+#endif
+#ifdef UR_HAVE_TLS
+    fprintf(stderr, "SIGHUP loads the HTTPS certificate and key again.\n");
+#endif
+}
 
 int main(int argc, char *argv[]) {
     server_config config = {
@@ -9,12 +57,45 @@ int main(int argc, char *argv[]) {
         .web_root = "public",
         .template_dir = "templates"
     };
+    int opt;
+
+    upgrade_init(argv);
+    while ((opt = getopt(argc, argv, "a:c:p:b:H:B:k:w:L:u:m:r:M:S:n:X:G:F:C:K:T:esh")) != -1) {
+        switch (opt) {
+            case 'a': config.asset_dir = optarg; break;
+            case 'c': config.max_connections = atoi(optarg); break;
+            case 'p': config.max_connections_per_ip = atoi(optarg); break;
+            case 'b': config.listen_backlog = atoi(optarg); break;
+            case 'H': config.header_timeout = atoi(optarg); break;
+            case 'B': config.body_timeout = atoi(optarg); break;
+            case 'k': config.keepalive_timeout = atoi(optarg); break;
+            case 'w': config.write_timeout = atoi(optarg); break;
+            case 'L': config.log_file = optarg; break;
+            case 'u': config.config_dir = optarg; break;
+            case 'm': config.terminal_memory = (size_t)atol(optarg) * 1024; break;
+            case 'r': config.rate_limit = atoi(optarg) > 0 ? atoi(optarg) : -1; break;
+            case 'M': config.history_file = optarg; break;
+            case 'S': config.history_sync = atoi(optarg); break;
+            case 'n': config.runner_nice = atoi(optarg); break;
+            case 'X': config.runner_memory = atoi(optarg); break;
+            case 'G': config.runner_cgroup = optarg; break;
+            case 'F': config.fleet_file = optarg; break;
+            case 'C': config.tls_cert = optarg; break;
+            case 'K': config.tls_key = optarg; break;
+            case 'T': config.tls_port = atoi(optarg); break;
+            case 'e': config.force_epoll = 1; break;
+            case 's': config.static_shell = 1; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
 
     // Parse command line arguments
-    if (argc > 1) {
-        config.ip_address = argv[1];
-        if (argc > 2) {
-            config.port = atoi(argv[2]);
+    if (optind < argc) {
+        config.ip_address = argv[optind];
+        if (optind + 1 < argc) {
+            config.port = atoi(argv[optind + 1]);
         }
     }
 
@@ -0,0 +1,76 @@
+// First-load data for the whole page in one request. A static shell
+// (data-shell="1") arrives without server-side values and is filled in
+// from here; the other scripts take their first round from this too.
+const shellMode = document.body.dataset.shell === '1';
+
+const dashboardBatch = fetch('/api/batch?parts=' +
+        (shellMode ? 'client,metrics,system,network,firmware,mqtt' : 'metrics,mqtt'))
+    .then(response => response.json())
+    .catch(error => {
+        console.error('Error fetching dashboard data:', error);
+        return null;
+    });
+
+// Resolves to one part of the batch, or fetches it on its own if the batch failed
+function initialPart(name, url) {
+    return dashboardBatch.then(data => data && data[name] ? data[name] :
+                                       fetch(url).then(response => response.json()));
+}
+
+function setText(id, value) {
+    const element = document.getElementById(id);
+    if (element && value !== undefined) element.textContent = value;
+}
+
+function renderSections(containerId, className, sections) {
+    const container = document.getElementById(containerId);
+    if (!container) return;
+
+    const wrapper = document.createElement('div');
+    wrapper.className = className;
+    sections.forEach(([title, text]) => {
+        const heading = document.createElement('h3');
+        heading.textContent = title;
+        const pre = document.createElement('pre');
+        pre.textContent = text || '';
+        wrapper.append(heading, pre);
+    });
+    container.replaceChildren(wrapper);
+}
+
+function hydrateShell(data) {
+    const client = data.client || {};
+    const system = data.system || {};
+    const network = data.network || {};
+    const firmware = data.firmware || {};
+
+    setText('clientIP', client.client_ip);
+    setText('serverTime', client.server_time);
+    setText('openwrtVersion', system.openwrt_version);
+    setText('kernelVersion', system.kernel_version);
+    setText('uptimeValue', system.uptime);
+    setText('firmwareVersion', firmware.version);
+
+    const backupName = document.getElementById('backupFileName');
+    if (backupName && client.server_time) {
+        backupName.value = 'openwrt-backup-' + client.server_time;
+    }
+
+    renderSections('systemInfo', 'system-info', [
+        ['OpenWRT Version', system.openwrt_version],
+        ['Kernel Version', system.kernel_version],
+        ['Uptime', system.uptime],
+        ['CPU Information', system.cpu_info]
+    ]);
+    renderSections('networkInfo', 'network-info', [
+        ['Network Interfaces', network.interfaces],
+        ['IP Addresses', network.ip_addresses],
+        ['Routing Table', network.routing]
+    ]);
+}
+
+if (shellMode) {
+    dashboardBatch.then(data => {
+        if (data) hydrateShell(data);
+    });
+}
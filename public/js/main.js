@@ -309,11 +309,18 @@ function stopMetricsUpdates() {
     }
 }
 
+// The first round of metrics comes with the page's batch request
+let firstMetrics = true;
+
 // Update all metrics
 function updateMetrics() {
     // Fetch metrics data from the server
-    fetch('/api/metrics')
-        .then(response => response.json())
+    const request = firstMetrics && typeof initialPart === 'function' ?
+        initialPart('metrics', '/api/metrics') :
+        fetch('/api/metrics').then(response => response.json());
+    firstMetrics = false;
+
+    request
         .then(data => {
             updateCPUMetrics(data.cpu);
             updateMemoryMetrics(data.memory);
@@ -9,7 +9,7 @@ document.addEventListener('DOMContentLoaded', function() {
     setupMqttUI();
     
     // Check if MQTT broker is running
-    checkMqttStatus();
+    checkMqttStatus(true);
     
     // Set up MQTT API docs popup event handlers
     document.getElementById('api-docs-btn')?.addEventListener('click', showApiDocs);
@@ -32,10 +32,13 @@ function setupMqttUI() {
     console.log('Setting up MQTT UI elements');
 }
 
-// Check MQTT broker status
-function checkMqttStatus() {
-    fetch('/api/mqtt/status')
-        .then(response => response.json())
+// Check MQTT broker status; the first check on load uses the page's batch request
+function checkMqttStatus(initial) {
+    const request = initial && typeof initialPart === 'function' ?
+        initialPart('mqtt', '/api/mqtt/status') :
+        fetch('/api/mqtt/status').then(response => response.json());
+
+    request
         .catch(error => {
             console.error('Error fetching MQTT status:', error);
             updateMqttStatusUI(false);
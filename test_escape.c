@@ -0,0 +1,248 @@
+/*
+ * Checks the escaping and URL decoding kernels against a byte-at-a-time
+ * reference. ur_escape.c is built in so every kernel this CPU has can be
+ * swapped in for find_special, not just the one kernel_pick() would choose.
+ * The cases put each kind of special byte at every offset of inputs up to
+ * a few blocks long, starting at several alignments, so the 16 and 32 byte
+ * block edges and the scalar tail are all crossed; then random inputs
+ * heavy in special bytes, broken % sequences and NULs follow.
+ *
+ *   make test
+ */
+#include "ur_escape.c"
+#include <stdio.h>
+
+#define TEST_MAX_LEN 80
+#define TEST_FUZZ_ROUNDS 200000
+#define TEST_FUZZ_LEN 300
+
+typedef struct {
+    const char *name;
+    find_fn find;
+} kernel;
+
+static kernel kernels[4];
+static int kernel_count;
+static const char *current;
+static unsigned long cases, failures;
+
+/* Reference */
+
+static int json_special(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\' || c == '/';
+}
+
+static int html_special(unsigned char c) {
+    return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+}
+
+static size_t ref_escape(int (*special)(unsigned char), replace_fn replace,
+                         char *out, const char *s, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (special(c)) {
+            n += replace(c, out + n);
+        } else {
+            out[n++] = c;
+        }
+    }
+    return n;
+}
+
+static int ref_hex(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static size_t ref_url_decode(char *dst, const char *src, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (src[i] == '%' && i + 2 < len && ref_hex(src[i + 1]) >= 0 && ref_hex(src[i + 2]) >= 0) {
+            dst[n++] = ref_hex(src[i + 1]) << 4 | ref_hex(src[i + 2]);
+            i += 2;
+        } else {
+            dst[n++] = src[i] == '+' ? ' ' : src[i];
+        }
+    }
+    return n;
+}
+
+/* Checks */
+
+static void report(const char *what, const char *s, size_t len, size_t want, size_t got) {
+    if (++failures > 20) return;
+    fprintf(stderr, "FAIL %s %s: len %zu, want %zu bytes, got %zu; input:", current, what, len,
+            want, got);
+    for (size_t i = 0; i < len; i++) fprintf(stderr, " %02x", (unsigned char)s[i]);
+    fputc('\n', stderr);
+}
+
+static void check_one(const char *s, size_t len) {
+    static char want[TEST_FUZZ_LEN * ESCAPE_MAX_GROWTH], got[TEST_FUZZ_LEN * ESCAPE_MAX_GROWTH];
+    static char inplace[TEST_FUZZ_LEN];
+    size_t w, g;
+
+    cases++;
+
+    w = ref_escape(json_special, json_replace, want, s, len);
+    g = escape_json(got, s, len);
+    if (g != w || memcmp(got, want, w) != 0) report("json", s, len, w, g);
+    g = escape_json(NULL, s, len);
+    if (g != w) report("json measure", s, len, w, g);
+
+    w = ref_escape(html_special, html_replace, want, s, len);
+    g = escape_html(got, s, len);
+    if (g != w || memcmp(got, want, w) != 0) report("html", s, len, w, g);
+    g = escape_html(NULL, s, len);
+    if (g != w) report("html measure", s, len, w, g);
+
+    char *dup = escape_html_dup(s, len);
+    if (!dup || memcmp(dup, want, w) != 0 || dup[w] != '\0') report("html dup", s, len, w, 0);
+    free(dup);
+
+    w = ref_url_decode(want, s, len);
+    g = escape_url_decode(got, s, len);
+    if (g != w || memcmp(got, want, w) != 0) report("url", s, len, w, g);
+    memcpy(inplace, s, len);
+    g = escape_url_decode(inplace, inplace, len);
+    if (g != w || memcmp(inplace, want, w) != 0) report("url in place", s, len, w, g);
+}
+
+// Copies s to a buffer that ends exactly where the input does, starting at
+// the given misalignment, so the kernels see every block phase
+static void check(const char *s, size_t len, size_t align) {
+    char *buf = malloc(align + len + 1);
+    memcpy(buf + align, s, len);
+    check_one(buf + align, len);
+    free(buf);
+}
+
+/* Cases */
+
+// One of every class: JSON controls, short escapes and NUL, the HTML set,
+// the URL set, bytes next to the control range and high bytes that must
+// not be mistaken for signed controls
+static const unsigned char specials[] = {
+    0x00, 0x01, 0x08, 0x09, 0x0a, 0x0c, 0x0d, 0x1e, 0x1f, '"', '\\', '/',
+    '&', '<', '>', '\'', '%', '+',
+    0x20, 0x7f, 0x80, 0x9f, 0xdf, 0xff,
+};
+
+static const size_t alignments[] = { 0, 1, 7, 15, 16, 17, 31 };
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static void check_offsets(void) {
+    char s[TEST_MAX_LEN];
+
+    for (size_t k = 0; k < COUNT(specials); k++) {
+        for (size_t len = 1; len <= TEST_MAX_LEN; len++) {
+            for (size_t at = 0; at < len; at++) {
+                memset(s, 'a', len);
+                s[at] = specials[k];
+                for (size_t a = 0; a < COUNT(alignments); a++) check(s, len, alignments[a]);
+            }
+        }
+    }
+
+    // Two hits in one block and a hit on each side of a block edge
+    for (size_t len = 2; len <= TEST_MAX_LEN; len++) {
+        for (size_t at = 0; at + 1 < len; at++) {
+            memset(s, 'a', len);
+            s[at] = '"';
+            s[len - 1] = '<';
+            check(s, len, 0);
+            s[at + 1] = '\n';
+            check(s, len, 3);
+        }
+    }
+}
+
+static void check_percent(void) {
+    static const char *seqs[] = {
+        "%", "%4", "%41", "%4g", "%g4", "%zz", "%%41", "%%", "%0", "%00", "%ff", "%FF",
+        "%fG", "+%2", "%2+", "%+2", "%\0""1", "%4\0",
+    };
+    static const size_t seq_lens[] = { 1, 2, 3, 3, 3, 3, 4, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 3 };
+    char s[TEST_MAX_LEN];
+
+    for (size_t k = 0; k < COUNT(seqs); k++) {
+        for (size_t len = seq_lens[k]; len <= TEST_MAX_LEN; len++) {
+            // Including sequences cut short by the end of the input
+            for (size_t at = 0; at < len; at++) {
+                memset(s, 'x', len);
+                size_t n = len - at < seq_lens[k] ? len - at : seq_lens[k];
+                memcpy(s + at, seqs[k], n);
+                for (size_t a = 0; a < COUNT(alignments); a++) check(s, len, alignments[a]);
+            }
+        }
+    }
+}
+
+static uint32_t fuzz_state = 0x2545f491;
+
+static uint32_t fuzz_next(void) {
+    fuzz_state ^= fuzz_state << 13;
+    fuzz_state ^= fuzz_state >> 17;
+    fuzz_state ^= fuzz_state << 5;
+    return fuzz_state;
+}
+
+static void check_fuzz(void) {
+    static const char pool[] = "%+&<>\"'\\/\n\t\x00\x1f" "0aF9gz";
+    char s[TEST_FUZZ_LEN];
+
+    for (int round = 0; round < TEST_FUZZ_ROUNDS; round++) {
+        size_t len = fuzz_next() % TEST_FUZZ_LEN;
+        // Mostly clean text with the occasional special byte, or dense specials
+        unsigned density = fuzz_next() % 4 == 0 ? 2 : 40;
+
+        for (size_t i = 0; i < len; i++) {
+            uint32_t r = fuzz_next();
+            if (r % density == 0) {
+                s[i] = pool[(r >> 8) % (sizeof(pool) - 1)];
+            } else if (r % 7 == 1) {
+                s[i] = (char)(r >> 16);
+            } else {
+                s[i] = 'a' + (r >> 8) % 26;
+            }
+        }
+        check(s, len, fuzz_next() % 32);
+    }
+}
+
+static void add_kernel(const char *name, find_fn find) {
+    kernels[kernel_count].name = name;
+    kernels[kernel_count].find = find;
+    kernel_count++;
+}
+
+int main(void) {
+    // Fills the tables the scalar kernel and the tails rely on
+    escape_kernel();
+
+    add_kernel("scalar", find_scalar);
+#if defined(ESCAPE_X86)
+    if (__builtin_cpu_supports("sse2")) add_kernel("sse2", find_sse2);
+    if (__builtin_cpu_supports("avx2")) add_kernel("avx2", find_avx2);
+#elif defined(__ARM_NEON)
+    add_kernel("neon", find_neon);
+#endif
+
+    for (int i = 0; i < kernel_count; i++) {
+        current = kernels[i].name;
+        find_special = kernels[i].find;
+        unsigned long before = failures;
+
+        check_offsets();
+        check_percent();
+        check_fuzz();
+        printf("escape %-6s %s\n", current, failures == before ? "ok" : "FAILED");
+    }
+
+    printf("%lu cases, %lu failures\n", cases, failures);
+    return failures ? 1 : 0;
+}
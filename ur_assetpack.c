@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include "ur_assets.h"
+#include "ur_crypto.h"
+#include "ur_gzip.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Build-time packer: ur_assetpack <out> <file>... writes the asset bundle
+ * that ur_assets.c links into the server. Each file gets a SHA-256 based
+ * ETag and, when it actually shrinks, a precompressed gzip variant.
+ *
+ * Stylesheets and scripts under public/ are minified first, then listed a
+ * second time under a name carrying a hash of the result, and quoted
+ * references to them in the HTML templates are rewritten to that name. The
+ * server lets browsers keep those for good; the plain names stay in the
+ * bundle and are revalidated as before.
+ */
+
+#define FINGERPRINT_LEN 10
+
+typedef struct {
+    const char *name;
+    char *data;
+    size_t len;
+    char *gzip;
+    size_t gzip_len;
+    char etag[ASSET_ETAG_SIZE];
+    uint32_t name_off;
+    uint32_t data_off;
+    uint32_t gzip_off;
+    uint32_t flags;
+    // Fingerprinted entries share the data of the asset they are named after
+    const char *source;
+} pack_entry;
+
+static void store_le32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static char* load(const char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *data = malloc(size > 0 ? size : 1);
+    if (data && fread(data, 1, size, file) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+
+    *len = size;
+    return data;
+}
+
+/* Minifying */
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static int is_word(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '$' || (unsigned char)c >= 0x80;
+}
+
+static int has_suffix(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// End of the string or template literal opening at s[i], or 0 when it is not
+// closed on its line and so probably is not one
+static size_t literal_end(const char *s, size_t len, size_t i) {
+    char quote = s[i];
+    int depth = 0;
+
+    for (size_t j = i + 1; j < len; j++) {
+        char c = s[j];
+        if (depth) {
+            // Inside ${...} of a template
+            if (c == '\'' || c == '"' || c == '`') {
+                j = literal_end(s, len, j);
+                if (!j--) return 0;
+            } else if (c == '{') {
+                depth++;
+            } else if (c == '}') {
+                depth--;
+            }
+        } else if (c == '\\') {
+            j++;
+        } else if (c == quote) {
+            return j + 1;
+        } else if (c == '\n' && quote != '`') {
+            return 0;
+        } else if (c == '$' && quote == '`' && j + 1 < len && s[j + 1] == '{') {
+            depth = 1;
+            j++;
+        }
+    }
+    return 0;
+}
+
+// End of the regular expression opening at s[i], flags aside, or 0
+static size_t regex_end(const char *s, size_t len, size_t i) {
+    int in_class = 0;
+
+    for (size_t j = i + 1; j < len; j++) {
+        if (s[j] == '\\') j++;
+        else if (s[j] == '\n') return 0;
+        else if (s[j] == '[') in_class = 1;
+        else if (s[j] == ']') in_class = 0;
+        else if (s[j] == '/' && !in_class) return j + 1;
+    }
+    return 0;
+}
+
+// Whether a slash after the first n bytes of output starts a regular
+// expression rather than dividing
+static int regex_allowed(const char *out, size_t n) {
+    static const char *keywords[] = {
+        "return", "typeof", "instanceof", "in", "of", "new", "delete", "void",
+        "throw", "case", "do", "else", "yield", "await", NULL
+    };
+
+    while (n && is_space(out[n - 1])) n--;
+    if (!n || strchr("(,=:[!&|?{};+-*%<>~^", out[n - 1])) return 1;
+    if (!is_word(out[n - 1])) return 0;
+
+    size_t start = n;
+    while (start && is_word(out[start - 1])) start--;
+    for (int k = 0; keywords[k]; k++) {
+        if (strlen(keywords[k]) == n - start && memcmp(out + start, keywords[k], n - start) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Turns the comment at s[i] into a single whitespace character the caller
+// goes on to collapse; returns where that character is
+static size_t skip_comment(char *s, size_t len, size_t i) {
+    if (s[i + 1] == '/') {
+        while (i < len - 1 && s[i] != '\n') i++;
+        s[i] = '\n';
+        return i;
+    }
+    const char *close = memmem(s + i + 2, len - i - 2, "*/", 2);
+    size_t last = close ? (size_t)(close - s) + 1 : len - 1;
+    // A line break inside still ends a statement
+    s[last] = memchr(s + i, '\n', last - i) ? '\n' : ' ';
+    return last;
+}
+
+// Drops comments and indentation in place. Line breaks stay wherever they
+// may end a statement, so automatic semicolons still go where they did.
+static size_t minify_js(char *s, size_t len) {
+    size_t i = 0, o = 0;
+
+    while (i < len) {
+        char c = s[i];
+        size_t end = 0;
+
+        if (c == '/' && i + 1 < len && (s[i + 1] == '/' || s[i + 1] == '*')) {
+            i = skip_comment(s, len, i);
+            continue;
+        }
+        if (c == '\'' || c == '"' || c == '`') end = literal_end(s, len, i);
+        else if (c == '/' && regex_allowed(s, o)) end = regex_end(s, len, i);
+        if (end) {
+            memmove(s + o, s + i, end - i);
+            o += end - i;
+            i = end;
+            continue;
+        }
+
+        if (is_space(c)) {
+            int newline = 0;
+            while (i < len && is_space(s[i])) newline |= s[i++] == '\n';
+            char prev = o ? s[o - 1] : '\n';
+            char next = i < len ? s[i] : '\n';
+            if (newline && !strchr("{};,(\n", prev)) {
+                s[o++] = '\n';
+            } else if ((is_word(prev) && (is_word(next) || next == '.')) ||
+                       (prev == next && (prev == '+' || prev == '-'))) {
+                s[o++] = ' ';
+            }
+            continue;
+        }
+        s[o++] = s[i++];
+    }
+    return o;
+}
+
+// Drops comments and collapses whitespace in place, keeping what selectors
+// need: a space before ':' or '(' can change what they match
+static size_t minify_css(char *s, size_t len) {
+    size_t i = 0, o = 0;
+
+    while (i < len) {
+        char c = s[i];
+
+        if (c == '/' && i + 1 < len && s[i + 1] == '*') {
+            i = skip_comment(s, len, i);
+            continue;
+        }
+        size_t end = c == '\'' || c == '"' ? literal_end(s, len, i) : 0;
+        if (end) {
+            memmove(s + o, s + i, end - i);
+            o += end - i;
+            i = end;
+            continue;
+        }
+
+        if (is_space(c)) {
+            while (i < len && is_space(s[i])) i++;
+            char prev = o ? s[o - 1] : '{';
+            char next = i < len ? s[i] : '}';
+            if (!strchr("{};,>(:", prev) && !strchr("{};,>)", next)) s[o++] = ' ';
+            continue;
+        }
+        if (c == '}' && o && s[o - 1] == ';') o--;
+        s[o++] = s[i++];
+    }
+    return o;
+}
+
+/* Fingerprinting */
+
+static void content_hash(const char *data, size_t len, char hex[SHA256_DIGEST_SIZE * 2 + 1]) {
+    sha256_ctx sha;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    sha256_init(&sha);
+    sha256_update(&sha, data, len);
+    sha256_final(&sha, digest);
+    sha256_hex(digest, hex);
+}
+
+// public/js/main.js becomes public/js/main.<hash>.js
+static char* fingerprint_name(const pack_entry *e) {
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    const char *ext = strrchr(e->name, '.');
+    size_t stem = ext - e->name;
+    char *name = malloc(strlen(e->name) + FINGERPRINT_LEN + 2);
+
+    if (!name) return NULL;
+    content_hash(e->data, e->len, hex);
+    sprintf(name, "%.*s.%.*s%s", (int)stem, e->name, FINGERPRINT_LEN, hex, ext);
+    return name;
+}
+
+// Replaces every quoted "from" or 'from' in a template with to
+static void rewrite_references(pack_entry *e, const char *from, const char *to) {
+    size_t from_len = strlen(from), to_len = strlen(to);
+    size_t count = 0;
+
+    for (const char *p = e->data; (p = memmem(p, e->data + e->len - p, from, from_len)); p++) count++;
+    if (!count) return;
+
+    char *data = malloc(e->len + count * (to_len > from_len ? to_len - from_len : 0) + 1);
+    if (!data) return;
+
+    size_t i = 0, o = 0;
+    while (i < e->len) {
+        char quote = i ? e->data[i - 1] : 0;
+        if ((quote == '"' || quote == '\'') && i + from_len < e->len &&
+            memcmp(e->data + i, from, from_len) == 0 && e->data[i + from_len] == quote) {
+            memcpy(data + o, to, to_len);
+            o += to_len;
+            i += from_len;
+            continue;
+        }
+        data[o++] = e->data[i++];
+    }
+    free(e->data);
+    e->data = data;
+    e->len = o;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(((const pack_entry *)a)->name, ((const pack_entry *)b)->name);
+}
+
+static uint32_t align(uint32_t offset) {
+    return (offset + ASSET_DATA_ALIGN - 1) & ~(uint32_t)(ASSET_DATA_ALIGN - 1);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <bundle> [file...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int files = argc - 2;
+    // Room for a fingerprinted entry next to every file
+    pack_entry *entries = calloc(files ? files * 2 : 1, sizeof(pack_entry));
+    if (!entries) return EXIT_FAILURE;
+
+    for (int i = 0; i < files; i++) {
+        pack_entry *e = &entries[i];
+        e->name = argv[i + 2];
+        while (strncmp(e->name, "./", 2) == 0) e->name += 2;
+
+        e->data = load(argv[i + 2], &e->len);
+        if (!e->data) {
+            perror(argv[i + 2]);
+            return EXIT_FAILURE;
+        }
+
+        if (strncmp(e->name, "public/", 7) != 0) continue;
+        if (has_suffix(e->name, ".css")) e->len = minify_css(e->data, e->len);
+        else if (has_suffix(e->name, ".js") && !has_suffix(e->name, ".min.js")) e->len = minify_js(e->data, e->len);
+    }
+
+    int count = files;
+    for (int i = 0; i < files; i++) {
+        pack_entry *e = &entries[i];
+        if (strncmp(e->name, "public/", 7) != 0 || !(has_suffix(e->name, ".css") || has_suffix(e->name, ".js"))) {
+            continue;
+        }
+
+        pack_entry *alias = &entries[count++];
+        alias->name = fingerprint_name(e);
+        if (!alias->name) return EXIT_FAILURE;
+        alias->data = e->data;
+        alias->len = e->len;
+        alias->flags = ASSET_FLAG_IMMUTABLE;
+        alias->source = e->name;
+
+        // Served from the web root, so the URL is the name without public/
+        for (int t = 0; t < files; t++) {
+            if (strncmp(entries[t].name, "templates/", 10) == 0 && has_suffix(entries[t].name, ".html")) {
+                rewrite_references(&entries[t], e->name + 6, alias->name + 6);
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        pack_entry *e = &entries[i];
+        char hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+        if (e->source) continue;
+        content_hash(e->data, e->len, hex);
+        snprintf(e->etag, sizeof(e->etag), "\"%.20s\"", hex);
+        e->gzip = gzip_variant(e->data, e->len, &e->gzip_len);
+    }
+
+    qsort(entries, count, sizeof(pack_entry), by_name);
+
+    // Lay out names after the index, then every payload on an aligned offset
+    uint32_t offset = ASSET_HEADER_SIZE + count * ASSET_ENTRY_SIZE;
+    for (int i = 0; i < count; i++) {
+        entries[i].name_off = offset;
+        offset += strlen(entries[i].name) + 1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (entries[i].source) continue;
+        offset = align(offset);
+        entries[i].data_off = offset;
+        offset += entries[i].len + 1;
+        if (entries[i].gzip) {
+            offset = align(offset);
+            entries[i].gzip_off = offset;
+            offset += entries[i].gzip_len + 1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (!entries[i].source) continue;
+        pack_entry key = { .name = entries[i].source };
+        const pack_entry *source = bsearch(&key, entries, count, sizeof(pack_entry), by_name);
+        if (!source) return EXIT_FAILURE;
+        memcpy(entries[i].etag, source->etag, ASSET_ETAG_SIZE);
+        entries[i].data_off = source->data_off;
+        entries[i].gzip = source->gzip;
+        entries[i].gzip_len = source->gzip_len;
+        entries[i].gzip_off = source->gzip_off;
+    }
+
+    unsigned char *blob = calloc(1, offset);
+    if (!blob) return EXIT_FAILURE;
+
+    memcpy(blob, ASSET_MAGIC, ASSET_MAGIC_LEN);
+    store_le32(blob + 8, count);
+    store_le32(blob + 12, offset);
+
+    for (int i = 0; i < count; i++) {
+        pack_entry *e = &entries[i];
+        unsigned char *index = blob + ASSET_HEADER_SIZE + i * ASSET_ENTRY_SIZE;
+
+        store_le32(index + ASSET_NAME_OFF, e->name_off);
+        store_le32(index + ASSET_NAME_LEN, strlen(e->name));
+        store_le32(index + ASSET_DATA_OFF, e->data_off);
+        store_le32(index + ASSET_DATA_LEN, e->len);
+        store_le32(index + ASSET_GZIP_OFF, e->gzip ? e->gzip_off : 0);
+        store_le32(index + ASSET_GZIP_LEN, e->gzip ? e->gzip_len : 0);
+        memcpy(index + ASSET_ETAG, e->etag, ASSET_ETAG_SIZE);
+        store_le32(index + ASSET_FLAGS, e->flags);
+
+        memcpy(blob + e->name_off, e->name, strlen(e->name));
+        if (e->source) continue;
+        memcpy(blob + e->data_off, e->data, e->len);
+        if (e->gzip) memcpy(blob + e->gzip_off, e->gzip, e->gzip_len);
+    }
+
+    FILE *out = fopen(argv[1], "wb");
+    if (!out || fwrite(blob, 1, offset, out) != offset || fclose(out) != 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    printf("packed %d assets, %d fingerprinted, into %s (%u bytes)\n", files, count - files, argv[1], offset);
+    return EXIT_SUCCESS;
+}
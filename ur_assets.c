@@ -0,0 +1,533 @@
+#include "ur_assets.h"
+#include "ur_management.h"
+#include "ur_conn.h"
+#include "ur_crypto.h"
+#include "ur_gzip.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+/*
+ * public/ and templates/ are packed at build time into assets.bin, which is
+ * linked into a page-aligned read-only section. Lookups are a binary search
+ * over the sorted index and responses point straight into the section, so
+ * serving an asset touches neither the filesystem nor the heap.
+ *
+ * An override directory (-a) gets the same treatment at run time: its
+ * public/ and templates/ trees are loaded into a snapshot with SHA-256
+ * ETags and gzip variants, and inotify watches them. A change rebuilds the
+ * whole snapshot on a worker thread and the loop thread swaps it in, so a
+ * lookup stays a pointer load and a binary search. Responses still sending
+ * from the previous snapshot hold a reference that keeps it alive until
+ * they finish. Without inotify the override files are read per request.
+ */
+
+__asm__(
+    ".pushsection .rodata.ur_assets,\"a\"\n"
+    ".balign 4096\n"
+    ".globl ur_asset_blob\n"
+    ".hidden ur_asset_blob\n"
+    "ur_asset_blob:\n"
+    ".incbin \"assets.bin\"\n"
+    ".globl ur_asset_blob_end\n"
+    ".hidden ur_asset_blob_end\n"
+    "ur_asset_blob_end:\n"
+    ".byte 0\n"
+    ".popsection\n"
+);
+
+extern const char ur_asset_blob[];
+extern const char ur_asset_blob_end[];
+
+#define ASSET_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | \
+                          IN_DELETE | IN_DELETE_SELF)
+#define ASSET_BUILDER_STACK (256 * 1024)
+
+typedef struct {
+    char *name;
+    // NULL for a file too large to hold, which is then read per request
+    char *data;
+    size_t len;
+    char *gzip;
+    size_t gzip_len;
+    char etag[ASSET_ETAG_SIZE];
+} snapshot_file;
+
+// The builder hands its result over through reload_fd; references are
+// counted under snapshot_lock, since the heavy worker reads assets too
+struct asset_snapshot {
+    int refs;
+    int count;
+    snapshot_file *files;
+};
+
+static uint32_t asset_count = 0;
+static char *override_dir = NULL;
+// The override trees held in the snapshot, relative to override_dir
+static char *trees[2];
+
+// 0 until assets_start(), then 1 while inotify watches the override trees, -1 without
+static int watch_state = 0;
+static int watch_fd = -1;
+static int root_wd = -1;
+static int reload_fd = -1;
+static event_handler watch_io;
+static event_handler reload_io;
+static ur_timer reload_timer;
+static asset_snapshot *current = NULL;
+static unsigned generation = 0;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set while a rebuild runs, with another one asked for when changes came in meanwhile
+static int building = 0;
+static int rebuild = 0;
+static int builder_joinable = 0;
+static pthread_t builder;
+static asset_snapshot *built = NULL;
+
+static uint32_t load_le32(const char *p) {
+    const uint8_t *b = (const uint8_t *)p;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+int assets_init(const char *dir, const char *web_root, const char *template_dir) {
+    size_t size = ur_asset_blob_end - ur_asset_blob;
+
+    free(override_dir);
+    override_dir = dir && *dir ? strdup(dir) : NULL;
+    free(trees[0]);
+    free(trees[1]);
+    trees[0] = strdup(web_root);
+    trees[1] = strdup(template_dir);
+
+    asset_count = 0;
+    if (size < ASSET_HEADER_SIZE || memcmp(ur_asset_blob, ASSET_MAGIC, ASSET_MAGIC_LEN) != 0 ||
+        load_le32(ur_asset_blob + 12) != size) {
+        fprintf(stderr, "assets: embedded bundle is missing or corrupt\n");
+        return -1;
+    }
+
+    uint32_t count = load_le32(ur_asset_blob + 8);
+    if (ASSET_HEADER_SIZE + (uint64_t)count * ASSET_ENTRY_SIZE > size) {
+        fprintf(stderr, "assets: embedded index is truncated\n");
+        return -1;
+    }
+
+    asset_count = count;
+    return 0;
+}
+
+static const char* find_entry(const char *name) {
+    size_t name_len = strlen(name);
+    uint32_t low = 0, high = asset_count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const char *entry = ur_asset_blob + ASSET_HEADER_SIZE + (size_t)mid * ASSET_ENTRY_SIZE;
+        const char *key = ur_asset_blob + load_le32(entry + ASSET_NAME_OFF);
+        size_t key_len = load_le32(entry + ASSET_NAME_LEN);
+
+        int cmp = memcmp(name, key, name_len < key_len ? name_len : key_len);
+        if (cmp == 0) cmp = (name_len > key_len) - (name_len < key_len);
+        if (cmp == 0) return entry;
+
+        if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+static int stat_override(const char *name, char *path, size_t path_len, struct stat *st) {
+    snprintf(path, path_len, "%s/%s", override_dir, name);
+    return stat(path, st) == 0 && S_ISREG(st->st_mode) ? 0 : -1;
+}
+
+static void override_etag(asset *out, const struct stat *st) {
+    snprintf(out->etag, sizeof(out->etag), "\"%lx-%lx\"",
+             (unsigned long)st->st_size, (unsigned long)st->st_mtime);
+}
+
+// Development override: the file is read fresh and tagged by size and mtime
+static int open_override(const char *name, asset *out) {
+    char path[MAX_PATH_LENGTH * 2];
+    struct stat st;
+
+    if (stat_override(name, path, sizeof(path), &st) < 0) return -1;
+
+    size_t size;
+    char *content = read_file(path, &size);
+    if (!content) return -1;
+
+    out->data = content;
+    out->len = size;
+    out->owned = content;
+    override_etag(out, &st);
+    return 0;
+}
+
+/* Override snapshot */
+
+static void snapshot_release(asset_snapshot *s) {
+    if (!s) return;
+    pthread_mutex_lock(&snapshot_lock);
+    int refs = --s->refs;
+    pthread_mutex_unlock(&snapshot_lock);
+    if (refs > 0) return;
+
+    for (int i = 0; i < s->count; i++) {
+        free(s->files[i].name);
+        free(s->files[i].data);
+        free(s->files[i].gzip);
+    }
+    free(s->files);
+    free(s);
+}
+
+static int snapshot_add(asset_snapshot *s, int *cap, const char *name, const char *path,
+                        const struct stat *st) {
+    if (s->count == *cap) {
+        int new_cap = *cap ? *cap * 2 : 64;
+        snapshot_file *files = realloc(s->files, new_cap * sizeof(*files));
+        if (!files) return -1;
+        s->files = files;
+        *cap = new_cap;
+    }
+
+    snapshot_file *f = &s->files[s->count];
+    memset(f, 0, sizeof(*f));
+    f->name = strdup(name);
+    if (!f->name) return -1;
+    s->count++;
+
+    // A file gone or too large by now is left to the per-request path
+    size_t size;
+    if (st->st_size > ASSET_SNAPSHOT_FILE_MAX || !(f->data = read_file(path, &size))) return 0;
+    f->len = size;
+
+    sha256_ctx sha;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    sha256_init(&sha);
+    sha256_update(&sha, f->data, f->len);
+    sha256_final(&sha, digest);
+    sha256_hex(digest, hex);
+    snprintf(f->etag, sizeof(f->etag), "\"%.20s\"", hex);
+
+    f->gzip = gzip_variant(f->data, f->len, &f->gzip_len);
+    return 0;
+}
+
+// Each directory is watched before it is listed, so nothing written during the walk is missed
+static int snapshot_walk(asset_snapshot *s, int *cap, const char *name, int depth) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", override_dir, name);
+
+    if (inotify_add_watch(watch_fd, path, ASSET_WATCH_MASK | IN_ONLYDIR) < 0) {
+        // A missing tree is fine, the root watch sees it appear; a lost watch is not
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+
+    struct dirent *de;
+    int rc = 0;
+    while (rc == 0 && (de = readdir(dir))) {
+        // Hidden files are mostly editor swap and backup files
+        if (de->d_name[0] == '.') continue;
+
+        char child[PATH_MAX];
+        struct stat st;
+        if (snprintf(child, sizeof(child), "%s/%s", name, de->d_name) >= (int)sizeof(child)) continue;
+        snprintf(path, sizeof(path), "%s/%s", override_dir, child);
+        if (stat(path, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            if (depth < ASSET_WATCH_DEPTH) rc = snapshot_walk(s, cap, child, depth + 1);
+        } else if (S_ISREG(st.st_mode)) {
+            rc = snapshot_add(s, cap, child, path, &st);
+        }
+    }
+    closedir(dir);
+    return rc;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(((const snapshot_file *)a)->name, ((const snapshot_file *)b)->name);
+}
+
+// Runs on the builder thread and touches nothing the loop thread reads
+static asset_snapshot* snapshot_build(void) {
+    asset_snapshot *s = calloc(1, sizeof(*s));
+    int cap = 0;
+    if (!s) return NULL;
+    s->refs = 1;
+
+    for (int i = 0; i < 2; i++) {
+        if (snapshot_walk(s, &cap, trees[i], 0) < 0) {
+            snapshot_release(s);
+            return NULL;
+        }
+    }
+    qsort(s->files, s->count, sizeof(snapshot_file), by_name);
+    return s;
+}
+
+static const snapshot_file* snapshot_find(const asset_snapshot *s, const char *name) {
+    snapshot_file key = { .name = (char *)name };
+    return bsearch(&key, s->files, s->count, sizeof(snapshot_file), by_name);
+}
+
+static void* reload_worker(void *arg) {
+    (void)arg;
+    uint64_t one = 1;
+    built = snapshot_build();
+    if (write(reload_fd, &one, sizeof(one)) < 0) perror("assets: eventfd");
+    return NULL;
+}
+
+static void reload_start(void) {
+    if (building) {
+        rebuild = 1;
+        return;
+    }
+    building = 1;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, ASSET_BUILDER_STACK);
+    builder_joinable = pthread_create(&builder, &attr, reload_worker, NULL) == 0;
+    pthread_attr_destroy(&attr);
+
+    // Without a thread the loop builds it; the swap still happens from reload_done()
+    if (!builder_joinable) reload_worker(NULL);
+}
+
+static void reload_done(void *data, unsigned events) {
+    (void)data;
+    (void)events;
+    uint64_t count;
+    while (read(reload_fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+    if (!building) return;
+
+    if (builder_joinable) pthread_join(builder, NULL);
+    building = 0;
+
+    // A snapshot that cannot be built or kept watched gives way to per-request reads
+    if (!built) fprintf(stderr, "assets: cannot snapshot %s, reading it per request\n", override_dir);
+    pthread_mutex_lock(&snapshot_lock);
+    asset_snapshot *old = current;
+    current = built;
+    pthread_mutex_unlock(&snapshot_lock);
+    built = NULL;
+    generation++;
+    snapshot_release(old);
+
+    if (rebuild) {
+        rebuild = 0;
+        reload_start();
+    }
+}
+
+static void reload_timer_fired(ur_timer *timer) {
+    (void)timer;
+    reload_start();
+}
+
+static int is_tree(const char *name) {
+    return strcmp(name, trees[0]) == 0 || strcmp(name, trees[1]) == 0;
+}
+
+static void watch_events(void *data, unsigned events) {
+    (void)data;
+    (void)events;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+
+    for (;;) {
+        ssize_t n = read(watch_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            // Next to the trees the override directory may hold anything
+            if (ev->wd == root_wd && !(ev->len && is_tree(ev->name))) continue;
+            changed = 1;
+        }
+    }
+
+    // Saving one file is often several events; rebuild once they settle
+    if (changed) timer_arm(&conn_server_loop()->timers, &reload_timer, ASSET_RELOAD_DELAY_MS);
+}
+
+static void assets_watch(void) {
+    event_loop *loop = conn_server_loop();
+    watch_state = -1;
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    reload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    watch_io.callback = watch_events;
+    reload_io.callback = reload_done;
+
+    // The root watch sees the trees themselves being created, replaced or removed
+    if (watch_fd >= 0 && reload_fd >= 0) {
+        root_wd = inotify_add_watch(watch_fd, override_dir,
+                                    IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR);
+    }
+    if (root_wd < 0 || event_add(loop, watch_fd, EVENT_READ, &watch_io) < 0) {
+        if (watch_fd >= 0) close(watch_fd);
+        if (reload_fd >= 0) close(reload_fd);
+        watch_fd = reload_fd = -1;
+        return;
+    }
+    if (event_add(loop, reload_fd, EVENT_READ, &reload_io) < 0) {
+        event_del(loop, watch_fd, &watch_io);
+        close(watch_fd);
+        close(reload_fd);
+        watch_fd = reload_fd = -1;
+        return;
+    }
+
+    timer_init(&reload_timer, reload_timer_fired, NULL);
+    watch_state = 1;
+
+    // Files are read per request until the first snapshot is in
+    reload_start();
+}
+
+void assets_start(void) {
+    if (override_dir && watch_state == 0) assets_watch();
+}
+
+// Returns 0 with out filled in, -1 when the override directory does not have name,
+// or 1 when it has to be read from disk (no snapshot yet, or too large to hold)
+static int open_snapshot(const char *name, asset *out) {
+    int found = 1;
+
+    pthread_mutex_lock(&snapshot_lock);
+    const snapshot_file *f = current ? snapshot_find(current, name) : NULL;
+    if (current && !f) {
+        found = -1;
+    } else if (f && f->data) {
+        out->data = f->data;
+        out->len = f->len;
+        out->gzip = f->gzip;
+        out->gzip_len = f->gzip_len;
+        memcpy(out->etag, f->etag, sizeof(out->etag));
+        out->snapshot = current;
+        current->refs++;
+        found = 0;
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return found;
+}
+
+static int open_bundled(const char *name, asset *out) {
+    const char *entry = find_entry(name);
+    if (!entry) return -1;
+
+    out->data = ur_asset_blob + load_le32(entry + ASSET_DATA_OFF);
+    out->len = load_le32(entry + ASSET_DATA_LEN);
+    if (load_le32(entry + ASSET_GZIP_LEN)) {
+        out->gzip = ur_asset_blob + load_le32(entry + ASSET_GZIP_OFF);
+        out->gzip_len = load_le32(entry + ASSET_GZIP_LEN);
+    }
+    memcpy(out->etag, entry + ASSET_ETAG, ASSET_ETAG_SIZE);
+    out->etag[ASSET_ETAG_SIZE - 1] = '\0';
+    out->immutable = (load_le32(entry + ASSET_FLAGS) & ASSET_FLAG_IMMUTABLE) != 0;
+    return 0;
+}
+
+int asset_open(const char *name, asset *out) {
+    memset(out, 0, sizeof(*out));
+    out->fd = -1;
+
+    // Asset names never climb out of the bundle root
+    if (strstr(name, "..")) return -1;
+
+    if (override_dir) {
+        int found = open_snapshot(name, out);
+        if (found == 0 || (found > 0 && open_override(name, out) == 0)) return 0;
+    }
+    return open_bundled(name, out);
+}
+
+int asset_open_file(const char *name, asset *out) {
+    char path[MAX_PATH_LENGTH * 2];
+    struct stat st;
+
+    memset(out, 0, sizeof(*out));
+    out->fd = -1;
+
+    if (strstr(name, "..")) return -1;
+
+    if (override_dir) {
+        int found = open_snapshot(name, out);
+        if (found == 0) return 0;
+        if (found > 0 && stat_override(name, path, sizeof(path), &st) == 0) {
+            out->fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (out->fd >= 0) {
+                out->len = st.st_size;
+                override_etag(out, &st);
+                return 0;
+            }
+        }
+    }
+    return open_bundled(name, out);
+}
+
+int asset_exists(const char *name) {
+    char path[MAX_PATH_LENGTH * 2];
+    struct stat st;
+
+    if (strstr(name, "..")) return 0;
+    if (override_dir) {
+        pthread_mutex_lock(&snapshot_lock);
+        int snapshot = current != NULL;
+        int found = snapshot && snapshot_find(current, name) != NULL;
+        pthread_mutex_unlock(&snapshot_lock);
+        if (snapshot ? found : stat_override(name, path, sizeof(path), &st) == 0) return 1;
+    }
+    return find_entry(name) != NULL;
+}
+
+void asset_close(asset *a) {
+    free(a->owned);
+    a->owned = NULL;
+    if (a->fd >= 0) close(a->fd);
+    a->fd = -1;
+    snapshot_release(a->snapshot);
+    a->snapshot = NULL;
+}
+
+unsigned assets_generation(void) {
+    return generation;
+}
+
+void* asset_retain(const asset *a) {
+    if (a->snapshot) {
+        pthread_mutex_lock(&snapshot_lock);
+        a->snapshot->refs++;
+        pthread_mutex_unlock(&snapshot_lock);
+    }
+    return a->snapshot;
+}
+
+void asset_release(void *ref) {
+    snapshot_release(ref);
+}
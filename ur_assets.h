@@ -0,0 +1,91 @@
+#ifndef UR_ASSETS_H
+#define UR_ASSETS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bundle layout shared by the packer and the server. All integers are
+ * little-endian so a bundle packed on the build host is valid on any target.
+ *
+ *   header | entries[count] sorted by name | names | data (16-byte aligned)
+ *
+ * Every data and gzip region is followed by a NUL that is not counted in
+ * its length, so text assets can be used as C strings in place. Several
+ * entries may point at the same region: a stylesheet or script is also
+ * listed under a fingerprinted name, e.g. public/js/main.<hash>.js, that
+ * carries ASSET_FLAG_IMMUTABLE.
+ */
+
+#define ASSET_MAGIC "URASSET2"
+#define ASSET_MAGIC_LEN 8
+#define ASSET_HEADER_SIZE 16
+#define ASSET_ENTRY_SIZE 52
+#define ASSET_ETAG_SIZE 24
+#define ASSET_DATA_ALIGN 16
+
+// Override files are held in memory up to this size, larger ones read per request
+#define ASSET_SNAPSHOT_FILE_MAX (4 * 1024 * 1024)
+// A burst of edits settles for this long before the snapshot is rebuilt
+#define ASSET_RELOAD_DELAY_MS 200
+#define ASSET_WATCH_DEPTH 8
+
+// Offsets of the fields inside one index entry
+#define ASSET_NAME_OFF 0
+#define ASSET_NAME_LEN 4
+#define ASSET_DATA_OFF 8
+#define ASSET_DATA_LEN 12
+#define ASSET_GZIP_OFF 16
+#define ASSET_GZIP_LEN 20
+#define ASSET_ETAG 24
+#define ASSET_FLAGS 48
+
+// The name carries a hash of the content, which can therefore be cached for good
+#define ASSET_FLAG_IMMUTABLE 1
+
+typedef struct asset_snapshot asset_snapshot;
+
+typedef struct {
+    const char *data;
+    size_t len;
+    const char *gzip;
+    size_t gzip_len;
+    char etag[ASSET_ETAG_SIZE];
+    // Fingerprinted bundle asset; override files never are
+    int immutable;
+    // Set when the asset came from the override directory and must be freed
+    char *owned;
+    // Override file opened by asset_open_file(), or -1
+    int fd;
+    // Reloaded override snapshot the data points into, held until asset_close()
+    asset_snapshot *snapshot;
+} asset;
+
+// Validates the linked bundle; files under override_dir, if given, win over it.
+// Its web_root and template_dir trees are watched and reloaded as they change.
+int assets_init(const char *override_dir, const char *web_root, const char *template_dir);
+
+// Watches the override directory and keeps a snapshot of it; called from the
+// loop thread once the server loop is up
+void assets_start(void);
+
+// Looks up an asset by its path relative to the source tree, e.g. "public/css/styles.css"
+int asset_open(const char *name, asset *out);
+
+// Like asset_open(), but override files are opened instead of read so they can be sent zero-copy
+int asset_open_file(const char *name, asset *out);
+
+int asset_exists(const char *name);
+
+// Bumped each time a reload swaps in new override files; anything built from
+// assets is stale once it changes
+unsigned assets_generation(void);
+
+void asset_close(asset *a);
+
+// Keeps the asset's data valid past asset_close(); hand the result to asset_release()
+void* asset_retain(const asset *a);
+
+void asset_release(void *ref);
+
+#endif
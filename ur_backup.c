@@ -0,0 +1,482 @@
+#include "ur_backup.h"
+#include "ur_crypto.h"
+#include "ur_gzip.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+/*
+ * Configuration backups are generated while they are being downloaded:
+ * a tar writer walks the selected paths, its output is gzipped and
+ * optionally encrypted, and each stage works on a fixed-size buffer.
+ * Nothing is staged on flash or in /tmp, so memory stays the same
+ * whatever the archive size.
+ *
+ * Encrypted archives use the OpenSSL "enc" layout so they can be opened
+ * without this server:
+ *   openssl enc -d -chacha20 -pbkdf2 -iter 10000 -md sha256 -in <file>
+ */
+
+typedef struct {
+    const char *name;
+    const char *paths[8];
+} backup_set;
+
+static const backup_set backup_sets[] = {
+    {"system",   {"/etc/config/system", "/etc/passwd", "/etc/group", "/etc/shadow",
+                  "/etc/crontabs", "/etc/rc.local", "/etc/sysupgrade.conf", NULL}},
+    {"network",  {"/etc/config/network", "/etc/config/wireless", "/etc/config/dhcp", NULL}},
+    {"firewall", {"/etc/config/firewall", "/etc/firewall.user", NULL}},
+    {"services", {"/etc/config", "/etc/init.d", NULL}},
+    {"packages", {"/etc/opkg.conf", "/etc/opkg", "/usr/lib/opkg/status", NULL}},
+    {"data",     {"/root", "/etc/dropbear", NULL}},
+};
+
+#define BACKUP_SET_COUNT (sizeof(backup_sets) / sizeof(backup_sets[0]))
+#define BACKUP_DEFAULT_SETS 0x07
+// Room for a header behind a ././@LongLink record holding a PATH_MAX target
+#define BACKUP_PENDING_SIZE (512 + 512 + (PATH_MAX + 511) / 512 * 512)
+
+typedef struct {
+    int used;
+    time_t created;
+    char file_name[BACKUP_NAME_MAX];
+    unsigned sets;
+    int encrypt;
+    char password[128];
+} backup_job;
+
+typedef struct {
+    char roots[BACKUP_MAX_ROOTS][MAX_PATH_LENGTH];
+    int root_count;
+    int root_index;
+
+    DIR *dirs[BACKUP_MAX_DEPTH];
+    char dir_paths[BACKUP_MAX_DEPTH][MAX_PATH_LENGTH];
+    int depth;
+
+    int fd;
+    uint64_t file_size;
+    uint64_t file_remaining;
+    uint8_t pending[BACKUP_PENDING_SIZE];
+    size_t pending_len;
+    size_t pending_pos;
+    int trailer_queued;
+    int eof;
+
+    uint8_t raw[BACKUP_RAW_SIZE];
+    size_t raw_len;
+    size_t raw_pos;
+    gzip_stream gz;
+
+    int encrypt;
+    chacha20_ctx cipher;
+    uint8_t prefix[16];
+    size_t prefix_len;
+    size_t prefix_pos;
+} backup_stream;
+
+static backup_job jobs[BACKUP_MAX_JOBS];
+
+/* Tar writer */
+
+static void tar_octal(char *field, size_t size, uint64_t value) {
+    snprintf(field, size, "%0*llo", (int)size - 1, (unsigned long long)value);
+}
+
+static int tar_header(uint8_t *block, const char *name, const struct stat *st,
+                      char type, const char *link) {
+    char *h = (char *)block;
+    size_t name_len = strlen(name);
+
+    memset(block, 0, 512);
+
+    if (name_len <= 100) {
+        memcpy(h, name, name_len);
+    } else {
+        // ustar splits long names at a '/' into prefix (155) and name (100)
+        const char *split = name + name_len - 101;
+        while (*split && *split != '/') split++;
+        if (!*split || split - name > 155) return -1;
+        memcpy(h + 345, name, split - name);
+        memcpy(h, split + 1, name_len - (split - name) - 1);
+    }
+
+    tar_octal(h + 100, 8, st->st_mode & 07777);
+    tar_octal(h + 108, 8, st->st_uid);
+    tar_octal(h + 116, 8, st->st_gid);
+    tar_octal(h + 124, 12, type == '0' || type == 'K' ? (uint64_t)st->st_size : 0);
+    tar_octal(h + 136, 12, (uint64_t)st->st_mtime);
+    h[156] = type;
+    if (link) memcpy(h + 157, link, strnlen(link, 100));
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < 512; i++) sum += block[i];
+    snprintf(h + 148, 8, "%06o", sum);
+
+    return 0;
+}
+
+// GNU tar's record for a link target that does not fit the header's 100 bytes;
+// the header that follows it still carries the first 100. Returns its length.
+static size_t tar_long_link(uint8_t *block, const char *link, size_t len) {
+    struct stat st = { .st_size = len + 1 };
+    size_t data_len = (len + 1 + 511) / 512 * 512;
+
+    tar_header(block, "././@LongLink", &st, 'K', NULL);
+    memset(block + 512, 0, data_len);
+    memcpy(block + 512, link, len);
+    return 512 + data_len;
+}
+
+static void queue_pending(backup_stream *bs, size_t len) {
+    bs->pending_len = len;
+    bs->pending_pos = 0;
+}
+
+static int next_entry(backup_stream *bs, char *path, size_t path_len, struct stat *st) {
+    while (1) {
+        if (bs->depth > 0) {
+            struct dirent *de = readdir(bs->dirs[bs->depth - 1]);
+            if (!de) {
+                closedir(bs->dirs[--bs->depth]);
+                continue;
+            }
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+            if ((size_t)snprintf(path, path_len, "%s/%s", bs->dir_paths[bs->depth - 1],
+                                 de->d_name) >= path_len) {
+                continue;
+            }
+        } else {
+            if (bs->root_index >= bs->root_count) return 0;
+            snprintf(path, path_len, "%s", bs->roots[bs->root_index++]);
+        }
+
+        if (lstat(path, st) == 0) return 1;
+    }
+}
+
+static void emit_entry(backup_stream *bs, const char *path, struct stat *st) {
+    char name[MAX_PATH_LENGTH + 2];
+    char link[PATH_MAX];
+    ssize_t link_len = 0;
+    size_t offset = 0;
+    char type;
+
+    // Archive members are relative, like sysupgrade -b
+    snprintf(name, sizeof(name), "%s", path[0] == '/' ? path + 1 : path);
+
+    if (S_ISDIR(st->st_mode)) {
+        strcat(name, "/");
+        type = '5';
+        if (bs->depth < BACKUP_MAX_DEPTH) {
+            DIR *dir = opendir(path);
+            if (dir) {
+                bs->dirs[bs->depth] = dir;
+                snprintf(bs->dir_paths[bs->depth], MAX_PATH_LENGTH, "%s", path);
+                bs->depth++;
+            }
+        }
+    } else if (S_ISLNK(st->st_mode)) {
+        link_len = readlink(path, link, sizeof(link));
+        if (link_len < 0) return;
+        if (link_len == sizeof(link)) {
+            fprintf(stderr, "backup: skipping %s, link target too long\n", path);
+            return;
+        }
+        link[link_len] = '\0';
+        type = '2';
+    } else if (S_ISREG(st->st_mode)) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        fstat(fd, st);
+        bs->fd = fd;
+        bs->file_size = st->st_size;
+        bs->file_remaining = st->st_size;
+        type = '0';
+    } else {
+        return;
+    }
+
+    if (type == '2' && link_len > 100) offset = tar_long_link(bs->pending, link, link_len);
+    if (tar_header(bs->pending + offset, name, st, type, type == '2' ? link : NULL) < 0) {
+        fprintf(stderr, "backup: skipping %s, name too long\n", path);
+        if (bs->fd >= 0) {
+            close(bs->fd);
+            bs->fd = -1;
+        }
+        return;
+    }
+    queue_pending(bs, offset + 512);
+}
+
+// Refills the raw buffer with the next slice of the tar stream
+static void fill_raw(backup_stream *bs) {
+    bs->raw_len = 0;
+    bs->raw_pos = 0;
+
+    while (bs->raw_len < sizeof(bs->raw)) {
+        size_t space = sizeof(bs->raw) - bs->raw_len;
+
+        if (bs->pending_pos < bs->pending_len) {
+            size_t n = bs->pending_len - bs->pending_pos;
+            if (n > space) n = space;
+            memcpy(bs->raw + bs->raw_len, bs->pending + bs->pending_pos, n);
+            bs->pending_pos += n;
+            bs->raw_len += n;
+        } else if (bs->fd >= 0 && bs->file_remaining > 0) {
+            size_t want = space < bs->file_remaining ? space : bs->file_remaining;
+            ssize_t n = read(bs->fd, bs->raw + bs->raw_len, want);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                // The file shrank while archiving; pad to the size in the header
+                memset(bs->raw + bs->raw_len, 0, want);
+                n = want;
+            }
+            bs->raw_len += n;
+            bs->file_remaining -= n;
+        } else if (bs->fd >= 0) {
+            close(bs->fd);
+            bs->fd = -1;
+            memset(bs->pending, 0, 512);
+            queue_pending(bs, (512 - bs->file_size % 512) % 512);
+        } else if (bs->trailer_queued) {
+            bs->eof = 1;
+            break;
+        } else {
+            char path[MAX_PATH_LENGTH];
+            struct stat st;
+
+            if (next_entry(bs, path, sizeof(path), &st)) {
+                emit_entry(bs, path, &st);
+            } else {
+                memset(bs->pending, 0, 1024);
+                queue_pending(bs, 1024);
+                bs->trailer_queued = 1;
+            }
+        }
+    }
+}
+
+/* Stream pipeline: tar -> gzip -> chacha20 */
+
+static ssize_t backup_stream_read(void *ctx, char *buf, size_t len) {
+    backup_stream *bs = ctx;
+    size_t out = 0;
+
+    while (bs->prefix_pos < bs->prefix_len && out < len) {
+        buf[out++] = bs->prefix[bs->prefix_pos++];
+    }
+    size_t cipher_start = out;
+
+    while (out < len && !gzip_stream_done(&bs->gz)) {
+        if (bs->raw_pos == bs->raw_len && !bs->eof) fill_raw(bs);
+
+        int finish = bs->eof && bs->raw_pos == bs->raw_len;
+        size_t consumed;
+        size_t written = gzip_stream_write(&bs->gz, bs->raw + bs->raw_pos,
+                                           bs->raw_len - bs->raw_pos, &consumed,
+                                           buf + out, len - out, finish);
+        bs->raw_pos += consumed;
+        out += written;
+
+        if (written == 0 && consumed == 0 && (finish || bs->eof)) break;
+    }
+
+    if (bs->encrypt) {
+        chacha20_xor(&bs->cipher, (uint8_t *)buf + cipher_start, out - cipher_start);
+    }
+    return out;
+}
+
+static void backup_stream_free(void *ctx) {
+    backup_stream *bs = ctx;
+    if (!bs) return;
+
+    while (bs->depth > 0) closedir(bs->dirs[--bs->depth]);
+    if (bs->fd >= 0) close(bs->fd);
+    gzip_stream_end(&bs->gz);
+    memset(&bs->cipher, 0, sizeof(bs->cipher));
+    free(bs);
+}
+
+static int root_covered(const backup_stream *bs, const char *path) {
+    for (int i = 0; i < bs->root_count; i++) {
+        size_t len = strlen(bs->roots[i]);
+        if (strncmp(bs->roots[i], path, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void add_roots(backup_stream *bs, unsigned sets) {
+    // Directories first so that files they already contain are not archived twice
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < BACKUP_SET_COUNT; i++) {
+            if (!(sets & (1u << i))) continue;
+
+            for (int j = 0; backup_sets[i].paths[j]; j++) {
+                const char *path = backup_sets[i].paths[j];
+                struct stat st;
+                if (lstat(path, &st) < 0) continue;
+                if ((pass == 0) != (S_ISDIR(st.st_mode) != 0)) continue;
+                if (root_covered(bs, path) || bs->root_count >= BACKUP_MAX_ROOTS) continue;
+
+                snprintf(bs->roots[bs->root_count++], MAX_PATH_LENGTH, "%s", path);
+            }
+        }
+    }
+}
+
+static backup_stream* backup_stream_open(unsigned sets, const char *password) {
+    backup_stream *bs = calloc(1, sizeof(backup_stream));
+    if (!bs) return NULL;
+
+    bs->fd = -1;
+    add_roots(bs, sets);
+
+    if (gzip_stream_init(&bs->gz, 6) < 0) {
+        free(bs);
+        return NULL;
+    }
+
+    if (password) {
+        uint8_t salt[8];
+        uint8_t key_iv[CHACHA20_KEY_SIZE + CHACHA20_IV_SIZE];
+
+        if (random_bytes(salt, sizeof(salt)) < 0) {
+            backup_stream_free(bs);
+            return NULL;
+        }
+        pbkdf2_hmac_sha256(password, strlen(password), salt, sizeof(salt),
+                           BACKUP_PBKDF2_ITERATIONS, key_iv, sizeof(key_iv));
+        chacha20_init(&bs->cipher, key_iv, key_iv + CHACHA20_KEY_SIZE);
+        memset(key_iv, 0, sizeof(key_iv));
+
+        memcpy(bs->prefix, "Salted__", 8);
+        memcpy(bs->prefix + 8, salt, sizeof(salt));
+        bs->prefix_len = 16;
+        bs->encrypt = 1;
+    }
+
+    return bs;
+}
+
+/* Job table */
+
+static void sanitize_name(const char *in, char *out, size_t out_len) {
+    size_t n = 0;
+    for (; *in && n + 16 < out_len; in++) {
+        if (isalnum((unsigned char)*in) || *in == '-' || *in == '_' || *in == '.') {
+            out[n++] = *in;
+        }
+    }
+    out[n] = '\0';
+
+    if (n == 0 || out[0] == '.') snprintf(out, out_len, "openwrt-backup");
+}
+
+static backup_job* find_job(const char *file_name) {
+    time_t now = time(NULL);
+    for (int i = 0; i < BACKUP_MAX_JOBS; i++) {
+        if (jobs[i].used && now - jobs[i].created > BACKUP_JOB_TTL) {
+            memset(&jobs[i], 0, sizeof(jobs[i]));
+        }
+        if (jobs[i].used && strcmp(jobs[i].file_name, file_name) == 0) return &jobs[i];
+    }
+    return NULL;
+}
+
+static backup_job* alloc_job(void) {
+    backup_job *oldest = &jobs[0];
+    for (int i = 0; i < BACKUP_MAX_JOBS; i++) {
+        if (!jobs[i].used) return &jobs[i];
+        if (jobs[i].created < oldest->created) oldest = &jobs[i];
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    return oldest;
+}
+
+/* Request Handlers */
+
+static void api_backup_create(http_request *req, http_response *res) {
+    char requested[BACKUP_NAME_MAX] = "";
+    unsigned sets = 0;
+    int enabled = 0;
+
+    json_get_string(req->body, "fileName", requested, sizeof(requested));
+
+    for (size_t i = 0; i < BACKUP_SET_COUNT; i++) {
+        int selected = 0;
+        if (json_get_bool(req->body, backup_sets[i].name, &selected) == 0 && selected) {
+            sets |= 1u << i;
+        }
+    }
+    if (sets == 0) sets = BACKUP_DEFAULT_SETS;
+
+    backup_job *job = alloc_job();
+    json_get_bool(req->body, "enabled", &enabled);
+    if (enabled && json_get_string(req->body, "password", job->password,
+                                   sizeof(job->password)) == 0 && job->password[0]) {
+        job->encrypt = 1;
+    }
+
+    sanitize_name(requested, job->file_name, sizeof(job->file_name));
+    size_t len = strlen(job->file_name);
+    if (len < 7 || strcmp(job->file_name + len - 7, ".tar.gz") != 0) {
+        strcat(job->file_name, ".tar.gz");
+    }
+    if (job->encrypt) strcat(job->file_name, ".enc");
+    job->sets = sets;
+    job->created = time(NULL);
+    job->used = 1;
+
+    char *json = malloc(BACKUP_NAME_MAX + 64);
+    if (json) {
+        sprintf(json, "{\"success\": true, \"fileName\": \"%s\"}", job->file_name);
+    }
+    response_json(res, 200, json);
+}
+
+static void api_backup_download(http_request *req, http_response *res) {
+    const char *file_name = req->param_count > 0 ? req->params[0] : "";
+
+    // Only a backup prepared by POST can be fetched
+    backup_job *job = find_job(file_name);
+    if (!job) {
+        response_error(res, 404, "Unknown backup");
+        return;
+    }
+    backup_stream *bs = backup_stream_open(job->sets, job->encrypt ? job->password : NULL);
+    // Prepared downloads are one-shot so the password does not linger
+    memset(job, 0, sizeof(*job));
+
+    if (!bs) {
+        response_error(res, 500, "Could not start backup");
+        return;
+    }
+
+    char safe_name[BACKUP_NAME_MAX];
+    sanitize_name(file_name, safe_name, sizeof(safe_name));
+
+    res->status = 200;
+    res->content_type = bs->encrypt ? "application/octet-stream" : "application/gzip";
+    response_header(res, "Content-Disposition: attachment; filename=\"%s\"", safe_name);
+    res->stream = backup_stream_read;
+    res->stream_free = backup_stream_free;
+    res->stream_ctx = bs;
+}
+
+void backup_register_routes(router *r) {
+    router_add(r, HTTP_POST, "/api/system/backup", api_backup_create, CACHE_NO_STORE);
+    router_set_class(r, "/api/system/backup", ROUTE_HEAVY);
+    router_add(r, HTTP_GET, "/api/system/backup/download/:file", api_backup_download,
+               CACHE_NO_STORE);
+}
@@ -0,0 +1,16 @@
+#ifndef UR_BACKUP_H
+#define UR_BACKUP_H
+
+#include "ur_router.h"
+
+#define BACKUP_MAX_JOBS 4
+#define BACKUP_JOB_TTL 600
+#define BACKUP_MAX_ROOTS 32
+#define BACKUP_MAX_DEPTH 8
+#define BACKUP_RAW_SIZE 8192
+#define BACKUP_NAME_MAX 128
+#define BACKUP_PBKDF2_ITERATIONS 10000
+
+void backup_register_routes(router *r);
+
+#endif
@@ -0,0 +1,319 @@
+#include "ur_collect.h"
+#include "ur_timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * The dashboard's data parts (metrics, system, network, ...) behind one
+ * cache. Each part has a generator and a time to live. Most generators
+ * spend their time waiting on forked commands, so a batch request refreshes
+ * every stale part it names at once, one thread each, and then streams the
+ * snapshots back as a single JSON object. Heavy requests read the cache
+ * from the server's heavy worker while light ones read it on the loop, so
+ * a part is regenerated under a lock of its own: whoever comes second
+ * waits for that and then finds the part fresh. Swapping in a value and
+ * taking a reference is a short critical section on cache_lock.
+ */
+
+#define COLLECT_THREAD_STACK (256 * 1024)
+
+typedef struct {
+    char name[COLLECT_NAME_MAX];
+    collect_fn generate;
+    int ttl_ms;
+    // What regenerating the part costs, as the class of a route
+    route_class cls;
+    // Held while the part is regenerated
+    pthread_mutex_t refresh_lock;
+    collect_value *value;
+    uint64_t stamp;
+} collector;
+
+typedef struct {
+    collector *part;
+} refresh_job;
+
+static collector collectors[COLLECT_MAX_PARTS];
+static int collector_count = 0;
+// Guards value and stamp of every part
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int collect_register(const char *name, collect_fn generate, int ttl_ms, route_class cls) {
+    if (collector_count >= COLLECT_MAX_PARTS || strlen(name) >= COLLECT_NAME_MAX) return -1;
+
+    collector *c = &collectors[collector_count++];
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->generate = generate;
+    c->ttl_ms = ttl_ms;
+    c->cls = cls;
+    pthread_mutex_init(&c->refresh_lock, NULL);
+    return 0;
+}
+
+static collector* collect_find(const char *name, size_t len) {
+    for (int i = 0; i < collector_count; i++) {
+        if (strlen(collectors[i].name) == len && memcmp(collectors[i].name, name, len) == 0) {
+            return &collectors[i];
+        }
+    }
+    return NULL;
+}
+
+// Takes ownership of json; a failed generator still yields a valid document
+static collect_value* collect_value_new(char *json) {
+    const char *data = json ? json : "null";
+    size_t len = strlen(data);
+
+    collect_value *value = malloc(sizeof(collect_value) + len + 1);
+    if (value) {
+        value->refs = 1;
+        value->len = len;
+        memcpy(value->data, data, len + 1);
+    }
+    free(json);
+    return value;
+}
+
+void collect_release(collect_value *value) {
+    if (value && __atomic_sub_fetch(&value->refs, 1, __ATOMIC_ACQ_REL) == 0) free(value);
+}
+
+static int collect_stale(collector *c, uint64_t now) {
+    pthread_mutex_lock(&cache_lock);
+    int stale = !c->value || c->ttl_ms == 0 || now - c->stamp >= (uint64_t)c->ttl_ms;
+    pthread_mutex_unlock(&cache_lock);
+    return stale;
+}
+
+// A reference to the part's current value, or NULL
+static collect_value* collect_take(collector *c) {
+    pthread_mutex_lock(&cache_lock);
+    collect_value *value = c->value;
+    if (value) __atomic_add_fetch(&value->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache_lock);
+    return value;
+}
+
+// Regenerates the part unless somebody else did while this waited for the lock
+static void* refresh_worker(void *arg) {
+    refresh_job *job = arg;
+    collector *c = job->part;
+
+    pthread_mutex_lock(&c->refresh_lock);
+    if (collect_stale(c, monotonic_ms())) {
+        collect_value *value = collect_value_new(c->generate());
+        if (value) {
+            pthread_mutex_lock(&cache_lock);
+            collect_value *old = c->value;
+            c->value = value;
+            c->stamp = monotonic_ms();
+            pthread_mutex_unlock(&cache_lock);
+            collect_release(old);
+        }
+    }
+    pthread_mutex_unlock(&c->refresh_lock);
+    return NULL;
+}
+
+// Regenerates the stale parts among the given ones, concurrently when there are several
+static void collect_refresh(collector **parts, int count) {
+    refresh_job jobs[COLLECT_MAX_PARTS];
+    pthread_t threads[COLLECT_MAX_PARTS];
+    int started[COLLECT_MAX_PARTS];
+    int job_count = 0;
+    uint64_t now = monotonic_ms();
+
+    for (int i = 0; i < count; i++) {
+        if (collect_stale(parts[i], now)) {
+            jobs[job_count].part = parts[i];
+            job_count++;
+        }
+    }
+    if (job_count == 0) return;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, COLLECT_THREAD_STACK);
+
+    // Cheap parts, the last job and any a thread cannot be had for run right here
+    for (int i = 0; i < job_count; i++) {
+        started[i] = jobs[i].part->ttl_ms > 0 && i < job_count - 1 &&
+                     pthread_create(&threads[i], &attr, refresh_worker, &jobs[i]) == 0;
+    }
+    for (int i = 0; i < job_count; i++) {
+        if (!started[i]) refresh_worker(&jobs[i]);
+    }
+    for (int i = 0; i < job_count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+collect_value* collect_get(const char *name) {
+    collector *c = collect_find(name, strlen(name));
+    if (!c) return NULL;
+
+    collect_refresh(&c, 1);
+    return collect_take(c);
+}
+
+/* Batch endpoint */
+
+typedef struct {
+    int count;
+    // Framing in front of each value: '{"name":' or ',"name":'
+    char prefix[COLLECT_MAX_PARTS + 1][COLLECT_NAME_MAX + 8];
+    collect_value *values[COLLECT_MAX_PARTS + 1];
+    // Position: piece 2i is prefix i, 2i+1 is value i, 2*count the closing brace
+    int piece;
+    size_t offset;
+} batch_stream;
+
+// The caller's own details are per request and never cached
+static collect_value* client_value(const http_request *req) {
+    time_t now = time(NULL);
+    struct tm tm;
+    char time_str[64];
+    char json[160];
+
+    strftime(time_str, sizeof(time_str), "%a %b %e %H:%M:%S %Y", localtime_r(&now, &tm));
+    snprintf(json, sizeof(json), "{\"client_ip\": \"%s\", \"server_time\": \"%s\"}",
+             req->client_ip, time_str);
+    return collect_value_new(strdup(json));
+}
+
+static ssize_t batch_stream_read(void *ctx, char *buf, size_t len) {
+    batch_stream *bs = ctx;
+    size_t out = 0;
+
+    while (out < len && bs->piece <= 2 * bs->count) {
+        const char *data;
+        size_t data_len;
+
+        if (bs->piece == 2 * bs->count) {
+            data = bs->count ? "}\n" : "{}\n";
+            data_len = strlen(data);
+        } else if (bs->piece % 2 == 0) {
+            data = bs->prefix[bs->piece / 2];
+            data_len = strlen(data);
+        } else {
+            data = bs->values[bs->piece / 2]->data;
+            data_len = bs->values[bs->piece / 2]->len;
+        }
+
+        size_t n = data_len - bs->offset;
+        if (n > len - out) n = len - out;
+        memcpy(buf + out, data + bs->offset, n);
+        out += n;
+        bs->offset += n;
+
+        if (bs->offset == data_len) {
+            bs->piece++;
+            bs->offset = 0;
+        }
+    }
+    return out;
+}
+
+static void batch_stream_free(void *ctx) {
+    batch_stream *bs = ctx;
+    if (!bs) return;
+
+    for (int i = 0; i < bs->count; i++) collect_release(bs->values[i]);
+    free(bs);
+}
+
+static int batch_add(batch_stream *bs, const char *name, size_t len, collect_value *value) {
+    snprintf(bs->prefix[bs->count], sizeof(bs->prefix[0]), "%s\"%.*s\": ",
+             bs->count ? ",\n" : "{", (int)len, name);
+    bs->values[bs->count++] = value;
+    return value ? 0 : -1;
+}
+
+// Reads the parts a batch asks for; -1 for an unknown part
+static int batch_parts(const http_request *req, collector **wanted, int *wanted_count, int *want_client) {
+    char parts[256];
+    *wanted_count = 0;
+    *want_client = 0;
+
+    // Without a list every part is sent
+    if (query_get_param(req->query, "parts", parts, sizeof(parts)) < 0 || !parts[0]) {
+        for (int i = 0; i < collector_count; i++) wanted[(*wanted_count)++] = &collectors[i];
+        *want_client = 1;
+        return 0;
+    }
+
+    const char *p = parts;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        collector *c = collect_find(p, len);
+
+        if (len == 6 && memcmp(p, "client", 6) == 0) {
+            *want_client = 1;
+        } else if (!c) {
+            return -1;
+        } else {
+            int seen = 0;
+            for (int i = 0; i < *wanted_count; i++) seen |= wanted[i] == c;
+            if (!seen) wanted[(*wanted_count)++] = c;
+        }
+
+        p += len;
+        if (*p == ',') p++;
+    }
+    return 0;
+}
+
+route_class collect_batch_class(const http_request *req) {
+    collector *wanted[COLLECT_MAX_PARTS];
+    int wanted_count, want_client;
+    uint64_t now = monotonic_ms();
+
+    if (batch_parts(req, wanted, &wanted_count, &want_client) < 0) return ROUTE_LIGHT;
+    for (int i = 0; i < wanted_count; i++) {
+        if (wanted[i]->cls == ROUTE_HEAVY && collect_stale(wanted[i], now)) return ROUTE_HEAVY;
+    }
+    return ROUTE_LIGHT;
+}
+
+static void api_batch(http_request *req, http_response *res) {
+    collector *wanted[COLLECT_MAX_PARTS];
+    int wanted_count, want_client;
+
+    if (batch_parts(req, wanted, &wanted_count, &want_client) < 0) {
+        response_error(res, 400, "Unknown part requested");
+        return;
+    }
+
+    batch_stream *bs = calloc(1, sizeof(batch_stream));
+    if (!bs) {
+        response_error(res, 500, "Memory allocation error");
+        return;
+    }
+
+    collect_refresh(wanted, wanted_count);
+
+    int failed = 0;
+    if (want_client) failed |= batch_add(bs, "client", 6, client_value(req));
+    for (int i = 0; i < wanted_count; i++) {
+        failed |= batch_add(bs, wanted[i]->name, strlen(wanted[i]->name), collect_take(wanted[i]));
+    }
+    if (failed) {
+        batch_stream_free(bs);
+        response_error(res, 500, "Memory allocation error");
+        return;
+    }
+
+    res->status = 200;
+    res->content_type = "application/json";
+    res->stream = batch_stream_read;
+    res->stream_free = batch_stream_free;
+    res->stream_ctx = bs;
+}
+
+void collect_register_routes(router *r) {
+    // Classed per request by collect_batch_class()
+    router_add(r, HTTP_GET, "/api/batch", api_batch, CACHE_NO_STORE);
+}
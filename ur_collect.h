@@ -0,0 +1,33 @@
+#ifndef UR_COLLECT_H
+#define UR_COLLECT_H
+
+#include "ur_router.h"
+
+#define COLLECT_MAX_PARTS 16
+#define COLLECT_NAME_MAX 32
+
+// Produces one part as a malloc'd JSON document; may run on a worker thread
+typedef char* (*collect_fn)(void);
+
+// Immutable snapshot of a part, shared by the cache and the responses reading it
+typedef struct {
+    int refs;
+    size_t len;
+    char data[];
+} collect_value;
+
+// ttl_ms of 0 means the part is produced fresh every time; cls is what
+// producing it costs, ROUTE_HEAVY for parts that fork commands
+int collect_register(const char *name, collect_fn generate, int ttl_ms, route_class cls);
+
+// Returns a reference to the named part, refreshing it first if stale, or NULL
+collect_value* collect_get(const char *name);
+
+void collect_release(collect_value *value);
+
+// Heavy when the batch would have to regenerate a heavy part, light otherwise
+route_class collect_batch_class(const http_request *req);
+
+void collect_register_routes(router *r);
+
+#endif
@@ -0,0 +1,1685 @@
+#define _GNU_SOURCE
+#include "ur_conn.h"
+#include "ur_event.h"
+#include "ur_range.h"
+#include "ur_assets.h"
+#include "ur_limit.h"
+#include "ur_upgrade.h"
+#include "ur_fleet.h"
+#include "ur_flight.h"
+#include "ur_history.h"
+#include "ur_metrics.h"
+#include "ur_tls.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+/*
+ * Connections are nonblocking and driven by one epoll loop. Each one moves
+ * through HEADERS -> BODY -> WRITE and then either back to HEADERS for the
+ * next keep-alive request or into LINGER, where it half-closes and drains
+ * what the peer still sends so the reply is not lost to a reset.
+ *
+ * Every state runs under one timer from the wheel. The header deadline is
+ * absolute from the first byte, so trickling a header one byte at a time
+ * does not keep a slot. The body deadline is only pushed back once the
+ * client has made real progress. Admission is capped in total and per
+ * client address, so a single host cannot take every slot.
+ *
+ * The state machine only sees bytes coming in (conn_input) and asks for
+ * output to be flushed (conn_flush). On epoll those are read() and send()
+ * on readiness. On io_uring a multishot recv hands over provided buffers,
+ * head and body go out as linked sends and file bodies are read through
+ * the ring, so nothing in between knows which backend is running. Ring
+ * operations keep the connection alive until their last completion.
+ *
+ * Once routed, a request is charged to its client's rate limit for its
+ * route class and answered 429 when over it. Heavy handlers, the ones that
+ * fork commands, do not run on the loop at all: they wait in QUEUED, and
+ * the scheduler timer hands them one at a time to the heavy worker thread.
+ * The worker gets its own copy of the request and a response to fill in;
+ * the connection sits in RUNNING, still taking input, until the worker
+ * posts it back through an eventfd. Each heavy run is followed by a pause
+ * in proportion to the CPU time it took, which keeps heavy work within
+ * SCHED_HEAVY_SHARE percent of the CPU however many are waiting.
+ *
+ * HTTPS connections come in on a second listener and run through the same
+ * states. Their input is decrypted by the session, so they are driven by
+ * readiness even when the loop runs on io_uring, and each read takes a
+ * whole record so the session never holds bytes back that no event would
+ * announce. Output goes through the session too until the kernel has the
+ * keys; after that it is the plain send and sendfile path again.
+ */
+
+typedef enum {
+    CONN_HEADERS,
+    CONN_BODY,
+    CONN_QUEUED,
+    CONN_RUNNING,
+    CONN_WRITE,
+    CONN_LINGER
+} conn_state;
+
+typedef struct ip_slot {
+    uint32_t addr;
+    int count;
+    struct ip_slot *next;
+} ip_slot;
+
+// A piece of the response in place, wherever it lives; sent is its progress
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t *sent;
+} out_segment;
+
+// The head and one body piece: the whole body, a chunk or a file block
+#define CONN_SEGMENTS 2
+
+// Plain HTTP and HTTPS
+#define CONN_LISTENERS 2
+
+typedef struct {
+    uring_op op;
+    out_segment out[CONN_SEGMENTS];
+    int count;
+    struct iovec iov[CONN_SEGMENTS];
+    struct msghdr msg;
+} conn_op;
+
+typedef struct connection {
+    int fd;
+    conn_state state;
+    event_handler io;
+    // Callers on the stack plus ring operations in flight; freed at zero once closing
+    int refs;
+    int closing;
+    ur_timer timer;
+    uint32_t addr;
+    char client_ip[INET6_ADDRSTRLEN];
+    int idle;
+
+    // Input: request headers, then a buffered body or one chunk for a sink
+    char *in;
+    size_t in_cap;
+    size_t in_len;
+    size_t head_len;
+    size_t request_len;
+
+    http_request req;
+    http_response res;
+    route_handler handler;
+    route_class cls;
+    // Next heavy request waiting behind this one
+    struct connection *queue_next;
+    const body_sink *sink;
+    void *sink_ctx;
+    int sink_ok;
+    size_t body_remaining;
+    size_t body_progress;
+    int keep_alive;
+
+    // Output: response head, then the body or chunks pulled from res.stream
+    char head[MAX_RESPONSE_HEADERS + 512];
+    size_t head_out;
+    size_t head_sent;
+    size_t body_sent;
+    char *chunk;
+    size_t chunk_off;
+    size_t chunk_len;
+    size_t chunk_sent;
+    int stream_done;
+    // The stream has nothing yet; the timer or conn_wake() brings it back
+    int stream_paused;
+    // Linked into server.waiting while paused on a wait key
+    struct connection *wait_next;
+    struct connection **wait_pprev;
+    // Bytes of the current response on the wire, head included
+    uint64_t out_bytes;
+
+    size_t lingered;
+#ifdef UR_HAVE_FLIGHT
+    flight_id flight;
+#endif
+#ifdef UR_HAVE_TLS
+    // HTTPS only; tls_ready once the handshake is done, tls_offload once
+    // the kernel encrypts for the socket
+    tls_conn *tls;
+    int tls_ready;
+    int tls_offload;
+    // A read has to get a write out first (a key update) and waits for room
+    int tls_read_blocked;
+#endif
+
+    // io_uring only
+    uring_op recv_op;
+    uring_op read_op;
+    uring_op cancel_op;
+    conn_op send_op;
+    int out_pending;
+} connection;
+
+typedef struct {
+    int fd;
+    // Connections accepted here start with a TLS handshake
+    int tls;
+    event_handler io;
+#ifdef UR_HAVE_IO_URING
+    uring_op accept_op;
+    uring_op cancel_op;
+#endif
+} conn_listener;
+
+typedef struct {
+    conn_listener listeners[CONN_LISTENERS];
+    int listener_count;
+    int spare_fd;
+    event_loop loop;
+    const server_config *cfg;
+    int active;
+    ip_slot *ips[CONN_IP_BUCKETS];
+    // Paused streams that conn_wake() can resume early
+    connection *waiting;
+    // Heavy requests in arrival order, run by sched_timer
+    connection *heavy_head;
+    int heavy_count;
+    ur_timer sched_timer;
+    // The next heavy request may not start before this
+    uint64_t heavy_after;
+    // The one the worker has, with its copy of the request; heavy_posted is
+    // under heavy_lock and set until the handler has returned
+    connection *heavy_conn;
+    route_handler heavy_handler;
+    char *heavy_in;
+    http_request heavy_req;
+    http_response heavy_res;
+    // CPU time the worker spent on it, in milliseconds
+    uint64_t heavy_spent;
+    int heavy_posted;
+    pthread_mutex_t heavy_lock;
+    pthread_cond_t heavy_wake;
+    // -1 when there is no worker and heavy handlers run on the loop
+    int heavy_fd;
+    event_handler heavy_io;
+    // Handing over to a replacement: no new connections, no keep-alive
+    int draining;
+    ur_timer drain_timer;
+#ifdef UR_HAVE_IO_URING
+    // NULL when the loop runs on epoll
+    uring *ring;
+#endif
+} conn_server;
+
+static conn_server server;
+
+static const char overload_reply[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 20\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Server is too busy\r\n";
+
+static const char timeout_reply[] =
+    "HTTP/1.1 408 Request Timeout\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static void conn_io(void *data, unsigned events);
+static void conn_timeout(ur_timer *timer);
+static void sched_remove(connection *c);
+static void conn_process(connection *c);
+static void conn_unpause(connection *c);
+
+/* Per-address admission */
+
+static ip_slot** ip_bucket(uint32_t addr) {
+    uint32_t h = addr * 2654435761u;
+    return &server.ips[h >> 24];
+}
+
+static int ip_acquire(uint32_t addr) {
+    ip_slot **bucket = ip_bucket(addr);
+    ip_slot *slot = *bucket;
+    while (slot && slot->addr != addr) slot = slot->next;
+
+    if (!slot) {
+        slot = calloc(1, sizeof(ip_slot));
+        if (!slot) return -1;
+        slot->addr = addr;
+        slot->next = *bucket;
+        *bucket = slot;
+    }
+
+    if (slot->count >= server.cfg->max_connections_per_ip) return -1;
+    slot->count++;
+    return 0;
+}
+
+static void ip_release(uint32_t addr) {
+    ip_slot **link = ip_bucket(addr);
+    while (*link && (*link)->addr != addr) link = &(*link)->next;
+    if (!*link) return;
+
+    ip_slot *slot = *link;
+    if (--slot->count <= 0) {
+        *link = slot->next;
+        free(slot);
+    }
+}
+
+/* Connection lifecycle */
+
+static void conn_arm(connection *c, int seconds) {
+    timer_arm(&server.loop.timers, &c->timer, (uint64_t)seconds * 1000);
+}
+
+#ifdef UR_HAVE_IO_URING
+// Whether the connection's I/O goes through the ring rather than readiness
+static int conn_on_ring(connection *c) {
+#ifdef UR_HAVE_TLS
+    if (c->tls) return 0;
+#else
+    (void)c;
+#endif
+    return server.ring != NULL;
+}
+#endif
+
+static void conn_watch(connection *c, unsigned events) {
+#ifdef UR_HAVE_IO_URING
+    // The multishot recv stays armed and sends complete on their own
+    if (conn_on_ring(c)) return;
+#endif
+    event_mod(&server.loop, c->fd, events, &c->io);
+}
+
+static void conn_release(connection *c) {
+#ifdef UR_HAVE_TLS
+    if (c->tls) tls_free(c->tls);
+#endif
+    // Sends still in flight may point into the response, so it goes last
+    close(c->fd);
+    response_free(&c->res);
+    free(c->chunk);
+    free(c->in);
+    free(c);
+}
+
+static void conn_unref(connection *c) {
+    if (--c->refs == 0 && c->closing) conn_release(c);
+}
+
+#ifdef UR_HAVE_IO_URING
+static void conn_cancel_done(uring_op *op, int res, unsigned flags) {
+    (void)res;
+    (void)flags;
+    conn_unref(op->data);
+}
+#endif
+
+static void conn_close(connection *c) {
+    if (c->closing) return;
+    c->closing = 1;
+
+    // A dropped upload still has to release its sink
+    if (c->sink_ctx) {
+        http_response scratch = { .status = 200 };
+        c->sink->finish(c->sink_ctx, &c->req, &scratch);
+        response_free(&scratch);
+        c->sink_ctx = NULL;
+    }
+
+    // Does nothing for a response already out
+    flight_request_end(c->flight, 0, c->out_bytes);
+#ifdef UR_HAVE_TLS
+    if (c->tls) tls_close(c->tls);
+#endif
+
+    timer_cancel(&server.loop.timers, &c->timer);
+    conn_unpause(c);
+    if (c->state == CONN_QUEUED) sched_remove(c);
+    ip_release(c->addr);
+    server.active--;
+    if (server.draining && server.active == 0) event_loop_stop(&server.loop);
+
+#ifdef UR_HAVE_IO_URING
+    if (server.ring) {
+        // Wake and cancel whatever is queued on the socket, readiness polls of
+        // HTTPS connections included. The cancel holds a reference too:
+        // closing the fd before it runs would let a new connection inherit
+        // the number and be cancelled in its place.
+        c->io.fd = -1;
+        shutdown(c->fd, SHUT_RDWR);
+        struct io_uring_sqe *sqe = uring_get_sqe(server.ring, &c->cancel_op);
+        if (sqe) {
+            c->cancel_op.callback = conn_cancel_done;
+            c->cancel_op.data = c;
+            uring_prep_cancel_fd(sqe, c->fd);
+            c->refs++;
+        }
+    } else
+#endif
+    event_del(&server.loop, c->fd, &c->io);
+
+    if (c->refs == 0) conn_release(c);
+}
+
+static int conn_reserve(connection *c, size_t size) {
+    if (size + 1 <= c->in_cap) return 0;
+
+    // Request pointers refer into the input buffer
+    size_t headers_at = c->req.headers_len ? (size_t)(c->req.headers - c->in) : 0;
+    size_t body_at = c->req.body ? (size_t)(c->req.body - c->in) : 0;
+
+    char *grown = realloc(c->in, size + 1);
+    if (!grown) return -1;
+
+    if (c->req.headers_len) c->req.headers = grown + headers_at;
+    if (c->req.body) c->req.body = grown + body_at;
+
+    c->in = grown;
+    c->in_cap = size + 1;
+    return 0;
+}
+
+static void conn_linger(connection *c) {
+    c->state = CONN_LINGER;
+    c->lingered = 0;
+#ifdef UR_HAVE_TLS
+    if (c->tls) tls_close(c->tls);
+#endif
+    shutdown(c->fd, SHUT_WR);
+    conn_watch(c, EVENT_READ);
+    timer_arm(&server.loop.timers, &c->timer, CONN_LINGER_MS);
+}
+
+// Starts the next request on a kept-alive connection, keeping pipelined bytes
+static void conn_reset(connection *c) {
+    response_free(&c->res);
+    free(c->chunk);
+    c->chunk = NULL;
+
+    size_t leftover = c->in_len > c->request_len ? c->in_len - c->request_len : 0;
+    if (leftover) memmove(c->in, c->in + c->request_len, leftover);
+    c->in_len = leftover;
+    if (c->in) c->in[c->in_len] = '\0';
+
+    memset(&c->req, 0, sizeof(c->req));
+    memset(&c->res, 0, sizeof(c->res));
+    c->res.status = 200;
+    c->handler = NULL;
+    c->sink = NULL;
+    c->head_len = c->request_len = 0;
+    c->head_out = c->head_sent = c->body_sent = 0;
+    c->chunk_len = c->chunk_sent = 0;
+    c->out_bytes = 0;
+    c->stream_done = 0;
+    conn_unpause(c);
+
+    c->state = CONN_HEADERS;
+    c->idle = leftover == 0;
+    if (!c->idle) flight_request_begin(&c->flight, c->addr);
+    conn_arm(c, c->idle ? server.cfg->keepalive_timeout : server.cfg->header_timeout);
+    conn_watch(c, EVENT_READ);
+}
+
+/* Response output */
+
+// Returns 1 when the stream asked to wait, 0 with a chunk ready, -1 on error
+static int stream_next_chunk(connection *c) {
+    if (!c->chunk) {
+        c->chunk = malloc(STREAM_CHUNK_SIZE + 16);
+        if (!c->chunk) return -1;
+    }
+
+    // Room for the chunk-size line in front and the CRLF behind the payload
+    char *payload = c->chunk + 10;
+    ssize_t produced = c->res.stream(c->res.stream_ctx, payload, STREAM_CHUNK_SIZE);
+    if (produced == STREAM_WAIT) return 1;
+    if (produced < 0) return -1;
+
+    if (produced == 0) {
+        memcpy(c->chunk, "0\r\n\r\n", 5);
+        c->chunk_off = 0;
+        c->chunk_len = 5;
+        c->chunk_sent = 0;
+        c->stream_done = 1;
+        return 0;
+    }
+
+    char size_line[11];
+    int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", (size_t)produced);
+    char *start = payload - size_len;
+    memcpy(start, size_line, size_len);
+    payload[produced] = '\r';
+    payload[produced + 1] = '\n';
+
+    c->chunk_off = start - c->chunk;
+    c->chunk_len = size_len + produced + 2;
+    c->chunk_sent = 0;
+    return 0;
+}
+
+static void conn_wait_link(connection *c, connection **head) {
+    c->wait_next = *head;
+    if (c->wait_next) c->wait_next->wait_pprev = &c->wait_next;
+    c->wait_pprev = head;
+    *head = c;
+}
+
+static void conn_wait_unlink(connection *c) {
+    if (!c->wait_pprev) return;
+    *c->wait_pprev = c->wait_next;
+    if (c->wait_next) c->wait_next->wait_pprev = c->wait_pprev;
+    c->wait_next = NULL;
+    c->wait_pprev = NULL;
+}
+
+// Parks a stream until its next frame is due; meanwhile only a hangup matters
+static void conn_pause(connection *c) {
+    c->stream_paused = 1;
+    timer_arm(&server.loop.timers, &c->timer, c->res.stream_wait_ms);
+    conn_watch(c, EVENT_READ);
+    if (c->res.stream_wait_key) conn_wait_link(c, &server.waiting);
+}
+
+static void conn_unpause(connection *c) {
+    c->stream_paused = 0;
+    conn_wait_unlink(c);
+}
+
+// Any progress pushes the write-stall deadline back
+static void conn_wrote(connection *c, size_t n) {
+    if (!c->out_bytes) flight_mark(c->flight, FLIGHT_FIRST_BYTE);
+    c->out_bytes += n;
+    conn_arm(c, server.cfg->write_timeout);
+}
+
+// Points iov at what is left of each segment; returns how many entries that takes
+static int out_iov(const out_segment *out, int count, struct iovec *iov) {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (*out[i].sent < out[i].len) {
+            iov[n].iov_base = (char *)out[i].data + *out[i].sent;
+            iov[n].iov_len = out[i].len - *out[i].sent;
+            n++;
+        }
+    }
+    return n;
+}
+
+// Hands n sent bytes to the segments in order
+static void out_credit(out_segment *out, int count, size_t n) {
+    for (int i = 0; i < count && n; i++) {
+        size_t left = out[i].len - *out[i].sent;
+        size_t take = left < n ? left : n;
+        *out[i].sent += take;
+        n -= take;
+    }
+}
+
+#ifdef UR_HAVE_TLS
+
+// Gathers up to a record's worth of the segments per write, so a small
+// response is one record; a write cut short is retried with the same bytes
+static int conn_tls_send(connection *c, out_segment *out, int count) {
+    static char record[STREAM_CHUNK_SIZE];
+    struct iovec iov[CONN_SEGMENTS];
+    int pieces;
+
+    while ((pieces = out_iov(out, count, iov)) > 0) {
+        size_t len = 0;
+        for (int i = 0; i < pieces && len < sizeof(record); i++) {
+            size_t take = iov[i].iov_len < sizeof(record) - len ? iov[i].iov_len : sizeof(record) - len;
+            memcpy(record + len, iov[i].iov_base, take);
+            len += take;
+        }
+
+        unsigned want;
+        ssize_t n = tls_write(c->tls, record, len, &want);
+        if (n < 0) return want == EVENT_WRITE ? 0 : -1;
+        out_credit(out, count, n);
+        conn_wrote(c, n);
+    }
+    return 1;
+}
+
+// Without the kernel's keys a file has to come up through userspace to be
+// encrypted: one block at a time through the chunk buffer
+static int conn_tls_sendfile(connection *c) {
+    if (!c->chunk) {
+        c->chunk = malloc(STREAM_CHUNK_SIZE + 16);
+        if (!c->chunk) return -1;
+    }
+
+    for (;;) {
+        if (c->chunk_sent == c->chunk_len) {
+            if (c->body_sent == c->res.body_len) return 1;
+            size_t want = c->res.body_len - c->body_sent;
+            if (want > STREAM_CHUNK_SIZE) want = STREAM_CHUNK_SIZE;
+            ssize_t n = pread(c->res.body_fd, c->chunk, want, c->res.body_offset + c->body_sent);
+            if (n < 0 && errno == EINTR) continue;
+            // The file shrank underneath us, as with sendfile()
+            if (n <= 0) return -1;
+            c->chunk_off = 0;
+            c->chunk_len = n;
+            c->chunk_sent = 0;
+            c->body_sent += n;
+        }
+
+        out_segment block = { c->chunk + c->chunk_off, c->chunk_len, &c->chunk_sent };
+        int done = conn_tls_send(c, &block, 1);
+        if (done <= 0) return done;
+    }
+}
+
+#endif
+
+// Gathers the segments into one sendmsg per round, picking up after a short
+// one. With more set the kernel holds a partial packet back for what follows.
+// Returns 1 when everything is out, 0 when the socket is full, -1 on error
+static int conn_send(connection *c, out_segment *out, int count, int more) {
+    struct iovec iov[CONN_SEGMENTS];
+    struct msghdr msg = { .msg_iov = iov };
+
+#ifdef UR_HAVE_TLS
+    if (c->tls && !c->tls_offload) return conn_tls_send(c, out, count);
+#endif
+
+    while ((msg.msg_iovlen = out_iov(out, count, iov)) > 0) {
+        ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        out_credit(out, count, n);
+        conn_wrote(c, n);
+    }
+    return 1;
+}
+
+static int conn_sendfile(connection *c) {
+#ifdef UR_HAVE_TLS
+    if (c->tls && !c->tls_offload) return conn_tls_sendfile(c);
+#endif
+    while (c->body_sent < c->res.body_len) {
+        off_t offset = c->res.body_offset + c->body_sent;
+        ssize_t n = sendfile(c->fd, c->res.body_fd, &offset, c->res.body_len - c->body_sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        // The file shrank underneath us; the promised length can no longer be met
+        if (n == 0) return -1;
+        c->body_sent += n;
+        conn_wrote(c, n);
+    }
+    return 1;
+}
+
+// The response is out: start over for the next request or wind down
+static void conn_sent(connection *c) {
+    flight_request_end(c->flight, c->res.status, c->out_bytes);
+    if (c->keep_alive) {
+        conn_reset(c);
+        if (c->in_len) conn_process(c);
+    } else {
+        conn_linger(c);
+    }
+}
+
+#ifdef UR_HAVE_IO_URING
+
+static void conn_uring_flush(connection *c);
+
+static void conn_send_done(uring_op *op, int res, unsigned flags) {
+    (void)flags;
+    conn_op *send = (conn_op *)op;
+    connection *c = op->data;
+
+    c->out_pending--;
+    if (!c->closing) {
+        if (res > 0) {
+            out_credit(send->out, send->count, res);
+            conn_wrote(c, res);
+        } else if (res != -ECANCELED) {
+            // The peer went away
+            conn_close(c);
+        }
+        // Whatever a short send left over goes out next round
+        if (!c->closing && c->out_pending == 0) conn_uring_flush(c);
+    }
+    conn_unref(c);
+}
+
+static void conn_read_done(uring_op *op, int res, unsigned flags) {
+    (void)flags;
+    connection *c = op->data;
+
+    c->out_pending--;
+    if (!c->closing) {
+        if (res <= 0) {
+            // Read error, or the file shrank below the promised length
+            conn_close(c);
+        } else {
+            c->chunk_off = 0;
+            c->chunk_len = res;
+            c->chunk_sent = 0;
+            c->body_sent += res;
+            if (c->out_pending == 0) conn_uring_flush(c);
+        }
+    }
+    conn_unref(c);
+}
+
+// The segments go out as one gathered send; the ring keeps at most one in flight
+static int conn_queue_send(connection *c, const out_segment *out, int count) {
+    conn_op *send = &c->send_op;
+    struct io_uring_sqe *sqe = uring_get_sqe(server.ring, &send->op);
+    if (!sqe) return -1;
+
+    send->op.callback = conn_send_done;
+    send->op.data = c;
+    memcpy(send->out, out, sizeof(*out) * count);
+    send->count = count;
+    memset(&send->msg, 0, sizeof(send->msg));
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = out_iov(send->out, count, send->iov);
+    uring_prep_sendmsg(sqe, c->fd, &send->msg);
+
+    c->out_pending++;
+    c->refs++;
+    return 0;
+}
+
+static int conn_queue_read(connection *c) {
+    if (!c->chunk) {
+        c->chunk = malloc(STREAM_CHUNK_SIZE + 16);
+        if (!c->chunk) return -1;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(server.ring, &c->read_op);
+    if (!sqe) return -1;
+
+    size_t want = c->res.body_len - c->body_sent;
+    if (want > STREAM_CHUNK_SIZE) want = STREAM_CHUNK_SIZE;
+    c->read_op.callback = conn_read_done;
+    c->read_op.data = c;
+    uring_prep_read(sqe, c->res.body_fd, c->chunk, want, c->res.body_offset + c->body_sent);
+
+    c->out_pending++;
+    c->refs++;
+    return 0;
+}
+
+// Queues the next piece of the response: the head gathered with the first
+// body piece, then one chunk or file block per round until everything is out
+static void conn_uring_flush(connection *c) {
+    int head = c->head_sent < c->head_out;
+    const char *body = NULL;
+    size_t body_len = 0;
+    size_t *progress = NULL;
+    int ret = 0;
+
+    if (!c->res.head_only) {
+        if (c->res.stream && c->chunk_sent == c->chunk_len && !c->stream_done) {
+            int next = stream_next_chunk(c);
+            if (next < 0) {
+                conn_close(c);
+                return;
+            }
+            // A head still to go is sent now; the stream is asked again after it
+            if (next > 0 && !head) {
+                conn_pause(c);
+                return;
+            }
+        } else if (c->res.body && !c->res.body_file && c->body_sent < c->res.body_len) {
+            body = c->res.body + c->res.body_offset;
+            body_len = c->res.body_len;
+            progress = &c->body_sent;
+        }
+
+        if ((c->res.stream || c->res.body_file) && c->chunk_sent < c->chunk_len) {
+            body = c->chunk + c->chunk_off;
+            body_len = c->chunk_len;
+            progress = &c->chunk_sent;
+        } else if (c->res.body_file && c->body_sent < c->res.body_len) {
+            // The block is read while the head is still going out
+            ret = conn_queue_read(c);
+        }
+    }
+
+    out_segment out[CONN_SEGMENTS];
+    int count = 0;
+    if (head) out[count++] = (out_segment){ c->head, c->head_out, &c->head_sent };
+    if (body) out[count++] = (out_segment){ body, body_len, progress };
+    if (ret == 0 && count) ret = conn_queue_send(c, out, count);
+
+    if (ret < 0) {
+        conn_close(c);
+    } else if (c->out_pending == 0) {
+        conn_sent(c);
+    }
+}
+
+#endif
+
+static void conn_flush(connection *c) {
+#ifdef UR_HAVE_IO_URING
+    if (conn_on_ring(c)) {
+        if (c->out_pending == 0) conn_uring_flush(c);
+        return;
+    }
+#endif
+
+    // The head shares a send with the body, or with each chunk until it is out
+    out_segment out[CONN_SEGMENTS] = { { c->head, c->head_out, &c->head_sent } };
+    int done = 1;
+
+    if (c->res.head_only) {
+        done = conn_send(c, out, 1, 0);
+    } else if (c->res.stream) {
+        do {
+            if (c->chunk_sent == c->chunk_len) {
+                if (c->stream_done) break;
+                int next = stream_next_chunk(c);
+                if (next < 0) {
+                    done = -1;
+                    break;
+                }
+                if (next > 0) {
+                    done = conn_send(c, out, 1, 0);
+                    if (done <= 0) break;
+                    conn_pause(c);
+                    return;
+                }
+            }
+            out[1] = (out_segment){ c->chunk + c->chunk_off, c->chunk_len, &c->chunk_sent };
+            done = conn_send(c, out, 2, 0);
+        } while (done > 0);
+    } else if (c->res.body_file) {
+        // The head waits to leave in one packet with the start of the file
+        done = conn_send(c, out, 1, c->body_sent < c->res.body_len);
+        if (done > 0) done = conn_sendfile(c);
+    } else {
+        int count = 1;
+        if (c->res.body && c->res.body_len > 0) {
+            out[count++] = (out_segment){ c->res.body + c->res.body_offset, c->res.body_len, &c->body_sent };
+        }
+        done = conn_send(c, out, count, 0);
+    }
+
+    if (done < 0) {
+        conn_close(c);
+    } else if (done == 0) {
+        conn_watch(c, EVENT_WRITE);
+    } else {
+        conn_sent(c);
+    }
+}
+
+static void conn_respond(connection *c) {
+    c->state = CONN_WRITE;
+    c->keep_alive = c->keep_alive && c->req.keep_alive && !server.draining;
+    http_apply_range(&c->req, &c->res);
+    c->head_out = http_format_head(&c->res, c->keep_alive, c->head, sizeof(c->head));
+    c->head_sent = 0;
+    conn_arm(c, server.cfg->write_timeout);
+    conn_flush(c);
+}
+
+// Replies without reading the rest of the request; the connection cannot be reused
+static void conn_reject(connection *c, int status, const char *message) {
+    response_free(&c->res);
+    memset(&c->res, 0, sizeof(c->res));
+    response_error(&c->res, status, message);
+    c->keep_alive = 0;
+    conn_respond(c);
+}
+
+// Turns a request away for now, telling the client when to come back
+static void conn_defer(connection *c, int status, const char *message, int retry_after) {
+    response_free(&c->res);
+    memset(&c->res, 0, sizeof(c->res));
+    response_error(&c->res, status, message);
+    response_header(&c->res, "Retry-After: %d", retry_after);
+    conn_respond(c);
+}
+
+/* Heavy request scheduling */
+
+static void sched_arm(void) {
+    uint64_t now = monotonic_ms();
+    uint64_t delay = server.heavy_after > now ? server.heavy_after - now : 0;
+    timer_arm(&server.loop.timers, &server.sched_timer, delay);
+}
+
+static void sched_remove(connection *c) {
+    for (connection **link = &server.heavy_head; *link; link = &(*link)->queue_next) {
+        if (*link == c) {
+            *link = c->queue_next;
+            c->queue_next = NULL;
+            server.heavy_count--;
+            return;
+        }
+    }
+}
+
+static void conn_call_handler(connection *c);
+
+// Holds the next heavy request back in proportion to the time the last one took
+static void sched_done(uint64_t spent) {
+    server.heavy_after = monotonic_ms() + spent * (100 - SCHED_HEAVY_SHARE) / SCHED_HEAVY_SHARE;
+    if (server.heavy_head) sched_arm();
+}
+
+static uint64_t thread_cpu_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void* heavy_main(void *arg) {
+    (void)arg;
+    uint64_t one = 1;
+
+    for (;;) {
+        pthread_mutex_lock(&server.heavy_lock);
+        while (!server.heavy_posted) pthread_cond_wait(&server.heavy_wake, &server.heavy_lock);
+        pthread_mutex_unlock(&server.heavy_lock);
+
+        // Waiting on commands costs nobody anything; only CPU time is paced
+        uint64_t cpu = thread_cpu_ms();
+        server.heavy_handler(&server.heavy_req, &server.heavy_res);
+        cpu = thread_cpu_ms() - cpu;
+
+        pthread_mutex_lock(&server.heavy_lock);
+        server.heavy_spent = cpu;
+        server.heavy_posted = 0;
+        pthread_mutex_unlock(&server.heavy_lock);
+        if (write(server.heavy_fd, &one, sizeof(one)) < 0) perror("heavy worker: eventfd");
+    }
+    return NULL;
+}
+
+// Gives the worker its own copy of the request, since input that arrives
+// meanwhile may move c->in; the response is handed back by heavy_done()
+static int heavy_post(connection *c) {
+    char *in = malloc(c->request_len + 1);
+    if (!in) return -1;
+    memcpy(in, c->in, c->request_len);
+    in[c->request_len] = '\0';
+
+    server.heavy_req = c->req;
+    if (c->req.headers_len) server.heavy_req.headers = in + (c->req.headers - c->in);
+    if (c->req.body) server.heavy_req.body = in + (c->req.body - c->in);
+    server.heavy_req.body_len = c->req.content_length;
+    server.heavy_res = c->res;
+    memset(&c->res, 0, sizeof(c->res));
+    server.heavy_in = in;
+    server.heavy_handler = c->handler;
+    server.heavy_conn = c;
+
+    // The handler's own deadlines apply; the write deadline starts with the response
+    c->refs++;
+    c->state = CONN_RUNNING;
+    timer_cancel(&server.loop.timers, &c->timer);
+    flight_mark(c->flight, FLIGHT_HANDLER_START);
+
+    pthread_mutex_lock(&server.heavy_lock);
+    server.heavy_posted = 1;
+    pthread_cond_signal(&server.heavy_wake);
+    pthread_mutex_unlock(&server.heavy_lock);
+    return 0;
+}
+
+static void heavy_done(void *data, unsigned events) {
+    (void)data;
+    (void)events;
+    uint64_t count;
+    while (read(server.heavy_fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+
+    pthread_mutex_lock(&server.heavy_lock);
+    int running = server.heavy_posted;
+    pthread_mutex_unlock(&server.heavy_lock);
+    connection *c = server.heavy_conn;
+    if (running || !c) return;
+
+    server.heavy_conn = NULL;
+    free(server.heavy_in);
+    server.heavy_in = NULL;
+    flight_mark(c->flight, FLIGHT_HANDLER_END);
+
+    // A client that went away meanwhile only leaves the response to free
+    if (c->closing) {
+        response_free(&server.heavy_res);
+    } else {
+        c->res = server.heavy_res;
+        conn_respond(c);
+    }
+    memset(&server.heavy_res, 0, sizeof(server.heavy_res));
+    conn_unref(c);
+    sched_done(server.heavy_spent);
+}
+
+static void heavy_start(void) {
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_mutex_init(&server.heavy_lock, NULL);
+    pthread_cond_init(&server.heavy_wake, NULL);
+    server.heavy_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.heavy_io.callback = heavy_done;
+    if (server.heavy_fd < 0 || event_add(&server.loop, server.heavy_fd, EVENT_READ, &server.heavy_io) < 0) {
+        perror("heavy worker");
+        if (server.heavy_fd >= 0) close(server.heavy_fd);
+        server.heavy_fd = -1;
+        return;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, heavy_main, NULL) != 0) {
+        perror("heavy worker");
+        event_del(&server.loop, server.heavy_fd, &server.heavy_io);
+        close(server.heavy_fd);
+        server.heavy_fd = -1;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Starts the oldest heavy request once the worker is free and the pause
+// after the last one is over; without a worker it runs right here
+static void sched_run(ur_timer *timer) {
+    (void)timer;
+    uint64_t start = monotonic_ms();
+    if (server.heavy_conn) return;
+    if (start < server.heavy_after) {
+        sched_arm();
+        return;
+    }
+
+    connection *c = server.heavy_head;
+    if (!c) return;
+    sched_remove(c);
+
+    if (server.heavy_fd >= 0) {
+        if (heavy_post(c) < 0) {
+            conn_reject(c, 500, "Memory allocation error");
+            if (server.heavy_head) sched_arm();
+        }
+        return;
+    }
+
+    c->refs++;
+    conn_call_handler(c);
+    conn_unref(c);
+    sched_done(monotonic_ms() - start);
+}
+
+static void sched_queue(connection *c) {
+    if (server.heavy_count >= SCHED_QUEUE_MAX) {
+        conn_defer(c, 503, "Server is busy", 1);
+        return;
+    }
+
+    connection **link = &server.heavy_head;
+    while (*link) link = &(*link)->queue_next;
+    *link = c;
+    c->queue_next = NULL;
+    server.heavy_count++;
+
+    // Waiting its turn counts against the write deadline
+    c->state = CONN_QUEUED;
+    conn_arm(c, server.cfg->write_timeout);
+    if (!timer_pending(&server.sched_timer)) sched_arm();
+}
+
+/* Request input */
+
+static void conn_call_handler(connection *c) {
+    // Handlers expect a terminated body; the byte after it may be pipelined data
+    char *end = c->in + c->request_len;
+    char saved = *end;
+    *end = '\0';
+    c->req.body_len = c->req.content_length;
+    flight_mark(c->flight, FLIGHT_HANDLER_START);
+    c->handler(&c->req, &c->res);
+    flight_mark(c->flight, FLIGHT_HANDLER_END);
+    *end = saved;
+    conn_respond(c);
+}
+
+static void conn_run_handler(connection *c) {
+    if (c->cls == ROUTE_HEAVY) {
+        sched_queue(c);
+    } else {
+        conn_call_handler(c);
+    }
+}
+
+static void conn_finish_sink(connection *c) {
+    void *ctx = c->sink_ctx;
+    c->sink_ctx = NULL;
+    c->sink->finish(ctx, &c->req, &c->res);
+    flight_mark(c->flight, FLIGHT_HANDLER_END);
+
+    // A sink that stopped early leaves unread body behind
+    if (!c->sink_ok || c->body_remaining) c->keep_alive = 0;
+    conn_respond(c);
+}
+
+static void conn_sink_write(connection *c, const char *data, size_t len) {
+    if (len > c->body_remaining) len = c->body_remaining;
+    c->body_remaining -= len;
+    if (len && c->sink->write(c->sink_ctx, data, len) < 0) c->sink_ok = 0;
+}
+
+static void conn_begin_body(connection *c, const route_target *target) {
+    size_t available = c->in_len - c->head_len;
+
+    if (target->sink) {
+        c->sink = target->sink;
+        flight_mark(c->flight, FLIGHT_HANDLER_START);
+        c->sink_ctx = c->sink->begin(&c->req, &c->res);
+        if (!c->sink_ctx) {
+            if (c->req.content_length) c->keep_alive = 0;
+            conn_respond(c);
+            return;
+        }
+
+        c->sink_ok = 1;
+        c->body_remaining = c->req.content_length;
+        conn_sink_write(c, c->in + c->head_len, available);
+
+        // Only the headers stay buffered; a pipelined request behind the body moves up
+        size_t consumed = c->req.content_length - c->body_remaining;
+        size_t leftover = available - consumed;
+        if (leftover) memmove(c->in + c->head_len, c->in + c->head_len + consumed, leftover);
+        c->request_len = c->head_len;
+        c->in_len = c->head_len + leftover;
+        c->in[c->in_len] = '\0';
+
+        if (!c->body_remaining || !c->sink_ok) {
+            conn_finish_sink(c);
+            return;
+        }
+    } else {
+        if (c->req.content_length >= BUFFER_SIZE - c->head_len) {
+            conn_reject(c, 413, "Request body too large");
+            return;
+        }
+        if (conn_reserve(c, c->head_len + c->req.content_length) < 0) {
+            conn_close(c);
+            return;
+        }
+
+        c->handler = target->handler;
+        c->request_len = c->head_len + c->req.content_length;
+        if (available >= c->req.content_length) {
+            conn_run_handler(c);
+            return;
+        }
+    }
+
+    c->state = CONN_BODY;
+    c->body_progress = 0;
+    conn_arm(c, server.cfg->body_timeout);
+}
+
+static void conn_process(connection *c) {
+    char *end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+    if (!end) {
+        if (c->in_len >= CONN_HEADER_LIMIT) {
+            conn_reject(c, 431, "Request headers too large");
+        }
+        return;
+    }
+
+    c->head_len = end + 4 - c->in;
+    c->request_len = c->head_len;
+    c->keep_alive = 1;
+    c->res.status = 200;
+
+    if (http_parse_request(c->in, c->head_len, &c->req) < 0) {
+        conn_reject(c, 400, "Malformed request");
+        return;
+    }
+    c->req.socket = c->fd;
+    memcpy(c->req.client_ip, c->client_ip, sizeof(c->req.client_ip));
+
+    route_target target;
+    int routed = server_route_request(&c->req, &c->res, &target);
+    flight_request_route(c->flight, c->req.method_name, c->req.uri, target.cls);
+    if (routed < 0) {
+        if (c->req.content_length) c->keep_alive = 0;
+        conn_respond(c);
+        return;
+    }
+
+    int retry_after = limit_take(c->addr, target.cls, monotonic_ms());
+    if (retry_after) {
+        if (c->req.content_length) c->keep_alive = 0;
+        conn_defer(c, 429, "Too many requests", retry_after);
+        return;
+    }
+    c->cls = target.cls;
+
+    conn_begin_body(c, &target);
+}
+
+// Appends bytes that arrived ahead of their turn, e.g. a pipelined request
+static int conn_append(connection *c, const char *data, size_t len) {
+    if (c->in_len + len >= BUFFER_SIZE || conn_reserve(c, c->in_len + len) < 0) return -1;
+    memcpy(c->in + c->in_len, data, len);
+    c->in_len += len;
+    c->in[c->in_len] = '\0';
+    return 0;
+}
+
+static size_t conn_input_headers(connection *c, const char *data, size_t len) {
+    if (conn_reserve(c, CONN_HEADER_LIMIT) < 0) {
+        conn_close(c);
+        return len;
+    }
+
+    size_t take = c->in_len < CONN_HEADER_LIMIT ? CONN_HEADER_LIMIT - c->in_len : 0;
+    if (take > len) take = len;
+
+    // The header deadline starts with the first byte and is never extended
+    if (c->idle) {
+        c->idle = 0;
+        flight_request_begin(&c->flight, c->addr);
+        conn_arm(c, server.cfg->header_timeout);
+    }
+
+    memcpy(c->in + c->in_len, data, take);
+    c->in_len += take;
+    c->in[c->in_len] = '\0';
+    conn_process(c);
+
+    // A full buffer without a complete head has been rejected by now
+    if (take == 0 && c->state == CONN_HEADERS) {
+        conn_close(c);
+        return len;
+    }
+    return take;
+}
+
+static size_t conn_input_body(connection *c, const char *data, size_t len) {
+    size_t take;
+
+    // Only real progress earns more time; a trickle runs into the deadline
+    if (c->sink) {
+        take = len < c->body_remaining ? len : c->body_remaining;
+    } else {
+        take = c->request_len - c->in_len;
+        if (take > len) take = len;
+    }
+    c->body_progress += take;
+    if (c->body_progress >= CONN_BODY_MIN_PROGRESS) {
+        c->body_progress = 0;
+        conn_arm(c, server.cfg->body_timeout);
+    }
+
+    if (c->sink) {
+        conn_sink_write(c, data, take);
+        if (!c->body_remaining || !c->sink_ok) conn_finish_sink(c);
+    } else {
+        memcpy(c->in + c->in_len, data, take);
+        c->in_len += take;
+        c->in[c->in_len] = '\0';
+        if (c->in_len >= c->request_len) conn_run_handler(c);
+    }
+    return take;
+}
+
+// Feeds received bytes through the state machine, which may move on part way
+static void conn_input(connection *c, const char *data, size_t len) {
+    while (len > 0 && !c->closing) {
+        size_t used = len;
+
+        switch (c->state) {
+            case CONN_HEADERS:
+                used = conn_input_headers(c, data, len);
+                break;
+            case CONN_BODY:
+                used = conn_input_body(c, data, len);
+                break;
+            case CONN_QUEUED:
+            case CONN_RUNNING:
+            case CONN_WRITE:
+                // Held until the response is out; a client that keeps piling on is dropped
+                if (conn_append(c, data, len) < 0) conn_close(c);
+                break;
+            case CONN_LINGER:
+                c->lingered += len;
+                if (c->lingered >= LINGER_DRAIN_LIMIT) conn_close(c);
+                break;
+        }
+
+        data += used;
+        len -= used;
+    }
+}
+
+#ifdef UR_HAVE_TLS
+
+// Moves the handshake on; returns 1 once the session is up, 0 while it
+// waits and -1 after closing the connection
+static int conn_handshake(connection *c) {
+    unsigned want;
+    int ret = tls_handshake(c->tls, &want);
+
+    if (ret < 0) {
+        conn_close(c);
+        return -1;
+    }
+    if (ret == 0) {
+        conn_watch(c, want);
+        return 0;
+    }
+
+    c->tls_ready = 1;
+    c->tls_offload = tls_offloaded(c->tls);
+    conn_watch(c, EVENT_READ);
+    return 1;
+}
+
+// Reads through the session; -1 with errno EAGAIN while it waits on the socket
+static ssize_t conn_tls_read(connection *c, char *buf, size_t len) {
+    unsigned want;
+
+    if (c->tls_read_blocked) {
+        c->tls_read_blocked = 0;
+        conn_watch(c, EVENT_READ);
+    }
+
+    ssize_t n = tls_read(c->tls, buf, len, &want);
+    if (n < 0) {
+        errno = want ? EAGAIN : EIO;
+        if (want == EVENT_WRITE) {
+            c->tls_read_blocked = 1;
+            conn_watch(c, EVENT_WRITE);
+        }
+    }
+    return n;
+}
+
+#endif
+
+static void conn_read(connection *c) {
+    // A whole TLS record, so the session is always read dry
+    static char scratch[BODY_CHUNK_SIZE];
+
+    // While a response is pending the socket is only watched for writing
+    while (!c->closing && (c->state != CONN_WRITE || c->stream_paused)) {
+        ssize_t n;
+#ifdef UR_HAVE_TLS
+        // Lingering only drains, and close_notify has already gone out
+        if (c->tls && c->state != CONN_LINGER) {
+            n = conn_tls_read(c, scratch, sizeof(scratch));
+        } else
+#endif
+        n = read(c->fd, scratch, sizeof(scratch));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            conn_close(c);
+            return;
+        }
+        conn_input(c, scratch, n);
+    }
+}
+
+static void conn_io(void *data, unsigned events) {
+    connection *c = data;
+
+    c->refs++;
+    if ((events & EVENT_ERROR) && c->state != CONN_LINGER) {
+        conn_close(c);
+#ifdef UR_HAVE_TLS
+    } else if (c->tls && !c->tls_ready) {
+        // The request may have come in with the end of the handshake
+        if (conn_handshake(c) > 0) conn_read(c);
+#endif
+    } else if (c->state == CONN_WRITE && !c->stream_paused) {
+        conn_flush(c);
+    } else {
+        conn_read(c);
+    }
+    conn_unref(c);
+}
+
+#ifdef UR_HAVE_IO_URING
+
+static void conn_recv_done(uring_op *op, int res, unsigned flags);
+
+static int conn_arm_recv(connection *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(server.ring, &c->recv_op);
+    if (!sqe) return -1;
+
+    c->recv_op.callback = conn_recv_done;
+    c->recv_op.data = c;
+    uring_prep_recv_multishot(sqe, c->fd);
+    c->refs++;
+    return 0;
+}
+
+static void conn_recv_done(uring_op *op, int res, unsigned flags) {
+    connection *c = op->data;
+
+    if (res > 0 && !c->closing) conn_input(c, uring_buffer(server.ring, flags), res);
+    uring_buffer_recycle(server.ring, flags);
+
+    // Running out of provided buffers only ends this round of the multishot
+    if (res == 0 || (res < 0 && res != -ENOBUFS)) conn_close(c);
+
+    // The reference is held for as long as the multishot stays armed
+    if (flags & IORING_CQE_F_MORE) return;
+    if (!c->closing && conn_arm_recv(c) < 0) conn_close(c);
+    conn_unref(c);
+}
+
+#endif
+
+// Gives a paused stream its next chunk, under the write deadline again
+static void conn_resume(connection *c) {
+    conn_unpause(c);
+    c->refs++;
+    conn_arm(c, server.cfg->write_timeout);
+    conn_flush(c);
+    conn_unref(c);
+}
+
+void conn_wake(const void *key) {
+    // Resumed streams may pause again straight away, so work off a detached list
+    connection *pending = server.waiting;
+    server.waiting = NULL;
+    if (pending) pending->wait_pprev = &pending;
+
+    while (pending) {
+        connection *c = pending;
+        conn_wait_unlink(c);
+        if (c->res.stream_wait_key == key) {
+            conn_resume(c);
+        } else {
+            conn_wait_link(c, &server.waiting);
+        }
+    }
+}
+
+event_loop* conn_server_loop(void) {
+    return &server.loop;
+}
+
+// A last word before closing, if the socket takes it right away
+static void conn_reply_now(connection *c, const char *reply, size_t len) {
+#ifdef UR_HAVE_TLS
+    if (c->tls && !c->tls_offload) {
+        unsigned want;
+        if (c->tls_ready) tls_write(c->tls, reply, len, &want);
+        return;
+    }
+#endif
+    send(c->fd, reply, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void conn_timeout(ur_timer *timer) {
+    connection *c = timer->data;
+
+    if (c->stream_paused) {
+        conn_resume(c);
+        return;
+    }
+
+    // Too long in the queue: the client may try again rather than just see a drop
+    if (c->state == CONN_QUEUED) {
+        sched_remove(c);
+        conn_defer(c, 503, "Server is busy", 1);
+        return;
+    }
+
+    // A request that stalled part way gets told why before it is dropped
+    if ((c->state == CONN_HEADERS && !c->idle && c->in_len) || c->state == CONN_BODY) {
+        conn_reply_now(c, timeout_reply, sizeof(timeout_reply) - 1);
+    }
+    conn_close(c);
+}
+
+/* Listener */
+
+static void conn_refuse(int fd, int tls) {
+    // Before a handshake there is no way to tell a TLS client why
+    if (!tls) send(fd, overload_reply, sizeof(overload_reply) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(fd, SHUT_WR);
+    close(fd);
+}
+
+static void conn_accept(int fd, const struct sockaddr_in *address, int tls) {
+    uint32_t addr = address->sin_addr.s_addr;
+
+    if (server.active >= server.cfg->max_connections || ip_acquire(addr) < 0) {
+        conn_refuse(fd, tls);
+        return;
+    }
+
+    connection *c = calloc(1, sizeof(connection));
+    if (!c) {
+        ip_release(addr);
+        conn_refuse(fd, tls);
+        return;
+    }
+
+    c->fd = fd;
+    c->addr = addr;
+    c->state = CONN_HEADERS;
+    c->res.status = 200;
+    c->io.callback = conn_io;
+    c->io.data = c;
+    inet_ntop(AF_INET, &address->sin_addr, c->client_ip, sizeof(c->client_ip));
+    timer_init(&c->timer, conn_timeout, c);
+    flight_request_begin(&c->flight, addr);
+    server.active++;
+
+#ifdef UR_HAVE_TLS
+    if (tls && !(c->tls = tls_new(fd))) {
+        conn_close(c);
+        return;
+    }
+#endif
+
+#ifdef UR_HAVE_IO_URING
+    if (conn_on_ring(c)) {
+        if (conn_arm_recv(c) < 0) {
+            conn_close(c);
+            return;
+        }
+    } else
+#endif
+    if (event_add(&server.loop, fd, EVENT_READ, &c->io) < 0) {
+        perror("epoll_ctl");
+        conn_close(c);
+        return;
+    }
+
+    // A fresh connection gets the header deadline right away, not an idle grace;
+    // for HTTPS it covers the handshake too
+    conn_arm(c, server.cfg->header_timeout);
+}
+
+static void listener_io(void *data, unsigned events) {
+    (void)events;
+    conn_listener *l = data;
+
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        int fd = accept4(l->fd, (struct sockaddr *)&address, &addrlen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if ((errno == EMFILE || errno == ENFILE) && server.spare_fd >= 0) {
+                // Out of descriptors: free the spare to accept and shed one client
+                close(server.spare_fd);
+                fd = accept(l->fd, NULL, NULL);
+                if (fd >= 0) conn_refuse(fd, l->tls);
+                server.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+
+        conn_accept(fd, &address, l->tls);
+    }
+}
+
+#ifdef UR_HAVE_IO_URING
+
+static void listener_accept_done(uring_op *op, int res, unsigned flags);
+
+static int listener_arm(conn_listener *l) {
+    struct io_uring_sqe *sqe = uring_get_sqe(server.ring, &l->accept_op);
+    if (!sqe) return -1;
+
+    l->accept_op.callback = listener_accept_done;
+    l->accept_op.data = l;
+    uring_prep_accept_multishot(sqe, l->fd);
+    return 0;
+}
+
+static void listener_accept_done(uring_op *op, int res, unsigned flags) {
+    conn_listener *l = op->data;
+
+    if (res >= 0) {
+        // Multishot accept cannot report the peer address; ask for it
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        if (getpeername(res, (struct sockaddr *)&address, &addrlen) == 0 &&
+            address.sin_family == AF_INET) {
+            conn_accept(res, &address, l->tls);
+        } else {
+            close(res);
+        }
+    } else if ((res == -EMFILE || res == -ENFILE) && server.spare_fd >= 0) {
+        close(server.spare_fd);
+        int fd = accept(l->fd, NULL, NULL);
+        if (fd >= 0) conn_refuse(fd, l->tls);
+        server.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    } else if (res < 0 && res != -ECANCELED) {
+        fprintf(stderr, "accept: %s\n", strerror(-res));
+    }
+
+    if (!(flags & IORING_CQE_F_MORE) && !server.draining && listener_arm(l) < 0) {
+        fprintf(stderr, "accept: submission queue full\n");
+        event_loop_stop(&server.loop);
+    }
+}
+
+static void listener_cancel_done(uring_op *op, int res, unsigned flags) {
+    (void)op;
+    (void)res;
+    (void)flags;
+}
+
+#endif
+
+static void drain_expired(ur_timer *timer) {
+    (void)timer;
+    // Streams and stragglers still open are cut off when the process exits
+    event_loop_stop(&server.loop);
+}
+
+void conn_server_drain(uint64_t deadline_ms) {
+    if (server.draining) return;
+    server.draining = 1;
+
+    for (int i = 0; i < server.listener_count; i++) {
+        conn_listener *l = &server.listeners[i];
+#ifdef UR_HAVE_IO_URING
+        if (server.ring) {
+            struct io_uring_sqe *sqe = uring_get_sqe(server.ring, &l->cancel_op);
+            if (sqe) {
+                l->cancel_op.callback = listener_cancel_done;
+                uring_prep_cancel_fd(sqe, l->fd);
+            }
+            continue;
+        }
+#endif
+        event_del(&server.loop, l->fd, &l->io);
+    }
+
+    if (server.active == 0) {
+        event_loop_stop(&server.loop);
+        return;
+    }
+    timer_init(&server.drain_timer, drain_expired, NULL);
+    timer_arm(&server.loop.timers, &server.drain_timer, deadline_ms);
+}
+
+// Starts accepting on one listener; -1 when the loop cannot watch it
+static int listener_start(int fd, int tls) {
+    conn_listener *l = &server.listeners[server.listener_count++];
+    l->fd = fd;
+    l->tls = tls;
+    l->io.callback = listener_io;
+    l->io.data = l;
+
+#ifdef UR_HAVE_IO_URING
+    if (server.ring) return listener_arm(l);
+#endif
+    if (event_add(&server.loop, fd, EVENT_READ, &l->io) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+void conn_server_run(int listen_fd, int tls_fd, const server_config *cfg) {
+    memset(&server, 0, sizeof(server));
+    server.cfg = cfg;
+    server.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    timer_init(&server.sched_timer, sched_run, NULL);
+
+    if (event_loop_init(&server.loop, cfg->force_epoll ? 0 : EVENT_LOOP_URING) < 0) return;
+
+#ifdef UR_HAVE_IO_URING
+    server.ring = event_loop_uring(&server.loop);
+    printf("Event loop: %s\n", server.ring ? "io_uring" : "epoll");
+#else
+    printf("Event loop: epoll\n");
+#endif
+    if (listener_start(listen_fd, 0) < 0 || (tls_fd >= 0 && listener_start(tls_fd, 1) < 0)) {
+        event_loop_free(&server.loop);
+        return;
+    }
+
+    if (upgrade_watch(&server.loop, listen_fd, tls_fd) < 0) {
+        fprintf(stderr, "Restart on signal unavailable\n");
+    }
+#ifdef UR_HAVE_TLS
+    if (tls_fd >= 0) tls_watch(&server.loop);
+#endif
+    fleet_start(&server.loop);
+    flight_watch(&server.loop);
+    assets_start();
+    metrics_start(&server.loop);
+    heavy_start();
+    history_start(&server.loop);
+    event_loop_run(&server.loop);
+
+    event_loop_free(&server.loop);
+    if (server.spare_fd >= 0) close(server.spare_fd);
+}
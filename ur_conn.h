@@ -0,0 +1,34 @@
+#ifndef UR_CONN_H
+#define UR_CONN_H
+
+#include "ur_management.h"
+#include "ur_router.h"
+#include "ur_event.h"
+
+#define CONN_HEADER_LIMIT 8192
+#define CONN_BODY_MIN_PROGRESS 1024
+#define CONN_LINGER_MS 2000
+#define CONN_IP_BUCKETS 256
+// Heavy requests waiting to run; more are answered 503
+#define SCHED_QUEUE_MAX 16
+// Percent of the time the heavy worker may spend running handlers
+#define SCHED_HEAVY_SHARE 25
+
+// Runs the nonblocking HTTP server on already listening sockets; connections
+// to tls_fd speak HTTPS, and -1 leaves it out
+void conn_server_run(int listen_fd, int tls_fd, const server_config *cfg);
+
+// Stops accepting and lets open connections finish; the loop ends once they
+// are gone or after deadline_ms, whichever comes first
+void conn_server_drain(uint64_t deadline_ms);
+
+// Resumes every paused stream whose response has this stream_wait_key
+void conn_wake(const void *key);
+
+// The server's loop, for modules that watch descriptors of their own
+event_loop* conn_server_loop(void);
+
+// Routes a parsed request; returns 1 with target set, -1 when res is already filled
+int server_route_request(http_request *req, http_response *res, route_target *target);
+
+#endif
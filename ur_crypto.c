@@ -0,0 +1,280 @@
+#include "ur_crypto.h"
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Small self-contained primitives for the backup and firmware paths.
+ * Everything works incrementally so callers can hash or encrypt data
+ * as it streams past without holding it in memory.
+ */
+
+/* SHA-256 */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha256_transform(sha256_ctx *ctx, const uint8_t *block) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(sha256_ctx *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    ctx->length += len;
+
+    if (ctx->block_len > 0) {
+        size_t take = SHA256_BLOCK_SIZE - ctx->block_len;
+        if (take > len) take = len;
+        memcpy(ctx->block + ctx->block_len, p, take);
+        ctx->block_len += take;
+        p += take;
+        len -= take;
+        if (ctx->block_len < SHA256_BLOCK_SIZE) return;
+        sha256_transform(ctx, ctx->block);
+        ctx->block_len = 0;
+    }
+
+    while (len >= SHA256_BLOCK_SIZE) {
+        sha256_transform(ctx, p);
+        p += SHA256_BLOCK_SIZE;
+        len -= SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(ctx->block, p, len);
+    ctx->block_len = len;
+}
+
+void sha256_final(sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad = 0x80;
+    uint8_t zero = 0;
+    uint8_t length_be[8];
+
+    sha256_update(ctx, &pad, 1);
+    while (ctx->block_len != 56) sha256_update(ctx, &zero, 1);
+
+    for (int i = 0; i < 8; i++) length_be[i] = (uint8_t)(bits >> (56 - i * 8));
+    sha256_update(ctx, length_be, 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[SHA256_DIGEST_SIZE * 2 + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0x0f];
+    }
+    hex[SHA256_DIGEST_SIZE * 2] = '\0';
+}
+
+/* HMAC and PBKDF2 */
+
+typedef struct {
+    sha256_ctx inner;
+    sha256_ctx outer;
+} hmac_sha256_ctx;
+
+static void hmac_sha256_init(hmac_sha256_ctx *ctx, const void *key, size_t key_len) {
+    uint8_t block[SHA256_BLOCK_SIZE] = {0};
+    uint8_t pad[SHA256_BLOCK_SIZE];
+
+    if (key_len > SHA256_BLOCK_SIZE) {
+        sha256_ctx hash;
+        sha256_init(&hash);
+        sha256_update(&hash, key, key_len);
+        sha256_final(&hash, block);
+    } else {
+        memcpy(block, key, key_len);
+    }
+
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) pad[i] = block[i] ^ 0x36;
+    sha256_init(&ctx->inner);
+    sha256_update(&ctx->inner, pad, SHA256_BLOCK_SIZE);
+
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) pad[i] = block[i] ^ 0x5c;
+    sha256_init(&ctx->outer);
+    sha256_update(&ctx->outer, pad, SHA256_BLOCK_SIZE);
+}
+
+static void hmac_sha256_final(hmac_sha256_ctx *ctx, uint8_t mac[SHA256_DIGEST_SIZE]) {
+    uint8_t inner[SHA256_DIGEST_SIZE];
+    sha256_final(&ctx->inner, inner);
+    sha256_update(&ctx->outer, inner, sizeof(inner));
+    sha256_final(&ctx->outer, mac);
+}
+
+void hmac_sha256(const void *key, size_t key_len, const void *data, size_t data_len,
+                 uint8_t mac[SHA256_DIGEST_SIZE]) {
+    hmac_sha256_ctx ctx;
+    hmac_sha256_init(&ctx, key, key_len);
+    sha256_update(&ctx.inner, data, data_len);
+    hmac_sha256_final(&ctx, mac);
+}
+
+void pbkdf2_hmac_sha256(const char *password, size_t password_len,
+                        const uint8_t *salt, size_t salt_len, unsigned iterations,
+                        uint8_t *out, size_t out_len) {
+    hmac_sha256_ctx keyed;
+    hmac_sha256_init(&keyed, password, password_len);
+
+    for (uint32_t block = 1; out_len > 0; block++) {
+        uint8_t counter[4] = {
+            (uint8_t)(block >> 24), (uint8_t)(block >> 16), (uint8_t)(block >> 8), (uint8_t)block
+        };
+        uint8_t u[SHA256_DIGEST_SIZE];
+        uint8_t t[SHA256_DIGEST_SIZE];
+        hmac_sha256_ctx ctx = keyed;
+
+        sha256_update(&ctx.inner, salt, salt_len);
+        sha256_update(&ctx.inner, counter, sizeof(counter));
+        hmac_sha256_final(&ctx, u);
+        memcpy(t, u, sizeof(t));
+
+        for (unsigned i = 1; i < iterations; i++) {
+            ctx = keyed;
+            sha256_update(&ctx.inner, u, sizeof(u));
+            hmac_sha256_final(&ctx, u);
+            for (int j = 0; j < SHA256_DIGEST_SIZE; j++) t[j] ^= u[j];
+        }
+
+        size_t take = out_len < sizeof(t) ? out_len : sizeof(t);
+        memcpy(out, t, take);
+        out += take;
+        out_len -= take;
+    }
+}
+
+/* ChaCha20 */
+
+static uint32_t load32_le(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8);  \
+    c += d; b ^= c; b = ROTL32(b, 7)
+
+static void chacha20_block(chacha20_ctx *ctx) {
+    uint32_t x[16];
+    memcpy(x, ctx->input, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + ctx->input[i];
+        ctx->keystream[i * 4] = (uint8_t)v;
+        ctx->keystream[i * 4 + 1] = (uint8_t)(v >> 8);
+        ctx->keystream[i * 4 + 2] = (uint8_t)(v >> 16);
+        ctx->keystream[i * 4 + 3] = (uint8_t)(v >> 24);
+    }
+
+    ctx->input[12]++;
+    ctx->keystream_pos = 0;
+}
+
+void chacha20_init(chacha20_ctx *ctx, const uint8_t key[CHACHA20_KEY_SIZE],
+                   const uint8_t iv[CHACHA20_IV_SIZE]) {
+    ctx->input[0] = 0x61707865;
+    ctx->input[1] = 0x3320646e;
+    ctx->input[2] = 0x79622d32;
+    ctx->input[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) ctx->input[4 + i] = load32_le(key + i * 4);
+    for (int i = 0; i < 4; i++) ctx->input[12 + i] = load32_le(iv + i * 4);
+    ctx->keystream_pos = sizeof(ctx->keystream);
+}
+
+void chacha20_xor(chacha20_ctx *ctx, uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (ctx->keystream_pos == sizeof(ctx->keystream)) chacha20_block(ctx);
+        data[i] ^= ctx->keystream[ctx->keystream_pos++];
+    }
+}
+
+int random_bytes(void *buf, size_t len) {
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    close(fd);
+    return 0;
+}
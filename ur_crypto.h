@@ -0,0 +1,48 @@
+#ifndef UR_CRYPTO_H
+#define UR_CRYPTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+#define CHACHA20_KEY_SIZE 32
+#define CHACHA20_IV_SIZE 16
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[SHA256_BLOCK_SIZE];
+    size_t block_len;
+} sha256_ctx;
+
+typedef struct {
+    uint32_t input[16];
+    uint8_t keystream[64];
+    size_t keystream_pos;
+} chacha20_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+
+void sha256_final(sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[SHA256_DIGEST_SIZE * 2 + 1]);
+
+void hmac_sha256(const void *key, size_t key_len, const void *data, size_t data_len,
+                 uint8_t mac[SHA256_DIGEST_SIZE]);
+
+void pbkdf2_hmac_sha256(const char *password, size_t password_len,
+                        const uint8_t *salt, size_t salt_len, unsigned iterations,
+                        uint8_t *out, size_t out_len);
+
+// The IV layout matches OpenSSL's chacha20: 32-bit LE counter followed by a 96-bit nonce
+void chacha20_init(chacha20_ctx *ctx, const uint8_t key[CHACHA20_KEY_SIZE],
+                   const uint8_t iv[CHACHA20_IV_SIZE]);
+
+void chacha20_xor(chacha20_ctx *ctx, uint8_t *data, size_t len);
+
+int random_bytes(void *buf, size_t len);
+
+#endif
@@ -0,0 +1,283 @@
+#include "ur_escape.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ESCAPE_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * JSON and HTML escaping and URL decoding. Most text that comes through
+ * here (command output, log lines, process names) has little or nothing to
+ * escape, so the work is finding the next byte that does. The kernels test
+ * 16 or 32 bytes per step against a small set of special bytes, the clean
+ * run before a hit is copied with memcpy(), and only the hit itself is
+ * handled byte by byte. The widest kernel the CPU has is picked on first
+ * use: AVX2 or SSE2 on x86, NEON on ARM, a table lookup elsewhere. They all
+ * stop at the same byte, so the output never depends on the kernel.
+ */
+
+#define ESCAPE_SET_SIZE 5
+
+typedef struct {
+    // Bytes that need handling; unused slots repeat the first
+    unsigned char eq[ESCAPE_SET_SIZE];
+    // So does every byte up to this one; 0 only adds NUL, which is passed through
+    unsigned char upto;
+    // The same set for the scalar kernel, filled in on first use
+    unsigned char table[256];
+} escape_set;
+
+static escape_set json_set = { .eq = { '"', '\\', '/', '"', '"' }, .upto = 0x1f };
+static escape_set html_set = { .eq = { '&', '<', '>', '"', '\'' }, .upto = 0 };
+static escape_set url_set = { .eq = { '%', '+', '%', '%', '%' }, .upto = 0 };
+
+// Returns the first byte of [p, end) in the set, or end
+typedef const char* (*find_fn)(const escape_set *set, const char *p, const char *end);
+
+// Writes the replacement for c to out, when given, and returns its length
+typedef size_t (*replace_fn)(unsigned char c, char *out);
+
+static find_fn find_special;
+static const char *kernel_name;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* Kernels */
+
+static const char* find_scalar(const escape_set *set, const char *p, const char *end) {
+    while (p < end && !set->table[(unsigned char)*p]) p++;
+    return p;
+}
+
+#ifdef ESCAPE_X86
+__attribute__((target("sse2")))
+static const char* find_sse2(const escape_set *set, const char *p, const char *end) {
+    const __m128i e0 = _mm_set1_epi8(set->eq[0]);
+    const __m128i e1 = _mm_set1_epi8(set->eq[1]);
+    const __m128i e2 = _mm_set1_epi8(set->eq[2]);
+    const __m128i e3 = _mm_set1_epi8(set->eq[3]);
+    const __m128i e4 = _mm_set1_epi8(set->eq[4]);
+    const __m128i upto = _mm_set1_epi8(set->upto);
+
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(x, e0), _mm_cmpeq_epi8(x, e1));
+        hit = _mm_or_si128(hit, _mm_or_si128(_mm_cmpeq_epi8(x, e2), _mm_cmpeq_epi8(x, e3)));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, e4));
+        // Unsigned x <= upto: the minimum of the two is x itself
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_min_epu8(x, upto), x));
+
+        unsigned mask = _mm_movemask_epi8(hit);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_scalar(set, p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* find_avx2(const escape_set *set, const char *p, const char *end) {
+    const __m256i e0 = _mm256_set1_epi8(set->eq[0]);
+    const __m256i e1 = _mm256_set1_epi8(set->eq[1]);
+    const __m256i e2 = _mm256_set1_epi8(set->eq[2]);
+    const __m256i e3 = _mm256_set1_epi8(set->eq[3]);
+    const __m256i e4 = _mm256_set1_epi8(set->eq[4]);
+    const __m256i upto = _mm256_set1_epi8(set->upto);
+
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(x, e0), _mm256_cmpeq_epi8(x, e1));
+        hit = _mm256_or_si256(hit, _mm256_or_si256(_mm256_cmpeq_epi8(x, e2),
+                                                   _mm256_cmpeq_epi8(x, e3)));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(x, e4));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(_mm256_min_epu8(x, upto), x));
+
+        unsigned mask = _mm256_movemask_epi8(hit);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_sse2(set, p, end);
+}
+#elif defined(__ARM_NEON)
+static const char* find_neon(const escape_set *set, const char *p, const char *end) {
+    const uint8x16_t e0 = vdupq_n_u8(set->eq[0]);
+    const uint8x16_t e1 = vdupq_n_u8(set->eq[1]);
+    const uint8x16_t e2 = vdupq_n_u8(set->eq[2]);
+    const uint8x16_t e3 = vdupq_n_u8(set->eq[3]);
+    const uint8x16_t e4 = vdupq_n_u8(set->eq[4]);
+    const uint8x16_t upto = vdupq_n_u8(set->upto);
+
+    while (end - p >= 16) {
+        uint8x16_t x = vld1q_u8((const uint8_t *)p);
+        uint8x16_t hit = vorrq_u8(vceqq_u8(x, e0), vceqq_u8(x, e1));
+        hit = vorrq_u8(hit, vorrq_u8(vceqq_u8(x, e2), vceqq_u8(x, e3)));
+        hit = vorrq_u8(hit, vorrq_u8(vceqq_u8(x, e4), vcleq_u8(x, upto)));
+
+        // Narrowed to four bits per byte, the first hit is a count of trailing zeros
+        uint8x8_t narrow = vshrn_n_u16(vreinterpretq_u16_u8(hit), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrow), 0);
+        if (mask) return p + (__builtin_ctzll(mask) >> 2);
+        p += 16;
+    }
+    return find_scalar(set, p, end);
+}
+#endif
+
+static void fill_table(escape_set *set) {
+    for (int c = 0; c < 256; c++) {
+        set->table[c] = c <= set->upto || memchr(set->eq, c, ESCAPE_SET_SIZE) != NULL;
+    }
+}
+
+static void kernel_pick(void) {
+    fill_table(&json_set);
+    fill_table(&html_set);
+    fill_table(&url_set);
+
+    find_special = find_scalar;
+    kernel_name = "scalar";
+#if defined(ESCAPE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_special = find_avx2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_special = find_sse2;
+        kernel_name = "sse2";
+    }
+#elif defined(__ARM_NEON)
+    find_special = find_neon;
+    kernel_name = "neon";
+#endif
+}
+
+const char* escape_kernel(void) {
+    pthread_once(&kernel_once, kernel_pick);
+    return kernel_name;
+}
+
+/* Escaping */
+
+static size_t json_replace(unsigned char c, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    char buf[ESCAPE_MAX_GROWTH] = { '\\' };
+    size_t n = 2;
+
+    switch (c) {
+        case '"': case '\\': case '/': buf[1] = c; break;
+        case '\b': buf[1] = 'b'; break;
+        case '\f': buf[1] = 'f'; break;
+        case '\n': buf[1] = 'n'; break;
+        case '\r': buf[1] = 'r'; break;
+        case '\t': buf[1] = 't'; break;
+        default:
+            memcpy(buf, "\\u00", 4);
+            buf[4] = hex[c >> 4];
+            buf[5] = hex[c & 0xf];
+            n = 6;
+            break;
+    }
+    if (out) memcpy(out, buf, n);
+    return n;
+}
+
+static size_t html_replace(unsigned char c, char *out) {
+    const char *entity;
+
+    switch (c) {
+        case '&': entity = "&amp;"; break;
+        case '<': entity = "&lt;"; break;
+        case '>': entity = "&gt;"; break;
+        case '"': entity = "&quot;"; break;
+        case '\'': entity = "&#39;"; break;
+        default:
+            if (out) *out = c;
+            return 1;
+    }
+
+    size_t n = strlen(entity);
+    if (out) memcpy(out, entity, n);
+    return n;
+}
+
+static size_t escape_run(const escape_set *set, replace_fn replace, char *out,
+                         const char *s, size_t len) {
+    const char *end = s + len;
+    size_t n = 0;
+
+    pthread_once(&kernel_once, kernel_pick);
+    for (;;) {
+        const char *hit = find_special(set, s, end);
+        if (out) memcpy(out + n, s, hit - s);
+        n += hit - s;
+        if (hit == end) return n;
+
+        n += replace((unsigned char)*hit, out ? out + n : NULL);
+        s = hit + 1;
+    }
+}
+
+static char* escape_dup(const escape_set *set, replace_fn replace, const char *s, size_t len) {
+    size_t n = escape_run(set, replace, NULL, s, len);
+    char *out = malloc(n + 1);
+    if (!out) return NULL;
+
+    // The same length means nothing needed escaping
+    if (n == len) {
+        memcpy(out, s, len);
+    } else {
+        escape_run(set, replace, out, s, len);
+    }
+    out[n] = '\0';
+    return out;
+}
+
+size_t escape_json(char *out, const char *s, size_t len) {
+    return escape_run(&json_set, json_replace, out, s, len);
+}
+
+size_t escape_html(char *out, const char *s, size_t len) {
+    return escape_run(&html_set, html_replace, out, s, len);
+}
+
+char* escape_json_dup(const char *s, size_t len) {
+    return escape_dup(&json_set, json_replace, s, len);
+}
+
+char* escape_html_dup(const char *s, size_t len) {
+    return escape_dup(&html_set, html_replace, s, len);
+}
+
+/* URL decoding */
+
+static int hex_value(unsigned char c) {
+    return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+size_t escape_url_decode(char *dst, const char *src, size_t len) {
+    const char *end = src + len;
+    size_t n = 0;
+
+    pthread_once(&kernel_once, kernel_pick);
+    for (;;) {
+        const char *hit = find_special(&url_set, src, end);
+        // dst never gets ahead of src, so decoding in place is safe
+        memmove(dst + n, src, hit - src);
+        n += hit - src;
+        if (hit == end) return n;
+
+        if (*hit == '%' && end - hit >= 3 && isxdigit((unsigned char)hit[1]) &&
+            isxdigit((unsigned char)hit[2])) {
+            dst[n++] = hex_value(hit[1]) << 4 | hex_value(hit[2]);
+            src = hit + 3;
+        } else {
+            dst[n++] = *hit == '+' ? ' ' : *hit;
+            src = hit + 1;
+        }
+    }
+}
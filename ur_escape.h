@@ -0,0 +1,28 @@
+#ifndef UR_ESCAPE_H
+#define UR_ESCAPE_H
+
+#include <stddef.h>
+
+// Longest expansion of one input byte ("\u001f", "&quot;"), for sizing a buffer up front
+#define ESCAPE_MAX_GROWTH 6
+
+// Writes s escaped for a JSON string (without the quotes) to out and returns
+// the length written; with out NULL it only measures. out is not terminated.
+size_t escape_json(char *out, const char *s, size_t len);
+
+// The same for HTML text and attribute values: & < > " '
+size_t escape_html(char *out, const char *s, size_t len);
+
+// Exactly sized, NUL-terminated copies; NULL when out of memory
+char* escape_json_dup(const char *s, size_t len);
+
+char* escape_html_dup(const char *s, size_t len);
+
+// Decodes %XX and '+' from src to dst, which may be src itself; returns the
+// decoded length. dst is not terminated.
+size_t escape_url_decode(char *dst, const char *src, size_t len);
+
+// Kernel picked for this CPU: "avx2", "sse2", "neon" or "scalar"
+const char* escape_kernel(void);
+
+#endif
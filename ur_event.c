@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include "ur_event.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+
+/*
+ * One loop, two backends. epoll is always available. On kernels with a
+ * complete io_uring (see ur_uring.c) the loop waits on the ring instead;
+ * fds registered here become multishot polls on it, and the connection
+ * code submits its accept, recv and send operations to the ring directly.
+ */
+
+typedef struct {
+    int sig;
+    event_signal_callback callback;
+} signal_watch;
+
+static signal_watch signal_watches[EVENT_SIGNAL_MAX];
+static int signal_watch_count = 0;
+static volatile sig_atomic_t signal_pending[EVENT_SIGNAL_MAX];
+static int signal_pipe[2] = { -1, -1 };
+static event_handler signal_handler;
+
+static uint32_t epoll_mask(unsigned events) {
+    uint32_t mask = 0;
+    // Peer half-close only matters while reading; reporting it otherwise would spin
+    if (events & EVENT_READ) mask |= EPOLLIN | EPOLLRDHUP;
+    if (events & EVENT_WRITE) mask |= EPOLLOUT;
+    return mask;
+}
+
+#ifdef UR_HAVE_IO_URING
+
+// Poll requests carry the handler address with the low bit set
+#define POLL_TAG 1
+
+static uint32_t poll_mask(unsigned events) {
+    uint32_t mask = 0;
+    if (events & EVENT_READ) mask |= POLLIN | POLLRDHUP;
+    if (events & EVENT_WRITE) mask |= POLLOUT;
+    return mask;
+}
+
+static int poll_arm(event_loop *loop, event_handler *handler) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring, NULL);
+    if (!sqe) return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = handler->fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = poll_mask(handler->events);
+    sqe->user_data = (uintptr_t)handler | POLL_TAG;
+    return 0;
+}
+
+static int poll_remove(event_loop *loop, event_handler *handler, int update) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring, NULL);
+    if (!sqe) return -1;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = (uintptr_t)handler | POLL_TAG;
+    if (update) {
+        sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = poll_mask(handler->events);
+    }
+    return 0;
+}
+
+static void poll_complete(void *ctx, uint64_t user_data, int res, unsigned flags) {
+    event_loop *loop = ctx;
+    event_handler *handler = (event_handler *)(uintptr_t)(user_data & ~(uint64_t)POLL_TAG);
+
+    // Cancelled or removed polls have nothing to report
+    if (res < 0 || handler->fd < 0) return;
+
+    // The kernel may end a multishot poll at any time; re-arm before the
+    // callback so that a callback deleting the handler still wins
+    if (!(flags & IORING_CQE_F_MORE)) poll_arm(loop, handler);
+
+    unsigned ready = 0;
+    if (res & (POLLIN | POLLRDHUP)) ready |= EVENT_READ;
+    if (res & POLLOUT) ready |= EVENT_WRITE;
+    if (res & (POLLERR | POLLHUP)) ready |= EVENT_ERROR;
+    handler->callback(handler->data, ready);
+}
+
+uring* event_loop_uring(event_loop *loop) {
+    return loop->use_uring ? &loop->ring : NULL;
+}
+
+#endif
+
+int event_loop_init(event_loop *loop, unsigned flags) {
+    memset(loop, 0, sizeof(*loop));
+    loop->epoll_fd = -1;
+    loop->now = monotonic_ms();
+    timer_wheel_init(&loop->timers, loop->now);
+
+#ifdef UR_HAVE_IO_URING
+    if ((flags & EVENT_LOOP_URING) && uring_init(&loop->ring) == 0) {
+        loop->use_uring = 1;
+        return 0;
+    }
+#else
+    (void)flags;
+#endif
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    return 0;
+}
+
+int event_add(event_loop *loop, int fd, unsigned events, event_handler *handler) {
+    handler->fd = fd;
+    handler->events = events;
+#ifdef UR_HAVE_IO_URING
+    if (loop->use_uring) return poll_arm(loop, handler);
+#endif
+    struct epoll_event ev = { .events = epoll_mask(events), .data.ptr = handler };
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int event_mod(event_loop *loop, int fd, unsigned events, event_handler *handler) {
+    handler->events = events;
+#ifdef UR_HAVE_IO_URING
+    if (loop->use_uring) return poll_remove(loop, handler, 1);
+#endif
+    struct epoll_event ev = { .events = epoll_mask(events), .data.ptr = handler };
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int event_del(event_loop *loop, int fd, event_handler *handler) {
+#ifdef UR_HAVE_IO_URING
+    if (loop->use_uring) {
+        int ret = poll_remove(loop, handler, 0);
+        handler->fd = -1;
+        return ret;
+    }
+#endif
+    handler->fd = -1;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void run_epoll(event_loop *loop) {
+    struct epoll_event events[EVENT_MAX_BATCH];
+
+    int timeout = timer_wheel_timeout(&loop->timers, monotonic_ms());
+    int n = epoll_wait(loop->epoll_fd, events, EVENT_MAX_BATCH, timeout);
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        loop->running = 0;
+        return;
+    }
+
+    loop->now = monotonic_ms();
+    for (int i = 0; i < n; i++) {
+        event_handler *handler = events[i].data.ptr;
+        unsigned ready = 0;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP)) ready |= EVENT_READ;
+        if (events[i].events & EPOLLOUT) ready |= EVENT_WRITE;
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) ready |= EVENT_ERROR;
+        handler->callback(handler->data, ready);
+    }
+}
+
+#ifdef UR_HAVE_IO_URING
+static void run_uring(event_loop *loop) {
+    int timeout = timer_wheel_timeout(&loop->timers, monotonic_ms());
+
+    if (uring_wait(&loop->ring, timeout) < 0) {
+        perror("io_uring_enter");
+        loop->running = 0;
+        return;
+    }
+
+    loop->now = monotonic_ms();
+    uring_dispatch(&loop->ring, poll_complete, loop);
+}
+#endif
+
+void event_loop_run(event_loop *loop) {
+    loop->running = 1;
+    while (loop->running) {
+#ifdef UR_HAVE_IO_URING
+        if (loop->use_uring) {
+            run_uring(loop);
+        } else
+#endif
+        run_epoll(loop);
+
+        // Handlers may run for a while; timers see the time after them
+        loop->now = monotonic_ms();
+        timer_wheel_advance(&loop->timers, loop->now);
+    }
+}
+
+void event_loop_stop(event_loop *loop) {
+    loop->running = 0;
+}
+
+void event_loop_free(event_loop *loop) {
+#ifdef UR_HAVE_IO_URING
+    if (loop->use_uring) uring_free(&loop->ring);
+    loop->use_uring = 0;
+#endif
+    if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+}
+
+/* Signals */
+
+/*
+ * Signals reach the loop through one self-pipe. The handler only marks the
+ * signal pending and writes a byte to wake the loop; the callbacks run on
+ * the loop thread, where they may do anything a handler may not.
+ */
+
+static void signal_caught(int sig) {
+    int saved = errno;
+    for (int i = 0; i < signal_watch_count; i++) {
+        if (signal_watches[i].sig == sig) signal_pending[i] = 1;
+    }
+    // A full pipe means the loop has a wakeup pending already
+    write(signal_pipe[1], "", 1);
+    errno = saved;
+}
+
+static void signal_io(void *data, unsigned events) {
+    (void)data;
+    (void)events;
+    char buf[16];
+
+    while (read(signal_pipe[0], buf, sizeof(buf)) > 0) {}
+    for (int i = 0; i < signal_watch_count; i++) {
+        if (!signal_pending[i]) continue;
+        signal_pending[i] = 0;
+        signal_watches[i].callback(signal_watches[i].sig);
+    }
+}
+
+int event_signal(event_loop *loop, int sig, event_signal_callback callback) {
+    struct sigaction action;
+
+    if (signal_watch_count == EVENT_SIGNAL_MAX) return -1;
+    if (signal_pipe[0] < 0) {
+        if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            perror("signal pipe");
+            return -1;
+        }
+        signal_handler.callback = signal_io;
+        if (event_add(loop, signal_pipe[0], EVENT_READ, &signal_handler) < 0) {
+            close(signal_pipe[0]);
+            close(signal_pipe[1]);
+            signal_pipe[0] = signal_pipe[1] = -1;
+            return -1;
+        }
+    }
+
+    signal_watches[signal_watch_count] = (signal_watch){ sig, callback };
+    signal_watch_count++;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signal_caught;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(sig, &action, NULL);
+}
@@ -0,0 +1,69 @@
+#ifndef UR_EVENT_H
+#define UR_EVENT_H
+
+#include "ur_timer.h"
+#include "ur_uring.h"
+
+#define EVENT_READ  (1u << 0)
+#define EVENT_WRITE (1u << 1)
+#define EVENT_ERROR (1u << 2)
+#define EVENT_MAX_BATCH 64
+
+// event_loop_init() flags
+#define EVENT_LOOP_URING (1u << 0)
+
+typedef void (*event_callback)(void *data, unsigned events);
+
+// Signals that can be watched with event_signal() at once
+#define EVENT_SIGNAL_MAX 8
+
+typedef void (*event_signal_callback)(int sig);
+
+// Embedded in whatever owns the fd; the loop hands it back on readiness
+typedef struct {
+    event_callback callback;
+    void *data;
+    // Filled in by event_add(); the io_uring backend re-arms polls from them
+    int fd;
+    unsigned events;
+} event_handler;
+
+typedef struct {
+    int epoll_fd;
+    int running;
+    uint64_t now;
+    timer_wheel timers;
+#ifdef UR_HAVE_IO_URING
+    // Completion backend; fd readiness is then delivered through multishot polls
+    int use_uring;
+    uring ring;
+#endif
+} event_loop;
+
+// With EVENT_LOOP_URING the loop runs on io_uring when the kernel supports it
+int event_loop_init(event_loop *loop, unsigned flags);
+
+#ifdef UR_HAVE_IO_URING
+// The loop's ring, or NULL when it runs on epoll
+uring* event_loop_uring(event_loop *loop);
+#endif
+
+// Handlers must drain the fd until EAGAIN; io_uring polls only report new readiness
+int event_add(event_loop *loop, int fd, unsigned events, event_handler *handler);
+
+int event_mod(event_loop *loop, int fd, unsigned events, event_handler *handler);
+
+int event_del(event_loop *loop, int fd, event_handler *handler);
+
+// Calls callback from the loop once sig has arrived, instead of inside the
+// signal handler; a burst of the same signal may come through as one call
+int event_signal(event_loop *loop, int sig, event_signal_callback callback);
+
+// Dispatches I/O readiness and due timers until event_loop_stop()
+void event_loop_run(event_loop *loop);
+
+void event_loop_stop(event_loop *loop);
+
+void event_loop_free(event_loop *loop);
+
+#endif
@@ -0,0 +1,528 @@
+#define _GNU_SOURCE
+#include "ur_firmware.h"
+#include "ur_crypto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * Firmware images are received as a stream: the body is parsed as it
+ * arrives (multipart/form-data or a raw octet stream), hashed with
+ * SHA-256 and written to the staging file in aligned blocks. The image
+ * header is checked as soon as the first bytes are in, so a wrong file
+ * is rejected long before the rest of it has been transferred.
+ */
+
+typedef enum {
+    FIRMWARE_IDLE,
+    FIRMWARE_RECEIVING,
+    FIRMWARE_READY,
+    FIRMWARE_FAILED
+} firmware_state;
+
+typedef enum {
+    PART_BOUNDARY,
+    PART_AFTER_BOUNDARY,
+    PART_HEADERS,
+    PART_DATA,
+    PART_DONE
+} multipart_state;
+
+typedef enum {
+    PART_SKIP,
+    PART_IMAGE,
+    PART_CHECKSUM
+} part_kind;
+
+typedef struct {
+    firmware_state state;
+    size_t expected;
+    size_t received;
+    size_t image_size;
+    char image_type[32];
+    char sha256[SHA256_DIGEST_SIZE * 2 + 1];
+    char error[128];
+    int error_status;
+    time_t started;
+    time_t finished;
+} firmware_progress;
+
+typedef struct {
+    int multipart;
+    multipart_state state;
+    part_kind kind;
+    int image_seen;
+    char delimiter[FIRMWARE_BOUNDARY_MAX + 8];
+    size_t delimiter_len;
+    char window[FIRMWARE_SCAN_SIZE];
+    size_t window_len;
+
+    char expected_sha256[SHA256_DIGEST_SIZE * 2 + 1];
+    size_t checksum_len;
+
+    int fd;
+    int direct;
+    uint8_t *block;
+    size_t block_len;
+    sha256_ctx hash;
+    uint8_t probe[FIRMWARE_HEADER_PROBE];
+    size_t probe_len;
+    int header_checked;
+} firmware_upload;
+
+typedef struct {
+    const char *name;
+    size_t offset;
+    const char *magic;
+    size_t len;
+} image_magic;
+
+static const image_magic image_magics[] = {
+    {"sysupgrade-tar", 257, "ustar", 5},
+    {"trx", 0, "HDR0", 4},
+    {"uimage", 0, "\x27\x05\x19\x56", 4},
+    {"fit", 0, "\xd0\x0d\xfe\xed", 4},
+    {"squashfs", 0, "hsqs", 4},
+    {"gzip", 0, "\x1f\x8b", 2},
+    {"mbr", 510, "\x55\xaa", 2},
+    {NULL, 0, NULL, 0}
+};
+
+static firmware_progress progress = { .state = FIRMWARE_IDLE };
+
+static void upload_fail(int status, const char *message) {
+    progress.state = FIRMWARE_FAILED;
+    progress.error_status = status;
+    progress.finished = time(NULL);
+    snprintf(progress.error, sizeof(progress.error), "%s", message);
+}
+
+/* Image validation */
+
+static uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t load_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int check_image_header(firmware_upload *up) {
+    const image_magic *match = NULL;
+
+    for (const image_magic *m = image_magics; m->name; m++) {
+        if (up->probe_len >= m->offset + m->len &&
+            memcmp(up->probe + m->offset, m->magic, m->len) == 0) {
+            match = m;
+            break;
+        }
+    }
+
+    if (!match) {
+        upload_fail(415, "Unrecognized firmware image format");
+        return -1;
+    }
+
+    // Containers that declare their own length must fit in what is being sent
+    uint64_t declared = 0;
+    if (strcmp(match->name, "trx") == 0) {
+        declared = load_le32(up->probe + 4);
+    } else if (strcmp(match->name, "uimage") == 0) {
+        declared = (uint64_t)load_be32(up->probe + 12) + 64;
+    }
+    if (declared > progress.expected) {
+        upload_fail(400, "Image header declares more data than the upload contains");
+        return -1;
+    }
+
+    snprintf(progress.image_type, sizeof(progress.image_type), "%s", match->name);
+    up->header_checked = 1;
+    return 0;
+}
+
+/* Staging writer */
+
+static int flush_block(firmware_upload *up, size_t len) {
+    size_t written = 0;
+
+    while (written < len) {
+        ssize_t n = write(up->fd, up->block + written, len - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL && up->direct) {
+            // Filesystem refused direct I/O after all; continue buffered
+            fcntl(up->fd, F_SETFL, fcntl(up->fd, F_GETFL) & ~O_DIRECT);
+            up->direct = 0;
+            continue;
+        }
+        if (n <= 0) {
+            upload_fail(500, "Could not write to the staging file");
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+static int image_write(firmware_upload *up, const char *data, size_t len) {
+    if (progress.image_size + len > FIRMWARE_MAX_SIZE) {
+        upload_fail(413, "Firmware image is too large");
+        return -1;
+    }
+
+    sha256_update(&up->hash, data, len);
+    progress.image_size += len;
+
+    if (!up->header_checked) {
+        size_t take = sizeof(up->probe) - up->probe_len;
+        if (take > len) take = len;
+        memcpy(up->probe + up->probe_len, data, take);
+        up->probe_len += take;
+        if (up->probe_len == sizeof(up->probe) && check_image_header(up) < 0) return -1;
+    }
+
+    while (len > 0) {
+        size_t take = FIRMWARE_WRITE_SIZE - up->block_len;
+        if (take > len) take = len;
+        memcpy(up->block + up->block_len, data, take);
+        up->block_len += take;
+        data += take;
+        len -= take;
+
+        if (up->block_len == FIRMWARE_WRITE_SIZE) {
+            if (flush_block(up, FIRMWARE_WRITE_SIZE) < 0) return -1;
+            up->block_len = 0;
+        }
+    }
+    return 0;
+}
+
+static int image_close(firmware_upload *up) {
+    if (up->block_len > 0) {
+        size_t len = up->block_len;
+        if (up->direct) {
+            // Direct I/O needs whole blocks; pad and cut the file back afterwards
+            len = (len + FIRMWARE_WRITE_ALIGN - 1) & ~(size_t)(FIRMWARE_WRITE_ALIGN - 1);
+            memset(up->block + up->block_len, 0, len - up->block_len);
+        }
+        if (flush_block(up, len) < 0) return -1;
+        up->block_len = 0;
+    }
+
+    if (ftruncate(up->fd, progress.image_size) < 0) {
+        upload_fail(500, "Could not finalize the staging file");
+        return -1;
+    }
+    return 0;
+}
+
+/* Multipart parser */
+
+static void capture_checksum(firmware_upload *up, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (isxdigit((unsigned char)data[i]) && up->checksum_len < SHA256_DIGEST_SIZE * 2) {
+            up->expected_sha256[up->checksum_len++] = tolower((unsigned char)data[i]);
+        }
+    }
+    up->expected_sha256[up->checksum_len] = '\0';
+}
+
+static int part_data(firmware_upload *up, const char *data, size_t len) {
+    if (len == 0) return 0;
+
+    switch (up->kind) {
+        case PART_IMAGE: return image_write(up, data, len);
+        case PART_CHECKSUM: capture_checksum(up, data, len); return 0;
+        default: return 0;
+    }
+}
+
+// Finds a Content-Disposition parameter without matching inside longer names
+static const char* disposition_param(const char *headers, const char *param) {
+    size_t len = strlen(param);
+    for (const char *p = strstr(headers, param); p; p = strstr(p + 1, param)) {
+        if ((p == headers || p[-1] == ' ' || p[-1] == ';') && p[len] == '=') return p + len + 1;
+    }
+    return NULL;
+}
+
+static void part_begin(firmware_upload *up, const char *headers, size_t len) {
+    char block[1024];
+    snprintf(block, sizeof(block), "%.*s", (int)len, headers);
+
+    const char *name = disposition_param(block, "name");
+    const char *filename = disposition_param(block, "filename");
+
+    up->kind = PART_SKIP;
+    if (name && strncmp(name, "\"sha256\"", 8) == 0) {
+        up->kind = PART_CHECKSUM;
+        up->checksum_len = 0;
+    } else if (filename && !up->image_seen) {
+        up->kind = PART_IMAGE;
+        up->image_seen = 1;
+    }
+}
+
+static void window_consume(firmware_upload *up, size_t len) {
+    memmove(up->window, up->window + len, up->window_len - len);
+    up->window_len -= len;
+}
+
+// Parses as much of the window as possible; returns -1 on error
+static int multipart_parse(firmware_upload *up) {
+    while (up->state != PART_DONE) {
+        if (up->state == PART_BOUNDARY || up->state == PART_DATA) {
+            char *hit = memmem(up->window, up->window_len, up->delimiter, up->delimiter_len);
+            if (hit) {
+                size_t before = hit - up->window;
+                if (up->state == PART_DATA && part_data(up, up->window, before) < 0) return -1;
+                window_consume(up, before + up->delimiter_len);
+                up->state = PART_AFTER_BOUNDARY;
+                continue;
+            }
+
+            // Keep a tail that could be the start of a delimiter split across reads
+            if (up->window_len >= up->delimiter_len) {
+                size_t safe = up->window_len - (up->delimiter_len - 1);
+                if (up->state == PART_DATA && part_data(up, up->window, safe) < 0) return -1;
+                window_consume(up, safe);
+            }
+            return 0;
+        }
+
+        if (up->state == PART_AFTER_BOUNDARY) {
+            if (up->window_len < 2) return 0;
+            if (memcmp(up->window, "--", 2) == 0) {
+                up->state = PART_DONE;
+                up->window_len = 0;
+                return 0;
+            }
+            window_consume(up, 2);
+            up->state = PART_HEADERS;
+            continue;
+        }
+
+        if (up->state == PART_HEADERS) {
+            char *end = memmem(up->window, up->window_len, "\r\n\r\n", 4);
+            if (!end) {
+                if (up->window_len == sizeof(up->window)) {
+                    upload_fail(400, "Multipart part headers are too large");
+                    return -1;
+                }
+                return 0;
+            }
+            part_begin(up, up->window, end - up->window);
+            window_consume(up, end - up->window + 4);
+            up->state = PART_DATA;
+        }
+    }
+    return 0;
+}
+
+/* Body sink */
+
+static void firmware_upload_free(firmware_upload *up) {
+    if (up->fd >= 0) close(up->fd);
+    free(up->block);
+    free(up);
+}
+
+static void* firmware_begin(http_request *req, http_response *res) {
+    size_t type_len = 0;
+    const char *type = http_request_header(req, "Content-Type", &type_len);
+
+    if (progress.state == FIRMWARE_RECEIVING) {
+        response_error(res, 409, "Another firmware upload is in progress");
+        return NULL;
+    }
+    if (type && type_len >= 16 && strncasecmp(type, "application/json", 16) == 0) {
+        response_error(res, 415, "Online update sources are not available; upload an image file");
+        return NULL;
+    }
+    if (req->content_length == 0 || req->content_length > FIRMWARE_MAX_SIZE + 65536) {
+        response_error(res, 413, "Firmware image is missing or too large");
+        return NULL;
+    }
+
+    firmware_upload *up = calloc(1, sizeof(firmware_upload));
+    if (!up || posix_memalign((void **)&up->block, FIRMWARE_WRITE_ALIGN, FIRMWARE_WRITE_SIZE) != 0) {
+        free(up);
+        response_error(res, 500, "Memory allocation error");
+        return NULL;
+    }
+
+    if (type && type_len >= 19 && strncasecmp(type, "multipart/form-data", 19) == 0) {
+        char header[256];
+        snprintf(header, sizeof(header), "%.*s", (int)type_len, type);
+        char *boundary = strstr(header, "boundary=");
+        if (!boundary || strlen(boundary + 9) == 0 || strlen(boundary + 9) > FIRMWARE_BOUNDARY_MAX) {
+            free(up->block);
+            free(up);
+            response_error(res, 400, "Missing multipart boundary");
+            return NULL;
+        }
+        boundary += 9;
+        if (*boundary == '"') {
+            boundary++;
+            boundary[strcspn(boundary, "\"")] = '\0';
+        }
+        boundary[strcspn(boundary, "; ")] = '\0';
+
+        up->multipart = 1;
+        up->state = PART_BOUNDARY;
+        up->delimiter_len = snprintf(up->delimiter, sizeof(up->delimiter), "\r\n--%s", boundary);
+        // The first boundary has no CRLF in front; pretend it does
+        memcpy(up->window, "\r\n", 2);
+        up->window_len = 2;
+    } else {
+        up->kind = PART_IMAGE;
+        up->image_seen = 1;
+    }
+
+    size_t checksum_len = 0;
+    const char *checksum = http_request_header(req, "X-Firmware-SHA256", &checksum_len);
+    if (checksum) capture_checksum(up, checksum, checksum_len);
+
+    up->direct = 1;
+    up->fd = open(FIRMWARE_STAGING_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0600);
+    if (up->fd < 0 && errno == EINVAL) {
+        up->direct = 0;
+        up->fd = open(FIRMWARE_STAGING_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    if (up->fd < 0) {
+        firmware_upload_free(up);
+        response_error(res, 500, "Could not open the staging file");
+        return NULL;
+    }
+
+    sha256_init(&up->hash);
+
+    memset(&progress, 0, sizeof(progress));
+    progress.state = FIRMWARE_RECEIVING;
+    progress.expected = req->content_length;
+    progress.started = time(NULL);
+    return up;
+}
+
+static int firmware_write(void *ctx, const char *data, size_t len) {
+    firmware_upload *up = ctx;
+    progress.received += len;
+
+    if (!up->multipart) return image_write(up, data, len);
+
+    while (len > 0) {
+        // Whatever follows the closing delimiter is epilogue; it is counted and dropped
+        if (up->state == PART_DONE) {
+            up->window_len = 0;
+            return 0;
+        }
+
+        size_t take = sizeof(up->window) - up->window_len;
+        if (take == 0) {
+            upload_fail(400, "Malformed multipart upload");
+            return -1;
+        }
+        if (take > len) take = len;
+        memcpy(up->window + up->window_len, data, take);
+        up->window_len += take;
+        data += take;
+        len -= take;
+
+        if (multipart_parse(up) < 0) return -1;
+    }
+    return 0;
+}
+
+static void firmware_finish(void *ctx, http_request *req, http_response *res) {
+    (void)req;
+    firmware_upload *up = ctx;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    if (progress.state == FIRMWARE_RECEIVING) {
+        if (progress.received < progress.expected) {
+            upload_fail(400, "Upload was interrupted");
+        } else if (up->multipart && (up->state != PART_DONE || !up->image_seen)) {
+            upload_fail(400, "No firmware file found in the upload");
+        } else if (!up->header_checked && progress.image_size > 0 && check_image_header(up) < 0) {
+            // check_image_header() recorded the reason
+        } else if (progress.image_size == 0) {
+            upload_fail(400, "Firmware image is empty");
+        }
+    }
+
+    if (progress.state == FIRMWARE_RECEIVING && image_close(up) == 0) {
+        sha256_final(&up->hash, digest);
+        sha256_hex(digest, progress.sha256);
+
+        if (up->checksum_len > 0 && strcmp(up->expected_sha256, progress.sha256) != 0) {
+            upload_fail(400, "SHA-256 checksum mismatch");
+        } else {
+            progress.state = FIRMWARE_READY;
+            progress.finished = time(NULL);
+        }
+    }
+
+    if (progress.state != FIRMWARE_READY) {
+        unlink(FIRMWARE_STAGING_PATH);
+        response_error(res, progress.error_status, progress.error);
+    } else {
+        char *json = malloc(512);
+        if (json) {
+            snprintf(json, 512,
+                "{\n"
+                "  \"success\": true,\n"
+                "  \"size\": %zu,\n"
+                "  \"sha256\": \"%s\",\n"
+                "  \"image_type\": \"%s\",\n"
+                "  \"staging_path\": \"%s\"\n"
+                "}",
+                progress.image_size, progress.sha256, progress.image_type,
+                FIRMWARE_STAGING_PATH);
+        }
+        response_json(res, 200, json);
+    }
+
+    firmware_upload_free(up);
+}
+
+static const body_sink firmware_sink = {
+    .begin = firmware_begin,
+    .write = firmware_write,
+    .finish = firmware_finish
+};
+
+/* Request Handlers */
+
+static void api_firmware_progress(http_request *req, http_response *res) {
+    (void)req;
+    static const char *state_names[] = { "idle", "receiving", "ready", "failed" };
+    char *json = malloc(1024);
+    char *error_esc = json_escape_string(progress.error);
+
+    if (json) {
+        int percent = progress.expected ? (int)(progress.received * 100 / progress.expected) : 0;
+        snprintf(json, 1024,
+            "{\n"
+            "  \"state\": \"%s\",\n"
+            "  \"received\": %zu,\n"
+            "  \"expected\": %zu,\n"
+            "  \"percent\": %d,\n"
+            "  \"image_size\": %zu,\n"
+            "  \"image_type\": \"%s\",\n"
+            "  \"sha256\": \"%s\",\n"
+            "  \"error\": \"%s\"\n"
+            "}",
+            state_names[progress.state], progress.received, progress.expected, percent,
+            progress.image_size, progress.image_type, progress.sha256,
+            error_esc ? error_esc : "");
+    }
+    free(error_esc);
+    response_json(res, 200, json);
+}
+
+void firmware_register_routes(router *r) {
+    router_add_sink(r, HTTP_POST | HTTP_PUT, "/api/firmware/update", &firmware_sink, CACHE_NO_STORE);
+    // Uploads stream through their sink as they arrive; the class only sets their rate limit
+    router_set_class(r, "/api/firmware/update", ROUTE_HEAVY);
+    router_add(r, HTTP_GET, "/api/firmware/update/progress", api_firmware_progress, CACHE_NO_STORE);
+}
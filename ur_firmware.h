@@ -0,0 +1,16 @@
+#ifndef UR_FIRMWARE_H
+#define UR_FIRMWARE_H
+
+#include "ur_router.h"
+
+#define FIRMWARE_STAGING_PATH "/tmp/firmware.bin"
+#define FIRMWARE_MAX_SIZE (64 * 1024 * 1024)
+#define FIRMWARE_WRITE_SIZE 16384
+#define FIRMWARE_WRITE_ALIGN 4096
+#define FIRMWARE_SCAN_SIZE 8192
+#define FIRMWARE_HEADER_PROBE 512
+#define FIRMWARE_BOUNDARY_MAX 72
+
+void firmware_register_routes(router *r);
+
+#endif
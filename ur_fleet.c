@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+#include "ur_fleet.h"
+#include "ur_metrics.h"
+#include "ur_escape.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * Aggregator mode: this instance polls the /api/metrics of every peer in
+ * a list and serves the merged table as /api/fleet. Peers are polled on
+ * the server's own loop with nonblocking sockets, so hundreds of them cost
+ * a timer and, between polls, an idle keep-alive connection each. Every
+ * poll passes the last sequence number the peer sent as ?since=, so a
+ * steady peer answers with the few fields that changed and the merged
+ * values stay whole. A peer that fails is marked down and retried with
+ * exponential backoff; its last values stay in the table, with their age.
+ * First polls are spread over one interval rather than fired at once.
+ */
+
+typedef enum {
+    PEER_IDLE,
+    PEER_CONNECTING,
+    PEER_READING
+} peer_state;
+
+typedef enum {
+    PEER_PENDING,
+    PEER_UP,
+    PEER_DOWN
+} peer_status;
+
+typedef struct {
+    char name[FLEET_NAME_MAX];
+    char address[FLEET_NAME_MAX];
+    struct sockaddr_in sockaddr;
+
+    int fd;
+    peer_state state;
+    event_handler io;
+    ur_timer timer;
+    // The request went out on a kept-alive connection the peer may since have closed
+    int reused;
+    // The response, while one is being read
+    char *buf;
+    size_t len;
+    uint64_t started;
+
+    peer_status status;
+    double values[METRIC_FIELD_COUNT];
+    int have_values;
+    uint32_t seq;
+    uint64_t updated;
+    unsigned latency_ms;
+    int failures;
+    char error[64];
+} fleet_peer;
+
+static fleet_peer *peers = NULL;
+static int peer_count = 0;
+static event_loop *loop = NULL;
+
+static void peer_poll(fleet_peer *p);
+
+/* Peer list */
+
+static int peer_resolve(fleet_peer *p, const char *spec) {
+    char host[FLEET_NAME_MAX];
+    int port = DEFAULT_PORT;
+
+    snprintf(host, sizeof(host), "%s", spec);
+    char *colon = strrchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+        if (port <= 0 || port > 65535) return -1;
+    }
+
+    // Resolved once at startup, before the loop runs
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *found = NULL;
+    if (getaddrinfo(host, NULL, &hints, &found) != 0 || !found) return -1;
+
+    memcpy(&p->sockaddr, found->ai_addr, sizeof(p->sockaddr));
+    p->sockaddr.sin_port = htons(port);
+    freeaddrinfo(found);
+
+    snprintf(p->address, sizeof(p->address), "%s:%d", host, port);
+    return 0;
+}
+
+int fleet_init(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    peers = calloc(FLEET_MAX_PEERS, sizeof(fleet_peer));
+    if (!peers) {
+        fclose(f);
+        return -1;
+    }
+
+    char line[256];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), f) && peer_count < FLEET_MAX_PEERS) {
+        line_no++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char spec[FLEET_NAME_MAX], name[FLEET_NAME_MAX];
+        int fields = sscanf(line, "%63s %63s", spec, name);
+        if (fields < 1) continue;
+
+        fleet_peer *p = &peers[peer_count];
+        if (peer_resolve(p, spec) < 0) {
+            fprintf(stderr, "%s:%d: cannot resolve peer %s\n", path, line_no, spec);
+            continue;
+        }
+        snprintf(p->name, sizeof(p->name), "%s", fields == 2 ? name : p->address);
+        p->fd = -1;
+        peer_count++;
+    }
+    fclose(f);
+    return peer_count;
+}
+
+/* Polling */
+
+static void peer_unwatch(fleet_peer *p) {
+    if (p->state != PEER_IDLE) event_del(loop, p->fd, &p->io);
+}
+
+static void peer_close(fleet_peer *p) {
+    if (p->fd < 0) return;
+    peer_unwatch(p);
+    close(p->fd);
+    p->fd = -1;
+    p->state = PEER_IDLE;
+}
+
+static void peer_idle(fleet_peer *p, uint64_t delay_ms) {
+    peer_unwatch(p);
+    p->state = PEER_IDLE;
+    free(p->buf);
+    p->buf = NULL;
+    timer_arm(&loop->timers, &p->timer, delay_ms);
+}
+
+static void peer_fail(fleet_peer *p, const char *error) {
+    peer_close(p);
+    p->status = PEER_DOWN;
+    snprintf(p->error, sizeof(p->error), "%s", error);
+
+    uint64_t backoff = FLEET_POLL_MS;
+    for (int i = 0; i < p->failures && backoff < FLEET_BACKOFF_MAX_MS; i++) backoff *= 2;
+    if (backoff > FLEET_BACKOFF_MAX_MS) backoff = FLEET_BACKOFF_MAX_MS;
+    p->failures++;
+    peer_idle(p, backoff);
+}
+
+// Merges a frame: a keyframe replaces every value, a delta the ones it names
+static int peer_merge(fleet_peer *p, const char *body) {
+    const char *seq = strstr(body, "\"seq\":");
+    const char *base = strstr(body, "\"base\":");
+    const char *fields = strstr(body, "\"fields\":");
+    if (!seq || !fields || !(fields = strchr(fields, '{'))) return -1;
+
+    // A delta on anything but what we hold cannot be applied
+    if (base && (!p->have_values || strtoul(base + 7, NULL, 10) != p->seq)) return -1;
+    if (!base) memset(p->values, 0, sizeof(p->values));
+
+    const char *s = fields + 1;
+    for (;;) {
+        while (*s == ' ' || *s == ',' || *s == '\n') s++;
+        if (*s != '"') break;
+
+        const char *name = s + 1;
+        const char *end = strchr(name, '"');
+        if (!end || end[1] != ':') return -1;
+
+        char *after;
+        double value = strtod(end + 2, &after);
+        if (after == end + 2) return -1;
+
+        // Fields this build does not know about are newer than it; skip them
+        int field = metrics_field_lookup(name, end - name);
+        if (field >= 0) p->values[field] = value;
+        s = after;
+    }
+
+    p->seq = strtoul(seq + 6, NULL, 10);
+    p->have_values = 1;
+    return 0;
+}
+
+// Returns 1 once the whole response is in and handled, 0 while more is due
+static int peer_response(fleet_peer *p) {
+    char *head_end = memmem(p->buf, p->len, "\r\n\r\n", 4);
+    if (!head_end) return p->len >= FLEET_RESPONSE_MAX - 1 ? -1 : 0;
+
+    int status = 0;
+    sscanf(p->buf, "HTTP/1.%*d %d", &status);
+    const char *length = strcasestr(p->buf, "\r\nContent-Length:");
+    if (!length || length > head_end) return -1;
+
+    size_t body_len = strtoul(length + 17, NULL, 10);
+    char *body = head_end + 4;
+    if (body + body_len >= p->buf + FLEET_RESPONSE_MAX) return -1;
+    if ((size_t)(p->buf + p->len - body) < body_len) return 0;
+    body[body_len] = '\0';
+
+    if (status != 200) {
+        char error[32];
+        snprintf(error, sizeof(error), "HTTP %d", status);
+        peer_fail(p, error);
+        return 1;
+    }
+    if (peer_merge(p, body) < 0) {
+        // Out of step: start over from a keyframe next time
+        p->have_values = 0;
+        p->seq = 0;
+        peer_fail(p, "unreadable metrics");
+        return 1;
+    }
+
+    uint64_t now = monotonic_ms();
+    p->status = PEER_UP;
+    p->failures = 0;
+    p->error[0] = '\0';
+    p->updated = now;
+    p->latency_ms = now - p->started;
+
+    char *closing = strcasestr(p->buf, "\r\nConnection: close");
+    if (closing && closing < head_end) peer_close(p);
+    peer_idle(p, FLEET_POLL_MS);
+    return 1;
+}
+
+static void peer_read(fleet_peer *p) {
+    for (;;) {
+        ssize_t n = read(p->fd, p->buf + p->len, FLEET_RESPONSE_MAX - 1 - p->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        if (n <= 0) {
+            // An idle connection the peer has dropped in the meantime; reconnect once
+            if (p->reused && p->len == 0) {
+                peer_close(p);
+                peer_poll(p);
+                return;
+            }
+            peer_fail(p, n == 0 ? "connection closed" : strerror(errno));
+            return;
+        }
+
+        p->len += n;
+        p->buf[p->len] = '\0';
+        int done = peer_response(p);
+        if (done < 0) peer_fail(p, "malformed response");
+        if (done) return;
+    }
+}
+
+static void peer_send(fleet_peer *p) {
+    char request[256];
+    int len = snprintf(request, sizeof(request),
+                       "GET /api/metrics?since=%u HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "Accept: application/json\r\n"
+                       "\r\n", p->have_values ? p->seq : 0, p->address);
+
+    // A request this small goes out whole or the connection is no good
+    if (send(p->fd, request, len, MSG_NOSIGNAL) != len) {
+        if (p->reused) {
+            peer_close(p);
+            peer_poll(p);
+        } else {
+            peer_fail(p, strerror(errno));
+        }
+        return;
+    }
+
+    if (p->state == PEER_IDLE) {
+        if (event_add(loop, p->fd, EVENT_READ, &p->io) < 0) {
+            peer_fail(p, "cannot watch connection");
+            return;
+        }
+    } else {
+        event_mod(loop, p->fd, EVENT_READ, &p->io);
+    }
+    p->state = PEER_READING;
+}
+
+static void peer_io(void *data, unsigned events) {
+    fleet_peer *p = data;
+
+    if (p->state == PEER_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) error = errno;
+        if (error) {
+            peer_fail(p, strerror(error));
+        } else if (events & (EVENT_WRITE | EVENT_ERROR)) {
+            peer_send(p);
+        }
+        return;
+    }
+    if (p->state == PEER_READING) peer_read(p);
+}
+
+static void peer_connect(fleet_peer *p) {
+    p->reused = 0;
+    p->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p->fd < 0) {
+        peer_fail(p, strerror(errno));
+        return;
+    }
+
+    if (connect(p->fd, (struct sockaddr *)&p->sockaddr, sizeof(p->sockaddr)) == 0) {
+        peer_send(p);
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        peer_fail(p, strerror(errno));
+        return;
+    }
+    if (event_add(loop, p->fd, EVENT_WRITE, &p->io) < 0) {
+        close(p->fd);
+        p->fd = -1;
+        peer_fail(p, "cannot watch connection");
+        return;
+    }
+    p->state = PEER_CONNECTING;
+}
+
+static void peer_poll(fleet_peer *p) {
+    if (!p->buf) {
+        p->buf = malloc(FLEET_RESPONSE_MAX);
+        if (!p->buf) {
+            peer_fail(p, "out of memory");
+            return;
+        }
+    }
+    p->len = 0;
+    p->started = monotonic_ms();
+
+    // The deadline covers connecting, sending and reading alike
+    timer_arm(&loop->timers, &p->timer, FLEET_TIMEOUT_MS);
+    if (p->fd >= 0) {
+        p->reused = 1;
+        peer_send(p);
+    } else {
+        peer_connect(p);
+    }
+}
+
+static void peer_timer(ur_timer *timer) {
+    fleet_peer *p = timer->data;
+
+    if (p->state == PEER_IDLE) {
+        peer_poll(p);
+    } else {
+        peer_fail(p, "timed out");
+    }
+}
+
+void fleet_start(event_loop *l) {
+    loop = l;
+    for (int i = 0; i < peer_count; i++) {
+        fleet_peer *p = &peers[i];
+        p->io.callback = peer_io;
+        p->io.data = p;
+        timer_init(&p->timer, peer_timer, p);
+        timer_arm(&loop->timers, &p->timer, (uint64_t)FLEET_POLL_MS * i / peer_count);
+    }
+}
+
+/* HTTP */
+
+typedef struct {
+    // -1 sorts by name
+    int field;
+    int ascending;
+} fleet_sort;
+
+// Whether a belongs before b in the answer; peers without values go last
+static int peer_before(const fleet_peer *a, const fleet_peer *b, fleet_sort sort) {
+    if (sort.field >= 0) {
+        if (a->have_values != b->have_values) return a->have_values;
+        double x = a->values[sort.field], y = b->values[sort.field];
+        if (x != y) return sort.ascending ? x < y : x > y;
+    }
+    return strcmp(a->name, b->name) < 0;
+}
+
+// heap[0] is the peer that would be dropped first
+static void heap_sift_down(const fleet_peer **heap, int n, int i, fleet_sort sort) {
+    for (;;) {
+        int last = i;
+        int l = 2 * i + 1, r = l + 1;
+        if (l < n && peer_before(heap[last], heap[l], sort)) last = l;
+        if (r < n && peer_before(heap[last], heap[r], sort)) last = r;
+        if (last == i) return;
+
+        const fleet_peer *tmp = heap[i];
+        heap[i] = heap[last];
+        heap[last] = tmp;
+        i = last;
+    }
+}
+
+static void heap_sift_up(const fleet_peer **heap, int i, fleet_sort sort) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!peer_before(heap[parent], heap[i], sort)) return;
+
+        const fleet_peer *tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+// Leaves the best limit matches in order in out; returns how many there are
+static int fleet_select(const fleet_peer **out, int limit, fleet_sort sort, int status) {
+    int n = 0;
+
+    for (int i = 0; i < peer_count; i++) {
+        const fleet_peer *p = &peers[i];
+        if (status >= 0 && (int)p->status != status) continue;
+
+        if (n < limit) {
+            out[n] = p;
+            heap_sift_up(out, n++, sort);
+        } else if (peer_before(p, out[0], sort)) {
+            out[0] = p;
+            heap_sift_down(out, n, 0, sort);
+        }
+    }
+
+    for (int end = n - 1; end > 0; end--) {
+        const fleet_peer *tmp = out[0];
+        out[0] = out[end];
+        out[end] = tmp;
+        heap_sift_down(out, end, 0, sort);
+    }
+    return n;
+}
+
+static const char* status_name(peer_status status) {
+    switch (status) {
+        case PEER_UP: return "up";
+        case PEER_DOWN: return "down";
+        default: return "pending";
+    }
+}
+
+static void write_peer(FILE *out, const fleet_peer *p, uint64_t now) {
+    char *name = escape_json_dup(p->name, strlen(p->name));
+    char *address = escape_json_dup(p->address, strlen(p->address));
+
+    fprintf(out, "\n  {\"name\": \"%s\", \"address\": \"%s\", \"status\": \"%s\", ",
+            name ? name : "", address ? address : "", status_name(p->status));
+    free(name);
+    free(address);
+
+    if (p->error[0]) {
+        fprintf(out, "\"error\": \"%s\", ", p->error);
+    }
+    if (!p->have_values) {
+        fputs("\"fields\": null}", out);
+        return;
+    }
+
+    fprintf(out, "\"seq\": %u, \"age_ms\": %llu, \"latency_ms\": %u, \"fields\": {",
+            p->seq, (unsigned long long)(now - p->updated), p->latency_ms);
+    for (int i = 0; i < METRIC_FIELD_COUNT; i++) {
+        fprintf(out, "%s\"%s\": %.10g", i ? ", " : "", metrics_field_name(i), p->values[i]);
+    }
+    fputs("}}", out);
+}
+
+// ?sort=<field>|name&order=asc|desc&limit=<n>&status=up|down|pending
+static void api_fleet(http_request *req, http_response *res) {
+    char param[FLEET_NAME_MAX];
+    fleet_sort sort = { -1, 1 };
+    int limit = FLEET_LIMIT_DEFAULT;
+    int status = -1;
+
+    if (query_get_param(req->query, "sort", param, sizeof(param)) == 0 && strcmp(param, "name") != 0) {
+        sort.field = metrics_field_lookup(param, strlen(param));
+        sort.ascending = 0;
+        if (sort.field < 0) {
+            response_error(res, 400, "Unknown sort field");
+            return;
+        }
+    }
+    if (query_get_param(req->query, "order", param, sizeof(param)) == 0) {
+        sort.ascending = strcmp(param, "desc") != 0;
+    }
+    if (query_get_param(req->query, "limit", param, sizeof(param)) == 0) {
+        limit = atoi(param);
+        if (limit < 1) limit = 1;
+        if (limit > FLEET_MAX_PEERS) limit = FLEET_MAX_PEERS;
+    }
+    if (query_get_param(req->query, "status", param, sizeof(param)) == 0) {
+        if (strcmp(param, "up") == 0) status = PEER_UP;
+        else if (strcmp(param, "down") == 0) status = PEER_DOWN;
+        else if (strcmp(param, "pending") == 0) status = PEER_PENDING;
+        else {
+            response_error(res, 400, "Unknown status");
+            return;
+        }
+    }
+
+    const fleet_peer **top = malloc(sizeof(*top) * (limit < peer_count ? limit : peer_count + 1));
+    char *json = NULL;
+    size_t json_len = 0;
+    FILE *out = top ? open_memstream(&json, &json_len) : NULL;
+    if (!out) {
+        free(top);
+        response_error(res, 500, "Memory allocation error");
+        return;
+    }
+
+    int counts[3] = {0};
+    for (int i = 0; i < peer_count; i++) counts[peers[i].status]++;
+    int n = fleet_select(top, limit, sort, status);
+    uint64_t now = monotonic_ms();
+
+    fprintf(out, "{\"peers\": %d, \"up\": %d, \"down\": %d, \"pending\": %d, \"results\": [",
+            peer_count, counts[PEER_UP], counts[PEER_DOWN], counts[PEER_PENDING]);
+    for (int i = 0; i < n; i++) {
+        if (i) fputc(',', out);
+        write_peer(out, top[i], now);
+    }
+    fputs("\n]}", out);
+    fclose(out);
+    free(top);
+
+    response_json(res, 200, json);
+}
+
+void fleet_register_routes(router *r) {
+    if (!peer_count) return;
+    router_add(r, HTTP_GET, "/api/fleet", api_fleet, CACHE_NO_STORE);
+    router_set_class(r, "/api/fleet", ROUTE_LIGHT);
+}
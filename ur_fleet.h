@@ -0,0 +1,27 @@
+#ifndef UR_FLEET_H
+#define UR_FLEET_H
+
+#include "ur_router.h"
+#include "ur_event.h"
+
+#define FLEET_MAX_PEERS 1024
+#define FLEET_NAME_MAX 64
+// Each peer is asked for a metrics delta this often while it answers
+#define FLEET_POLL_MS 5000
+#define FLEET_TIMEOUT_MS 3000
+// Unreachable peers are retried after FLEET_POLL_MS, doubling up to this
+#define FLEET_BACKOFF_MAX_MS 60000
+// A metrics frame and its response head
+#define FLEET_RESPONSE_MAX 2048
+#define FLEET_LIMIT_DEFAULT 20
+
+// Loads the peer list: one "host[:port] [name]" per line, '#' starts a
+// comment. Returns the number of peers, or -1 when the file cannot be read.
+int fleet_init(const char *path);
+
+// Starts polling the peers on loop; does nothing without any
+void fleet_start(event_loop *loop);
+
+void fleet_register_routes(router *r);
+
+#endif
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include "ur_flight.h"
+
+#ifdef UR_HAVE_FLIGHT
+
+#include "ur_management.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/*
+ * Flight recorder: the last FLIGHT_RING requests and commands, for looking
+ * at what the server was doing when something went wrong. An entry is
+ * claimed by bumping one counter and then only ever written by whoever
+ * holds its id, so recording takes no lock; a stamp is one clock read and
+ * a few stores. Each entry carries a sequence count that is odd while it
+ * is being written, and the dump skips entries that changed under it
+ * rather than print half of one. Requests still running show up with
+ * their later phases missing. A request that outlives a whole lap of the
+ * ring loses its entry and further stamps for it are dropped.
+ */
+
+typedef enum {
+    FLIGHT_REQUEST = 1,
+    FLIGHT_COMMAND
+} flight_kind;
+
+typedef struct {
+    // Odd while a writer is in the middle of the entry
+    uint32_t version;
+    uint8_t kind;
+    uint8_t cls;
+    int status;
+    uint32_t addr;
+    flight_id id;
+    // The request whose handler started a command
+    flight_id parent;
+    uint64_t start_us;
+    // Microseconds after start_us, plus one so that 0 is a phase not reached
+    uint32_t at[FLIGHT_PHASES];
+    uint64_t bytes;
+    char text[FLIGHT_TEXT_MAX];
+} flight_entry;
+
+static flight_entry ring[FLIGHT_RING];
+static flight_id last_id = 0;
+// The request whose handler is running on this thread
+static __thread flight_id running = 0;
+
+static const char *class_names[] = { "normal", "light", "heavy" };
+static const char *phase_names[] = {
+    "accept", "headers", "handler", "handled", "first_byte", "done"
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Recording */
+
+static void write_begin(flight_entry *e) {
+    __atomic_fetch_add(&e->version, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(flight_entry *e) {
+    __atomic_fetch_add(&e->version, 1, __ATOMIC_RELEASE);
+}
+
+// The entry id still owns, or NULL once the ring has gone round past it
+static flight_entry* entry_of(flight_id id) {
+    if (!id) return NULL;
+    flight_entry *e = &ring[id & (FLIGHT_RING - 1)];
+    return __atomic_load_n(&e->id, __ATOMIC_RELAXED) == id ? e : NULL;
+}
+
+static void stamp(flight_entry *e, flight_phase phase, uint64_t now) {
+    uint64_t since = now - e->start_us + 1;
+    e->at[phase] = since < UINT32_MAX ? (uint32_t)since : UINT32_MAX;
+}
+
+// Takes over the oldest entry; returns with it open for writing
+static flight_entry* claim(flight_id *id, flight_kind kind, uint64_t now) {
+    *id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+    flight_entry *e = &ring[*id & (FLIGHT_RING - 1)];
+
+    write_begin(e);
+    __atomic_store_n(&e->id, *id, __ATOMIC_RELAXED);
+    e->kind = kind;
+    e->cls = 0;
+    e->status = 0;
+    e->addr = 0;
+    e->parent = 0;
+    e->start_us = now;
+    memset(e->at, 0, sizeof(e->at));
+    e->bytes = 0;
+    e->text[0] = '\0';
+    return e;
+}
+
+void flight_request_begin(flight_id *id, uint32_t addr) {
+    uint64_t now = now_us();
+    flight_entry *e = claim(id, FLIGHT_REQUEST, now);
+    e->addr = addr;
+    stamp(e, FLIGHT_ACCEPT, now);
+    write_end(e);
+}
+
+void flight_request_route(flight_id id, const char *method, const char *path, int cls) {
+    flight_entry *e = entry_of(id);
+    if (!e) return;
+
+    write_begin(e);
+    e->cls = cls;
+    snprintf(e->text, sizeof(e->text), "%s %s", method, path);
+    stamp(e, FLIGHT_HEADERS, now_us());
+    write_end(e);
+}
+
+void flight_mark(flight_id id, flight_phase phase) {
+    if (phase == FLIGHT_HANDLER_START) running = id;
+    if (phase == FLIGHT_HANDLER_END) running = 0;
+
+    flight_entry *e = entry_of(id);
+    if (!e || e->at[phase]) return;
+
+    write_begin(e);
+    stamp(e, phase, now_us());
+    write_end(e);
+}
+
+void flight_request_end(flight_id id, int status, uint64_t bytes) {
+    flight_entry *e = entry_of(id);
+    if (!e || e->at[FLIGHT_DONE]) return;
+
+    write_begin(e);
+    e->status = status;
+    e->bytes = bytes;
+    stamp(e, FLIGHT_DONE, now_us());
+    write_end(e);
+}
+
+void flight_command_begin(flight_id *id, const char *command) {
+    uint64_t now = now_us();
+    flight_entry *e = claim(id, FLIGHT_COMMAND, now);
+    e->parent = running;
+    snprintf(e->text, sizeof(e->text), "%s", command);
+    stamp(e, FLIGHT_ACCEPT, now);
+    write_end(e);
+}
+
+void flight_command_end(flight_id id, int exit_status) {
+    flight_entry *e = entry_of(id);
+    if (!e) return;
+
+    write_begin(e);
+    e->status = exit_status;
+    stamp(e, FLIGHT_DONE, now_us());
+    write_end(e);
+}
+
+/* Dump */
+
+// Copies an entry that nobody was writing while it was read
+static int entry_read(const flight_entry *e, flight_entry *copy) {
+    uint32_t before = __atomic_load_n(&e->version, __ATOMIC_ACQUIRE);
+    if (before & 1) return -1;
+    memcpy(copy, e, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&e->version, __ATOMIC_RELAXED) == before ? 0 : -1;
+}
+
+static void format_wall(char *out, size_t len, int64_t wall_ms) {
+    time_t secs = wall_ms / 1000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    size_t n = strftime(out, len, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(out + n, len - n, ".%03d", (int)(wall_ms % 1000));
+}
+
+static void dump_entry(FILE *out, const flight_entry *e, int64_t wall_now_ms, uint64_t now) {
+    char when[32];
+    char client[INET_ADDRSTRLEN] = "-";
+    char status[16];
+
+    format_wall(when, sizeof(when), wall_now_ms - (int64_t)(now - e->start_us) / 1000);
+    if (e->at[FLIGHT_DONE] == 0) {
+        snprintf(status, sizeof(status), e->kind == FLIGHT_REQUEST ? "active" : "running");
+    } else if (e->kind == FLIGHT_REQUEST && e->status == 0) {
+        snprintf(status, sizeof(status), "aborted");
+    } else {
+        snprintf(status, sizeof(status), "%d", e->status);
+    }
+
+    if (e->kind == FLIGHT_REQUEST) {
+        inet_ntop(AF_INET, &e->addr, client, sizeof(client));
+        fprintf(out, "%llu %s request %s %s %s %llu", (unsigned long long)e->id, when, client,
+                e->text[0] ? class_names[e->cls] : "-", status, (unsigned long long)e->bytes);
+    } else {
+        // Commands show the request that ran them where requests show the client
+        snprintf(client, sizeof(client), "%llu", (unsigned long long)e->parent);
+        fprintf(out, "%llu %s command %s %s", (unsigned long long)e->id, when,
+                e->parent ? client : "-", status);
+    }
+
+    for (int p = 1; p < FLIGHT_PHASES; p++) {
+        if (e->at[p]) fprintf(out, " %s=%u", phase_names[p], e->at[p] - 1);
+    }
+    fprintf(out, " \"%s\"\n", e->text);
+}
+
+static void flight_dump(FILE *out) {
+    flight_id last = __atomic_load_n(&last_id, __ATOMIC_ACQUIRE);
+    flight_id first = last >= FLIGHT_RING ? last - FLIGHT_RING + 1 : 1;
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    int64_t wall_now_ms = (int64_t)wall.tv_sec * 1000 + wall.tv_nsec / 1000000;
+    uint64_t now = now_us();
+    int busy = 0;
+
+    fprintf(out, "# flight recorder: entries %llu to %llu, oldest first\n",
+            (unsigned long long)first, (unsigned long long)last);
+    fprintf(out, "# id time request client class status bytes phases... \"method path\"\n");
+    fprintf(out, "# id time command request status phases... \"command\"\n");
+    fprintf(out, "# phases are microseconds after accept, or after spawn for commands\n");
+
+    for (flight_id id = first; id && id <= last; id++) {
+        flight_entry copy;
+        if (entry_read(&ring[id & (FLIGHT_RING - 1)], &copy) < 0 || copy.id != id) {
+            busy++;
+            continue;
+        }
+        dump_entry(out, &copy, wall_now_ms, now);
+    }
+    if (busy) fprintf(out, "# %d entries skipped while being written\n", busy);
+}
+
+static void api_flight(http_request *req, http_response *res) {
+    (void)req;
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+    if (!out) {
+        response_error(res, 500, "Memory allocation error");
+        return;
+    }
+    flight_dump(out);
+    fclose(out);
+
+    res->status = 200;
+    res->content_type = "text/plain; charset=utf-8";
+    res->body = text;
+    res->body_len = text_len;
+}
+
+void flight_register_routes(router *r) {
+    router_add(r, HTTP_GET, "/api/admin/flight", api_flight, CACHE_NO_STORE);
+}
+
+/* Signal */
+
+static void on_dump_signal(int sig) {
+    (void)sig;
+    int fd = open(FLIGHT_DUMP_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    FILE *out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!out) {
+        perror("flight: " FLIGHT_DUMP_FILE);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    flight_dump(out);
+    fclose(out);
+    printf("Flight recorder: wrote " FLIGHT_DUMP_FILE "\n");
+}
+
+void flight_watch(event_loop *loop) {
+    event_signal(loop, FLIGHT_SIGNAL, on_dump_signal);
+}
+
+#endif
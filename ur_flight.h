@@ -0,0 +1,68 @@
+#ifndef UR_FLIGHT_H
+#define UR_FLIGHT_H
+
+#include <stdint.h>
+#include "ur_router.h"
+#include "ur_event.h"
+
+// Entries kept; a power of two
+#define FLIGHT_RING 256
+#define FLIGHT_TEXT_MAX 96
+// Sent to the running server to write the recorder out to FLIGHT_DUMP_FILE
+#define FLIGHT_SIGNAL SIGUSR1
+#define FLIGHT_DUMP_FILE "/tmp/ur_flight.log"
+
+// Names an entry; 0 is never handed out
+typedef uint64_t flight_id;
+
+typedef enum {
+    // Accepted, or the first byte of the next request on a kept-alive connection
+    FLIGHT_ACCEPT,
+    FLIGHT_HEADERS,
+    FLIGHT_HANDLER_START,
+    FLIGHT_HANDLER_END,
+    FLIGHT_FIRST_BYTE,
+    FLIGHT_DONE,
+    FLIGHT_PHASES
+} flight_phase;
+
+#ifdef UR_HAVE_FLIGHT
+
+// Opens an entry for a request from addr and stamps FLIGHT_ACCEPT
+void flight_request_begin(flight_id *id, uint32_t addr);
+
+// Records what was asked for once the head is parsed, and stamps FLIGHT_HEADERS
+void flight_request_route(flight_id id, const char *method, const char *path, int cls);
+
+// Stamps a phase; only the first stamp of each counts
+void flight_mark(flight_id id, flight_phase phase);
+
+// Closes the entry with the status sent, 0 for a connection that went away
+// first; later calls for the same entry do nothing
+void flight_request_end(flight_id id, int status, uint64_t bytes);
+
+// A child process started for command and its exit; commands run from a
+// handler are tied to the request that ran it
+void flight_command_begin(flight_id *id, const char *command);
+void flight_command_end(flight_id id, int exit_status);
+
+// Dumps to FLIGHT_DUMP_FILE on FLIGHT_SIGNAL
+void flight_watch(event_loop *loop);
+
+void flight_register_routes(router *r);
+
+#else
+
+// Compiled out: the arguments are not even evaluated
+#define flight_request_begin(id, addr) ((void)0)
+#define flight_request_route(id, method, path, cls) ((void)0)
+#define flight_mark(id, phase) ((void)0)
+#define flight_request_end(id, status, bytes) ((void)0)
+#define flight_command_begin(id, command) ((void)0)
+#define flight_command_end(id, exit_status) ((void)0)
+#define flight_watch(loop) ((void)0)
+#define flight_register_routes(r) ((void)0)
+
+#endif
+
+#endif
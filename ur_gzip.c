@@ -0,0 +1,180 @@
+#include "ur_gzip.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Streaming gzip encoder. With zlib this is a thin wrapper around deflate
+ * using a reduced window; without it we still emit a valid gzip stream
+ * made of stored blocks so archives stay readable by any gunzip.
+ */
+
+#ifdef UR_HAVE_ZLIB
+
+int gzip_stream_init(gzip_stream *gz, int level) {
+    memset(gz, 0, sizeof(*gz));
+    if (deflateInit2(&gz->z, level, Z_DEFLATED, GZIP_WINDOW_BITS + 16,
+                     GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+size_t gzip_stream_write(gzip_stream *gz, const void *in, size_t in_len, size_t *consumed,
+                         void *out, size_t out_len, int finish) {
+    gz->z.next_in = (Bytef *)in;
+    gz->z.avail_in = in_len;
+    gz->z.next_out = out;
+    gz->z.avail_out = out_len;
+
+    int ret = deflate(&gz->z, finish ? Z_FINISH : Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) gz->finished = 1;
+
+    *consumed = in_len - gz->z.avail_in;
+    return out_len - gz->z.avail_out;
+}
+
+void gzip_stream_end(gzip_stream *gz) {
+    deflateEnd(&gz->z);
+}
+
+#else
+
+#define STORED_BLOCK_MAX 65535
+
+static uint32_t crc_table[256];
+
+static void crc32_init_table(void) {
+    if (crc_table[1]) return;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    while (len--) crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+int gzip_stream_init(gzip_stream *gz, int level) {
+    (void)level;
+    memset(gz, 0, sizeof(*gz));
+    crc32_init_table();
+    return 0;
+}
+
+size_t gzip_stream_write(gzip_stream *gz, const void *in, size_t in_len, size_t *consumed,
+                         void *out, size_t out_len, int finish) {
+    static const uint8_t header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    uint8_t *o = out;
+    size_t written = 0;
+
+    *consumed = 0;
+
+    if (!gz->header_done) {
+        if (out_len < sizeof(header)) return 0;
+        memcpy(o, header, sizeof(header));
+        written += sizeof(header);
+        gz->header_done = 1;
+    }
+
+    // One non-final stored block per call keeps the framing simple
+    if (in_len > 0 && out_len - written > 5) {
+        size_t len = out_len - written - 5;
+        if (len > in_len) len = in_len;
+        if (len > STORED_BLOCK_MAX) len = STORED_BLOCK_MAX;
+
+        o[written] = 0;
+        o[written + 1] = (uint8_t)len;
+        o[written + 2] = (uint8_t)(len >> 8);
+        o[written + 3] = (uint8_t)~len;
+        o[written + 4] = (uint8_t)(~len >> 8);
+        memcpy(o + written + 5, in, len);
+
+        gz->crc = crc32_update(gz->crc, in, len);
+        gz->size += len;
+        written += len + 5;
+        *consumed = len;
+        return written;
+    }
+
+    if (finish && in_len == 0 && !gz->finished && out_len - written >= 13) {
+        static const uint8_t final_block[5] = { 1, 0, 0, 0xff, 0xff };
+        memcpy(o + written, final_block, sizeof(final_block));
+        put_le32(o + written + 5, gz->crc);
+        put_le32(o + written + 9, gz->size);
+        written += 13;
+        gz->finished = 1;
+    }
+
+    return written;
+}
+
+void gzip_stream_end(gzip_stream *gz) {
+    (void)gz;
+}
+
+#endif
+
+int gzip_stream_done(const gzip_stream *gz) {
+    return gz->finished;
+}
+
+char* gzip_variant(const char *data, size_t len, size_t *out_len) {
+    gzip_stream gz;
+    size_t cap = len + len / 8 + 256;
+    char *out = malloc(cap);
+    size_t used = 0, offset = 0;
+
+    if (!out || gzip_stream_init(&gz, 9) < 0) {
+        free(out);
+        return NULL;
+    }
+
+    while (!gzip_stream_done(&gz) && used < cap) {
+        size_t consumed = 0;
+        used += gzip_stream_write(&gz, data + offset, len - offset, &consumed,
+                                  out + used, cap - used, 1);
+        offset += consumed;
+    }
+    gzip_stream_end(&gz);
+
+    if (!gzip_stream_done(&gz) || used * 100 > len * (100 - GZIP_MIN_SAVING)) {
+        free(out);
+        return NULL;
+    }
+
+    *out_len = used;
+    return out;
+}
+
+int gzip_inflate(const char *data, size_t len, char *out, size_t out_len) {
+#ifdef UR_HAVE_ZLIB
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // 16 selects the gzip wrapper
+    if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) return -1;
+
+    z.next_in = (Bytef *)data;
+    z.avail_in = len;
+    z.next_out = (Bytef *)out;
+    z.avail_out = out_len;
+    int rc = inflate(&z, Z_FINISH);
+    size_t produced = z.total_out;
+    inflateEnd(&z);
+    return rc == Z_STREAM_END && produced == out_len ? 0 : -1;
+#else
+    // Stored blocks never come out smaller, so gzip_variant() has produced nothing to undo
+    (void)data; (void)len; (void)out; (void)out_len;
+    return -1;
+#endif
+}
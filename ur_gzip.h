@@ -0,0 +1,45 @@
+#ifndef UR_GZIP_H
+#define UR_GZIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef UR_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Deflate window and hash sizes chosen to keep one stream well under 64 KB
+#define GZIP_WINDOW_BITS 13
+#define GZIP_MEM_LEVEL 5
+// Only keep a gzip variant that saves at least this share (percent) of the original
+#define GZIP_MIN_SAVING 10
+
+typedef struct {
+#ifdef UR_HAVE_ZLIB
+    z_stream z;
+#else
+    uint32_t crc;
+    uint32_t size;
+    int header_done;
+#endif
+    int finished;
+} gzip_stream;
+
+int gzip_stream_init(gzip_stream *gz, int level);
+
+// Compresses from in into out; returns bytes written and sets *consumed.
+// With finish set, keep calling with the remaining input until gzip_stream_done().
+size_t gzip_stream_write(gzip_stream *gz, const void *in, size_t in_len, size_t *consumed,
+                         void *out, size_t out_len, int finish);
+
+int gzip_stream_done(const gzip_stream *gz);
+
+void gzip_stream_end(gzip_stream *gz);
+
+// Compresses a whole buffer at level 9 for serving as-is; NULL when that does not pay
+char* gzip_variant(const char *data, size_t len, size_t *out_len);
+
+// Undoes gzip_variant() into out, which must take exactly out_len bytes; 0 on success
+int gzip_inflate(const char *data, size_t len, char *out, size_t out_len);
+
+#endif
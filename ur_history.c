@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include "ur_history.h"
+#include "ur_metrics.h"
+#include "ur_management.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Long metrics history in a fixed-size ring file that is mapped, not read:
+ * every HISTORY_SAMPLE_MS the current sample is copied into the next slot
+ * and the kernel carries the page to the file. Put it on tmpfs to survive
+ * restarts and crashes, or on attached storage to survive reboots too.
+ * Nothing writes the file by hand; msync at a low rate bounds how much a
+ * power cut can lose, while the kernel's own writeback may go first.
+ *
+ * Record n lives in slot n % HISTORY_RECORDS and carries its number and a
+ * checksum over itself. Startup only looks at the numbers to find the
+ * newest record and carries on after it; a record a crash left half
+ * written fails its checksum when read and is skipped, as are slots
+ * holding a number that does not belong there. A history whose header
+ * does not describe this build's records gets the file formatted afresh.
+ */
+
+#define HISTORY_MAGIC 0x75726869
+// Bumped whenever the header or record layout changes
+#define HISTORY_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t records;
+    uint32_t fields;
+    uint32_t interval_ms;
+    uint32_t reserved[10];
+} history_header;
+
+typedef struct {
+    uint64_t seq;
+    // Wall clock of the sample, milliseconds since the epoch
+    uint64_t time_ms;
+    double values[METRIC_FIELD_COUNT];
+    // Over everything above
+    uint64_t check;
+} history_record;
+
+static history_header *header = NULL;
+static history_record *records = NULL;
+static size_t map_len = 0;
+static uint64_t next_seq = 1;
+static int sync_ms = HISTORY_SYNC_DEFAULT * 1000;
+
+static event_loop *loop = NULL;
+static ur_timer sample_timer;
+static ur_timer sync_timer;
+
+// FNV-1a; enough to tell a torn record from a whole one
+static uint64_t record_check(const history_record *r) {
+    const uint8_t *p = (const uint8_t *)r;
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < offsetof(history_record, check); i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Record seq if it is still in the ring and whole
+static const history_record* record_find(uint64_t seq) {
+    const history_record *r = &records[seq % HISTORY_RECORDS];
+    return seq && r->seq == seq && r->check == record_check(r) ? r : NULL;
+}
+
+static int header_matches(const history_header *h) {
+    return h->magic == HISTORY_MAGIC && h->version == HISTORY_VERSION &&
+           h->record_size == sizeof(history_record) && h->records == HISTORY_RECORDS &&
+           h->fields == METRIC_FIELD_COUNT && h->interval_ms == HISTORY_SAMPLE_MS;
+}
+
+int history_init(const char *path, int sync_s) {
+    map_len = sizeof(history_header) + sizeof(history_record) * HISTORY_RECORDS;
+    if (sync_s > 0) sync_ms = sync_s * 1000;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("history: open");
+        return -1;
+    }
+
+    struct stat st = { 0 };
+    history_header found = { 0 };
+    int fresh = fstat(fd, &st) < 0 || (size_t)st.st_size != map_len ||
+                pread(fd, &found, sizeof(found), 0) != sizeof(found) || !header_matches(&found);
+    // Only an empty file or an older history gets formatted, never something else
+    if (fresh && st.st_size > 0 && found.magic != HISTORY_MAGIC) {
+        fprintf(stderr, "history: %s is not a metrics history file\n", path);
+        close(fd);
+        return -1;
+    }
+    if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, map_len) < 0)) {
+        perror("history: ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("history: mmap");
+        return -1;
+    }
+    header = map;
+    records = (history_record *)(header + 1);
+
+    if (fresh) {
+        *header = (history_header){
+            .magic = HISTORY_MAGIC, .version = HISTORY_VERSION,
+            .record_size = sizeof(history_record), .records = HISTORY_RECORDS,
+            .fields = METRIC_FIELD_COUNT, .interval_ms = HISTORY_SAMPLE_MS
+        };
+        msync(map, map_len, MS_SYNC);
+        printf("Metrics history: formatted %s\n", path);
+        return 0;
+    }
+
+    // Numbers only; checksums are checked as records are read
+    uint64_t newest = 0;
+    for (uint64_t i = 0; i < HISTORY_RECORDS; i++) {
+        uint64_t seq = records[i].seq;
+        if (seq % HISTORY_RECORDS == i && seq > newest) newest = seq;
+    }
+    next_seq = newest + 1;
+    printf("Metrics history: resuming %s after record %llu\n", path, (unsigned long long)newest);
+    return 0;
+}
+
+/* Recording */
+
+static void history_sample(ur_timer *timer) {
+    (void)timer;
+    const metrics_sample *sample = metrics_latest();
+    history_record *r = &records[next_seq % HISTORY_RECORDS];
+
+    r->seq = next_seq++;
+    r->time_ms = sample->time_ms;
+    memcpy(r->values, sample->values, sizeof(r->values));
+    r->check = record_check(r);
+    timer_arm(&loop->timers, &sample_timer, HISTORY_SAMPLE_MS);
+}
+
+static void history_sync(ur_timer *timer) {
+    (void)timer;
+    msync(header, map_len, MS_SYNC);
+    timer_arm(&loop->timers, &sync_timer, sync_ms);
+}
+
+void history_start(event_loop *l) {
+    if (!records) return;
+    loop = l;
+    timer_init(&sample_timer, history_sample, NULL);
+    timer_init(&sync_timer, history_sync, NULL);
+    timer_arm(&loop->timers, &sample_timer, HISTORY_SAMPLE_MS);
+    timer_arm(&loop->timers, &sync_timer, sync_ms);
+}
+
+void history_stop(void) {
+    if (!records) return;
+    if (loop) {
+        timer_cancel(&loop->timers, &sample_timer);
+        timer_cancel(&loop->timers, &sync_timer);
+    }
+    msync(header, map_len, MS_SYNC);
+    munmap(header, map_len);
+    header = NULL;
+    records = NULL;
+}
+
+/* HTTP */
+
+// ?fields=<name>,...&since=<seq>&limit=<n>: the newest records after since,
+// one array per field
+static void api_history(http_request *req, http_response *res) {
+    char param[512];
+    int fields[METRIC_FIELD_COUNT];
+    int field_count = 0;
+    uint64_t since = 0;
+    int limit = HISTORY_LIMIT_DEFAULT;
+
+    if (!records) {
+        response_error(res, 404, "Metrics history is not enabled");
+        return;
+    }
+
+    if (query_get_param(req->query, "fields", param, sizeof(param)) == 0) {
+        char *save = NULL;
+        for (char *name = strtok_r(param, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+            int field = metrics_field_lookup(name, strlen(name));
+            if (field < 0) {
+                response_error(res, 400, "Unknown field");
+                return;
+            }
+            if (field_count < METRIC_FIELD_COUNT) fields[field_count++] = field;
+        }
+    } else {
+        for (int i = 0; i < METRIC_FIELD_COUNT; i++) fields[field_count++] = i;
+    }
+    if (query_get_param(req->query, "since", param, sizeof(param)) == 0) {
+        since = strtoull(param, NULL, 10);
+    }
+    if (query_get_param(req->query, "limit", param, sizeof(param)) == 0) {
+        limit = atoi(param);
+        if (limit < 1) limit = 1;
+        if (limit > HISTORY_RECORDS) limit = HISTORY_RECORDS;
+    }
+
+    // A since past the newest record would wrap since + 1 and walk the whole ring
+    uint64_t newest = next_seq - 1;
+    if (since > newest) since = newest;
+    uint64_t first = newest >= (uint64_t)limit ? newest - limit + 1 : 1;
+    if (first <= since) first = since + 1;
+
+    const history_record **found = malloc(sizeof(*found) * limit);
+    char *json = NULL;
+    size_t json_len = 0;
+    FILE *out = found ? open_memstream(&json, &json_len) : NULL;
+    if (!out) {
+        free(found);
+        response_error(res, 500, "Memory allocation error");
+        return;
+    }
+
+    int n = 0;
+    for (uint64_t seq = first; seq <= newest && n < limit; seq++) {
+        const history_record *r = record_find(seq);
+        if (r) found[n++] = r;
+    }
+
+    fprintf(out, "{\"seq\": %llu, \"interval\": %d, \"time\": [",
+            (unsigned long long)newest, HISTORY_SAMPLE_MS / 1000);
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "%s%llu", i ? ", " : "", (unsigned long long)found[i]->time_ms);
+    }
+    fprintf(out, "], \"values\": {");
+    for (int f = 0; f < field_count; f++) {
+        fprintf(out, "%s\"%s\": [", f ? ", " : "", metrics_field_name(fields[f]));
+        for (int i = 0; i < n; i++) {
+            fprintf(out, "%s%.10g", i ? ", " : "", found[i]->values[fields[f]]);
+        }
+        fprintf(out, "]");
+    }
+    fprintf(out, "}}");
+    fclose(out);
+    free(found);
+
+    response_json(res, 200, json);
+}
+
+void history_register_routes(router *r) {
+    router_add(r, HTTP_GET, "/api/metrics/history", api_history, CACHE_NO_STORE);
+}
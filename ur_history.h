@@ -0,0 +1,27 @@
+#ifndef UR_HISTORY_H
+#define UR_HISTORY_H
+
+#include "ur_router.h"
+#include "ur_event.h"
+
+// One record per interval; a day of them by default
+#define HISTORY_SAMPLE_MS 10000
+#define HISTORY_RECORDS 8640
+// How often dirty pages are pushed to the file, in seconds
+#define HISTORY_SYNC_DEFAULT 300
+#define HISTORY_LIMIT_DEFAULT 360
+
+// Maps the ring file at path, creating or reformatting it when it does not
+// match this build, and picks up after its newest record. sync_s of
+// zero selects HISTORY_SYNC_DEFAULT. Returns -1 when it cannot be mapped.
+int history_init(const char *path, int sync_s);
+
+// Starts recording on loop; does nothing without a file
+void history_start(event_loop *loop);
+
+// Syncs and lets go of the file, e.g. for a replacement process to carry on
+void history_stop(void);
+
+void history_register_routes(router *r);
+
+#endif
@@ -0,0 +1,83 @@
+#include "ur_limit.h"
+#include <string.h>
+
+/*
+ * Per-client rate limits. Every client address has a token bucket for each
+ * route class, refilled continuously at the class rate up to its burst, so
+ * a dashboard polling its metrics never notices while a script hammering
+ * the page that forks commands is turned away early. Buckets live in a
+ * fixed set-associative table: the memory is the same whatever the number
+ * of clients, and a client pushed out by newcomers simply starts over with
+ * full buckets, which only ever errs on the side of letting it in.
+ */
+
+typedef struct {
+    double rate;
+    double burst;
+} limit_class;
+
+typedef struct {
+    uint32_t addr;
+    int used;
+    uint64_t seen;
+    // Tokens as of seen
+    double tokens[ROUTE_CLASS_COUNT];
+} limit_client;
+
+static const limit_class defaults[ROUTE_CLASS_COUNT] = {
+    [ROUTE_NORMAL] = { LIMIT_NORMAL_RATE, LIMIT_NORMAL_BURST },
+    [ROUTE_LIGHT] = { LIMIT_LIGHT_RATE, LIMIT_LIGHT_BURST },
+    [ROUTE_HEAVY] = { LIMIT_HEAVY_RATE, LIMIT_HEAVY_BURST },
+};
+
+static limit_class classes[ROUTE_CLASS_COUNT];
+static limit_client table[LIMIT_SETS][LIMIT_WAYS];
+static int enabled = 1;
+
+void limit_init(int percent) {
+    if (percent == 0) percent = 100;
+    enabled = percent > 0;
+
+    for (int i = 0; i < ROUTE_CLASS_COUNT; i++) {
+        classes[i].rate = defaults[i].rate * percent / 100;
+        classes[i].burst = defaults[i].burst * percent / 100;
+        if (classes[i].burst < 1) classes[i].burst = 1;
+    }
+    memset(table, 0, sizeof(table));
+}
+
+static limit_client* client_find(uint32_t addr, uint64_t now) {
+    limit_client *set = table[((addr * 2654435761u) >> 16) % LIMIT_SETS];
+    limit_client *victim = &set[0];
+
+    for (int i = 0; i < LIMIT_WAYS; i++) {
+        if (set[i].used && set[i].addr == addr) return &set[i];
+        if (!set[i].used || (victim->used && set[i].seen < victim->seen)) victim = &set[i];
+    }
+
+    victim->addr = addr;
+    victim->used = 1;
+    victim->seen = now;
+    for (int i = 0; i < ROUTE_CLASS_COUNT; i++) victim->tokens[i] = classes[i].burst;
+    return victim;
+}
+
+int limit_take(uint32_t addr, route_class cls, uint64_t now_ms) {
+    if (!enabled) return 0;
+
+    limit_client *c = client_find(addr, now_ms);
+    if (now_ms > c->seen) {
+        double elapsed = (now_ms - c->seen) / 1000.0;
+        for (int i = 0; i < ROUTE_CLASS_COUNT; i++) {
+            c->tokens[i] += elapsed * classes[i].rate;
+            if (c->tokens[i] > classes[i].burst) c->tokens[i] = classes[i].burst;
+        }
+        c->seen = now_ms;
+    }
+
+    if (c->tokens[cls] >= 1) {
+        c->tokens[cls] -= 1;
+        return 0;
+    }
+    return (int)((1 - c->tokens[cls]) / classes[cls].rate) + 1;
+}
@@ -0,0 +1,28 @@
+#ifndef UR_LIMIT_H
+#define UR_LIMIT_H
+
+#include <stdint.h>
+#include "ur_router.h"
+
+// Token buckets per client address and route class: requests per second
+// sustained, and how many may come at once after a quiet spell
+#define LIMIT_LIGHT_RATE 50
+#define LIMIT_LIGHT_BURST 200
+#define LIMIT_NORMAL_RATE 10
+#define LIMIT_NORMAL_BURST 40
+// Heavy requests fork commands or build archives
+#define LIMIT_HEAVY_RATE 0.5
+#define LIMIT_HEAVY_BURST 5
+// Clients tracked, as LIMIT_SETS sets of LIMIT_WAYS; a new client takes the
+// place of the one in its set that was seen longest ago
+#define LIMIT_SETS 256
+#define LIMIT_WAYS 4
+
+// Scales every rate and burst by percent; zero selects 100, negative turns limiting off
+void limit_init(int percent);
+
+// Takes one token for a request from addr; returns 0, or the whole seconds
+// until a token will be there
+int limit_take(uint32_t addr, route_class cls, uint64_t now_ms);
+
+#endif
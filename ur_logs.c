@@ -0,0 +1,570 @@
+#include "ur_logs.h"
+#include "ur_conn.h"
+#include "ur_escape.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <regex.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+/*
+ * System log viewing without logread. /api/logs pages through the log file
+ * by byte offset, newest lines first unless an offset is given.
+ * /api/logs/stream follows it: one shared follower reads what inotify says
+ * was appended, once, into a ring, and every viewer walks the ring at its
+ * own pace, filtering as it goes. A viewer that falls more than a ring
+ * behind skips what was overwritten and is told how much. Log lines look
+ * like logread's, with "facility.severity" among the first few words:
+ *
+ *   Mon Oct 19 08:00:00 2026 daemon.err dnsmasq[1234]: message
+ */
+
+static const char *severity_names[] = {
+    "emerg", "alert", "crit", "err", "warn", "notice", "info", "debug"
+};
+
+static const char *facility_names[] = {
+    "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news",
+    "uucp", "cron", "authpriv", "ftp", NULL, NULL, NULL, NULL,
+    "local0", "local1", "local2", "local3", "local4", "local5", "local6", "local7"
+};
+
+#define SEVERITY_COUNT (int)(sizeof(severity_names) / sizeof(severity_names[0]))
+#define FACILITY_COUNT (int)(sizeof(facility_names) / sizeof(facility_names[0]))
+
+static char log_path[PATH_MAX] = LOG_DEFAULT_FILE;
+
+void logs_init(const char *path) {
+    if (path && *path) snprintf(log_path, sizeof(log_path), "%s", path);
+}
+
+/* Filters */
+
+typedef struct {
+    // Lines at this severity or worse; -1 for any
+    int severity;
+    int facility;
+    char text[128];
+    int has_regex;
+    regex_t regex;
+} log_filter;
+
+static int name_index(const char **names, int count, const char *name, size_t len) {
+    for (int i = 0; i < count; i++) {
+        if (names[i] && strlen(names[i]) == len && strncasecmp(names[i], name, len) == 0) return i;
+    }
+    return -1;
+}
+
+static int severity_index(const char *name, size_t len) {
+    // logread spells these out in full in places
+    if (len == 7 && strncasecmp(name, "warning", 7) == 0) return 4;
+    if (len == 5 && strncasecmp(name, "error", 5) == 0) return 3;
+    return name_index(severity_names, SEVERITY_COUNT, name, len);
+}
+
+// Finds "facility.severity" among the first words; 0 if found
+static int log_priority(const char *line, int *facility, int *severity) {
+    const char *p = line;
+
+    for (int word = 0; word < 8 && *p; word++) {
+        while (*p == ' ') p++;
+        size_t len = strcspn(p, " ");
+        const char *dot = memchr(p, '.', len);
+
+        if (dot) {
+            int f = name_index(facility_names, FACILITY_COUNT, p, dot - p);
+            int s = severity_index(dot + 1, len - (dot + 1 - p));
+            if (f >= 0 && s >= 0) {
+                *facility = f;
+                *severity = s;
+                return 0;
+            }
+        }
+        p += len;
+    }
+    return -1;
+}
+
+// Reads the filter from the query; on error res is filled in
+static int log_filter_parse(log_filter *filter, const char *query, http_response *res) {
+    char param[256];
+
+    memset(filter, 0, sizeof(*filter));
+    filter->severity = -1;
+    filter->facility = -1;
+
+    if (query_get_param(query, "severity", param, sizeof(param)) == 0 && param[0]) {
+        filter->severity = param[0] >= '0' && param[0] <= '7' && !param[1] ?
+                           param[0] - '0' : severity_index(param, strlen(param));
+        if (filter->severity < 0) {
+            response_error(res, 400, "Unknown severity");
+            return -1;
+        }
+    }
+    if (query_get_param(query, "facility", param, sizeof(param)) == 0 && param[0]) {
+        filter->facility = name_index(facility_names, FACILITY_COUNT, param, strlen(param));
+        if (filter->facility < 0) {
+            response_error(res, 400, "Unknown facility");
+            return -1;
+        }
+    }
+    query_get_param(query, "q", filter->text, sizeof(filter->text));
+    if (query_get_param(query, "re", param, sizeof(param)) == 0 && param[0]) {
+        if (regcomp(&filter->regex, param, REG_EXTENDED | REG_NOSUB) != 0) {
+            response_error(res, 400, "Invalid regular expression");
+            return -1;
+        }
+        filter->has_regex = 1;
+    }
+    return 0;
+}
+
+static void log_filter_free(log_filter *filter) {
+    if (filter->has_regex) regfree(&filter->regex);
+    filter->has_regex = 0;
+}
+
+static int log_filter_match(const log_filter *filter, const char *line) {
+    if (filter->severity >= 0 || filter->facility >= 0) {
+        int facility, severity;
+        if (log_priority(line, &facility, &severity) < 0) return 0;
+        if (filter->severity >= 0 && severity > filter->severity) return 0;
+        if (filter->facility >= 0 && facility != filter->facility) return 0;
+    }
+    if (filter->text[0] && !strstr(line, filter->text)) return 0;
+    if (filter->has_regex && regexec(&filter->regex, line, 0, NULL, 0) != 0) return 0;
+    return 1;
+}
+
+/* Paging */
+
+typedef struct {
+    long long offset;
+    char *text;
+} log_line;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} log_buf;
+
+static int buf_reserve(log_buf *b, size_t more) {
+    if (b->len + more <= b->cap) return 0;
+
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + more) cap *= 2;
+    char *grown = realloc(b->data, cap);
+    if (!grown) return -1;
+    b->data = grown;
+    b->cap = cap;
+    return 0;
+}
+
+static int buf_append(log_buf *b, const char *data, size_t len) {
+    if (buf_reserve(b, len + 1) < 0) return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+// Log lines carry whatever programs wrote, control bytes included
+static int buf_append_json(log_buf *b, const char *s) {
+    size_t len = strlen(s);
+    if (buf_reserve(b, len * ESCAPE_MAX_GROWTH + 3) < 0) return -1;
+
+    char *q = b->data + b->len;
+    *q++ = '"';
+    q += escape_json(q, s, len);
+    *q++ = '"';
+    *q = '\0';
+    b->len = q - b->data;
+    return 0;
+}
+
+static char* line_copy(const char *data, size_t len) {
+    if (len >= LOG_LINE_MAX) len = LOG_LINE_MAX - 1;
+    if (len && data[len - 1] == '\r') len--;
+    return strndup(data, len);
+}
+
+// Keeps the line if it passes the filter; -1 when out of memory
+static int log_keep(const log_filter *filter, const char *data, size_t len, long long offset,
+                    log_line *lines, int *count) {
+    char *text = line_copy(data, len);
+    if (!text) return -1;
+
+    if (log_filter_match(filter, text)) {
+        lines[*count].offset = offset;
+        lines[(*count)++].text = text;
+    } else {
+        free(text);
+    }
+    return 0;
+}
+
+// Collects up to limit matching lines from offset on; returns the count, -1 on error
+static int log_read_forward(int fd, long long offset, int limit, const log_filter *filter,
+                            log_line *lines, long long *next) {
+    char block[LOG_BLOCK_SIZE];
+    int count = 0;
+
+    *next = offset;
+    while (count < limit) {
+        ssize_t n = pread(fd, block, sizeof(block), *next);
+        if (n < 0) return -1;
+        if (n == 0) break;
+
+        size_t start = 0;
+        while (count < limit) {
+            char *nl = memchr(block + start, '\n', n - start);
+            if (!nl) break;
+
+            size_t len = nl - (block + start);
+            if (log_keep(filter, block + start, len, *next + start, lines, &count) < 0) return -1;
+            start += len + 1;
+        }
+
+        // A line longer than a block is cut short rather than stalling the page
+        if (start == 0 && n == (ssize_t)sizeof(block)) start = n;
+        // What is left is a line still being written
+        if (start == 0) break;
+        *next += start;
+    }
+    return count;
+}
+
+// Collects the last limit matching lines before end, oldest first
+static int log_read_backward(int fd, long long end, int limit, const log_filter *filter,
+                             log_line *lines, long long *start) {
+    // The file from pos on: a block, then the part of a line whose start is not read yet
+    char buf[LOG_BLOCK_SIZE + LOG_LINE_MAX];
+    long long pos = end;
+    size_t line_end = 0;
+    int count = 0;
+
+    while (count < limit && pos > 0) {
+        size_t block = pos > LOG_BLOCK_SIZE ? LOG_BLOCK_SIZE : (size_t)pos;
+        // Only so much of a line is ever shown
+        if (line_end > LOG_LINE_MAX) line_end = LOG_LINE_MAX;
+        memmove(buf + block, buf, line_end);
+        pos -= block;
+        if (pread(fd, buf, block, pos) != (ssize_t)block) return -1;
+
+        // The newline that ends the last line does not start another
+        if (pos + block == end && buf[block - 1] == '\n') block--;
+        line_end += block;
+
+        for (size_t i = line_end; i > 0 && count < limit; i--) {
+            if (buf[i - 1] != '\n') continue;
+            if (log_keep(filter, buf + i, line_end - i, pos + i, lines, &count) < 0) return -1;
+            line_end = i - 1;
+        }
+        // At the top of the file what is left is a whole line as well
+        if (pos == 0 && count < limit && log_keep(filter, buf, line_end, 0, lines, &count) < 0) {
+            return -1;
+        }
+    }
+
+    // Newest first so far
+    for (int i = 0; i < count / 2; i++) {
+        log_line tmp = lines[i];
+        lines[i] = lines[count - 1 - i];
+        lines[count - 1 - i] = tmp;
+    }
+    *start = count == limit ? lines[0].offset : 0;
+    return count;
+}
+
+static void api_logs(http_request *req, http_response *res) {
+    char param[32];
+    log_filter filter;
+    int limit = LOG_LIMIT_DEFAULT;
+
+    if (log_filter_parse(&filter, req->query, res) < 0) return;
+    if (query_get_param(req->query, "limit", param, sizeof(param)) == 0) {
+        limit = atoi(param);
+        if (limit < 1) limit = 1;
+        if (limit > LOG_LIMIT_MAX) limit = LOG_LIMIT_MAX;
+    }
+
+    int fd = open(log_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        log_filter_free(&filter);
+        response_error(res, 404, "No log file; set log_file in /etc/config/system");
+        return;
+    }
+
+    log_line *lines = calloc(limit, sizeof(log_line));
+    long long size = st.st_size;
+    long long start, next;
+    int count = -1;
+
+    if (lines && query_get_param(req->query, "offset", param, sizeof(param)) == 0) {
+        start = atoll(param);
+        if (start < 0 || start > size) start = size;
+        count = log_read_forward(fd, start, limit, &filter, lines, &next);
+    } else if (lines) {
+        next = size;
+        if (query_get_param(req->query, "before", param, sizeof(param)) == 0) {
+            next = atoll(param);
+            if (next < 0 || next > size) next = size;
+        }
+        count = log_read_backward(fd, next, limit, &filter, lines, &start);
+    }
+    close(fd);
+    log_filter_free(&filter);
+
+    log_buf out = {0};
+    char head[160];
+    int failed = count < 0;
+
+    snprintf(head, sizeof(head), "{\"size\": %lld, \"start\": %lld, \"next\": %lld, \"lines\": [",
+             size, count < 0 ? 0 : start, count < 0 ? 0 : next);
+    failed |= buf_append(&out, head, strlen(head));
+    for (int i = 0; i < count && !failed; i++) {
+        failed |= buf_append(&out, i ? ",\n  " : "\n  ", i ? 4 : 3);
+        failed |= buf_append_json(&out, lines[i].text);
+    }
+    failed |= buf_append(&out, "\n]}", 3);
+
+    for (int i = 0; i < count; i++) free(lines[i].text);
+    free(lines);
+
+    if (failed) {
+        free(out.data);
+        response_error(res, 500, "Could not read the log");
+        return;
+    }
+    response_json(res, 200, out.data);
+}
+
+/* Following */
+
+typedef struct {
+    int fd;
+    int inotify_fd;
+    int file_wd;
+    int dir_wd;
+    off_t offset;
+    // Bytes ever put in the ring; byte p lives at ring[p % LOG_RING_SIZE]
+    unsigned long long head;
+    int streams;
+    event_handler io;
+    char ring[LOG_RING_SIZE];
+} log_follower;
+
+typedef struct {
+    log_filter filter;
+    unsigned long long cursor;
+} log_stream;
+
+static log_follower follower = { .fd = -1, .inotify_fd = -1, .file_wd = -1, .dir_wd = -1 };
+
+// Appends whatever the file gained since the last read to the ring; 1 if it grew
+static int follower_read(void) {
+    struct stat st;
+    if (follower.fd < 0 || fstat(follower.fd, &st) < 0) return 0;
+
+    // Truncated in place: start over from the top
+    if (st.st_size < follower.offset) follower.offset = 0;
+
+    unsigned long long before = follower.head;
+    for (;;) {
+        size_t at = follower.head % LOG_RING_SIZE;
+        ssize_t n = pread(follower.fd, follower.ring + at, LOG_RING_SIZE - at, follower.offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        follower.offset += n;
+        follower.head += n;
+    }
+    return follower.head != before;
+}
+
+static void follower_open(int from_end) {
+    follower.fd = open(log_path, O_RDONLY | O_CLOEXEC);
+    if (follower.fd < 0) return;
+
+    struct stat st;
+    follower.offset = from_end && fstat(follower.fd, &st) == 0 ? st.st_size : 0;
+    follower.file_wd = inotify_add_watch(follower.inotify_fd, log_path,
+                                         IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+static void follower_close_file(void) {
+    if (follower.file_wd >= 0) inotify_rm_watch(follower.inotify_fd, follower.file_wd);
+    if (follower.fd >= 0) close(follower.fd);
+    follower.file_wd = -1;
+    follower.fd = -1;
+}
+
+static void follower_io(void *data, unsigned events) {
+    (void)data;
+    (void)events;
+    char events_buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *base = strrchr(log_path, '/');
+    base = base ? base + 1 : log_path;
+    int replaced = 0;
+
+    for (;;) {
+        ssize_t n = read(follower.inotify_fd, events_buf, sizeof(events_buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (char *p = events_buf; p < events_buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->wd == follower.file_wd && (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF))) {
+                replaced = 1;
+            }
+            if (ev->wd == follower.dir_wd && ev->len && strcmp(ev->name, base) == 0) {
+                replaced = 1;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    // Finish the old file before moving on to the new one at log rotation
+    int grew = follower_read();
+    if (replaced) {
+        follower_close_file();
+        follower_open(0);
+        grew |= follower_read();
+    }
+    if (grew) conn_wake(&follower);
+}
+
+static int follower_start(void) {
+    if (follower.streams++ > 0) return 0;
+
+    follower.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follower.inotify_fd < 0) {
+        follower.streams--;
+        return -1;
+    }
+
+    // The directory watch notices the file being (re)created
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", log_path);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        *(slash == dir ? slash + 1 : slash) = '\0';
+        follower.dir_wd = inotify_add_watch(follower.inotify_fd, dir, IN_CREATE | IN_MOVED_TO);
+    }
+    follower_open(1);
+
+    follower.io.callback = follower_io;
+    follower.io.data = &follower;
+    if (event_add(conn_server_loop(), follower.inotify_fd, EVENT_READ, &follower.io) < 0) {
+        follower_close_file();
+        close(follower.inotify_fd);
+        follower.inotify_fd = -1;
+        follower.streams--;
+        return -1;
+    }
+    return 0;
+}
+
+static void follower_stop(void) {
+    if (--follower.streams > 0) return;
+
+    event_del(conn_server_loop(), follower.inotify_fd, &follower.io);
+    follower_close_file();
+    close(follower.inotify_fd);
+    follower.inotify_fd = -1;
+    follower.dir_wd = -1;
+}
+
+static ssize_t log_stream_read(void *ctx, char *buf, size_t len) {
+    log_stream *ls = ctx;
+    char line[LOG_LINE_MAX];
+    size_t out = 0;
+
+    // Normally inotify got here first; this covers it staying silent
+    follower_read();
+
+    unsigned long long oldest = follower.head > LOG_RING_SIZE ? follower.head - LOG_RING_SIZE : 0;
+    if (ls->cursor < oldest) {
+        out = snprintf(buf, len, "-- %llu bytes dropped --\n", oldest - ls->cursor);
+        ls->cursor = oldest;
+        // Resume at the next whole line
+        while (ls->cursor < follower.head && follower.ring[ls->cursor++ % LOG_RING_SIZE] != '\n');
+    }
+
+    while (ls->cursor < follower.head) {
+        unsigned long long end = ls->cursor;
+        while (end < follower.head && end - ls->cursor < LOG_LINE_MAX - 1 &&
+               follower.ring[end % LOG_RING_SIZE] != '\n') {
+            end++;
+        }
+        // Wait for the rest of a line that is still being written
+        if (end == follower.head) break;
+
+        size_t n = end - ls->cursor;
+        for (size_t i = 0; i < n; i++) line[i] = follower.ring[(ls->cursor + i) % LOG_RING_SIZE];
+        if (n && line[n - 1] == '\r') n--;
+        line[n] = '\0';
+
+        if (log_filter_match(&ls->filter, line)) {
+            if (out + n + 1 > len) break;
+            memcpy(buf + out, line, n);
+            buf[out + n] = '\n';
+            out += n + 1;
+        }
+        // An overlong line goes out in pieces
+        ls->cursor = end + (follower.ring[end % LOG_RING_SIZE] == '\n');
+    }
+
+    return out ? (ssize_t)out : STREAM_WAIT;
+}
+
+static void log_stream_free(void *ctx) {
+    log_stream *ls = ctx;
+    log_filter_free(&ls->filter);
+    free(ls);
+    follower_stop();
+}
+
+static void api_logs_stream(http_request *req, http_response *res) {
+    log_stream *ls = calloc(1, sizeof(log_stream));
+    if (!ls) {
+        response_error(res, 500, "Memory allocation error");
+        return;
+    }
+    if (log_filter_parse(&ls->filter, req->query, res) < 0) {
+        log_filter_free(&ls->filter);
+        free(ls);
+        return;
+    }
+    if (follower_start() < 0) {
+        log_filter_free(&ls->filter);
+        free(ls);
+        response_error(res, 500, "Cannot watch the log");
+        return;
+    }
+
+    // Only what is logged from now on; /api/logs has the history
+    ls->cursor = follower.head;
+
+    res->status = 200;
+    res->content_type = "text/plain; charset=utf-8";
+    res->stream = log_stream_read;
+    res->stream_free = log_stream_free;
+    res->stream_ctx = ls;
+    res->stream_wait_ms = LOG_POLL_MS;
+    res->stream_wait_key = &follower;
+}
+
+void logs_register_routes(router *r) {
+    router_add(r, HTTP_GET, "/api/logs", api_logs, CACHE_NO_STORE);
+    router_add(r, HTTP_GET, "/api/logs/stream", api_logs_stream, CACHE_NO_STORE);
+}
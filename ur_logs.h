@@ -0,0 +1,21 @@
+#ifndef UR_LOGS_H
+#define UR_LOGS_H
+
+#include "ur_router.h"
+
+// Where syslogd/logd writes when log_file is set in /etc/config/system
+#define LOG_DEFAULT_FILE "/var/log/messages"
+// Recent output shared by the followers; a viewer further behind loses lines
+#define LOG_RING_SIZE (64 * 1024)
+#define LOG_LINE_MAX 1024
+#define LOG_BLOCK_SIZE 8192
+#define LOG_LIMIT_DEFAULT 100
+#define LOG_LIMIT_MAX 1000
+// Followers also look for new lines this often, in case inotify stays silent
+#define LOG_POLL_MS 5000
+
+void logs_init(const char *path);
+
+void logs_register_routes(router *r);
+
+#endif
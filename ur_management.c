@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
@@ -17,6 +18,31 @@
 #include <sys/statvfs.h>
 #include <sys/sysinfo.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <poll.h>
+
+#include "ur_router.h"
+#include "ur_backup.h"
+#include "ur_firmware.h"
+#include "ur_conn.h"
+#include "ur_assets.h"
+#include "ur_collect.h"
+#include "ur_metrics.h"
+#include "ur_proc.h"
+#include "ur_logs.h"
+#include "ur_uci.h"
+#include "ur_escape.h"
+#include "ur_term.h"
+#include "ur_limit.h"
+#include "ur_upgrade.h"
+#include "ur_storage.h"
+#include "ur_fleet.h"
+#include "ur_flight.h"
+#include "ur_history.h"
+#include "ur_runner.h"
+#include "ur_tls.h"
+#include <stdarg.h>
 
 // Content type mapping structure
 typedef struct {
@@ -39,6 +65,12 @@ static content_type_mapping content_types[] = {
     {NULL, NULL}
 };
 
+#define CONTENT_TYPE_COUNT (sizeof(content_types) / sizeof(content_types[0]) - 1)
+
+// Perfect hash over content_types, built in server_init()
+static const char *content_type_keys[CONTENT_TYPE_COUNT];
+static phash_table content_type_hash = {0};
+
 // Global metrics storage
 static system_metrics metrics = {0};
 
@@ -47,20 +79,24 @@ static mqtt_status mqtt_state = {0};
 
 // Server configuration
 static server_config server_cfg = {0};
+// HTTPS listener, or -1
+static int tls_server_fd = -1;
+
+// Request routing table
+static router routes;
 
 // Forward declarations for internal functions
 static const char* get_content_type(const char *path);
-static void handle_api_request(int socket, const char *path);
-static void handle_static_file(int socket, const char *path);
-static void render_template(char *buffer, const char *client_ip, 
-                          const char *command, const char *cmd_output, 
-                          int exit_status);
+static void register_routes(router *r);
+static void handle_static_file(http_request *req, http_response *res);
+static void handle_index(http_request *req, http_response *res);
+static void render_template(http_response *res, const char *client_ip, int shell);
+static void register_parts(void);
+static void sample_metrics(double *values);
 static void parse_query_params(const char *query, char *command, size_t cmd_len);
 static void update_bandwidth();
 
 /* Public API Implementation */
-static char command_history[MAX_HISTORY][MAX_COMMAND_SIZE];
-static int history_count = 0;
 
 static int check_ultima_server_connectivity() {
     struct hostent *host = gethostbyname("example.ultimarobotics.com");
@@ -72,92 +108,77 @@ static int check_internet_connectivity() {
     return (host != NULL);
 }
 char* execute_command(const char *command, int *exit_status) {
-    char cmd[MAX_COMMAND_SIZE + 100];
-    sprintf(cmd, "(%s) 2>&1", command);
-
-    FILE *fp = popen(cmd, "r");
-    if (!fp) {
+    runner_job job;
+    flight_id trace;
+    flight_command_begin(&trace, command);
+    if (runner_start(&job, command) < 0) {
+        flight_command_end(trace, -1);
         *exit_status = -1;
         return strdup("Error executing command");
     }
 
     size_t output_size = 4096;
+    size_t total_read = 0;
     char *output = malloc(output_size);
     if (!output) {
-        pclose(fp);
+        runner_cancel(&job);
+        flight_command_end(trace, -1);
         *exit_status = -1;
         return strdup("Memory allocation error");
     }
-    output[0] = '\0';
 
-    char buffer[4096];
-    size_t total_read = 0;
-    
-    while (fgets(buffer, sizeof(buffer), fp)) {
-        size_t buffer_len = strlen(buffer);
-        
-        if (total_read + buffer_len + 1 > output_size) {
-            output_size *= 2;
-            char *new_output = realloc(output, output_size);
+    // A command that is still going at the deadline is killed with whatever it started
+    uint64_t deadline = monotonic_ms() + COMMAND_TIMEOUT_MS;
+    for (;;) {
+        if (total_read + 4096 + 1 > output_size) {
+            char *new_output = realloc(output, output_size * 2);
             if (!new_output) {
                 free(output);
-                pclose(fp);
+                runner_cancel(&job);
+                flight_command_end(trace, -1);
                 *exit_status = -1;
                 return strdup("Memory allocation error during output capture");
             }
             output = new_output;
+            output_size *= 2;
         }
-        
-        strcat(output, buffer);
-        total_read += buffer_len;
+
+        uint64_t now = monotonic_ms();
+        struct pollfd pfd = { .fd = job.out, .events = POLLIN };
+        int ready = now < deadline ? poll(&pfd, 1, (int)(deadline - now)) : 0;
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) {
+            runner_cancel(&job);
+            // The buffer always has room for the note
+            snprintf(output + total_read, output_size - total_read, "%sCommand killed after %d seconds\n",
+                     total_read && output[total_read - 1] != '\n' ? "\n" : "",
+                     COMMAND_TIMEOUT_MS / 1000);
+            flight_command_end(trace, -1);
+            *exit_status = -1;
+            return output;
+        }
+
+        ssize_t n = read(job.out, output + total_read, 4096);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        total_read += n;
     }
+    output[total_read] = '\0';
 
-    int status = pclose(fp);
+    close(job.out);
+    int status = runner_wait(&job);
     *exit_status = WEXITSTATUS(status);
-    
+    flight_command_end(trace, *exit_status);
+
     return output;
 }
 char* json_escape_string(const char *str) {
-    if (!str) return strdup("");
-    
-    size_t escaped_len = 0;
-    const char *p;
-    
-    for (p = str; *p; p++) {
-        switch (*p) {
-            case '\"': case '\\': case '/': case '\b': case '\f': case '\n': case '\r': case '\t':
-                escaped_len += 2;
-                break;
-            default:
-                escaped_len++;
-                break;
-        }
-    }
-    
-    char *escaped = malloc(escaped_len + 1);
-    if (!escaped) return strdup("");
-    
-    char *q = escaped;
-    for (p = str; *p; p++) {
-        switch (*p) {
-            case '\"': *q++ = '\\'; *q++ = '\"'; break;
-            case '\\': *q++ = '\\'; *q++ = '\\'; break;
-            case '/': *q++ = '\\'; *q++ = '/'; break;
-            case '\b': *q++ = '\\'; *q++ = 'b'; break;
-            case '\f': *q++ = '\\'; *q++ = 'f'; break;
-            case '\n': *q++ = '\\'; *q++ = 'n'; break;
-            case '\r': *q++ = '\\'; *q++ = 'r'; break;
-            case '\t': *q++ = '\\'; *q++ = 't'; break;
-            default: *q++ = *p;
-        }
-    }
-    *q = '\0';
-    
-    return escaped;
+    char *escaped = str ? escape_json_dup(str, strlen(str)) : NULL;
+    return escaped ? escaped : strdup("");
 }
 
 static char* get_uptime() {
-    static char uptime_str[128] = "Unknown";
+    char uptime_str[128] = "Unknown";
     int exit_status;
     
     char *output = execute_command("uptime -p 2>/dev/null || uptime", &exit_status);
@@ -172,7 +193,7 @@ static char* get_uptime() {
 }
 
 static char* get_kernel_version() {
-    static char version[128] = "Unknown";
+    char version[128] = "Unknown";
     int exit_status;
     
     char *output = execute_command("uname -r", &exit_status);
@@ -187,7 +208,7 @@ static char* get_kernel_version() {
 }
 
 static char* get_openwrt_version() {
-    static char version[128] = "Unknown";
+    char version[128] = "Unknown";
     int exit_status;
     
     char *output = execute_command("cat /etc/openwrt_release 2>/dev/null | grep DISTRIB_RELEASE | cut -d \"'\" -f 2", &exit_status);
@@ -206,9 +227,11 @@ static char* generate_firmware_json() {
     char *firmware_info = execute_command("cat /etc/openwrt_release", &exit_status);
     char *build_date = execute_command("ls -l --time-style=long-iso /bin/busybox | awk '{print $6}'", &exit_status);
     char *arch = execute_command("uname -m", &exit_status);
+    char *version = get_openwrt_version();
     
     char *json = malloc(4096);
     if (!json) {
+        free(version);
         if (firmware_info) free(firmware_info);
         if (build_date) free(build_date);
         if (arch) free(arch);
@@ -237,11 +260,12 @@ static char* generate_firmware_json() {
         "  \"status\": \"stable\",\n"
         "  \"update_available\": false\n"
         "}",
-        get_openwrt_version(),
+        version,
         build_date_esc,
         arch_esc
     );
     
+    free(version);
     free(firmware_esc);
     free(build_date_esc);
     free(arch_esc);
@@ -253,17 +277,6 @@ static char* generate_firmware_json() {
 }
 
 
-void add_to_history(const char *command) {
-    if (history_count == MAX_HISTORY) {
-        for (int i = 0; i < MAX_HISTORY - 1; i++) {
-            strcpy(command_history[i], command_history[i + 1]);
-        }
-        history_count--;
-    }
-    
-    strcpy(command_history[history_count], command);
-    history_count++;
-}
 static float get_cpu_usage() {
     FILE *fp = fopen("/proc/stat", "r");
     if (!fp) return 0.0;
@@ -306,6 +319,9 @@ static char* generate_system_json() {
     
     char *json = malloc(4096);
     if (!json) {
+        free(version);
+        free(kernel);
+        free(uptime);
         if (cpu_info) free(cpu_info);
         return NULL;
     }
@@ -332,6 +348,9 @@ static char* generate_system_json() {
     free(kernel_esc);
     free(uptime_esc);
     free(cpu_esc);
+    free(version);
+    free(kernel);
+    free(uptime);
     if (cpu_info) free(cpu_info);
     
     return json;
@@ -376,6 +395,14 @@ static char* generate_network_json() {
     
     return json;
 }
+// Takes command output (or the fallback when it failed) for a <pre> block
+static char* html_text(char *output, const char *fallback) {
+    const char *text = output ? output : fallback;
+    char *escaped = escape_html_dup(text, strlen(text));
+    free(output);
+    return escaped ? escaped : strdup("");
+}
+
 static char* get_system_info() {
     static char info[4096];
     int exit_status;
@@ -385,6 +412,11 @@ static char* get_system_info() {
     char *uptime_output = execute_command("uptime", &exit_status);
     char *cpu_info = execute_command("cat /proc/cpuinfo | grep 'model name' | head -1 || cat /proc/cpuinfo | grep 'cpu model' | head -1", &exit_status);
     
+    version_output = html_text(version_output, "Could not retrieve version information");
+    kernel_output = html_text(kernel_output, "Could not retrieve kernel information");
+    uptime_output = html_text(uptime_output, "Could not retrieve uptime information");
+    cpu_info = html_text(cpu_info, "Could not retrieve CPU information");
+
     snprintf(info, sizeof(info),
         "<div class=\"system-info\">"
         "<h3>System Details</h3>"
@@ -396,10 +428,7 @@ static char* get_system_info() {
         "<h3>CPU Information</h3>"
         "<pre>%s</pre>"
         "</div>",
-        version_output ? version_output : "Could not retrieve version information",
-        kernel_output ? kernel_output : "Could not retrieve kernel information",
-        uptime_output ? uptime_output : "Could not retrieve uptime information",
-        cpu_info ? cpu_info : "Could not retrieve CPU information"
+        version_output, kernel_output, uptime_output, cpu_info
     );
     
     if (version_output) free(version_output);
@@ -419,6 +448,11 @@ static char* get_network_info() {
     char *routing = execute_command("route -n", &exit_status);
     char *dns = execute_command("cat /etc/resolv.conf", &exit_status);
     
+    interfaces = html_text(interfaces, "Could not retrieve interface information");
+    wireless = html_text(wireless, "Could not retrieve wireless information");
+    routing = html_text(routing, "Could not retrieve routing information");
+    dns = html_text(dns, "Could not retrieve DNS information");
+
     snprintf(info, sizeof(info),
         "<div class=\"network-info\">"
         "<h3>Network Interfaces</h3>"
@@ -430,10 +464,7 @@ static char* get_network_info() {
         "<h3>DNS Configuration</h3>"
         "<pre>%s</pre>"
         "</div>",
-        interfaces ? interfaces : "Could not retrieve interface information",
-        wireless ? wireless : "Could not retrieve wireless information",
-        routing ? routing : "Could not retrieve routing information",
-        dns ? dns : "Could not retrieve DNS information"
+        interfaces, wireless, routing, dns
     );
     
     if (interfaces) free(interfaces);
@@ -480,25 +511,12 @@ static void get_storage_usage(unsigned long *total, unsigned long *free,
 
 
 
-int server_init(server_config *config) {
-    if (!config) return -1;
-
-    // Copy configuration
-    server_cfg.ip_address = strdup(config->ip_address ? config->ip_address : "0.0.0.0");
-    server_cfg.port = config->port > 0 ? config->port : DEFAULT_PORT;
-    server_cfg.web_root = strdup(config->web_root ? config->web_root : "public");
-    server_cfg.template_dir = strdup(config->template_dir ? config->template_dir : "templates");
-
-    // Initialize metrics
-    memset(&metrics, 0, sizeof(metrics));
-    metrics.last_bandwidth_check = time(NULL);
-
-    // Initialize MQTT status
-    memset(&mqtt_state, 0, sizeof(mqtt_state));
+// A nonblocking socket bound and listening on ip:port, or -1
+static int listen_on(const char *ip, int port) {
+    int server_fd;
 
     // Create socket
-    int server_fd;
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror("socket failed");
         return -1;
     }
@@ -514,8 +532,8 @@ int server_init(server_config *config) {
     // Bind socket
     struct sockaddr_in address;
     address.sin_family = AF_INET;
-    address.sin_addr.s_addr = inet_addr(server_cfg.ip_address);
-    address.sin_port = htons(server_cfg.port);
+    address.sin_addr.s_addr = inet_addr(ip);
+    address.sin_port = htons(port);
 
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
         perror("bind failed");
@@ -524,135 +542,299 @@ int server_init(server_config *config) {
     }
 
     // Start listening
-    if (listen(server_fd, 10) < 0) {
+    if (listen(server_fd, server_cfg.listen_backlog) < 0) {
         perror("listen");
         close(server_fd);
         return -1;
     }
-
-    printf("OpenWRT Management Interface running on http://%s:%d\n", 
-           server_cfg.ip_address, server_cfg.port);
     return server_fd;
 }
 
-void server_run(int server_fd) {
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    char buffer[BUFFER_SIZE] = {0};
-    char client_ip[INET_ADDRSTRLEN];
-
-    while (1) {
-        // Accept connection
-        int new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
-        if (new_socket < 0) {
-            perror("accept");
-            continue;
-        }
-
-        // Get client IP
-        inet_ntop(AF_INET, &(address.sin_addr), client_ip, INET_ADDRSTRLEN);
+int server_init(server_config *config) {
+    if (!config) return -1;
 
-        // Read request
-        ssize_t bytes_read = read(new_socket, buffer, BUFFER_SIZE - 1);
-        if (bytes_read < 0) {
-            perror("read");
-            close(new_socket);
-            continue;
-        }
-        buffer[bytes_read] = '\0';
-
-        // Parse request line
-        char method[16] = {0};
-        char path[MAX_PATH_LENGTH] = {0};
-        char protocol[16] = {0};
-        sscanf(buffer, "%s %s %s", method, path, protocol);
-
-        // Parse command if GET with query params
-        char command[MAX_COMMAND_SIZE] = {0};
-        char *cmd_output = NULL;
-        int exit_status = 0;
-
-        char *query_string = strchr(path, '?');
-        if (query_string) {
-            *query_string = '\0';
-            query_string++;
-            parse_query_params(query_string, command, sizeof(command));
-            *(query_string - 1) = '?';
+    // Copy configuration
+    server_cfg.ip_address = strdup(config->ip_address ? config->ip_address : "0.0.0.0");
+    server_cfg.port = config->port > 0 ? config->port : DEFAULT_PORT;
+    server_cfg.web_root = strdup(config->web_root ? config->web_root : "public");
+    server_cfg.template_dir = strdup(config->template_dir ? config->template_dir : "templates");
+    server_cfg.asset_dir = config->asset_dir ? strdup(config->asset_dir) : NULL;
+    server_cfg.max_connections = config->max_connections > 0 ? config->max_connections : DEFAULT_MAX_CONNECTIONS;
+    server_cfg.max_connections_per_ip = config->max_connections_per_ip > 0 ?
+                                        config->max_connections_per_ip : DEFAULT_MAX_CONNECTIONS_PER_IP;
+    server_cfg.listen_backlog = config->listen_backlog > 0 ? config->listen_backlog : DEFAULT_LISTEN_BACKLOG;
+    server_cfg.header_timeout = config->header_timeout > 0 ? config->header_timeout : DEFAULT_HEADER_TIMEOUT;
+    server_cfg.body_timeout = config->body_timeout > 0 ? config->body_timeout : DEFAULT_BODY_TIMEOUT;
+    server_cfg.keepalive_timeout = config->keepalive_timeout > 0 ? config->keepalive_timeout : DEFAULT_KEEPALIVE_TIMEOUT;
+    server_cfg.write_timeout = config->write_timeout > 0 ? config->write_timeout : DEFAULT_WRITE_TIMEOUT;
+    server_cfg.force_epoll = config->force_epoll;
+    server_cfg.static_shell = config->static_shell;
+
+    // First, while there is little of the server for the helper to copy
+    runner_limits limits = { config->runner_nice, config->runner_memory, config->runner_cgroup };
+    if (runner_init(&limits) < 0) {
+        fprintf(stderr, "Command runner unavailable, forking commands directly\n");
+    }
+    logs_init(config->log_file);
+    uci_init(config->config_dir);
+    term_init(config->terminal_memory);
+    limit_init(config->rate_limit);
+    if (config->fleet_file) {
+        int count = fleet_init(config->fleet_file);
+        if (count < 0) {
+            fprintf(stderr, "Cannot read fleet peers from %s\n", config->fleet_file);
+        } else {
+            printf("Aggregating %d fleet peers\n", count);
         }
+    }
+    if (config->history_file && history_init(config->history_file, config->history_sync) < 0) {
+        fprintf(stderr, "Cannot keep metrics history in %s\n", config->history_file);
+    }
 
-        // Execute command if provided
-        if (command[0]) {
-            if (strcmp(command, "help") == 0) {
-                cmd_output = strdup(
-                    "Common OpenWRT Commands:\n\n"
-                    "System Information:\n"
-                    "  cat /etc/openwrt_release    - Show OpenWRT version\n"
-                    "  uname -a                    - Show kernel information\n"
-                    "  uptime                      - Show system uptime\n"
-                    "  top                         - Show running processes\n"
-                    "  free                        - Show memory usage\n"
-                    "  df -h                       - Show disk usage\n\n"
-                    "Network Commands:\n"
-                    "  ifconfig                    - Show network interfaces\n"
-                    "  iwconfig                    - Show wireless interfaces\n"
-                    "  route -n                    - Show routing table\n"
-                    "  ip addr                     - Show IP addresses\n"
-                    "  cat /etc/config/network     - Show network configuration\n"
-                    "  cat /etc/config/wireless    - Show wireless configuration\n"
-                    "  ping [host]                 - Test network connectivity\n\n"
-                    "Service Management:\n"
-                    "  /etc/init.d/[service] [start|stop|restart|status]\n"
-                    "  Examples: /etc/init.d/network restart, /etc/init.d/firewall status\n\n"
-                    "Firewall:\n"
-                    "  iptables -L -n              - List firewall rules\n"
-                    "  cat /etc/config/firewall    - Show firewall configuration\n\n"
-                    "Advanced:\n"
-                    "  logread                     - Show system logs\n"
-                    "  ps                          - List running processes\n"
-                );
-                exit_status = 0;
-            } else {
-                cmd_output = execute_command(command, &exit_status);
-                add_to_history(command);
-            }
+    if (config->tls_cert) {
+#ifdef UR_HAVE_TLS
+        if (tls_init(config->tls_cert, config->tls_key) == 0) {
+            server_cfg.tls_port = config->tls_port > 0 ? config->tls_port : DEFAULT_TLS_PORT;
+        } else {
+            fprintf(stderr, "Cannot use the TLS certificate, serving plain HTTP only\n");
         }
+#else
+        fprintf(stderr, "Built without TLS, serving plain HTTP only\n");
+#endif
+    }
 
-        // Route request
-        if (strncmp(path, "/api/", 5) == 0) {
-            handle_api_request(new_socket, path);
-        } 
-        else if (strncmp(path, "/css/", 5) == 0 || 
-                 strncmp(path, "/js/", 4) == 0 || 
-                 strncmp(path, "/img/", 5) == 0) {
-            handle_static_file(new_socket, path);
-        }
-        else {
-            if (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0) {
-                render_template(buffer, client_ip, command[0] ? command : NULL, 
-                               cmd_output, exit_status);
-                send(new_socket, buffer, strlen(buffer), 0);
-            }
-            else if (file_exists(path + 1)) {
-                handle_static_file(new_socket, path);
-            }
-            else {
-                render_template(buffer, client_ip, command[0] ? command : NULL, 
-                               cmd_output, exit_status);
-                send(new_socket, buffer, strlen(buffer), 0);
-            }
-        }
+    // Peers that go away mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // The UI is compiled in; a broken bundle only matters without an override
+    if (assets_init(server_cfg.asset_dir, server_cfg.web_root, server_cfg.template_dir) < 0 && !server_cfg.asset_dir) {
+        fprintf(stderr, "No usable web assets, pass an override directory with -a\n");
+    }
+
+    // Initialize metrics
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.last_bandwidth_check = time(NULL);
+
+    // Initialize MQTT status
+    memset(&mqtt_state, 0, sizeof(mqtt_state));
+
+    // Build lookup tables
+    for (size_t i = 0; i < CONTENT_TYPE_COUNT; i++) {
+        content_type_keys[i] = content_types[i].extension;
+    }
+    if (phash_build(&content_type_hash, content_type_keys, CONTENT_TYPE_COUNT) < 0) {
+        fprintf(stderr, "Failed to build content type table\n");
+        return -1;
+    }
+
+    metrics_init(sample_metrics);
+    register_parts();
+    router_init(&routes);
+    register_routes(&routes);
+    if (router_build(&routes) < 0) {
+        fprintf(stderr, "Failed to build route table\n");
+        return -1;
+    }
+
+    // A replaced process hands over its sockets, already bound and listening
+    int server_fd = upgrade_listener();
+    tls_server_fd = upgrade_tls_listener();
+    if (tls_server_fd >= 0 && !server_cfg.tls_port) {
+        close(tls_server_fd);
+        tls_server_fd = -1;
+    }
+    if (tls_server_fd >= 0) {
+        fcntl(tls_server_fd, F_SETFL, fcntl(tls_server_fd, F_GETFL) | O_NONBLOCK);
+    } else if (server_cfg.tls_port) {
+        tls_server_fd = listen_on(server_cfg.ip_address, server_cfg.tls_port);
+        if (tls_server_fd < 0) fprintf(stderr, "Cannot listen for HTTPS, serving plain HTTP only\n");
+    }
+
+    if (server_fd >= 0) {
+        fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+        printf("OpenWRT Management Interface taking over on http://%s:%d\n",
+               server_cfg.ip_address, server_cfg.port);
+    } else {
+        server_fd = listen_on(server_cfg.ip_address, server_cfg.port);
+        if (server_fd < 0) return -1;
+        printf("OpenWRT Management Interface running on http://%s:%d\n",
+               server_cfg.ip_address, server_cfg.port);
+    }
+    if (tls_server_fd >= 0) {
+        printf("OpenWRT Management Interface running on https://%s:%d\n",
+               server_cfg.ip_address, server_cfg.tls_port);
+    }
+    upgrade_ready();
+    return server_fd;
+}
+
+// Digits only: a sign, a blank value or one that does not fit in size_t is malformed
+static int parse_content_length(const char *value, size_t len, size_t *out) {
+    size_t n = 0;
+
+    if (len == 0) return -1;
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') return -1;
+        if (n > (SIZE_MAX - (value[i] - '0')) / 10) return -1;
+        n = n * 10 + (value[i] - '0');
+    }
+    *out = n;
+    return 0;
+}
 
-        // Cleanup
-        if (cmd_output) free(cmd_output);
-        close(new_socket);
+int http_parse_request(char *buffer, size_t length, http_request *req) {
+    char uri[MAX_URI_LENGTH];
+    char protocol[16] = {0};
+
+    if (sscanf(buffer, "%15s %8191s %15s", req->method_name, uri, protocol) < 2) {
+        return -1;
+    }
+    req->method = http_method_from_string(req->method_name);
+
+    snprintf(req->uri, sizeof(req->uri), "%s", uri);
+    req->path = req->uri;
+    req->query = strchr(req->uri, '?');
+    if (req->query) {
+        *req->query++ = '\0';
+    } else {
+        req->query = req->uri + strlen(req->uri);
+    }
+
+    char *line_end = strstr(buffer, "\r\n");
+    char *header_end = strstr(buffer, "\r\n\r\n");
+    if (line_end && header_end && line_end < header_end) {
+        req->headers = line_end + 2;
+        req->headers_len = header_end + 2 - req->headers;
+        req->body = header_end + 4;
+        req->body_len = length - (req->body - buffer);
+    } else {
+        req->headers = "";
+        req->headers_len = 0;
+        req->body = buffer + length;
+        req->body_len = 0;
+    }
+
+    size_t value_len;
+    const char *content_length = http_request_header(req, "Content-Length", &value_len);
+    req->content_length = 0;
+    if (content_length && parse_content_length(content_length, value_len, &req->content_length) < 0) {
+        return -1;
+    }
+
+    // HTTP/1.1 keeps the connection open unless asked not to; 1.0 only on request
+    const char *connection = http_request_header(req, "Connection", &value_len);
+    if (strcmp(protocol, "HTTP/1.1") == 0) {
+        req->keep_alive = !(connection && value_len >= 5 && strncasecmp(connection, "close", 5) == 0);
+    } else {
+        req->keep_alive = connection && value_len >= 10 &&
+                          strncasecmp(connection, "keep-alive", 10) == 0;
     }
+
+    return 0;
+}
+
+int http_format_head(const http_response *res, int keep_alive, char *out, size_t len) {
+    const char *connection = keep_alive ? "keep-alive" : "close";
+    int written;
+
+    if (res->status == 204 || res->status == 304) {
+        written = snprintf(out, len,
+            "HTTP/1.1 %d %s\r\n"
+            "%.*s"
+            "Connection: %s\r\n"
+            "\r\n",
+            res->status, http_status_text(res->status),
+            (int)res->headers_len, res->headers, connection);
+    } else if (res->stream) {
+        written = snprintf(out, len,
+            "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Cache-Control: %s\r\n"
+            "%.*s"
+            "Connection: %s\r\n"
+            "\r\n",
+            res->status, http_status_text(res->status),
+            res->content_type ? res->content_type : "application/octet-stream",
+            res->cache_control ? res->cache_control : "no-store",
+            (int)res->headers_len, res->headers, connection);
+    } else {
+        written = snprintf(out, len,
+            "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Cache-Control: %s\r\n"
+            "%.*s"
+            "Connection: %s\r\n"
+            "\r\n",
+            res->status, http_status_text(res->status),
+            res->content_type ? res->content_type : "text/plain",
+            res->body_len,
+            res->cache_control ? res->cache_control : "no-store",
+            (int)res->headers_len, res->headers, connection);
+    }
+
+    return written < (int)len ? written : (int)len - 1;
+}
+
+void response_free(http_response *res) {
+    if (res->body && !res->body_static) free(res->body);
+    res->body = NULL;
+    if (res->body_file) close(res->body_fd);
+    res->body_file = 0;
+    if (res->stream_free) res->stream_free(res->stream_ctx);
+    if (res->body_release) res->body_release(res->body_release_ctx);
+    res->body_release = NULL;
+    res->body_release_ctx = NULL;
+    res->stream = NULL;
+    res->stream_free = NULL;
+    res->stream_ctx = NULL;
+}
+
+int server_route_request(http_request *req, http_response *res, route_target *target) {
+    memset(target, 0, sizeof(*target));
+
+    if (http_request_header(req, "Transfer-Encoding", NULL)) {
+        response_error(res, 411, "Chunked request bodies are not supported");
+        return -1;
+    }
+
+    int resolved = router_resolve(&routes, req, res, target);
+    if (resolved < 0) return -1;
+
+    if (resolved == 0) {
+        // Unrouted paths fall back to a bundled file under the web root or the page
+        char file_path[MAX_PATH_LENGTH];
+        snprintf(file_path, sizeof(file_path), "%s%s", server_cfg.web_root, req->path);
+        target->handler = asset_exists(file_path) ? handle_static_file : handle_index;
+        target->cls = ROUTE_LIGHT;
+    }
+
+    // The page forks commands to fill itself in, unless it is the static shell;
+    // the command is read as handle_index() reads it, so the two always agree
+    if (target->handler == handle_index) {
+        char command[MAX_COMMAND_SIZE];
+        parse_query_params(req->query, command, sizeof(command));
+        target->cls = server_cfg.static_shell && !command[0] ? ROUTE_LIGHT : ROUTE_HEAVY;
+    }
+    // A batch is only heavy when it has commands to fork for a stale part
+    if (strcmp(req->path, "/api/batch") == 0) target->cls = collect_batch_class(req);
+    return 1;
+}
+
+void server_run(int server_fd) {
+    conn_server_run(server_fd, tls_server_fd, &server_cfg);
 }
 
 void server_cleanup(int server_fd) {
     if (server_fd >= 0) close(server_fd);
+    if (tls_server_fd >= 0) close(tls_server_fd);
     if (server_cfg.ip_address) free(server_cfg.ip_address);
     if (server_cfg.web_root) free(server_cfg.web_root);
     if (server_cfg.template_dir) free(server_cfg.template_dir);
+    if (server_cfg.asset_dir) free(server_cfg.asset_dir);
+    router_free(&routes);
+    phash_free(&content_type_hash);
 }
 
 void update_metrics() {
@@ -674,22 +856,53 @@ void update_metrics() {
     metrics.ultima_server_connected = check_ultima_server_connectivity();
 }
 
-char* generate_metrics_json() {
+// One decimal is all any consumer shows; rounding here keeps deltas quiet
+static double round_tenth(double v) {
+    return (double)(long long)(v * 10 + (v < 0 ? -0.5 : 0.5)) / 10;
+}
+
+static void sample_metrics(double *values) {
+    storage_summary storage;
+
     update_metrics();
+    storage_sample(&storage);
+
+    values[METRIC_CPU_USAGE] = round_tenth(metrics.cpu_usage);
+    values[METRIC_MEMORY_TOTAL] = metrics.total_memory;
+    values[METRIC_MEMORY_USED] = metrics.used_memory;
+    values[METRIC_MEMORY_USAGE] = round_tenth(metrics.memory_usage);
+    values[METRIC_STORAGE_TOTAL] = metrics.total_storage;
+    values[METRIC_STORAGE_USED] = metrics.used_storage;
+    values[METRIC_STORAGE_FREE] = metrics.free_storage;
+    values[METRIC_STORAGE_USAGE] = round_tenth(metrics.storage_usage);
+    values[METRIC_BANDWIDTH_DOWNLOAD] = round_tenth(metrics.download_rate);
+    values[METRIC_BANDWIDTH_UPLOAD] = round_tenth(metrics.upload_rate);
+    values[METRIC_INTERNET_CONNECTED] = metrics.internet_connected != 0;
+    values[METRIC_ULTIMA_CONNECTED] = metrics.ultima_server_connected != 0;
+    values[METRIC_STORAGE_MAX_USAGE] = round_tenth(storage.max_usage);
+    values[METRIC_DISK_READ_RATE] = round_tenth(storage.read_rate);
+    values[METRIC_DISK_WRITE_RATE] = round_tenth(storage.write_rate);
+    values[METRIC_DISK_UTIL] = round_tenth(storage.max_util);
+}
+
+char* generate_metrics_json() {
+    const double *v = metrics_latest()->values;
+    unsigned long used_storage = v[METRIC_STORAGE_USED];
+    unsigned long total_storage = v[METRIC_STORAGE_TOTAL];
     
     char storage_used_formatted[32];
     char storage_total_formatted[32];
     
-    if (metrics.used_storage < 1024) {
-        sprintf(storage_used_formatted, "%lu MB", metrics.used_storage);
+    if (used_storage < 1024) {
+        sprintf(storage_used_formatted, "%lu MB", used_storage);
     } else {
-        sprintf(storage_used_formatted, "%.1f GB", metrics.used_storage / 1024.0);
+        sprintf(storage_used_formatted, "%.1f GB", used_storage / 1024.0);
     }
     
-    if (metrics.total_storage < 1024) {
-        sprintf(storage_total_formatted, "%lu MB", metrics.total_storage);
+    if (total_storage < 1024) {
+        sprintf(storage_total_formatted, "%lu MB", total_storage);
     } else {
-        sprintf(storage_total_formatted, "%.1f GB", metrics.total_storage / 1024.0);
+        sprintf(storage_total_formatted, "%.1f GB", total_storage / 1024.0);
     }
     
     char *json = malloc(4096);
@@ -724,13 +937,15 @@ char* generate_metrics_json() {
         "    \"connected\": %s\n"
         "  }\n"
         "}",
-        metrics.cpu_usage,
-        metrics.total_memory, metrics.used_memory, metrics.memory_usage,
-        metrics.total_storage, metrics.used_storage, metrics.free_storage, metrics.storage_usage,
+        v[METRIC_CPU_USAGE],
+        (unsigned long)v[METRIC_MEMORY_TOTAL], (unsigned long)v[METRIC_MEMORY_USED],
+        v[METRIC_MEMORY_USAGE],
+        total_storage, used_storage, (unsigned long)v[METRIC_STORAGE_FREE],
+        v[METRIC_STORAGE_USAGE],
         storage_used_formatted, storage_total_formatted,
-        metrics.download_rate, metrics.upload_rate,
-        metrics.internet_connected ? "true" : "false",
-        metrics.ultima_server_connected ? "true" : "false"
+        v[METRIC_BANDWIDTH_DOWNLOAD], v[METRIC_BANDWIDTH_UPLOAD],
+        v[METRIC_INTERNET_CONNECTED] ? "true" : "false",
+        v[METRIC_ULTIMA_CONNECTED] ? "true" : "false"
     );
     
     return json;
@@ -780,25 +995,7 @@ char* generate_mqtt_status_json(mqtt_status *status) {
 /* Utility Functions */
 
 void url_decode(char *dst, const char *src) {
-    char a, b;
-    while (*src) {
-        if ((*src == '%') && (a = src[1]) && (b = src[2]) && isxdigit(a) && isxdigit(b)) {
-            if (a >= 'a') a -= 'a'-'A';
-            if (a >= 'A') a -= ('A' - 10);
-            else a -= '0';
-            if (b >= 'a') b -= 'a'-'A';
-            if (b >= 'A') b -= ('A' - 10);
-            else b -= '0';
-            *dst++ = 16*a+b;
-            src+=3;
-        } else if (*src == '+') {
-            *dst++ = ' ';
-            src++;
-        } else {
-            *dst++ = *src++;
-        }
-    }
-    *dst++ = '\0';
+    dst[escape_url_decode(dst, src, strlen(src))] = '\0';
 }
 
 
@@ -832,99 +1029,411 @@ int file_exists(const char *path) {
     return access(path, R_OK) == 0;
 }
 
+// Finds the value following "key": anywhere in a flat JSON document
+static const char* json_find_value(const char *json, const char *key) {
+    size_t key_len = strlen(key);
+    const char *p = json;
+
+    while (p && (p = strchr(p, '"')) != NULL) {
+        if (strncmp(p + 1, key, key_len) == 0 && p[key_len + 1] == '"') {
+            const char *v = p + key_len + 2;
+            while (isspace((unsigned char)*v)) v++;
+            if (*v == ':') {
+                v++;
+                while (isspace((unsigned char)*v)) v++;
+                return v;
+            }
+        }
+        p++;
+    }
+    return NULL;
+}
+
+int json_get_string(const char *json, const char *key, char *out, size_t out_len) {
+    const char *v = json ? json_find_value(json, key) : NULL;
+    if (!v || *v != '"' || out_len == 0) return -1;
+
+    size_t n = 0;
+    for (v++; *v && *v != '"'; v++) {
+        char c = *v;
+        if (c == '\\' && v[1]) {
+            v++;
+            switch (*v) {
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                default: c = *v; break;
+            }
+        }
+        if (n + 1 < out_len) out[n++] = c;
+    }
+    out[n] = '\0';
+    return *v == '"' ? 0 : -1;
+}
+
+int json_get_bool(const char *json, const char *key, int *value) {
+    const char *v = json ? json_find_value(json, key) : NULL;
+    if (!v) return -1;
+
+    if (strncmp(v, "true", 4) == 0) {
+        *value = 1;
+    } else if (strncmp(v, "false", 5) == 0) {
+        *value = 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int query_get_param(const char *query, const char *name, char *out, size_t out_len) {
+    size_t name_len = strlen(name);
+    const char *p = query;
+
+    while (p && *p) {
+        if (strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            const char *value = p + name_len + 1;
+            const char *end = strchr(value, '&');
+            size_t len = end ? (size_t)(end - value) : strlen(value);
+            char *raw = malloc(len + 1);
+            if (!raw) return -1;
+
+            memcpy(raw, value, len);
+            raw[len] = '\0';
+            if (len < out_len) {
+                url_decode(out, raw);
+            } else {
+                out[0] = '\0';
+            }
+            free(raw);
+            return len < out_len ? 0 : -1;
+        }
+        p = strchr(p, '&');
+        if (p) p++;
+    }
+    return -1;
+}
+
 /* Internal Functions */
 
 static const char* get_content_type(const char *path) {
     const char *extension = strrchr(path, '.');
     if (!extension) return "text/plain";
     
-    for (int i = 0; content_types[i].extension; i++) {
-        if (strcmp(extension, content_types[i].extension) == 0) {
-            return content_types[i].mime_type;
-        }
+    int index = phash_lookup(&content_type_hash, content_type_keys,
+                             extension, strlen(extension));
+    if (index >= 0) {
+        return content_types[index].mime_type;
     }
     
     return "text/plain";
 }
 
-static void handle_api_request(int socket, const char *path) {
-    char *json = NULL;
-    int success = 0;
-    
-    if (strcmp(path, "/api/metrics") == 0) {
-        json = generate_metrics_json();
-        success = (json != NULL);
-    }
-    else if (strcmp(path, "/api/system") == 0) {
-        json = generate_system_json();
-        success = (json != NULL);
+const char* http_status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 206: return "Partial Content";
+        case 204: return "No Content";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 408: return "Request Timeout";
+        case 409: return "Conflict";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 415: return "Unsupported Media Type";
+        case 416: return "Range Not Satisfiable";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
     }
-    else if (strcmp(path, "/api/network") == 0) {
-        json = generate_network_json();
-        success = (json != NULL);
+}
+
+const char* http_request_header(const http_request *req, const char *name, size_t *len) {
+    size_t name_len = strlen(name);
+    const char *line = req->headers;
+    const char *end = req->headers + req->headers_len;
+
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0) {
+            const char *value = line + name_len + 1;
+            while (value < eol && (*value == ' ' || *value == '\t')) value++;
+            const char *value_end = eol;
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ')) value_end--;
+            if (len) *len = value_end - value;
+            return value;
+        }
+        line = eol + 1;
     }
-    else if (strcmp(path, "/api/firmware") == 0) {
-        json = generate_firmware_json();
-        success = (json != NULL);
+    return NULL;
+}
+
+void response_header(http_response *res, const char *fmt, ...) {
+    size_t room = sizeof(res->headers) - res->headers_len;
+    va_list args;
+
+    va_start(args, fmt);
+    int written = vsnprintf(res->headers + res->headers_len, room, fmt, args);
+    va_end(args);
+
+    if (written < 0 || (size_t)written + 2 >= room) {
+        res->headers[res->headers_len] = '\0';
+        return;
     }
-    else if (strcmp(path, "/api/mqtt/status") == 0) {
-        json = generate_mqtt_status_json(&mqtt_state);
-        success = (json != NULL);
+    res->headers_len += written;
+    res->headers[res->headers_len++] = '\r';
+    res->headers[res->headers_len++] = '\n';
+}
+
+void response_json(http_response *res, int status, char *json) {
+    if (!json) {
+        response_error(res, 500, "Memory allocation error");
+        return;
     }
-    else if (strcmp(path, "/api/mqtt/start") == 0) {
-        success = start_mqtt_broker(&mqtt_state);
-        json = strdup("{ \"success\": true }");
+    res->status = status;
+    res->content_type = "application/json";
+    res->body = json;
+    res->body_len = strlen(json);
+    res->body_static = 0;
+    response_header(res, "Access-Control-Allow-Origin: *");
+}
+
+void response_static(http_response *res, int status, const char *content_type,
+                     const char *body) {
+    res->status = status;
+    res->content_type = content_type;
+    res->body = (char *)body;
+    res->body_len = strlen(body);
+    res->body_static = 1;
+}
+
+void response_error(http_response *res, int status, const char *message) {
+    char *json = malloc(strlen(message) + 16);
+    if (!json) {
+        response_static(res, status, "application/json", "{\"error\":\"Internal error\"}");
+        return;
     }
-    else if (strcmp(path, "/api/mqtt/stop") == 0) {
-        success = stop_mqtt_broker(&mqtt_state);
-        json = strdup("{ \"success\": true }");
+    sprintf(json, "{\"error\":\"%s\"}", message);
+    response_json(res, status, json);
+}
+
+/* Dashboard parts, cached so that concurrent dashboards share one sample */
+
+static char* generate_mqtt_part(void) {
+    return generate_mqtt_status_json(&mqtt_state);
+}
+
+// Sampled by the metrics sampler, which a reader of the part keeps awake
+static char* generate_storage_part(void) {
+    metrics_latest();
+    return storage_json();
+}
+
+static void register_parts(void) {
+    collect_register("metrics", generate_metrics_json, 1000, ROUTE_LIGHT);
+    collect_register("system", generate_system_json, 30000, ROUTE_HEAVY);
+    collect_register("network", generate_network_json, 10000, ROUTE_HEAVY);
+    collect_register("firmware", generate_firmware_json, 300000, ROUTE_HEAVY);
+    collect_register("mqtt", generate_mqtt_part, 0, ROUTE_LIGHT);
+    collect_register("storage", generate_storage_part, 1000, ROUTE_LIGHT);
+}
+
+static void respond_part(http_response *res, const char *name) {
+    collect_value *value = collect_get(name);
+    response_json(res, 200, value ? strndup(value->data, value->len) : NULL);
+    collect_release(value);
+}
+
+/* Request Handlers */
+
+static void api_metrics(http_request *req, http_response *res) {
+    response_header(res, "Vary: Accept");
+    if (metrics_respond(req, res)) return;
+    respond_part(res, "metrics");
+}
+
+static void api_system(http_request *req, http_response *res) {
+    (void)req;
+    respond_part(res, "system");
+}
+
+static void api_storage(http_request *req, http_response *res) {
+    (void)req;
+    respond_part(res, "storage");
+}
+
+static void api_network(http_request *req, http_response *res) {
+    (void)req;
+    respond_part(res, "network");
+}
+
+static void api_firmware(http_request *req, http_response *res) {
+    (void)req;
+    respond_part(res, "firmware");
+}
+
+static void api_mqtt_status(http_request *req, http_response *res) {
+    (void)req;
+    respond_part(res, "mqtt");
+}
+
+static void api_mqtt_start(http_request *req, http_response *res) {
+    (void)req;
+    int success = start_mqtt_broker(&mqtt_state);
+    response_json(res, 200, strdup(success ? "{ \"success\": true }" : "{ \"success\": false }"));
+}
+
+static void api_mqtt_stop(http_request *req, http_response *res) {
+    (void)req;
+    int success = stop_mqtt_broker(&mqtt_state);
+    response_json(res, 200, strdup(success ? "{ \"success\": true }" : "{ \"success\": false }"));
+}
+
+static void api_not_found(http_request *req, http_response *res) {
+    (void)req;
+    response_error(res, 404, "The requested API was not found");
+}
+
+// The rendered static shell, shared by the responses still sending it and
+// rendered again once a reload has changed the templates
+typedef struct {
+    int refs;
+    unsigned generation;
+    http_response res;
+} shell_page;
+
+static shell_page *index_shell = NULL;
+
+static void shell_release(void *ctx) {
+    shell_page *page = ctx;
+    if (--page->refs > 0) return;
+    response_free(&page->res);
+    free(page);
+}
+
+static void handle_index(http_request *req, http_response *res) {
+    char command[MAX_COMMAND_SIZE] = {0};
+    char *cmd_output = NULL;
+    int exit_status = 0;
+
+    parse_query_params(req->query, command, sizeof(command));
+
+    // The shell is the same for everyone; /api/batch fills it in on the client
+    if (server_cfg.static_shell && !command[0]) {
+        unsigned generation = assets_generation();
+        if (!index_shell || index_shell->generation != generation) {
+            shell_page *fresh = calloc(1, sizeof(*fresh));
+            if (!fresh) {
+                response_error(res, 500, "Memory allocation error");
+                return;
+            }
+            fresh->refs = 1;
+            fresh->generation = generation;
+            render_template(&fresh->res, "", 1);
+            if (index_shell) shell_release(index_shell);
+            index_shell = fresh;
+        }
+        response_static(res, index_shell->res.status, index_shell->res.content_type,
+                        index_shell->res.body);
+        index_shell->refs++;
+        res->body_release = shell_release;
+        res->body_release_ctx = index_shell;
+        return;
     }
-    
-    if (success && json) {
-        char *response = malloc(strlen(json) + 256);
-        if (!response) {
-            free(json);
-            char error_response[] = 
-                "HTTP/1.1 500 Internal Server Error\r\n"
-                "Content-Type: application/json\r\n"
-                "Content-Length: 35\r\n"
-                "\r\n"
-                "{\"error\":\"Memory allocation error\"}";
-            
-            send(socket, error_response, strlen(error_response), 0);
-            return;
+
+    // Execute command if provided
+    if (command[0]) {
+        if (strcmp(command, "help") == 0) {
+            cmd_output = strdup(
+                "Common OpenWRT Commands:\n\n"
+                "System Information:\n"
+                "  cat /etc/openwrt_release    - Show OpenWRT version\n"
+                "  uname -a                    - Show kernel information\n"
+                "  uptime                      - Show system uptime\n"
+                "  top                         - Show running processes\n"
+                "  free                        - Show memory usage\n"
+                "  df -h                       - Show disk usage\n\n"
+                "Network Commands:\n"
+                "  ifconfig                    - Show network interfaces\n"
+                "  iwconfig                    - Show wireless interfaces\n"
+                "  route -n                    - Show routing table\n"
+                "  ip addr                     - Show IP addresses\n"
+                "  cat /etc/config/network     - Show network configuration\n"
+                "  cat /etc/config/wireless    - Show wireless configuration\n"
+                "  ping [host]                 - Test network connectivity\n\n"
+                "Service Management:\n"
+                "  /etc/init.d/[service] [start|stop|restart|status]\n"
+                "  Examples: /etc/init.d/network restart, /etc/init.d/firewall status\n\n"
+                "Firewall:\n"
+                "  iptables -L -n              - List firewall rules\n"
+                "  cat /etc/config/firewall    - Show firewall configuration\n\n"
+                "Advanced:\n"
+                "  logread                     - Show system logs\n"
+                "  ps                          - List running processes\n"
+            );
+            exit_status = 0;
+        } else {
+            cmd_output = execute_command(command, &exit_status);
         }
-        
-        sprintf(response,
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: application/json\r\n"
-            "Access-Control-Allow-Origin: *\r\n"
-            "Content-Length: %zu\r\n"
-            "\r\n"
-            "%s", strlen(json), json);
-        
-        send(socket, response, strlen(response), 0);
-        
-        free(json);
-        free(response);
-    }
-    else {
-        char error_response[] = 
-            "HTTP/1.1 404 Not Found\r\n"
-            "Content-Type: application/json\r\n"
-            "Access-Control-Allow-Origin: *\r\n"
-            "Content-Length: 44\r\n"
-            "\r\n"
-            "{\"error\":\"The requested API was not found\"}";
-        
-        send(socket, error_response, strlen(error_response), 0);
+        term_record(req, res, command, cmd_output, exit_status);
     }
+
+    render_template(res, req->client_ip, 0);
+
+    if (cmd_output) free(cmd_output);
+}
+
+static void register_routes(router *r) {
+    router_add(r, HTTP_GET, "/", handle_index, CACHE_NO_STORE);
+    router_add(r, HTTP_GET, "/index.html", handle_index, CACHE_NO_STORE);
+
+    router_add(r, HTTP_GET, "/api/metrics", api_metrics, CACHE_NO_STORE);
+    router_add(r, HTTP_GET, "/api/system", api_system, CACHE_NO_STORE);
+    router_add(r, HTTP_GET, "/api/network", api_network, CACHE_NO_STORE);
+    router_add(r, HTTP_GET, "/api/storage", api_storage, CACHE_NO_STORE);
+    router_add(r, HTTP_GET, "/api/firmware", api_firmware, CACHE_NO_STORE);
+    router_add(r, HTTP_GET, "/api/mqtt/status", api_mqtt_status, CACHE_NO_STORE);
+    router_add(r, HTTP_GET | HTTP_POST, "/api/mqtt/start", api_mqtt_start, CACHE_NO_STORE);
+    router_add(r, HTTP_GET | HTTP_POST, "/api/mqtt/stop", api_mqtt_stop, CACHE_NO_STORE);
+    router_set_class(r, "/api/metrics", ROUTE_LIGHT);
+    // A cache miss forks the collectors' commands and waits for them
+    router_set_class(r, "/api/system", ROUTE_HEAVY);
+    router_set_class(r, "/api/network", ROUTE_HEAVY);
+    router_set_class(r, "/api/firmware", ROUTE_HEAVY);
+    metrics_register_routes(r);
+    proc_register_routes(r);
+    logs_register_routes(r);
+    uci_register_routes(r);
+    term_register_routes(r);
+    collect_register_routes(r);
+    backup_register_routes(r);
+    firmware_register_routes(r);
+    fleet_register_routes(r);
+    flight_register_routes(r);
+    history_register_routes(r);
+    router_add(r, HTTP_GET | HTTP_HEAD | HTTP_POST | HTTP_PUT | HTTP_DELETE,
+               "/api/*", api_not_found, CACHE_NO_STORE);
+
+    router_add(r, HTTP_GET, "/css/*", handle_static_file, CACHE_REVALIDATE);
+    router_add(r, HTTP_GET, "/js/*", handle_static_file, CACHE_REVALIDATE);
+    router_add(r, HTTP_GET, "/img/*", handle_static_file, CACHE_REVALIDATE);
+    router_set_class(r, "/css/*", ROUTE_LIGHT);
+    router_set_class(r, "/js/*", ROUTE_LIGHT);
+    router_set_class(r, "/img/*", ROUTE_LIGHT);
 }
 
 /* Internal Functions Continued */
 
-static void handle_static_file(int socket, const char *path) {
+static void handle_static_file(http_request *req, http_response *res) {
     char file_path[MAX_PATH_LENGTH];
+    const char *path = req->path;
     
     // Skip leading / in path if present
     if (path[0] == '/') path++;
@@ -937,59 +1446,87 @@ static void handle_static_file(int socket, const char *path) {
         snprintf(file_path, MAX_PATH_LENGTH, "%s/index.html", server_cfg.template_dir);
     }
     
-    // Try to open the file
-    size_t file_size;
-    char *file_content = read_file(file_path, &file_size);
-    
-    if (!file_content) {
-        // File not found or error reading
-        char not_found[] = 
-            "HTTP/1.1 404 Not Found\r\n"
-            "Content-Type: text/html\r\n"
-            "Content-Length: 121\r\n"
-            "\r\n"
-            "<html><head><title>404 Not Found</title></head><body><h1>404 Not Found</h1><p>The requested file was not found.</p></body></html>";
-        
-        send(socket, not_found, strlen(not_found), 0);
+    asset file;
+    if (asset_open_file(file_path, &file) < 0) {
+        // File not found in the bundle or the override directory
+        response_static(res, 404, "text/html",
+            "<html><head><title>404 Not Found</title></head><body><h1>404 Not Found</h1><p>The requested file was not found.</p></body></html>");
         return;
     }
     
-    // Determine the content type
-    const char *content_type = get_content_type(file_path);
-    
-    // Prepare the response header
-    char header[256];
-    snprintf(header, sizeof(header),
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %zu\r\n"
-        "\r\n", content_type, file_size);
-    
-    // Send the header
-    send(socket, header, strlen(header), 0);
-    
-    // Send the file content
-    send(socket, file_content, file_size, 0);
-    
-    // Clean up
-    free(file_content);
+    // Ranges are served from the identity encoding, which is what clients resume
+    const char *accept_encoding = http_request_header(req, "Accept-Encoding", NULL);
+    int use_gzip = file.gzip && accept_encoding && strstr(accept_encoding, "gzip") &&
+                   !http_request_header(req, "Range", NULL);
+
+    // Each encoding is its own representation and gets its own strong tag, so
+    // neither a 304 nor If-Range can match one against the other
+    char etag[ASSET_ETAG_SIZE + 3];
+    size_t etag_len = strlen(file.etag);
+    if (use_gzip && etag_len >= 2) {
+        snprintf(etag, sizeof(etag), "%.*s-gz\"", (int)etag_len - 1, file.etag);
+    } else {
+        snprintf(etag, sizeof(etag), "%s", file.etag);
+    }
+
+    response_header(res, "ETag: %s", etag);
+    if (file.gzip) response_header(res, "Vary: Accept-Encoding");
+    // Fingerprinted names change with their content, so they never need revalidating
+    if (file.immutable) res->cache_control = cache_policy_header(CACHE_IMMUTABLE);
+
+    const char *if_none_match = http_request_header(req, "If-None-Match", NULL);
+    if (if_none_match && strncmp(if_none_match, etag, strlen(etag)) == 0) {
+        res->status = 304;
+        asset_close(&file);
+        return;
+    }
+
+    res->status = 200;
+    res->content_type = get_content_type(file_path);
+    res->accept_ranges = 1;
+
+    if (use_gzip) {
+        response_header(res, "Content-Encoding: gzip");
+        res->body = (char *)file.gzip;
+        res->body_len = file.gzip_len;
+        res->body_static = 1;
+    } else if (file.fd >= 0) {
+        // Override files go out with sendfile(); the response takes the descriptor
+        res->body_file = 1;
+        res->body_fd = file.fd;
+        res->body_len = file.len;
+        file.fd = -1;
+    } else {
+        res->body = (char *)file.data;
+        res->body_len = file.len;
+        res->body_static = 1;
+    }
+
+    // A reloaded snapshot stays around until the response is done with it
+    if (!res->body_file) {
+        res->body_release = asset_release;
+        res->body_release_ctx = asset_retain(&file);
+    }
+    asset_close(&file);
 }
 
-static void render_template(char *buffer, const char *client_ip, 
-                          const char *command, const char *cmd_output, 
-                          int exit_status) {
-    // Read the template file
-    size_t template_size;
+// Text placeholders go into the page HTML-escaped, cut short like snprintf() when out of room
+static int put_html(char *out, int room, const char *text) {
+    char *escaped = escape_html_dup(text, strlen(text));
+    int written = snprintf(out, room, "%s", escaped ? escaped : "");
+    free(escaped);
+    return written < room ? written : room - 1;
+}
+
+static void render_template(http_response *res, const char *client_ip, int shell) {
+    // Load the template from the bundle
     char template_path[MAX_PATH_LENGTH];
     snprintf(template_path, MAX_PATH_LENGTH, "%s/index.html", server_cfg.template_dir);
-    char *template = read_file(template_path, &template_size);
+    asset template;
     
-    if (!template) {
+    if (asset_open(template_path, &template) < 0) {
         // Template not found, use a basic HTML response
-        sprintf(buffer,
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/html\r\n"
-            "\r\n"
+        response_static(res, 200, "text/html",
             "<html><head><title>Error</title></head><body>"
             "<h1>Template Error</h1>"
             "<p>Could not load the template file.</p>"
@@ -1000,35 +1537,32 @@ static void render_template(char *buffer, const char *client_ip,
     
     // Get current time for server time display
     time_t now;
+    char time_buf[32];
     time(&now);
-    char *time_str = ctime(&now);
+    char *time_str = ctime_r(&now, time_buf);
     // Remove trailing newline from time string
     if (time_str[strlen(time_str) - 1] == '\n') {
         time_str[strlen(time_str) - 1] = '\0';
     }
     
-    // Get system information
-    char *system_info = get_system_info();
-    char *network_info = get_network_info();
-    char *openwrt_version = get_openwrt_version();
-    char *kernel_version = get_kernel_version();
-    char *uptime = get_uptime();
+    // Get system information; a static shell leaves it all to hydration
+    char *system_info = shell ? strdup("") : get_system_info();
+    char *network_info = shell ? strdup("") : get_network_info();
+    char *openwrt_version = shell ? strdup("") : get_openwrt_version();
+    char *kernel_version = shell ? strdup("") : get_kernel_version();
+    char *uptime = shell ? strdup("") : get_uptime();
+    if (shell) time_str = "";
     
     // Create a new string buffer for the processed template
     char *processed = malloc(TEMPLATE_MAX_SIZE);
     if (!processed) {
-        free(template);
-        sprintf(buffer, 
-            "HTTP/1.1 500 Internal Server Error\r\n"
-            "Content-Type: text/plain\r\n"
-            "\r\n"
-            "Memory allocation error"
-        );
+        asset_close(&template);
+        response_static(res, 500, "text/plain", "Memory allocation error");
         return;
     }
     
     // Simple template replacement
-    char *pos = template;
+    const char *pos = template.data;
     char *write_pos = processed;
     int remaining = TEMPLATE_MAX_SIZE - 1;
     
@@ -1053,10 +1587,10 @@ static void render_template(char *buffer, const char *client_ip,
             int written = 0;
             
             if (strcmp(trim, "client_ip") == 0) {
-                written = snprintf(write_pos, remaining, "%s", client_ip);
+                written = put_html(write_pos, remaining, client_ip);
             }
             else if (strcmp(trim, "server_time") == 0) {
-                written = snprintf(write_pos, remaining, "%s", time_str);
+                written = put_html(write_pos, remaining, time_str);
             }
             else if (strcmp(trim, "system_info") == 0) {
                 written = snprintf(write_pos, remaining, "%s", system_info);
@@ -1065,15 +1599,19 @@ static void render_template(char *buffer, const char *client_ip,
                 written = snprintf(write_pos, remaining, "%s", network_info);
             }
             else if (strcmp(trim, "openwrt_version") == 0) {
-                written = snprintf(write_pos, remaining, "%s", openwrt_version);
+                written = put_html(write_pos, remaining, openwrt_version);
             }
             else if (strcmp(trim, "kernel_version") == 0) {
-                written = snprintf(write_pos, remaining, "%s", kernel_version);
+                written = put_html(write_pos, remaining, kernel_version);
             }
             else if (strcmp(trim, "uptime") == 0) {
-                written = snprintf(write_pos, remaining, "%s", uptime);
+                written = put_html(write_pos, remaining, uptime);
+            }
+            else if (strcmp(trim, "shell_mode") == 0) {
+                written = snprintf(write_pos, remaining, "%d", shell);
             }
             else if (strcmp(trim, "#terminal_history") == 0) {
+                // Loaded by the page from /api/terminal/history
                 written = 0;
             }
             else {
@@ -1093,77 +1631,20 @@ static void render_template(char *buffer, const char *client_ip,
     
     *write_pos = '\0';
     
-    // Add terminal history if room
-    if (history_count > 0 && strstr(processed, "terminal-body") != NULL) {
-        char *terminal_body_end = strstr(processed, "</div>\n        <form");
-        if (terminal_body_end) {
-            char history_html[4096] = {0};
-            char *p = history_html;
-            int remaining_history = sizeof(history_html) - 1;
-            
-            for (int i = 0; i < history_count && remaining_history > 0; i++) {
-                int written = snprintf(p, remaining_history, 
-                    "            <div class=\"terminal-prompt\">$ %s</div>\n", 
-                    command_history[i]);
-                
-                if (written > 0) {
-                    p += written;
-                    remaining_history -= written;
-                }
-                
-                if (i == history_count - 1 && command && strcmp(command, command_history[i]) == 0 && cmd_output) {
-                    written = snprintf(p, remaining_history,
-                        "            <div class=\"command-output %s\">%s</div>\n",
-                        exit_status == 0 ? "command-success" : "command-error",
-                        cmd_output);
-                    
-                    if (written > 0) {
-                        p += written;
-                        remaining_history -= written;
-                    }
-                }
-            }
-            
-            if (command && command[0] && cmd_output && 
-                (history_count == 0 || strcmp(command, command_history[history_count-1]) != 0)) {
-                int written = snprintf(p, remaining_history,
-                    "            <div class=\"terminal-prompt\">$ %s</div>\n"
-                    "            <div class=\"command-output %s\">%s</div>\n",
-                    command, 
-                    exit_status == 0 ? "command-success" : "command-error",
-                    cmd_output);
-                
-                if (written > 0) {
-                    p += written;
-                    remaining_history -= written;
-                }
-            }
-            
-            size_t history_len = strlen(history_html);
-            size_t insert_pos = terminal_body_end - processed;
-            
-            if (insert_pos + history_len < TEMPLATE_MAX_SIZE) {
-                memmove(processed + insert_pos + history_len, processed + insert_pos, 
-                        strlen(processed + insert_pos) + 1);
-                memcpy(processed + insert_pos, history_html, history_len);
-            }
-        }
-    }
-    
-    // Prepare the HTTP response
-    sprintf(buffer,
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: text/html\r\n"
-        "Content-Length: %zu\r\n"
-        "\r\n"
-        "%s",
-        strlen(processed), processed);
+    // Hand the page to the response
+    res->status = 200;
+    res->content_type = "text/html";
+    res->body = processed;
+    res->body_len = strlen(processed);
+    res->body_static = 0;
     
     // Clean up
-    free(template);
-    free(processed);
+    asset_close(&template);
     free(system_info);
     free(network_info);
+    free(openwrt_version);
+    free(kernel_version);
+    free(uptime);
 }
 
 static void parse_query_params(const char *query, char *command, size_t cmd_len) {
@@ -23,11 +23,27 @@
 #include <sys/wait.h>
 
 #define DEFAULT_PORT 5000
+#define DEFAULT_TLS_PORT 5443
 #define BUFFER_SIZE 65536
 #define MAX_COMMAND_SIZE 2048
-#define MAX_HISTORY 10
+// A command still running after this long is killed, along with anything it started
+#define COMMAND_TIMEOUT_MS 10000
 #define MAX_PATH_LENGTH 256
 #define TEMPLATE_MAX_SIZE 65536
+#define DEFAULT_MAX_CONNECTIONS 64
+#define DEFAULT_MAX_CONNECTIONS_PER_IP 8
+#define DEFAULT_LISTEN_BACKLOG 64
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_BODY_TIMEOUT 30
+#define DEFAULT_KEEPALIVE_TIMEOUT 15
+#define DEFAULT_WRITE_TIMEOUT 30
+#define MAX_URI_LENGTH 8192
+#define MAX_ROUTE_PARAMS 4
+#define MAX_RESPONSE_HEADERS 1024
+#define STREAM_CHUNK_SIZE 16384
+#define BODY_CHUNK_SIZE 16384
+#define LINGER_DRAIN_LIMIT 262144
+#define STREAM_WAIT (-2)
 
 typedef struct {
     float cpu_usage;
@@ -61,14 +77,139 @@ typedef struct {
     int port;
     char *web_root;
     char *template_dir;
+    // Files here override the assets compiled into the binary (development)
+    char *asset_dir;
+    // Connection admission and deadlines (seconds); zero selects the default
+    int max_connections;
+    int max_connections_per_ip;
+    int listen_backlog;
+    int header_timeout;
+    int body_timeout;
+    int keepalive_timeout;
+    int write_timeout;
+    // Stay on epoll even where io_uring is available
+    int force_epoll;
+    // Serve index.html as a cached shell that /api/batch hydrates in the browser
+    int static_shell;
+    // System log for /api/logs; NULL selects LOG_DEFAULT_FILE
+    char *log_file;
+    // UCI configuration for /api/config; NULL selects UCI_DEFAULT_DIR
+    char *config_dir;
+    // Bytes of terminal history kept across sessions; zero selects TERM_MEMORY_DEFAULT
+    size_t terminal_memory;
+    // Per-client rate limits in percent of the defaults; zero selects 100, negative turns them off
+    int rate_limit;
+    // Peers to aggregate under /api/fleet, one per line; NULL for none
+    char *fleet_file;
+    // Ring file that keeps metrics history across restarts; NULL for none
+    char *history_file;
+    // Seconds between syncs of the history file; zero selects HISTORY_SYNC_DEFAULT
+    int history_sync;
+    // Niceness added to commands, their address space limit in megabytes
+    // and the cgroup they run in; zero or NULL for none
+    int runner_nice;
+    int runner_memory;
+    char *runner_cgroup;
+    // HTTPS listener: PEM certificate chain and key (NULL for the certificate
+    // file), on tls_port; no HTTPS without a certificate
+    char *tls_cert;
+    char *tls_key;
+    int tls_port;
 } server_config;
 
+typedef struct {
+    unsigned method;
+    char method_name[16];
+    char uri[MAX_URI_LENGTH];
+    char *path;
+    char *query;
+    const char *headers;
+    size_t headers_len;
+    const char *body;
+    size_t body_len;
+    size_t content_length;
+    int keep_alive;
+    char client_ip[INET6_ADDRSTRLEN];
+    char *params[MAX_ROUTE_PARAMS];
+    int param_count;
+    char param_buf[MAX_PATH_LENGTH];
+    int socket;
+} http_request;
+
+typedef struct {
+    int status;
+    const char *content_type;
+    const char *cache_control;
+    char headers[MAX_RESPONSE_HEADERS];
+    size_t headers_len;
+    char *body;
+    size_t body_len;
+    // Bytes of body (or of body_fd when body_file is set) skipped before sending
+    size_t body_offset;
+    int body_static;
+    // File-backed bodies are sent with sendfile() and closed afterwards
+    int body_file;
+    int body_fd;
+    // Called by response_free() for a body borrowed from something refcounted
+    void (*body_release)(void *ctx);
+    void *body_release_ctx;
+    int head_only;
+    int accept_ranges;
+    // Streamed bodies are pulled chunk by chunk; return 0 at the end, -1 to abort,
+    // or STREAM_WAIT to be called again after stream_wait_ms, or sooner when
+    // conn_wake() is given a non-NULL stream_wait_key
+    ssize_t (*stream)(void *ctx, char *buf, size_t len);
+    void (*stream_free)(void *ctx);
+    void *stream_ctx;
+    int stream_wait_ms;
+    const void *stream_wait_key;
+} http_response;
+
 int server_init(server_config *config);
 
 void server_run(int server_fd);
 
 void server_cleanup(int server_fd);
 
+/* HTTP helpers shared by the request handlers */
+
+int http_parse_request(char *buffer, size_t length, http_request *req);
+
+int http_format_head(const http_response *res, int keep_alive, char *out, size_t len);
+
+void response_free(http_response *res);
+
+const char* http_status_text(int status);
+
+const char* http_request_header(const http_request *req, const char *name, size_t *len);
+
+void response_header(http_response *res, const char *fmt, ...);
+
+void response_json(http_response *res, int status, char *json);
+
+void response_static(http_response *res, int status, const char *content_type,
+                     const char *body);
+
+void response_error(http_response *res, int status, const char *message);
+
+/* Utility functions */
+
+char* execute_command(const char *command, int *exit_status);
+
+char* json_escape_string(const char *str);
+
+void url_decode(char *dst, const char *src);
+
+char* read_file(const char *path, size_t *size);
+
+int file_exists(const char *path);
+
+int json_get_string(const char *json, const char *key, char *out, size_t out_len);
+
+int json_get_bool(const char *json, const char *key, int *value);
+
+int query_get_param(const char *query, const char *name, char *out, size_t out_len);
+
 
 
 
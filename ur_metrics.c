@@ -0,0 +1,474 @@
+#define _GNU_SOURCE
+#include "ur_metrics.h"
+#include "ur_timer.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/*
+ * Metric samples are taken at most once a second whatever the number of
+ * clients and kept in a short numbered history, so any recent sample can
+ * serve as the base of a delta. A poller acknowledges what it has by
+ * passing the last seq back as ?since=; a stream over TCP bases each frame
+ * on the previous one. Either way a keyframe goes out when the base is
+ * gone or every METRICS_KEYFRAME_INTERVAL frames, so a client that lost
+ * track resynchronises on its own.
+ *
+ * The sampler (connectivity probes, statvfs on every mount) can block, so
+ * it runs on a thread of its own once a second for as long as somebody
+ * keeps reading, and sleeps after METRICS_IDLE_MS without a reader. Each
+ * finished sample is handed to the loop thread through an eventfd, which
+ * appends it to the history under sampler_lock; readers just take the
+ * newest entry, from the heavy worker as well as the loop.
+ */
+
+#define METRICS_FRAME_MAX 1024
+#define METRICS_SAVE_MAGIC 0x75726d68
+
+static const char *field_names[METRIC_FIELD_COUNT] = {
+    "cpu.usage",
+    "memory.total",
+    "memory.used",
+    "memory.usage",
+    "storage.total",
+    "storage.used",
+    "storage.free",
+    "storage.usage",
+    "bandwidth.download",
+    "bandwidth.upload",
+    "internet.connected",
+    "ultima_server.connected",
+    "storage.max_usage",
+    "disk.read_rate",
+    "disk.write_rate",
+    "disk.util"
+};
+
+static metrics_sampler sampler = NULL;
+static metrics_sample history[METRICS_HISTORY];
+static uint32_t next_seq = 1;
+static uint64_t sampled_at = 0;
+
+// Hand-off between the sampler thread and the loop
+static pthread_mutex_t sampler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sampler_wake = PTHREAD_COND_INITIALIZER;
+static uint64_t wanted_at = 0;
+static double taken_values[METRIC_FIELD_COUNT];
+static uint64_t taken_time_ms = 0;
+static int taken = 0;
+static int sampler_running = 0;
+static int done_fd = -1;
+static event_handler done_io;
+
+void metrics_init(metrics_sampler fill) {
+    sampler = fill;
+}
+
+static uint64_t wall_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Under sampler_lock
+static void history_append(const double *values, uint64_t time_ms) {
+    metrics_sample *sample = &history[next_seq % METRICS_HISTORY];
+
+    memcpy(sample->values, values, sizeof(sample->values));
+    sample->time_ms = time_ms;
+    sample->seq = next_seq++;
+    sampled_at = monotonic_ms();
+}
+
+static void take_sample(double *values) {
+    memset(values, 0, sizeof(double) * METRIC_FIELD_COUNT);
+    if (sampler) sampler(values);
+}
+
+static void* sampler_main(void *arg) {
+    (void)arg;
+    double values[METRIC_FIELD_COUNT];
+    uint64_t one = 1;
+
+    for (;;) {
+        pthread_mutex_lock(&sampler_lock);
+        while (monotonic_ms() - wanted_at > METRICS_IDLE_MS) {
+            pthread_cond_wait(&sampler_wake, &sampler_lock);
+        }
+        pthread_mutex_unlock(&sampler_lock);
+
+        uint64_t started = monotonic_ms();
+        take_sample(values);
+        uint64_t time_ms = wall_clock_ms();
+
+        pthread_mutex_lock(&sampler_lock);
+        memcpy(taken_values, values, sizeof(taken_values));
+        taken_time_ms = time_ms;
+        taken = 1;
+        pthread_mutex_unlock(&sampler_lock);
+        if (write(done_fd, &one, sizeof(one)) < 0) perror("metrics: eventfd");
+
+        uint64_t spent = monotonic_ms() - started;
+        if (spent < METRICS_SAMPLE_MS) usleep((METRICS_SAMPLE_MS - spent) * 1000);
+    }
+    return NULL;
+}
+
+static void sample_done(void *data, unsigned events) {
+    (void)data;
+    (void)events;
+    uint64_t count;
+
+    while (read(done_fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+
+    pthread_mutex_lock(&sampler_lock);
+    if (taken) history_append(taken_values, taken_time_ms);
+    taken = 0;
+    pthread_mutex_unlock(&sampler_lock);
+}
+
+void metrics_start(event_loop *loop) {
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    done_io.callback = sample_done;
+    if (done_fd < 0 || event_add(loop, done_fd, EVENT_READ, &done_io) < 0) {
+        perror("metrics: sampler");
+        if (done_fd >= 0) close(done_fd);
+        done_fd = -1;
+        return;
+    }
+
+    // The first sample is taken right away; until it is in, readers get zeros
+    wanted_at = monotonic_ms();
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, sampler_main, NULL) != 0) {
+        perror("metrics: sampler");
+        event_del(loop, done_fd, &done_io);
+        close(done_fd);
+        done_fd = -1;
+    } else {
+        sampler_running = 1;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+const metrics_sample* metrics_latest(void) {
+    uint64_t now = monotonic_ms();
+    const metrics_sample *latest;
+
+    pthread_mutex_lock(&sampler_lock);
+    if (!sampler_running) {
+        if (next_seq == 1 || now - sampled_at >= METRICS_SAMPLE_MS) {
+            double values[METRIC_FIELD_COUNT];
+            take_sample(values);
+            history_append(values, wall_clock_ms());
+        }
+    } else {
+        if (now - wanted_at > METRICS_IDLE_MS) pthread_cond_signal(&sampler_wake);
+        wanted_at = now;
+    }
+    latest = &history[(next_seq - 1) % METRICS_HISTORY];
+    pthread_mutex_unlock(&sampler_lock);
+    return latest;
+}
+
+const metrics_sample* metrics_find(uint32_t seq) {
+    const metrics_sample *sample = &history[seq % METRICS_HISTORY];
+    return seq && sample->seq == seq ? sample : NULL;
+}
+
+const char* metrics_field_name(metric_field field) {
+    return field_names[field];
+}
+
+int metrics_field_lookup(const char *name, size_t len) {
+    for (int i = 0; i < METRIC_FIELD_COUNT; i++) {
+        if (strlen(field_names[i]) == len && memcmp(field_names[i], name, len) == 0) return i;
+    }
+    return -1;
+}
+
+/* Handover */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t history;
+    uint32_t fields;
+    uint32_t next_seq;
+    // Monotonic, so it still holds in the next process
+    uint64_t sampled_at;
+} saved_header;
+
+int metrics_save(int fd) {
+    saved_header head = { METRICS_SAVE_MAGIC, METRICS_HISTORY, METRIC_FIELD_COUNT, next_seq, sampled_at };
+
+    if (pwrite(fd, &head, sizeof(head), 0) != sizeof(head)) return -1;
+    if (pwrite(fd, history, sizeof(history), sizeof(head)) != sizeof(history)) return -1;
+    return 0;
+}
+
+int metrics_restore(int fd) {
+    saved_header head;
+
+    if (pread(fd, &head, sizeof(head), 0) != sizeof(head) || head.magic != METRICS_SAVE_MAGIC ||
+        head.history != METRICS_HISTORY || head.fields != METRIC_FIELD_COUNT) {
+        return -1;
+    }
+    if (pread(fd, history, sizeof(history), sizeof(head)) != sizeof(history)) {
+        memset(history, 0, sizeof(history));
+        return -1;
+    }
+
+    // Sequence numbers carry on, so ?since= and stream bases stay valid
+    next_seq = head.next_seq;
+    sampled_at = head.sampled_at;
+    return 0;
+}
+
+/* Frame encoding */
+
+typedef struct {
+    uint8_t *out;
+    size_t len;
+    size_t pos;
+} frame_writer;
+
+static void put(frame_writer *w, const void *data, size_t len) {
+    if (w->pos + len <= w->len) memcpy(w->out + w->pos, data, len);
+    w->pos += len;
+}
+
+static void put_text(frame_writer *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void put_text(frame_writer *w, const char *fmt, ...) {
+    char text[64];
+    va_list args;
+
+    va_start(args, fmt);
+    int n = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    if (n > 0) put(w, text, n < (int)sizeof(text) ? (size_t)n : sizeof(text) - 1);
+}
+
+// Integral values are sent as integers; the rest only carry one decimal anyway
+static int is_integral(double v) {
+    return v > -9007199254740992.0 && v < 9007199254740992.0 && v == (double)(int64_t)v;
+}
+
+static void cbor_head(frame_writer *w, uint8_t major, uint64_t value) {
+    uint8_t head[9];
+    size_t len;
+
+    head[0] = major << 5;
+    if (value < 24) {
+        head[0] |= value;
+        len = 1;
+    } else if (value <= 0xff) {
+        head[0] |= 24;
+        head[1] = value;
+        len = 2;
+    } else if (value <= 0xffff) {
+        head[0] |= 25;
+        head[1] = value >> 8;
+        head[2] = value;
+        len = 3;
+    } else if (value <= 0xffffffffu) {
+        head[0] |= 26;
+        for (int i = 0; i < 4; i++) head[1 + i] = value >> (24 - 8 * i);
+        len = 5;
+    } else {
+        head[0] |= 27;
+        for (int i = 0; i < 8; i++) head[1 + i] = value >> (56 - 8 * i);
+        len = 9;
+    }
+    put(w, head, len);
+}
+
+static void cbor_number(frame_writer *w, double v) {
+    if (is_integral(v)) {
+        int64_t i = (int64_t)v;
+        if (i >= 0) {
+            cbor_head(w, 0, (uint64_t)i);
+        } else {
+            cbor_head(w, 1, (uint64_t)(-1 - i));
+        }
+        return;
+    }
+
+    // Single precision: plenty for one decimal
+    union { float f; uint32_t u; } bits = { .f = (float)v };
+    uint8_t out[5] = { 0xfa, bits.u >> 24, bits.u >> 16, bits.u >> 8, bits.u };
+    put(w, out, sizeof(out));
+}
+
+static void json_number(frame_writer *w, double v) {
+    if (is_integral(v)) {
+        put_text(w, "%lld", (long long)v);
+    } else {
+        put_text(w, "%.1f", v);
+    }
+}
+
+// Returns the frame length, or 0 if it does not fit
+static size_t encode_frame(int cbor, const metrics_sample *cur, const metrics_sample *base,
+                           uint8_t *out, size_t len) {
+    frame_writer w = { out, len, 0 };
+    int changed[METRIC_FIELD_COUNT];
+    int count = 0;
+
+    for (int i = 0; i < METRIC_FIELD_COUNT; i++) {
+        changed[i] = !base || cur->values[i] != base->values[i];
+        count += changed[i];
+    }
+
+    if (cbor) {
+        cbor_head(&w, 5, base ? 4 : 3);
+        cbor_head(&w, 0, METRICS_KEY_SEQ);
+        cbor_head(&w, 0, cur->seq);
+        if (base) {
+            cbor_head(&w, 0, METRICS_KEY_BASE);
+            cbor_head(&w, 0, base->seq);
+        }
+        cbor_head(&w, 0, METRICS_KEY_TIME);
+        cbor_head(&w, 0, cur->time_ms);
+        cbor_head(&w, 0, METRICS_KEY_FIELDS);
+        cbor_head(&w, 5, count);
+        for (int i = 0; i < METRIC_FIELD_COUNT; i++) {
+            if (!changed[i]) continue;
+            cbor_head(&w, 0, i);
+            cbor_number(&w, cur->values[i]);
+        }
+    } else {
+        put_text(&w, "{\"seq\":%u,", cur->seq);
+        if (base) put_text(&w, "\"base\":%u,", base->seq);
+        put_text(&w, "\"time\":%llu,\"fields\":{", (unsigned long long)cur->time_ms);
+        int first = 1;
+        for (int i = 0; i < METRIC_FIELD_COUNT; i++) {
+            if (!changed[i]) continue;
+            put_text(&w, "%s\"%s\":", first ? "" : ",", field_names[i]);
+            json_number(&w, cur->values[i]);
+            first = 0;
+        }
+        put(&w, "}}", 2);
+    }
+
+    return w.pos <= len ? w.pos : 0;
+}
+
+static int accepts_cbor(const http_request *req) {
+    size_t len;
+    const char *accept = http_request_header(req, "Accept", &len);
+    return accept && memmem(accept, len, "application/cbor", 16) != NULL;
+}
+
+// The delta base for a client holding sample since, or NULL for a keyframe
+static const metrics_sample* delta_base(const metrics_sample *cur, uint32_t since) {
+    const metrics_sample *base = metrics_find(since);
+    if (!base || cur->seq - base->seq > METRICS_KEYFRAME_INTERVAL) return NULL;
+    return base;
+}
+
+int metrics_respond(http_request *req, http_response *res) {
+    char since_param[16];
+    int cbor = accepts_cbor(req);
+    int delta = query_get_param(req->query, "since", since_param, sizeof(since_param)) == 0;
+
+    if (!cbor && !delta) return 0;
+
+    const metrics_sample *cur = metrics_latest();
+    const metrics_sample *base = delta ? delta_base(cur, strtoul(since_param, NULL, 10)) : NULL;
+
+    uint8_t *frame = malloc(METRICS_FRAME_MAX);
+    size_t len = frame ? encode_frame(cbor, cur, base, frame, METRICS_FRAME_MAX) : 0;
+    if (!len) {
+        free(frame);
+        response_error(res, 500, "Could not encode metrics");
+        return 1;
+    }
+
+    res->status = 200;
+    res->content_type = cbor ? "application/cbor" : "application/json";
+    res->body = (char *)frame;
+    res->body_len = len;
+    res->body_static = 0;
+    return 1;
+}
+
+/* Stream of frames, one per interval */
+
+typedef struct {
+    int cbor;
+    int delta;
+    int interval_ms;
+    uint64_t due_ms;
+    uint32_t last_seq;
+    int since_keyframe;
+} metrics_stream;
+
+static ssize_t metrics_stream_read(void *ctx, char *buf, size_t len) {
+    metrics_stream *ms = ctx;
+    uint64_t now = monotonic_ms();
+
+    // The connection's timer runs on wheel ticks; one tick early is on time
+    if (now + TIMER_TICK_MS < ms->due_ms) return STREAM_WAIT;
+    ms->due_ms = now + ms->interval_ms;
+
+    const metrics_sample *cur = metrics_latest();
+    const metrics_sample *base = NULL;
+    if (ms->delta && ms->since_keyframe < METRICS_KEYFRAME_INTERVAL) {
+        base = metrics_find(ms->last_seq);
+    }
+    ms->since_keyframe = base ? ms->since_keyframe + 1 : 0;
+    ms->last_seq = cur->seq;
+
+    if (len < 1) return -1;
+    size_t n = encode_frame(ms->cbor, cur, base, (uint8_t *)buf, len - 1);
+    if (!n) return -1;
+
+    // JSON frames are newline-delimited; CBOR items delimit themselves
+    if (!ms->cbor) buf[n++] = '\n';
+    return n;
+}
+
+static void api_metrics_stream(http_request *req, http_response *res) {
+    char param[16];
+    metrics_stream *ms = calloc(1, sizeof(metrics_stream));
+    if (!ms) {
+        response_error(res, 500, "Memory allocation error");
+        return;
+    }
+
+    int interval = METRICS_STREAM_INTERVAL;
+    if (query_get_param(req->query, "interval", param, sizeof(param)) == 0) {
+        interval = atoi(param);
+        if (interval < 1) interval = 1;
+        if (interval > METRICS_STREAM_MAX_INTERVAL) interval = METRICS_STREAM_MAX_INTERVAL;
+    }
+
+    ms->cbor = accepts_cbor(req);
+    ms->delta = !(query_get_param(req->query, "delta", param, sizeof(param)) == 0 &&
+                  strcmp(param, "0") == 0);
+    ms->interval_ms = interval * 1000;
+
+    res->status = 200;
+    res->content_type = ms->cbor ? "application/cbor-seq" : "application/x-ndjson";
+    response_header(res, "Vary: Accept");
+    res->stream = metrics_stream_read;
+    res->stream_free = free;
+    res->stream_ctx = ms;
+    res->stream_wait_ms = ms->interval_ms;
+}
+
+void metrics_register_routes(router *r) {
+    router_add(r, HTTP_GET, "/api/metrics/stream", api_metrics_stream, CACHE_NO_STORE);
+    router_set_class(r, "/api/metrics/stream", ROUTE_LIGHT);
+}
@@ -0,0 +1,93 @@
+#ifndef UR_METRICS_H
+#define UR_METRICS_H
+
+#include <stdint.h>
+#include "ur_router.h"
+#include "ur_event.h"
+
+#define METRICS_SAMPLE_MS 1000
+// The sampler thread goes to sleep once nobody has asked for a sample this long
+#define METRICS_IDLE_MS 15000
+#define METRICS_HISTORY 64
+#define METRICS_KEYFRAME_INTERVAL 30
+#define METRICS_STREAM_INTERVAL 2
+#define METRICS_STREAM_MAX_INTERVAL 60
+
+/*
+ * Metric frames, in JSON or CBOR (Accept: application/cbor):
+ *
+ *   { seq, base, time, fields: { field: value, ... } }
+ *
+ * A keyframe carries every field and no base. A delta carries only the
+ * fields that changed since the sample numbered base. CBOR frames use the
+ * integer keys below for the frame and field ids for the fields; JSON
+ * uses the names. Field ids are part of the protocol and never reused.
+ */
+
+#define METRICS_KEY_SEQ 0
+#define METRICS_KEY_BASE 1
+#define METRICS_KEY_TIME 2
+#define METRICS_KEY_FIELDS 3
+
+typedef enum {
+    METRIC_CPU_USAGE,
+    METRIC_MEMORY_TOTAL,
+    METRIC_MEMORY_USED,
+    METRIC_MEMORY_USAGE,
+    METRIC_STORAGE_TOTAL,
+    METRIC_STORAGE_USED,
+    METRIC_STORAGE_FREE,
+    METRIC_STORAGE_USAGE,
+    METRIC_BANDWIDTH_DOWNLOAD,
+    METRIC_BANDWIDTH_UPLOAD,
+    METRIC_INTERNET_CONNECTED,
+    METRIC_ULTIMA_CONNECTED,
+    METRIC_STORAGE_MAX_USAGE,
+    METRIC_DISK_READ_RATE,
+    METRIC_DISK_WRITE_RATE,
+    METRIC_DISK_UTIL,
+    METRIC_FIELD_COUNT
+} metric_field;
+
+typedef struct {
+    uint32_t seq;
+    // Wall clock of the sample, milliseconds since the epoch
+    uint64_t time_ms;
+    double values[METRIC_FIELD_COUNT];
+} metrics_sample;
+
+// Fills in the current values; called at most once per METRICS_SAMPLE_MS
+typedef void (*metrics_sampler)(double *values);
+
+void metrics_init(metrics_sampler sampler);
+
+// Starts sampling on a thread of its own; samples reach the history on the
+// loop thread. Without it every reader samples inline.
+void metrics_start(event_loop *loop);
+
+// The newest sample, never more than about METRICS_SAMPLE_MS old while
+// readers keep asking; never waits for a sample to be taken
+const metrics_sample* metrics_latest(void);
+
+// A recent sample by number, or NULL once it has left the history
+const metrics_sample* metrics_find(uint32_t seq);
+
+// Answers /api/metrics itself when the client asked for CBOR or a delta
+// (?since=<seq>); returns 0 to leave the plain JSON document to the caller
+int metrics_respond(http_request *req, http_response *res);
+
+// The name a field goes by in JSON frames
+const char* metrics_field_name(metric_field field);
+
+// The field with this name, or -1
+int metrics_field_lookup(const char *name, size_t len);
+
+// Writes the history to fd, for the process taking over from this one
+int metrics_save(int fd);
+
+// Takes over a history written by metrics_save(); -1 if it does not fit this build
+int metrics_restore(int fd);
+
+void metrics_register_routes(router *r);
+
+#endif
@@ -0,0 +1,353 @@
+#include "ur_proc.h"
+#include "ur_management.h"
+#include "ur_timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+/*
+ * Process table for /api/processes, kept between requests. /proc stays open
+ * and is rewound for each scan; every process costs two small reads, stat
+ * and statm, opened relative to it. Entries live in an open-addressed table
+ * keyed by pid, so CPU% is the tick delta since the previous scan, and
+ * processes that have gone are swept at the end of the scan that misses
+ * them. Answers pick the top N with a bounded heap rather than sorting
+ * everything.
+ */
+
+typedef struct {
+    proc_entry *slots;
+    int cap;
+    int count;
+} proc_table;
+
+static proc_table table = {0};
+static DIR *proc_dir = NULL;
+static uint32_t generation = 0;
+static uint64_t scanned_at = 0;
+static uint64_t scan_us = 0;
+static long clock_ticks = 100;
+static long page_kb = 4;
+
+static unsigned proc_hash(int pid, int cap) {
+    return ((unsigned)pid * 2654435761u) & (cap - 1);
+}
+
+static int table_grow(void) {
+    int cap = table.cap ? table.cap * 2 : PROC_TABLE_MIN;
+    proc_entry *slots = calloc(cap, sizeof(proc_entry));
+    if (!slots) return -1;
+
+    for (int i = 0; i < table.cap; i++) {
+        if (!table.slots[i].pid) continue;
+        unsigned h = proc_hash(table.slots[i].pid, cap);
+        while (slots[h].pid) h = (h + 1) & (cap - 1);
+        slots[h] = table.slots[i];
+    }
+    free(table.slots);
+    table.slots = slots;
+    table.cap = cap;
+    return 0;
+}
+
+// Finds the entry for pid, adding an empty one if it is new; NULL if out of memory
+static proc_entry* table_get(int pid) {
+    if ((table.count + 1) * 2 > table.cap && table_grow() < 0) return NULL;
+
+    unsigned h = proc_hash(pid, table.cap);
+    while (table.slots[h].pid && table.slots[h].pid != pid) h = (h + 1) & (table.cap - 1);
+
+    proc_entry *e = &table.slots[h];
+    if (!e->pid) {
+        memset(e, 0, sizeof(*e));
+        e->pid = pid;
+        table.count++;
+    }
+    return e;
+}
+
+// Removes slot i, shifting back later entries of its probe run so lookups never stop short
+static void table_remove(unsigned i) {
+    unsigned mask = table.cap - 1;
+    unsigned j = i;
+
+    table.slots[i].pid = 0;
+    table.count--;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!table.slots[j].pid) return;
+
+        unsigned home = proc_hash(table.slots[j].pid, table.cap);
+        // Leave j alone if its home lies cyclically in (i, j]
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+
+        table.slots[i] = table.slots[j];
+        table.slots[j].pid = 0;
+        i = j;
+    }
+}
+
+static ssize_t read_at(int dir, const char *path, char *buf, size_t len) {
+    int fd = openat(dir, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ssize_t n = read(fd, buf, len - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    return n;
+}
+
+// Fills in e from /proc/<pid>/stat and statm; 0 on success, -1 if the process is gone
+static int proc_read(int dir, int pid, proc_entry *e, unsigned long long *ticks) {
+    char path[32];
+    char buf[512];
+
+    snprintf(path, sizeof(path), "%d/stat", pid);
+    if (read_at(dir, path, buf, sizeof(buf)) <= 0) return -1;
+
+    // The name may itself contain spaces and parentheses; it ends at the last ')'
+    char *name_start = strchr(buf, '(');
+    char *close_paren = strrchr(buf, ')');
+    if (!name_start || !close_paren || close_paren < name_start) return -1;
+
+    size_t name_len = close_paren - name_start - 1;
+    if (name_len >= PROC_NAME_MAX) name_len = PROC_NAME_MAX - 1;
+    for (size_t i = 0; i < name_len; i++) {
+        unsigned char ch = name_start[1 + i];
+        e->name[i] = ch < 0x20 || ch == 0x7f ? '?' : ch;
+    }
+    e->name[name_len] = '\0';
+
+    unsigned long long utime, stime, start;
+    if (sscanf(close_paren + 2,
+               "%c %d %*d %*d %*d %*d %*u %*lu %*lu %*lu %*lu %llu %llu "
+               "%*ld %*ld %*ld %*ld %d %*ld %llu",
+               &e->state, &e->ppid, &utime, &stime, &e->threads, &start) != 6) {
+        return -1;
+    }
+    *ticks = utime + stime;
+
+    // A pid that came back as a different process starts over
+    if (e->start != start) {
+        e->start = start;
+        e->ticks = *ticks;
+    }
+
+    unsigned long size, resident;
+    snprintf(path, sizeof(path), "%d/statm", pid);
+    if (read_at(dir, path, buf, sizeof(buf)) <= 0 ||
+        sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+        return -1;
+    }
+    e->vsize_kb = size * page_kb;
+    e->rss_kb = resident * page_kb;
+    return 0;
+}
+
+int proc_scan(void) {
+    uint64_t now = monotonic_ms();
+    if (scanned_at && now - scanned_at < PROC_SCAN_MIN_MS) return table.count;
+
+    if (!proc_dir) {
+        proc_dir = opendir("/proc");
+        if (!proc_dir) return -1;
+        clock_ticks = sysconf(_SC_CLK_TCK);
+        page_kb = sysconf(_SC_PAGESIZE) / 1024;
+        if (clock_ticks <= 0) clock_ticks = 100;
+        if (page_kb <= 0) page_kb = 4;
+    } else {
+        rewinddir(proc_dir);
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    int dir = dirfd(proc_dir);
+    double elapsed = scanned_at ? (now - scanned_at) / 1000.0 : 0;
+    struct dirent *d;
+
+    generation++;
+    while ((d = readdir(proc_dir))) {
+        if (d->d_name[0] < '1' || d->d_name[0] > '9') continue;
+
+        char *end;
+        long pid = strtol(d->d_name, &end, 10);
+        if (*end || pid <= 0) continue;
+
+        proc_entry *e = table_get(pid);
+        if (!e) break;
+
+        int fresh = e->seen == 0;
+        unsigned long long ticks;
+        if (proc_read(dir, pid, e, &ticks) < 0) continue;
+
+        e->cpu = !fresh && elapsed > 0 ? (ticks - e->ticks) * 100.0 / (clock_ticks * elapsed) : 0;
+        e->ticks = ticks;
+        e->seen = generation;
+    }
+
+    // Sweep what this scan did not see; a removal may pull a later entry into slot i
+    for (int i = 0; i < table.cap; ) {
+        if (table.slots[i].pid && table.slots[i].seen != generation) {
+            table_remove(i);
+        } else {
+            i++;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    scan_us = (t1.tv_sec - t0.tv_sec) * 1000000ull + (t1.tv_nsec - t0.tv_nsec) / 1000;
+    scanned_at = now;
+    return table.count;
+}
+
+/* Top-N selection */
+
+typedef enum { SORT_CPU, SORT_MEM, SORT_PID, SORT_NAME } proc_sort;
+
+// Whether a belongs before b in the answer
+static int proc_before(const proc_entry *a, const proc_entry *b, proc_sort sort) {
+    switch (sort) {
+        case SORT_CPU:
+            if (a->cpu != b->cpu) return a->cpu > b->cpu;
+            break;
+        case SORT_MEM:
+            if (a->rss_kb != b->rss_kb) return a->rss_kb > b->rss_kb;
+            break;
+        case SORT_NAME: {
+            int cmp = strcmp(a->name, b->name);
+            if (cmp) return cmp < 0;
+            break;
+        }
+        case SORT_PID:
+            break;
+    }
+    return a->pid < b->pid;
+}
+
+// heap[0] is the entry that would be dropped first
+static void heap_sift_down(const proc_entry **heap, int n, int i, proc_sort sort) {
+    for (;;) {
+        int last = i;
+        int l = 2 * i + 1, r = l + 1;
+        if (l < n && proc_before(heap[last], heap[l], sort)) last = l;
+        if (r < n && proc_before(heap[last], heap[r], sort)) last = r;
+        if (last == i) return;
+
+        const proc_entry *tmp = heap[i];
+        heap[i] = heap[last];
+        heap[last] = tmp;
+        i = last;
+    }
+}
+
+static void heap_sift_up(const proc_entry **heap, int i, proc_sort sort) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!proc_before(heap[parent], heap[i], sort)) return;
+
+        const proc_entry *tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+// Leaves the best limit matches in order in out; returns how many there are
+static int proc_select(const proc_entry **out, int limit, proc_sort sort,
+                       const char *filter, char state, int *matched) {
+    int n = 0;
+
+    *matched = 0;
+    for (int i = 0; i < table.cap; i++) {
+        const proc_entry *e = &table.slots[i];
+        if (!e->pid) continue;
+        if (filter[0] && !strstr(e->name, filter)) continue;
+        if (state && e->state != state) continue;
+
+        (*matched)++;
+        if (n < limit) {
+            out[n] = e;
+            heap_sift_up(out, n++, sort);
+        } else if (proc_before(e, out[0], sort)) {
+            out[0] = e;
+            heap_sift_down(out, n, 0, sort);
+        }
+    }
+
+    // Taking the worst off the top fills the answer from the back
+    for (int end = n - 1; end > 0; end--) {
+        const proc_entry *tmp = out[0];
+        out[0] = out[end];
+        out[end] = tmp;
+        heap_sift_down(out, end, 0, sort);
+    }
+    return n;
+}
+
+static void api_processes(http_request *req, http_response *res) {
+    char param[PROC_NAME_MAX];
+    char filter[PROC_NAME_MAX] = "";
+    proc_sort sort = SORT_CPU;
+    int limit = PROC_LIMIT_DEFAULT;
+    char state = 0;
+
+    if (query_get_param(req->query, "sort", param, sizeof(param)) == 0) {
+        if (strcmp(param, "cpu") == 0) sort = SORT_CPU;
+        else if (strcmp(param, "mem") == 0) sort = SORT_MEM;
+        else if (strcmp(param, "pid") == 0) sort = SORT_PID;
+        else if (strcmp(param, "name") == 0) sort = SORT_NAME;
+        else {
+            response_error(res, 400, "Unknown sort key");
+            return;
+        }
+    }
+    if (query_get_param(req->query, "limit", param, sizeof(param)) == 0) {
+        limit = atoi(param);
+        if (limit < 1) limit = 1;
+        if (limit > PROC_LIMIT_MAX) limit = PROC_LIMIT_MAX;
+    }
+    if (query_get_param(req->query, "state", param, sizeof(param)) == 0) state = param[0];
+    query_get_param(req->query, "filter", filter, sizeof(filter));
+
+    if (proc_scan() < 0) {
+        response_error(res, 500, "Cannot read /proc");
+        return;
+    }
+
+    const proc_entry *top[PROC_LIMIT_MAX];
+    int matched;
+    int n = proc_select(top, limit, sort, filter, state, &matched);
+
+    // Escaped names are at most twice as long; the rest of an entry fits in 160 bytes
+    size_t cap = 128 + (size_t)n * (2 * PROC_NAME_MAX + 160);
+    char *json = malloc(cap);
+    if (!json) {
+        response_error(res, 500, "Memory allocation error");
+        return;
+    }
+
+    size_t len = snprintf(json, cap,
+                          "{\"total\": %d, \"matched\": %d, \"scan_us\": %llu, \"processes\": [",
+                          table.count, matched, (unsigned long long)scan_us);
+    for (int i = 0; i < n; i++) {
+        char *name = json_escape_string(top[i]->name);
+        len += snprintf(json + len, cap - len,
+                        "%s\n  {\"pid\": %d, \"ppid\": %d, \"name\": \"%s\", \"state\": \"%c\", "
+                        "\"threads\": %d, \"cpu\": %.1f, \"rss\": %lu, \"vsize\": %lu}",
+                        i ? "," : "", top[i]->pid, top[i]->ppid, name, top[i]->state,
+                        top[i]->threads, top[i]->cpu, top[i]->rss_kb, top[i]->vsize_kb);
+        free(name);
+    }
+    snprintf(json + len, cap - len, "\n]}");
+
+    response_json(res, 200, json);
+}
+
+void proc_register_routes(router *r) {
+    router_add(r, HTTP_GET, "/api/processes", api_processes, CACHE_NO_STORE);
+}
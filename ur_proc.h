@@ -0,0 +1,35 @@
+#ifndef UR_PROC_H
+#define UR_PROC_H
+
+#include <stdint.h>
+#include "ur_router.h"
+
+#define PROC_NAME_MAX 32
+#define PROC_TABLE_MIN 256
+// CPU% over a shorter window is mostly noise; closer requests share a scan
+#define PROC_SCAN_MIN_MS 1000
+#define PROC_LIMIT_DEFAULT 20
+#define PROC_LIMIT_MAX 512
+
+typedef struct {
+    int pid;
+    int ppid;
+    char state;
+    char name[PROC_NAME_MAX];
+    int threads;
+    // utime + stime, in clock ticks
+    unsigned long long ticks;
+    // Start time in ticks since boot; tells a reused pid from the old process
+    unsigned long long start;
+    unsigned long rss_kb;
+    unsigned long vsize_kb;
+    float cpu;
+    uint32_t seen;
+} proc_entry;
+
+// Rescans /proc unless the last scan is under PROC_SCAN_MIN_MS old; returns the process count
+int proc_scan(void);
+
+void proc_register_routes(router *r);
+
+#endif
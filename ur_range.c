@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include "ur_range.h"
+#include "ur_router.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Byte ranges over responses whose full length is known up front: bundled
+ * assets in memory and override files sent with sendfile(). A single range
+ * only moves the body window, so it stays zero-copy. Several ranges are
+ * assembled into one multipart/byteranges body. Streamed responses are
+ * produced on the fly and never advertise ranges.
+ */
+
+typedef struct {
+    size_t first;
+    size_t last;
+} byte_range;
+
+// Parses "bytes=a-b, c-, -n"; returns the satisfiable ranges, 0 for none, -1 to ignore the header
+static int parse_ranges(const char *value, size_t value_len, size_t size,
+                        byte_range *ranges, int max) {
+    char spec[256];
+    int count = 0, seen = 0;
+
+    if (value_len >= sizeof(spec)) return -1;
+    memcpy(spec, value, value_len);
+    spec[value_len] = '\0';
+
+    if (strncmp(spec, "bytes=", 6) != 0) return -1;
+
+    char *save = NULL;
+    for (char *part = strtok_r(spec + 6, ",", &save); part; part = strtok_r(NULL, ",", &save)) {
+        while (*part == ' ' || *part == '\t') part++;
+        char *dash = strchr(part, '-');
+        if (!dash || ++seen > max) return -1;
+
+        char *end;
+        byte_range r;
+        if (dash == part) {
+            // Suffix range: the last n bytes
+            unsigned long long n = strtoull(dash + 1, &end, 10);
+            if (end == dash + 1 || n == 0) continue;
+            r.first = n >= size ? 0 : size - n;
+            r.last = size - 1;
+        } else {
+            unsigned long long first = strtoull(part, &end, 10);
+            if (end != dash) return -1;
+            unsigned long long last = size ? size - 1 : 0;
+            if (dash[1] && dash[1] != ' ') {
+                last = strtoull(dash + 1, &end, 10);
+                if (end == dash + 1) return -1;
+                if (last < first) return -1;
+                if (last >= size) last = size - 1;
+            }
+            if (first >= size) continue;
+            r.first = first;
+            r.last = last;
+        }
+        ranges[count++] = r;
+    }
+
+    return seen ? count : -1;
+}
+
+// If-Range carries our ETag when the client resumes; a date or another tag means start over
+static int if_range_matches(const http_request *req, const http_response *res) {
+    size_t len;
+    const char *if_range = http_request_header(req, "If-Range", &len);
+    if (!if_range) return 1;
+    if (len < 2 || if_range[0] != '"') return 0;
+
+    const char *etag = memmem(res->headers, res->headers_len, "ETag: ", 6);
+    if (!etag) return 0;
+    etag += 6;
+    const char *etag_end = memchr(etag, '\r', res->headers + res->headers_len - etag);
+    if (!etag_end) return 0;
+
+    return (size_t)(etag_end - etag) == len && memcmp(etag, if_range, len) == 0;
+}
+
+static int copy_range(const http_response *res, char *out, const byte_range *r) {
+    size_t len = r->last - r->first + 1;
+
+    if (!res->body_file) {
+        memcpy(out, res->body + res->body_offset + r->first, len);
+        return 0;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(res->body_fd, out + done, len - done,
+                          res->body_offset + r->first + done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static void respond_multipart(http_response *res, const byte_range *ranges, int count,
+                              size_t size) {
+    const char *type = res->content_type ? res->content_type : "application/octet-stream";
+    char part_head[256];
+    size_t total = 0;
+
+    for (int i = 0; i < count; i++) {
+        total += snprintf(part_head, sizeof(part_head),
+                          "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                          RANGE_BOUNDARY, type, ranges[i].first, ranges[i].last, size);
+        total += ranges[i].last - ranges[i].first + 1;
+    }
+    total += strlen("\r\n--" RANGE_BOUNDARY "--\r\n");
+
+    // Overlapping ranges that add up to more than the file are not worth serving
+    if (total > size * 2 + 4096) return;
+
+    char *body = malloc(total + 1);
+    if (!body) return;
+
+    size_t pos = 0;
+    for (int i = 0; i < count; i++) {
+        pos += snprintf(body + pos, total + 1 - pos,
+                        "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                        RANGE_BOUNDARY, type, ranges[i].first, ranges[i].last, size);
+        if (copy_range(res, body + pos, &ranges[i]) < 0) {
+            free(body);
+            return;
+        }
+        pos += ranges[i].last - ranges[i].first + 1;
+    }
+    pos += snprintf(body + pos, total + 1 - pos, "\r\n--%s--\r\n", RANGE_BOUNDARY);
+
+    // The parts replace the original body, file-backed or not
+    if (res->body && !res->body_static) free(res->body);
+    if (res->body_file) close(res->body_fd);
+    res->body_file = 0;
+    res->body = body;
+    res->body_len = pos;
+    res->body_offset = 0;
+    res->body_static = 0;
+    res->content_type = "multipart/byteranges; boundary=" RANGE_BOUNDARY;
+    res->status = 206;
+}
+
+void http_apply_range(const http_request *req, http_response *res) {
+    if (!res->accept_ranges || res->status != 200 || res->stream) return;
+
+    response_header(res, "Accept-Ranges: bytes");
+
+    size_t len;
+    const char *range = http_request_header(req, "Range", &len);
+    if (!range || !(req->method == HTTP_GET || req->method == HTTP_HEAD)) return;
+    if (!if_range_matches(req, res)) return;
+
+    byte_range ranges[RANGE_MAX_PARTS];
+    size_t size = res->body_len;
+    int count = parse_ranges(range, len, size, ranges, RANGE_MAX_PARTS);
+    if (count < 0) return;
+
+    if (count == 0) {
+        response_free(res);
+        res->status = 416;
+        res->body_len = 0;
+        res->body_offset = 0;
+        response_header(res, "Content-Range: bytes */%zu", size);
+        return;
+    }
+
+    if (count == 1) {
+        res->status = 206;
+        res->body_offset += ranges[0].first;
+        res->body_len = ranges[0].last - ranges[0].first + 1;
+        response_header(res, "Content-Range: bytes %zu-%zu/%zu",
+                        ranges[0].first, ranges[0].last, size);
+        return;
+    }
+
+    respond_multipart(res, ranges, count, size);
+}
@@ -0,0 +1,13 @@
+#ifndef UR_RANGE_H
+#define UR_RANGE_H
+
+#include "ur_management.h"
+
+#define RANGE_MAX_PARTS 8
+#define RANGE_BOUNDARY "ur-byteranges-5f3a9c17e2d4b086"
+
+// Rewrites a complete 200 response that allows ranges into 206 or 416 as
+// the request's Range and If-Range headers ask; anything else is left as is
+void http_apply_range(const http_request *req, http_response *res);
+
+#endif
@@ -0,0 +1,450 @@
+#include "ur_router.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Routes without parameters live in a perfect hash built once at startup,
+ * so an exact lookup is one hash and one compare no matter how many
+ * endpoints are registered. Patterns with ":name" segments or a trailing
+ * "*" go into a radix tree that is only walked when the hash misses.
+ */
+
+#define PHASH_MAX_SEEDS 4096
+
+struct radix_node {
+    char *label;
+    size_t label_len;
+    radix_node *children;
+    radix_node *next;
+    radix_node *param;
+    char *param_name;
+    int wildcard_route;
+    int route;
+};
+
+typedef struct {
+    int route;
+    int param_count;
+    const char *param_start[MAX_ROUTE_PARAMS];
+    size_t param_len[MAX_ROUTE_PARAMS];
+} radix_match;
+
+static const char *method_names[HTTP_METHOD_COUNT] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS"
+};
+
+/* Perfect hash */
+
+static uint32_t phash_hash(uint32_t seed, const char *key, size_t len) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+int phash_build(phash_table *table, const char **keys, size_t count) {
+    uint32_t size = 8;
+    while (size < count * 2) size <<= 1;
+
+    free(table->slots);
+    table->slots = NULL;
+
+    for (; size <= 65536; size <<= 1) {
+        int16_t *slots = malloc(size * sizeof(int16_t));
+        if (!slots) return -1;
+
+        for (uint32_t seed = 1; seed <= PHASH_MAX_SEEDS; seed++) {
+            memset(slots, 0xff, size * sizeof(int16_t));
+            size_t i;
+            for (i = 0; i < count; i++) {
+                uint32_t slot = phash_hash(seed, keys[i], strlen(keys[i])) & (size - 1);
+                if (slots[slot] >= 0) break;
+                slots[slot] = (int16_t)i;
+            }
+            if (i == count) {
+                table->seed = seed;
+                table->mask = size - 1;
+                table->slots = slots;
+                return 0;
+            }
+        }
+        free(slots);
+    }
+
+    return -1;
+}
+
+int phash_lookup(const phash_table *table, const char **keys,
+                 const char *key, size_t len) {
+    if (!table->slots) return -1;
+
+    int index = table->slots[phash_hash(table->seed, key, len) & table->mask];
+    if (index < 0) return -1;
+    if (strncmp(keys[index], key, len) != 0 || keys[index][len] != '\0') return -1;
+    return index;
+}
+
+void phash_free(phash_table *table) {
+    free(table->slots);
+    table->slots = NULL;
+}
+
+/* Radix tree */
+
+static radix_node* radix_new(const char *label, size_t len) {
+    radix_node *node = calloc(1, sizeof(radix_node));
+    if (!node) return NULL;
+    node->label = strndup(label ? label : "", len);
+    node->label_len = len;
+    node->route = -1;
+    node->wildcard_route = -1;
+    return node;
+}
+
+static void radix_free(radix_node *node) {
+    while (node) {
+        radix_node *next = node->next;
+        radix_free(node->children);
+        radix_free(node->param);
+        free(node->label);
+        free(node->param_name);
+        free(node);
+        node = next;
+    }
+}
+
+// Descend through static text, splitting edges where the new text diverges
+static radix_node* radix_insert_static(radix_node *node, const char *text, size_t len) {
+    while (len > 0) {
+        radix_node *child = node->children;
+        while (child && child->label[0] != text[0]) child = child->next;
+
+        if (!child) {
+            child = radix_new(text, len);
+            if (!child) return NULL;
+            child->next = node->children;
+            node->children = child;
+            return child;
+        }
+
+        size_t common = 0;
+        while (common < child->label_len && common < len &&
+               child->label[common] == text[common]) {
+            common++;
+        }
+
+        if (common < child->label_len) {
+            radix_node *split = radix_new(child->label + common, child->label_len - common);
+            if (!split) return NULL;
+            split->children = child->children;
+            split->param = child->param;
+            split->param_name = child->param_name;
+            split->route = child->route;
+            split->wildcard_route = child->wildcard_route;
+
+            child->label[common] = '\0';
+            child->label_len = common;
+            child->children = split;
+            child->param = NULL;
+            child->param_name = NULL;
+            child->route = -1;
+            child->wildcard_route = -1;
+        }
+
+        node = child;
+        text += common;
+        len -= common;
+    }
+    return node;
+}
+
+static int radix_insert(radix_node *root, const char *pattern, int route) {
+    radix_node *node = root;
+    const char *p = pattern;
+
+    while (*p) {
+        const char *special = strpbrk(p, ":*");
+        size_t static_len = special ? (size_t)(special - p) : strlen(p);
+
+        if (static_len > 0) {
+            node = radix_insert_static(node, p, static_len);
+            if (!node) return -1;
+            p += static_len;
+        }
+
+        if (*p == '*') {
+            node->wildcard_route = route;
+            return 0;
+        }
+
+        if (*p == ':') {
+            const char *name = p + 1;
+            const char *end = strchr(name, '/');
+            size_t name_len = end ? (size_t)(end - name) : strlen(name);
+
+            if (!node->param) {
+                node->param = radix_new(NULL, 0);
+                if (!node->param) return -1;
+                node->param->param_name = strndup(name, name_len);
+            }
+            node = node->param;
+            p = name + name_len;
+        }
+    }
+
+    node->route = route;
+    return 0;
+}
+
+static int radix_lookup(const radix_node *node, const char *path, radix_match *match) {
+    if (*path == '\0') {
+        if (node->route >= 0) {
+            match->route = node->route;
+            return 1;
+        }
+    }
+
+    // Static children take priority over parameters, parameters over wildcards
+    for (const radix_node *child = node->children; child; child = child->next) {
+        if (child->label[0] == path[0] &&
+            strncmp(child->label, path, child->label_len) == 0) {
+            if (radix_lookup(child, path + child->label_len, match)) return 1;
+            break;
+        }
+    }
+
+    if (node->param && *path && *path != '/' && match->param_count < MAX_ROUTE_PARAMS) {
+        const char *end = strchr(path, '/');
+        size_t len = end ? (size_t)(end - path) : strlen(path);
+
+        int slot = match->param_count++;
+        match->param_start[slot] = path;
+        match->param_len[slot] = len;
+        if (radix_lookup(node->param, path + len, match)) return 1;
+        match->param_count--;
+    }
+
+    if (node->wildcard_route >= 0) {
+        match->route = node->wildcard_route;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Router */
+
+static int method_index(unsigned method) {
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+        if (method == (1u << i)) return i;
+    }
+    return -1;
+}
+
+unsigned http_method_from_string(const char *method) {
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+        if (strcmp(method, method_names[i]) == 0) return 1u << i;
+    }
+    return 0;
+}
+
+const char* cache_policy_header(cache_policy cache) {
+    switch (cache) {
+        case CACHE_REVALIDATE: return "no-cache";
+        case CACHE_SHORT: return "public, max-age=300";
+        case CACHE_IMMUTABLE: return "public, max-age=31536000, immutable";
+        case CACHE_NO_STORE:
+        default: return "no-store";
+    }
+}
+
+void router_init(router *r) {
+    memset(r, 0, sizeof(*r));
+}
+
+static int router_add_entry(router *r, unsigned methods, const char *pattern,
+                            route_handler handler, const body_sink *sink,
+                            cache_policy cache) {
+    if (!pattern || (!handler && !sink) || !methods) return -1;
+
+    int index = -1;
+    for (int i = 0; i < r->route_count; i++) {
+        if (strcmp(r->routes[i].pattern, pattern) == 0) {
+            index = i;
+            break;
+        }
+    }
+
+    if (index < 0) {
+        if (r->route_count >= ROUTER_MAX_ROUTES) {
+            fprintf(stderr, "router: too many routes, dropping %s\n", pattern);
+            return -1;
+        }
+        index = r->route_count++;
+        r->routes[index].pattern = strdup(pattern);
+        if (!r->routes[index].pattern) return -1;
+    }
+
+    route_entry *entry = &r->routes[index];
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+        if (methods & (1u << i)) {
+            entry->handlers[i] = handler;
+            entry->sinks[i] = sink;
+            entry->cache[i] = cache;
+        }
+    }
+    entry->methods |= methods;
+
+    // Routes registered after startup take effect on the next dispatch
+    r->built = 0;
+    return 0;
+}
+
+int router_add(router *r, unsigned methods, const char *pattern,
+               route_handler handler, cache_policy cache) {
+    return router_add_entry(r, methods, pattern, handler, NULL, cache);
+}
+
+int router_add_sink(router *r, unsigned methods, const char *pattern,
+                    const body_sink *sink, cache_policy cache) {
+    return router_add_entry(r, methods, pattern, NULL, sink, cache);
+}
+
+int router_set_class(router *r, const char *pattern, route_class cls) {
+    for (int i = 0; i < r->route_count; i++) {
+        if (strcmp(r->routes[i].pattern, pattern) == 0) {
+            r->routes[i].cls = cls;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int router_build(router *r) {
+    radix_free(r->tree);
+    r->tree = radix_new(NULL, 0);
+    if (!r->tree) return -1;
+
+    r->exact_count = 0;
+    for (int i = 0; i < r->route_count; i++) {
+        const char *pattern = r->routes[i].pattern;
+        if (strpbrk(pattern, ":*")) {
+            if (radix_insert(r->tree, pattern, i) < 0) return -1;
+        } else {
+            r->exact_keys[r->exact_count] = pattern;
+            r->exact_routes[r->exact_count] = i;
+            r->exact_count++;
+        }
+    }
+
+    if (phash_build(&r->exact, r->exact_keys, r->exact_count) < 0) {
+        fprintf(stderr, "router: could not build route hash\n");
+        return -1;
+    }
+
+    r->built = 1;
+    return 0;
+}
+
+static void store_params(http_request *req, const radix_match *match) {
+    char *out = req->param_buf;
+    size_t remaining = sizeof(req->param_buf);
+
+    req->param_count = 0;
+    for (int i = 0; i < match->param_count; i++) {
+        char raw[MAX_PATH_LENGTH];
+        if (match->param_len[i] + 1 > remaining) break;
+
+        memcpy(raw, match->param_start[i], match->param_len[i]);
+        raw[match->param_len[i]] = '\0';
+        url_decode(out, raw);
+        req->params[req->param_count++] = out;
+
+        size_t used = strlen(out) + 1;
+        out += used;
+        remaining -= used;
+    }
+}
+
+int router_resolve(router *r, http_request *req, http_response *res, route_target *target) {
+    if (!r->built && router_build(r) < 0) return 0;
+
+    int route = -1;
+    int index = phash_lookup(&r->exact, r->exact_keys, req->path, strlen(req->path));
+    if (index >= 0) {
+        route = r->exact_routes[index];
+        req->param_count = 0;
+    } else {
+        radix_match match = { .route = -1 };
+        if (radix_lookup(r->tree, req->path, &match)) {
+            route = match.route;
+            store_params(req, &match);
+        }
+    }
+
+    if (route < 0) return 0;
+
+    route_entry *entry = &r->routes[route];
+    int slot = method_index(req->method);
+
+    if (req->method == HTTP_HEAD && !entry->handlers[slot] && !entry->sinks[slot]) {
+        slot = method_index(HTTP_GET);
+        res->head_only = 1;
+    }
+
+    if (slot < 0 || (!entry->handlers[slot] && !entry->sinks[slot])) {
+        char allow[64] = "";
+        size_t len = 0;
+        unsigned methods = entry->methods;
+        if (methods & HTTP_GET) methods |= HTTP_HEAD;
+
+        for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+            if (methods & (1u << i)) {
+                len += snprintf(allow + len, sizeof(allow) - len, "%s%s",
+                                len ? ", " : "", method_names[i]);
+            }
+        }
+        response_header(res, "Allow: %s", allow);
+
+        if (req->method == HTTP_OPTIONS) {
+            res->status = 204;
+        } else {
+            response_error(res, 405, "Method not allowed");
+        }
+        return -1;
+    }
+
+    res->cache_control = cache_policy_header(entry->cache[slot]);
+    target->handler = entry->handlers[slot];
+    target->sink = entry->sinks[slot];
+    target->cls = entry->cls;
+    return 1;
+}
+
+int router_dispatch(router *r, http_request *req, http_response *res) {
+    route_target target = {0};
+    int resolved = router_resolve(r, req, res, &target);
+
+    if (resolved <= 0) return resolved < 0;
+    if (target.handler) {
+        target.handler(req, res);
+    } else {
+        response_error(res, 500, "Route expects a streamed body");
+    }
+    return 1;
+}
+
+void router_free(router *r) {
+    for (int i = 0; i < r->route_count; i++) {
+        free(r->routes[i].pattern);
+    }
+    radix_free(r->tree);
+    phash_free(&r->exact);
+    memset(r, 0, sizeof(*r));
+}
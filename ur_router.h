@@ -0,0 +1,114 @@
+#ifndef UR_ROUTER_H
+#define UR_ROUTER_H
+
+#include <stdint.h>
+#include "ur_management.h"
+
+#define ROUTER_MAX_ROUTES 128
+
+// Method bits used when registering routes
+#define HTTP_GET     (1u << 0)
+#define HTTP_HEAD    (1u << 1)
+#define HTTP_POST    (1u << 2)
+#define HTTP_PUT     (1u << 3)
+#define HTTP_DELETE  (1u << 4)
+#define HTTP_OPTIONS (1u << 5)
+#define HTTP_METHOD_COUNT 6
+
+// Cache-Control policy attached to a route
+typedef enum {
+    CACHE_NO_STORE = 0,
+    CACHE_REVALIDATE,
+    CACHE_SHORT,
+    CACHE_IMMUTABLE
+} cache_policy;
+
+// Admission class: rate-limited separately, and heavy handlers run one at a
+// time behind everything else. Routes are NORMAL unless set otherwise.
+typedef enum {
+    ROUTE_NORMAL = 0,
+    ROUTE_LIGHT,
+    ROUTE_HEAVY,
+    ROUTE_CLASS_COUNT
+} route_class;
+
+typedef void (*route_handler)(http_request *req, http_response *res);
+
+// Receives a request body incrementally instead of having it buffered first
+typedef struct {
+    // Returns a context, or NULL after filling res to reject the upload
+    void* (*begin)(http_request *req, http_response *res);
+    // Returns -1 to stop the upload early; finish() then reports why
+    int (*write)(void *ctx, const char *data, size_t len);
+    void (*finish)(void *ctx, http_request *req, http_response *res);
+} body_sink;
+
+typedef struct {
+    route_handler handler;
+    const body_sink *sink;
+    route_class cls;
+} route_target;
+
+// Perfect hash over a fixed key set, built once at startup
+typedef struct {
+    uint32_t seed;
+    uint32_t mask;
+    int16_t *slots;
+} phash_table;
+
+typedef struct radix_node radix_node;
+
+typedef struct {
+    char *pattern;
+    unsigned methods;
+    route_handler handlers[HTTP_METHOD_COUNT];
+    const body_sink *sinks[HTTP_METHOD_COUNT];
+    cache_policy cache[HTTP_METHOD_COUNT];
+    route_class cls;
+} route_entry;
+
+typedef struct {
+    route_entry routes[ROUTER_MAX_ROUTES];
+    int route_count;
+    const char *exact_keys[ROUTER_MAX_ROUTES];
+    int exact_routes[ROUTER_MAX_ROUTES];
+    int exact_count;
+    phash_table exact;
+    radix_node *tree;
+    int built;
+} router;
+
+void router_init(router *r);
+
+int router_add(router *r, unsigned methods, const char *pattern,
+               route_handler handler, cache_policy cache);
+
+int router_add_sink(router *r, unsigned methods, const char *pattern,
+                    const body_sink *sink, cache_policy cache);
+
+// For a pattern already added; returns -1 when there is none
+int router_set_class(router *r, const char *pattern, route_class cls);
+
+int router_build(router *r);
+
+// Returns 1 with target set, -1 when res was already filled (405, OPTIONS),
+// or 0 when no route matched
+int router_resolve(router *r, http_request *req, http_response *res, route_target *target);
+
+// Returns 1 when the request was handled (including 405), 0 when no route matched
+int router_dispatch(router *r, http_request *req, http_response *res);
+
+void router_free(router *r);
+
+unsigned http_method_from_string(const char *method);
+
+const char* cache_policy_header(cache_policy cache);
+
+int phash_build(phash_table *table, const char **keys, size_t count);
+
+int phash_lookup(const phash_table *table, const char **keys,
+                 const char *key, size_t len);
+
+void phash_free(phash_table *table);
+
+#endif
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include "ur_runner.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/*
+ * Commands are not forked from the server. A helper is forked once at
+ * startup, while the server is a few pages, and every command is a fork of
+ * that instead, so spawning costs the same however large the server has
+ * grown and does not fail for want of memory to copy page tables into.
+ *
+ * Each request is one message on a SOCK_SEQPACKET socketpair: the command,
+ * with two descriptors attached. The child writes its output straight into
+ * the first, a pipe the caller reads to EOF, so nothing is copied through
+ * the helper. The helper writes the wait status to the second once the
+ * child has exited. Any thread can run a command at the same time as
+ * another. Past RUNNER_MAX_CHILDREN the helper stops reading requests
+ * until one finishes. Limits are set on the helper itself and inherited.
+ *
+ * Every command leads a process group of its own. A caller that gives up
+ * on one closes its end of the status socket; the helper sees the hangup
+ * and kills the whole group, pipelines and background jobs included.
+ */
+
+typedef struct {
+    pid_t pid;
+    int status_fd;
+    // The caller hung up and the group has been sent SIGKILL
+    int killed;
+} runner_child;
+
+static int ctl = -1;
+static pid_t helper = 0;
+
+/* Helper */
+
+// Nothing of the server's stays open in the helper but its end of ctl
+static void helper_close_fds(int keep) {
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        int fd = atoi(entry->d_name);
+        if (fd > 2 && fd != keep && fd != dirfd(dir)) close(fd);
+    }
+    closedir(dir);
+}
+
+static void helper_limits(const runner_limits *limits) {
+    if (limits->nice) {
+        errno = 0;
+        if (nice(limits->nice) == -1 && errno) perror("runner: nice");
+    }
+    if (limits->memory_mb > 0) {
+        struct rlimit rl;
+        rl.rlim_cur = rl.rlim_max = (rlim_t)limits->memory_mb * 1024 * 1024;
+        if (setrlimit(RLIMIT_AS, &rl) < 0) perror("runner: setrlimit");
+    }
+    if (limits->cgroup) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/cgroup.procs", limits->cgroup);
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0 || dprintf(fd, "%d\n", (int)getpid()) < 0) perror("runner: cgroup");
+        if (fd >= 0) close(fd);
+    }
+}
+
+// In the child: runs command with out as stdout and stderr; never returns
+static void child_exec(const char *command, int out) {
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    setpgid(0, 0);
+
+    int null = open("/dev/null", O_RDONLY);
+    if (null >= 0) dup2(null, 0);
+    dup2(out, 1);
+    dup2(out, 2);
+    execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+    _exit(127);
+}
+
+static void helper_spawn(runner_child *slot, const char *command, int out, int status_fd) {
+    pid_t pid = fork();
+    if (pid == 0) child_exec(command, out);
+
+    close(out);
+    if (pid < 0) {
+        int status = -1;
+        send(status_fd, &status, sizeof(status), MSG_NOSIGNAL);
+        close(status_fd);
+        return;
+    }
+    // Also here, so a cancel that comes early still finds the group
+    setpgid(pid, pid);
+    slot->pid = pid;
+    slot->status_fd = status_fd;
+    slot->killed = 0;
+}
+
+static void helper_reap(runner_child *children, int *running) {
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < RUNNER_MAX_CHILDREN; i++) {
+            if (children[i].pid != pid) continue;
+            // Fails quietly when the caller has cancelled
+            send(children[i].status_fd, &status, sizeof(status), MSG_NOSIGNAL);
+            close(children[i].status_fd);
+            children[i].pid = 0;
+            (*running)--;
+            break;
+        }
+    }
+}
+
+// Takes one request off ctl; returns -1 once the server has gone
+static int helper_accept(runner_child *children, int *running) {
+    char command[RUNNER_COMMAND_MAX + 1];
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { command, RUNNER_COMMAND_MAX };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+
+    ssize_t n = recvmsg(ctl, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0) return errno == EINTR || errno == EAGAIN ? 0 : -1;
+    if (n == 0) return -1;
+    command[n] = '\0';
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        return 0;
+    }
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    for (int i = 0; i < RUNNER_MAX_CHILDREN; i++) {
+        if (children[i].pid) continue;
+        helper_spawn(&children[i], command, fds[0], fds[1]);
+        if (children[i].pid) (*running)++;
+        return 0;
+    }
+    // Not reached: ctl is not read while every slot is taken
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static void helper_main(const runner_limits *limits) {
+    runner_child children[RUNNER_MAX_CHILDREN] = { 0 };
+    int running = 0;
+    sigset_t chld;
+
+    prctl(PR_SET_NAME, "ur-runner");
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    helper_close_fds(ctl);
+    // Meant for the server, which shares the process name
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+    helper_limits(limits);
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sfd < 0) _exit(1);
+
+    for (;;) {
+        struct pollfd fds[2 + RUNNER_MAX_CHILDREN] = {
+            { .fd = sfd, .events = POLLIN },
+            { .fd = ctl, .events = running < RUNNER_MAX_CHILDREN ? POLLIN : 0 }
+        };
+        // Only a hangup is of interest on the status sockets
+        runner_child *watched[RUNNER_MAX_CHILDREN];
+        int count = 2;
+        for (int i = 0; i < RUNNER_MAX_CHILDREN; i++) {
+            if (!children[i].pid || children[i].killed) continue;
+            watched[count - 2] = &children[i];
+            fds[count++] = (struct pollfd){ .fd = children[i].status_fd };
+        }
+
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) continue;
+            _exit(1);
+        }
+
+        for (int i = 2; i < count; i++) {
+            if (!fds[i].revents) continue;
+            kill(-watched[i - 2]->pid, SIGKILL);
+            watched[i - 2]->killed = 1;
+        }
+        if (fds[0].revents) {
+            struct signalfd_siginfo info;
+            while (read(sfd, &info, sizeof(info)) > 0) {}
+            helper_reap(children, &running);
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (helper_accept(children, &running) < 0) _exit(0);
+        }
+    }
+}
+
+int runner_init(const runner_limits *limits) {
+    int pair[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0) {
+        perror("runner: socketpair");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("runner: fork");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(pair[0]);
+        ctl = pair[1];
+        helper_main(limits);
+    }
+
+    close(pair[1]);
+    ctl = pair[0];
+    helper = pid;
+    return 0;
+}
+
+/* Server side */
+
+// Without the helper the server forks the command itself, as popen() would
+static int runner_fork(runner_job *job, const char *command) {
+    int out[2];
+
+    if (pipe2(out, O_CLOEXEC) < 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) child_exec(command, out[1]);
+
+    close(out[1]);
+    if (pid < 0) {
+        close(out[0]);
+        return -1;
+    }
+    setpgid(pid, pid);
+    job->out = out[0];
+    job->status = -1;
+    job->pid = pid;
+    return 0;
+}
+
+int runner_start(runner_job *job, const char *command) {
+    int out[2], reply[2];
+    size_t len = strlen(command);
+
+    int fd = __atomic_load_n(&ctl, __ATOMIC_ACQUIRE);
+    if (fd < 0 || len > RUNNER_COMMAND_MAX) return runner_fork(job, command);
+    if (pipe2(out, O_CLOEXEC) < 0) return -1;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, reply) < 0) {
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { (char *)command, len };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    int fds[2] = { out[1], reply[1] };
+    memset(control, 0, sizeof(control));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    close(out[1]);
+    close(reply[1]);
+
+    if (sent < 0) {
+        // The helper is gone; the server forks commands from now on. Only one caller closes ctl.
+        if (__atomic_exchange_n(&ctl, -1, __ATOMIC_ACQ_REL) >= 0) {
+            fprintf(stderr, "Command runner exited, forking commands directly\n");
+            close(fd);
+            waitpid(helper, NULL, WNOHANG);
+        }
+        close(out[0]);
+        close(reply[0]);
+        return runner_fork(job, command);
+    }
+
+    job->out = out[0];
+    job->status = reply[0];
+    job->pid = 0;
+    return 0;
+}
+
+int runner_wait(runner_job *job) {
+    int status;
+    ssize_t n;
+
+    if (job->pid) {
+        pid_t pid;
+        do {
+            pid = waitpid(job->pid, &status, 0);
+        } while (pid < 0 && errno == EINTR);
+        job->pid = 0;
+        return pid > 0 ? status : -1;
+    }
+
+    do {
+        n = read(job->status, &status, sizeof(status));
+    } while (n < 0 && errno == EINTR);
+    close(job->status);
+    job->status = -1;
+    return n == sizeof(status) ? status : -1;
+}
+
+void runner_cancel(runner_job *job) {
+    if (job->out >= 0) close(job->out);
+    job->out = -1;
+
+    if (job->pid) {
+        kill(-job->pid, SIGKILL);
+        runner_wait(job);
+        return;
+    }
+    // The helper kills the group when it sees this end go
+    close(job->status);
+    job->status = -1;
+}
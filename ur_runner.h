@@ -0,0 +1,44 @@
+#ifndef UR_RUNNER_H
+#define UR_RUNNER_H
+
+#include <sys/types.h>
+
+// Commands running at once; further requests wait in the socket
+#define RUNNER_MAX_CHILDREN 8
+#define RUNNER_COMMAND_MAX 4096
+
+typedef struct {
+    // Added to the helper's niceness, and so to every command's; 0 for none
+    int nice;
+    // Address space limit per command in megabytes; 0 for none
+    int memory_mb;
+    // cgroup v2 directory the helper and its commands are moved into; NULL for none
+    const char *cgroup;
+} runner_limits;
+
+// A command started by the helper, or by the server itself without one
+typedef struct {
+    // Its stdout and stderr, until EOF
+    int out;
+    // The helper writes the wait status here once it has exited
+    int status;
+    // Set instead of status when the server forked the command itself
+    pid_t pid;
+} runner_job;
+
+// Forks the helper while the server is still small; without it commands are
+// forked from the server. Returns -1 in that case.
+int runner_init(const runner_limits *limits);
+
+// Starts command under /bin/sh, in a process group of its own; -1 when it
+// cannot be started at all
+int runner_start(runner_job *job, const char *command);
+
+// Waits for the command to exit and closes the job; returns its wait status
+// as from waitpid(), or -1. Read job->out to EOF first.
+int runner_wait(runner_job *job);
+
+// Kills the command and everything it started, then closes the job
+void runner_cancel(runner_job *job);
+
+#endif
@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include "ur_storage.h"
+#include "ur_escape.h"
+#include "ur_timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+
+/*
+ * Storage across every mounted filesystem and block device, without
+ * forking df or iostat. The mount table comes from /proc/self/mountinfo,
+ * which stays open: poll() flagging it as changed only marks the mount
+ * list for reparsing at the next sample, so a steady system costs one
+ * statvfs() per filesystem per sample. Device I/O comes from
+ * /proc/diskstats, also kept open; read and write IOPS, throughput and
+ * utilisation are deltas of its counters since the previous sample.
+ * statvfs() can hang on a dead network or USB mount, so samples are only
+ * taken by the metrics sampler thread; /api/storage renders the last one
+ * under the lock and never touches a filesystem itself.
+ */
+
+#define SECTOR_SIZE 512
+
+typedef struct {
+    char mount[STORAGE_PATH_MAX];
+    char source[STORAGE_PATH_MAX];
+    char type[STORAGE_TYPE_MAX];
+    unsigned major;
+    unsigned minor;
+    int readonly;
+    // From the last statvfs(), in bytes
+    unsigned long long total;
+    unsigned long long free;
+    unsigned long long avail;
+    unsigned long long files;
+    unsigned long long files_free;
+    int valid;
+} storage_mount;
+
+typedef struct {
+    char name[STORAGE_NAME_MAX];
+    unsigned major;
+    unsigned minor;
+    int partition;
+    // Counters as of the last sample
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned long long read_sectors;
+    unsigned long long write_sectors;
+    unsigned long long io_ms;
+    unsigned in_flight;
+    // Per second over the last interval; utilisation in percent
+    double read_iops;
+    double write_iops;
+    double read_rate;
+    double write_rate;
+    double util;
+    uint32_t seen;
+} storage_device;
+
+// Filesystems with nothing to fill up, skipped before statvfs() is asked
+static const char *pseudo_types[] = {
+    "proc", "sysfs", "devpts", "cgroup", "cgroup2", "securityfs", "debugfs",
+    "tracefs", "pstore", "bpf", "mqueue", "hugetlbfs", "configfs", "fusectl",
+    "binfmt_misc", "autofs", "nsfs", "efivarfs", "rpc_pipefs", "selinuxfs"
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int mountinfo_fd = -1;
+static int diskstats_fd = -1;
+static char *text = NULL;
+static size_t text_cap = 0;
+
+static storage_mount mounts[STORAGE_MAX_MOUNTS];
+static int mount_count = 0;
+static storage_device devices[STORAGE_MAX_DEVICES];
+static int device_count = 0;
+static uint32_t generation = 0;
+static uint64_t sampled_at = 0;
+static uint64_t interval_ms = 0;
+static storage_summary summary_now;
+
+// The whole of a /proc file from the start, in the shared text buffer
+static ssize_t read_text(int fd) {
+    size_t len = 0;
+
+    for (;;) {
+        if (len + 1 >= text_cap) {
+            size_t cap = text_cap ? text_cap * 2 : 8192;
+            char *grown = realloc(text, cap);
+            if (!grown) return -1;
+            text = grown;
+            text_cap = cap;
+        }
+        ssize_t n = pread(fd, text + len, text_cap - len - 1, len);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        len += n;
+    }
+    text[len] = '\0';
+    return len;
+}
+
+/* Mounts */
+
+// Mount points and sources escape space, tab, newline and backslash as \ooo
+static void copy_unescaped(char *out, size_t out_len, const char *in) {
+    size_t n = 0;
+
+    while (*in && n + 1 < out_len) {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' && in[2] <= '7' &&
+            in[3] >= '0' && in[3] <= '7') {
+            out[n++] = (in[1] - '0') << 6 | (in[2] - '0') << 3 | (in[3] - '0');
+            in += 4;
+        } else {
+            out[n++] = *in++;
+        }
+    }
+    out[n] = '\0';
+}
+
+static int pseudo_type(const char *type) {
+    for (size_t i = 0; i < sizeof(pseudo_types) / sizeof(pseudo_types[0]); i++) {
+        if (strcmp(type, pseudo_types[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+// "id parent major:minor root mount options [optional...] - type source super"
+static int parse_mount(char *line, storage_mount *m) {
+    char *save = NULL;
+    char *field[6];
+
+    for (int i = 0; i < 6; i++) {
+        field[i] = strtok_r(i ? NULL : line, " ", &save);
+        if (!field[i]) return -1;
+    }
+    // Optional fields run up to a lone "-"
+    char *tok;
+    do {
+        tok = strtok_r(NULL, " ", &save);
+    } while (tok && strcmp(tok, "-") != 0);
+    char *type = strtok_r(NULL, " ", &save);
+    char *source = strtok_r(NULL, " ", &save);
+    if (!tok || !type || !source) return -1;
+    if (pseudo_type(type) || sscanf(field[2], "%u:%u", &m->major, &m->minor) != 2) return -1;
+
+    copy_unescaped(m->mount, sizeof(m->mount), field[4]);
+    copy_unescaped(m->source, sizeof(m->source), source);
+    snprintf(m->type, sizeof(m->type), "%s", type);
+    m->readonly = strncmp(field[5], "ro", 2) == 0 && (field[5][2] == ',' || !field[5][2]);
+    return 0;
+}
+
+static void load_mounts(void) {
+    mount_count = 0;
+    if (read_text(mountinfo_fd) < 0) return;
+
+    char *save = NULL;
+    for (char *line = strtok_r(text, "\n", &save); line && mount_count < STORAGE_MAX_MOUNTS;
+         line = strtok_r(NULL, "\n", &save)) {
+        storage_mount m = {0};
+        if (parse_mount(line, &m) < 0) continue;
+
+        // A bind mount shows the same filesystem again; the first place it is mounted names it
+        int seen = 0;
+        for (int i = 0; i < mount_count && !seen; i++) {
+            seen = mounts[i].major == m.major && mounts[i].minor == m.minor;
+        }
+        if (!seen) mounts[mount_count++] = m;
+    }
+}
+
+// Whether the mount list must be parsed again; nothing else is done about a change
+static int mounts_changed(void) {
+    if (mountinfo_fd < 0) {
+        mountinfo_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+        return mountinfo_fd >= 0;
+    }
+
+    // The kernel flags the table with POLLPRI after every mount or unmount
+    struct pollfd pfd = { .fd = mountinfo_fd, .events = POLLPRI };
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR));
+}
+
+static void stat_mounts(void) {
+    for (int i = 0; i < mount_count; i++) {
+        storage_mount *m = &mounts[i];
+        struct statvfs fs;
+
+        m->valid = statvfs(m->mount, &fs) == 0 && fs.f_blocks > 0;
+        if (!m->valid) continue;
+        m->total = (unsigned long long)fs.f_blocks * fs.f_frsize;
+        m->free = (unsigned long long)fs.f_bfree * fs.f_frsize;
+        m->avail = (unsigned long long)fs.f_bavail * fs.f_frsize;
+        m->files = fs.f_files;
+        m->files_free = fs.f_ffree;
+    }
+}
+
+// Like df: the space reserved for root does not count as available
+static double mount_usage(const storage_mount *m) {
+    unsigned long long used = m->total - m->free;
+    return used + m->avail ? used * 100.0 / (used + m->avail) : 0;
+}
+
+/* Devices */
+
+static storage_device* device_get(const char *name, unsigned major, unsigned minor) {
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i].name, name) == 0) return &devices[i];
+    }
+    if (device_count >= STORAGE_MAX_DEVICES) return NULL;
+
+    storage_device *d = &devices[device_count++];
+    char path[64 + STORAGE_NAME_MAX];
+    memset(d, 0, sizeof(*d));
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    d->major = major;
+    d->minor = minor;
+    snprintf(path, sizeof(path), "/sys/class/block/%s/partition", name);
+    d->partition = access(path, F_OK) == 0;
+    return d;
+}
+
+static void sample_devices(double elapsed) {
+    if (diskstats_fd < 0) diskstats_fd = open("/proc/diskstats", O_RDONLY | O_CLOEXEC);
+    if (diskstats_fd < 0 || read_text(diskstats_fd) < 0) return;
+
+    generation++;
+    char *save = NULL;
+    for (char *line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char name[STORAGE_NAME_MAX];
+        unsigned major, minor, in_flight;
+        unsigned long long reads, read_sectors, writes, write_sectors, io_ms;
+
+        if (sscanf(line, "%u %u %31s %llu %*u %llu %*u %llu %*u %llu %*u %u %llu",
+                   &major, &minor, name, &reads, &read_sectors, &writes, &write_sectors,
+                   &in_flight, &io_ms) != 9) {
+            continue;
+        }
+        // Loop and RAM devices nobody uses would only be noise
+        if (!reads && !writes) continue;
+
+        storage_device *d = device_get(name, major, minor);
+        if (!d) continue;
+
+        if (d->seen && elapsed > 0) {
+            d->read_iops = (reads - d->reads) / elapsed;
+            d->write_iops = (writes - d->writes) / elapsed;
+            d->read_rate = (read_sectors - d->read_sectors) * SECTOR_SIZE / elapsed;
+            d->write_rate = (write_sectors - d->write_sectors) * SECTOR_SIZE / elapsed;
+            d->util = (io_ms - d->io_ms) / (elapsed * 10);
+            if (d->util > 100) d->util = 100;
+        }
+        d->reads = reads;
+        d->writes = writes;
+        d->read_sectors = read_sectors;
+        d->write_sectors = write_sectors;
+        d->io_ms = io_ms;
+        d->in_flight = in_flight;
+        d->seen = generation;
+    }
+
+    // Devices that went away (a USB stick pulled) are dropped
+    for (int i = 0; i < device_count; ) {
+        if (devices[i].seen != generation) {
+            devices[i] = devices[--device_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+static const storage_device* device_by_number(unsigned major, unsigned minor) {
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].major == major && devices[i].minor == minor) return &devices[i];
+    }
+    return NULL;
+}
+
+/* Sampling */
+
+static void sample_locked(void) {
+    uint64_t now = monotonic_ms();
+    if (sampled_at && now - sampled_at < STORAGE_SAMPLE_MIN_MS) return;
+
+    if (mounts_changed()) load_mounts();
+    stat_mounts();
+    interval_ms = sampled_at ? now - sampled_at : 0;
+    sample_devices(interval_ms / 1000.0);
+    sampled_at = now;
+
+    storage_summary s = {0};
+    for (int i = 0; i < mount_count; i++) {
+        // Read-only images such as the squashfs root are always full
+        if (!mounts[i].valid || mounts[i].readonly) continue;
+        double usage = mount_usage(&mounts[i]);
+        if (usage > s.max_usage) s.max_usage = usage;
+    }
+    for (int i = 0; i < device_count; i++) {
+        const storage_device *d = &devices[i];
+        if (d->util > s.max_util) s.max_util = d->util;
+        // Partitions are already counted in their disk
+        if (d->partition) continue;
+        s.read_rate += d->read_rate;
+        s.write_rate += d->write_rate;
+    }
+    summary_now = s;
+}
+
+void storage_sample(storage_summary *summary) {
+    pthread_mutex_lock(&lock);
+    sample_locked();
+    if (summary) *summary = summary_now;
+    pthread_mutex_unlock(&lock);
+}
+
+/* JSON */
+
+static void put_string(FILE *out, const char *s) {
+    char *escaped = escape_json_dup(s, strlen(s));
+    fprintf(out, "\"%s\"", escaped ? escaped : "");
+    free(escaped);
+}
+
+static void write_mount(FILE *out, const storage_mount *m) {
+    const storage_device *d = device_by_number(m->major, m->minor);
+    unsigned long long used = m->total - m->free;
+
+    fputs("\n  {\"mount\": ", out);
+    put_string(out, m->mount);
+    fputs(", \"source\": ", out);
+    put_string(out, m->source);
+    fputs(", \"type\": ", out);
+    put_string(out, m->type);
+    fputs(", \"device\": ", out);
+    if (d) {
+        put_string(out, d->name);
+    } else {
+        fputs("null", out);
+    }
+    fprintf(out, ", \"readonly\": %s, \"total\": %llu, \"used\": %llu, \"available\": %llu, "
+                 "\"usage\": %.1f, \"inodes\": %llu, \"inodes_usage\": %.1f}",
+            m->readonly ? "true" : "false", m->total, used, m->avail, mount_usage(m), m->files,
+            m->files ? (m->files - m->files_free) * 100.0 / m->files : 0.0);
+}
+
+static void write_device(FILE *out, const storage_device *d) {
+    fputs("\n  {\"name\": ", out);
+    put_string(out, d->name);
+    fprintf(out, ", \"partition\": %s, \"read_iops\": %.1f, \"write_iops\": %.1f, "
+                 "\"read_rate\": %.0f, \"write_rate\": %.0f, \"util\": %.1f, \"in_flight\": %u, "
+                 "\"read_total\": %llu, \"written_total\": %llu}",
+            d->partition ? "true" : "false", d->read_iops, d->write_iops, d->read_rate,
+            d->write_rate, d->util, d->in_flight, d->read_sectors * SECTOR_SIZE,
+            d->write_sectors * SECTOR_SIZE);
+}
+
+char* storage_json(void) {
+    char *json = NULL;
+    size_t json_len = 0;
+    FILE *out = open_memstream(&json, &json_len);
+    if (!out) return NULL;
+
+    pthread_mutex_lock(&lock);
+
+    // Rates need two samples; until then interval_ms is 0 and they read 0
+    fprintf(out, "{\"interval_ms\": %llu, \"filesystems\": [", (unsigned long long)interval_ms);
+    int first = 1;
+    for (int i = 0; i < mount_count; i++) {
+        if (!mounts[i].valid) continue;
+        if (!first) fputc(',', out);
+        write_mount(out, &mounts[i]);
+        first = 0;
+    }
+    fputs("\n], \"devices\": [", out);
+    for (int i = 0; i < device_count; i++) {
+        if (i) fputc(',', out);
+        write_device(out, &devices[i]);
+    }
+    fputs("\n]}", out);
+    pthread_mutex_unlock(&lock);
+
+    fclose(out);
+    return json;
+}
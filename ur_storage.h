@@ -0,0 +1,32 @@
+#ifndef UR_STORAGE_H
+#define UR_STORAGE_H
+
+#define STORAGE_MAX_MOUNTS 64
+#define STORAGE_MAX_DEVICES 64
+#define STORAGE_PATH_MAX 256
+#define STORAGE_TYPE_MAX 32
+#define STORAGE_NAME_MAX 32
+// Rates over a shorter window are mostly noise; closer callers share a sample
+#define STORAGE_SAMPLE_MIN_MS 1000
+
+// Headline numbers for the metrics stream
+typedef struct {
+    // Fullest filesystem, percent of the space its users can have
+    double max_usage;
+    // Whole disks together, bytes per second
+    double read_rate;
+    double write_rate;
+    // Busiest device, percent of the interval it had I/O in flight
+    double max_util;
+} storage_summary;
+
+// Rereads the mount table if it changed, then every filesystem's usage and
+// the block device counters, unless the last sample is under
+// STORAGE_SAMPLE_MIN_MS old; fills in summary when given
+void storage_sample(storage_summary *summary);
+
+// The /api/storage document: filesystems and devices as of the last
+// storage_sample(), with empty lists until there has been one
+char* storage_json(void);
+
+#endif
@@ -0,0 +1,300 @@
+#include "ur_term.h"
+#include "ur_crypto.h"
+#include "ur_escape.h"
+#include "ur_gzip.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+/*
+ * Terminal history per client. A session is found by its cookie and keeps
+ * its last TERM_HISTORY commands in a ring indexed by sequence number, so
+ * recording a command never moves the others. Each command keeps its
+ * output, cut at TERM_OUTPUT_MAX and gzip-compressed when that pays. All
+ * sessions share one memory budget: over it, the least recently used
+ * sessions are dropped first and the active one gives up its oldest
+ * commands last. /api/terminal/history pages back through the session
+ * newest first, so the UI can load history as it is scrolled to. Commands
+ * are recorded from the heavy worker and paged on the loop, so both hold
+ * term_lock.
+ */
+
+typedef struct {
+    char *command;
+    // gzip_variant() output when compressed, the text itself otherwise
+    char *output;
+    size_t stored_len;
+    size_t output_len;
+    int compressed;
+    int truncated;
+    int exit_status;
+    time_t time;
+    // Counted against the memory budget
+    size_t bytes;
+} term_entry;
+
+typedef struct term_session {
+    char id[TERM_ID_LEN + 1];
+    struct term_session *hash_next;
+    struct term_session *lru_prev;
+    struct term_session *lru_next;
+    // The ring holds sequence numbers [first, next), each at seq % TERM_HISTORY
+    unsigned long long first;
+    unsigned long long next;
+    term_entry ring[TERM_HISTORY];
+} term_session;
+
+static term_session *buckets[TERM_BUCKETS];
+// Most recently used first
+static term_session *lru_head = NULL;
+static term_session *lru_tail = NULL;
+static int session_count = 0;
+static size_t memory_used = 0;
+static size_t memory_cap = TERM_MEMORY_DEFAULT;
+static pthread_mutex_t term_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void term_init(size_t cap) {
+    memory_cap = cap ? cap : TERM_MEMORY_DEFAULT;
+}
+
+/* Sessions */
+
+static unsigned id_hash(const char *id) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < TERM_ID_LEN; i++) {
+        h ^= (unsigned char)id[i];
+        h *= 16777619u;
+    }
+    return h % TERM_BUCKETS;
+}
+
+static void lru_unlink(term_session *s) {
+    if (s->lru_prev) s->lru_prev->lru_next = s->lru_next;
+    else lru_head = s->lru_next;
+    if (s->lru_next) s->lru_next->lru_prev = s->lru_prev;
+    else lru_tail = s->lru_prev;
+    s->lru_prev = s->lru_next = NULL;
+}
+
+static void lru_push(term_session *s) {
+    s->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = s;
+    lru_head = s;
+    if (!lru_tail) lru_tail = s;
+}
+
+static void lru_touch(term_session *s) {
+    if (s == lru_head) return;
+    lru_unlink(s);
+    lru_push(s);
+}
+
+static void entry_clear(term_entry *e) {
+    memory_used -= e->bytes;
+    free(e->command);
+    free(e->output);
+    memset(e, 0, sizeof(*e));
+}
+
+static void drop_oldest(term_session *s) {
+    entry_clear(&s->ring[s->first % TERM_HISTORY]);
+    s->first++;
+}
+
+static void session_free(term_session *s) {
+    while (s->first < s->next) drop_oldest(s);
+
+    term_session **link = &buckets[id_hash(s->id)];
+    while (*link != s) link = &(*link)->hash_next;
+    *link = s->hash_next;
+
+    lru_unlink(s);
+    session_count--;
+    memory_used -= sizeof(*s);
+    free(s);
+}
+
+// The session named by the request's cookie, if it is still around
+static term_session* session_lookup(const http_request *req) {
+    size_t len;
+    const char *cookie = http_request_header(req, "Cookie", &len);
+    if (!cookie) return NULL;
+
+    const char *end = cookie + len;
+    size_t name_len = strlen(TERM_COOKIE "=");
+    while (cookie < end) {
+        while (cookie < end && (*cookie == ' ' || *cookie == ';')) cookie++;
+        const char *stop = memchr(cookie, ';', end - cookie);
+        if (!stop) stop = end;
+
+        if ((size_t)(stop - cookie) == name_len + TERM_ID_LEN &&
+            memcmp(cookie, TERM_COOKIE "=", name_len) == 0) {
+            const char *id = cookie + name_len;
+            for (term_session *s = buckets[id_hash(id)]; s; s = s->hash_next) {
+                if (memcmp(s->id, id, TERM_ID_LEN) == 0) return s;
+            }
+            return NULL;
+        }
+        cookie = stop;
+    }
+    return NULL;
+}
+
+// Ids are always fresh, so a client cannot pick one for somebody else to use
+static term_session* session_create(http_response *res) {
+    unsigned char raw[TERM_ID_LEN / 2];
+
+    if (session_count >= TERM_MAX_SESSIONS) session_free(lru_tail);
+
+    term_session *s = calloc(1, sizeof(*s));
+    if (!s || random_bytes(raw, sizeof(raw)) < 0) {
+        free(s);
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(raw); i++) sprintf(s->id + 2 * i, "%02x", raw[i]);
+    s->first = s->next = 1;
+
+    unsigned h = id_hash(s->id);
+    s->hash_next = buckets[h];
+    buckets[h] = s;
+    lru_push(s);
+    session_count++;
+    memory_used += sizeof(*s);
+
+    response_header(res, "Set-Cookie: " TERM_COOKIE "=%s; Path=/; HttpOnly; SameSite=Strict", s->id);
+    return s;
+}
+
+// Over budget, idle sessions go least recently used first, then the active one's oldest commands
+static void term_trim(term_session *active) {
+    while (memory_used > memory_cap && lru_tail && lru_tail != active) session_free(lru_tail);
+    while (memory_used > memory_cap && active->next - active->first > 1) drop_oldest(active);
+}
+
+static void term_store(term_session *s, const char *command, const char *output, int exit_status) {
+    lru_touch(s);
+
+    if (s->next - s->first == TERM_HISTORY) drop_oldest(s);
+    term_entry *e = &s->ring[s->next % TERM_HISTORY];
+
+    // One command may take at most a quarter of the budget
+    size_t len = output ? strlen(output) : 0;
+    size_t max = memory_cap / 4 < TERM_OUTPUT_MAX ? memory_cap / 4 : TERM_OUTPUT_MAX;
+    size_t keep = len < max ? len : max;
+
+    if (keep >= TERM_COMPRESS_MIN) e->output = gzip_variant(output, keep, &e->stored_len);
+    if (e->output) {
+        e->compressed = 1;
+    } else if ((e->output = malloc(keep + 1))) {
+        if (keep) memcpy(e->output, output, keep);
+        e->output[keep] = '\0';
+        e->stored_len = keep;
+    }
+    e->command = strdup(command);
+    if (!e->command || !e->output) {
+        entry_clear(e);
+        return;
+    }
+
+    e->output_len = keep;
+    e->truncated = keep < len;
+    e->exit_status = exit_status;
+    e->time = time(NULL);
+    e->bytes = strlen(command) + 1 + e->stored_len;
+    memory_used += e->bytes;
+    s->next++;
+
+    term_trim(s);
+}
+
+void term_record(const http_request *req, http_response *res, const char *command,
+                 const char *output, int exit_status) {
+    pthread_mutex_lock(&term_lock);
+    term_session *s = session_lookup(req);
+    if (!s) s = session_create(res);
+    if (s) term_store(s, command, output, exit_status);
+    pthread_mutex_unlock(&term_lock);
+}
+
+/* HTTP */
+
+static void write_entry(FILE *out, unsigned long long seq, const term_entry *e) {
+    char *text = e->output;
+    if (e->compressed) {
+        text = malloc(e->output_len + 1);
+        if (text && gzip_inflate(e->output, e->stored_len, text, e->output_len) < 0) {
+            free(text);
+            text = NULL;
+        }
+        if (text) text[e->output_len] = '\0';
+    }
+
+    char *command = escape_json_dup(e->command, strlen(e->command));
+    char *output = text ? escape_json_dup(text, e->output_len) : NULL;
+    if (text != e->output) free(text);
+
+    fprintf(out, "\n  {\"seq\": %llu, \"time\": %lld, \"command\": \"%s\", \"exit_status\": %d, "
+                 "\"truncated\": %s, \"output\": \"",
+            seq, (long long)e->time, command ? command : "", e->exit_status,
+            e->truncated ? "true" : "false");
+    if (output) fputs(output, out);
+    fputs("\"}", out);
+
+    free(command);
+    free(output);
+}
+
+// Newest first; ?before=<seq> continues from the "more" cursor of the previous page
+static void api_terminal_history(http_request *req, http_response *res) {
+    char param[32];
+    int limit = TERM_PAGE_DEFAULT;
+    unsigned long long before = ULLONG_MAX;
+
+    if (query_get_param(req->query, "limit", param, sizeof(param)) == 0) {
+        limit = atoi(param);
+        if (limit < 1) limit = 1;
+        if (limit > TERM_PAGE_MAX) limit = TERM_PAGE_MAX;
+    }
+    if (query_get_param(req->query, "before", param, sizeof(param)) == 0) {
+        before = strtoull(param, NULL, 10);
+    }
+
+    char *json = NULL;
+    size_t json_len = 0;
+    FILE *out = open_memstream(&json, &json_len);
+    if (!out) {
+        response_error(res, 500, "Memory allocation error");
+        return;
+    }
+
+    pthread_mutex_lock(&term_lock);
+    term_session *s = session_lookup(req);
+    unsigned long long first = s ? s->first : 0;
+    unsigned long long seq = s ? s->next : 0;
+    if (before < seq) seq = before;
+
+    if (s) lru_touch(s);
+    fputs("{\"commands\": [", out);
+    for (int n = 0; seq > first && n < limit; n++) {
+        seq--;
+        if (n) fputc(',', out);
+        write_entry(out, seq, &s->ring[seq % TERM_HISTORY]);
+    }
+    if (seq > first) {
+        fprintf(out, "\n], \"more\": %llu}", seq);
+    } else {
+        fputs("\n], \"more\": null}", out);
+    }
+    pthread_mutex_unlock(&term_lock);
+    fclose(out);
+
+    response_json(res, 200, json);
+}
+
+void term_register_routes(router *r) {
+    router_add(r, HTTP_GET, "/api/terminal/history", api_terminal_history, CACHE_NO_STORE);
+    router_set_class(r, "/api/terminal/history", ROUTE_LIGHT);
+}
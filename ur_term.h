@@ -0,0 +1,33 @@
+#ifndef UR_TERM_H
+#define UR_TERM_H
+
+#include <stddef.h>
+#include "ur_router.h"
+
+#define TERM_COOKIE "ur_term"
+// Random session ids, as hex
+#define TERM_ID_LEN 32
+// Commands remembered per session; a power of two
+#define TERM_HISTORY 64
+#define TERM_MAX_SESSIONS 128
+#define TERM_BUCKETS 256
+// Output kept per command; the rest is cut off
+#define TERM_OUTPUT_MAX (256 * 1024)
+// Shorter output is not worth compressing
+#define TERM_COMPRESS_MIN 512
+// Retained commands and output across all sessions
+#define TERM_MEMORY_DEFAULT (4 * 1024 * 1024)
+#define TERM_PAGE_DEFAULT 20
+#define TERM_PAGE_MAX 100
+
+// memory_cap in bytes; zero selects TERM_MEMORY_DEFAULT
+void term_init(size_t memory_cap);
+
+// Remembers a command run for this client, starting a session (and setting
+// its cookie on res) when the request does not carry a live one
+void term_record(const http_request *req, http_response *res, const char *command,
+                 const char *output, int exit_status);
+
+void term_register_routes(router *r);
+
+#endif
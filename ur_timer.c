@@ -0,0 +1,132 @@
+#include "ur_timer.h"
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Hierarchical timing wheel: four levels of 64 slots at 100 ms per tick
+ * covers about 19 days. Arming and cancelling are O(1) list operations;
+ * timers on the outer levels are cascaded inward as the wheel turns.
+ */
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_MAX_DELTA ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS))
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(timer_wheel *wheel, uint64_t now_ms) {
+    wheel->now = now_ms / TIMER_TICK_MS;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            ur_timer *head = &wheel->slots[level][slot];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+}
+
+void timer_init(ur_timer *timer, timer_callback callback, void *data) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+int timer_pending(const ur_timer *timer) {
+    return timer->next != NULL;
+}
+
+static void wheel_place(timer_wheel *wheel, ur_timer *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+
+    while (level < TIMER_LEVELS - 1 &&
+           delta >= ((uint64_t)1 << (TIMER_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+
+    ur_timer *head = &wheel->slots[level][(timer->expires >> (TIMER_SLOT_BITS * level)) & TIMER_MASK];
+    timer->next = head->next;
+    timer->prev = head;
+    head->next->prev = timer;
+    head->next = timer;
+}
+
+static void wheel_unlink(ur_timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+void timer_arm(timer_wheel *wheel, ur_timer *timer, uint64_t delay_ms) {
+    uint64_t ticks = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (ticks == 0) ticks = 1;
+    if (ticks >= TIMER_MAX_DELTA) ticks = TIMER_MAX_DELTA - 1;
+
+    if (timer_pending(timer)) {
+        wheel_unlink(timer);
+    } else {
+        wheel->count++;
+    }
+
+    timer->expires = wheel->now + ticks;
+    wheel_place(wheel, timer);
+}
+
+void timer_cancel(timer_wheel *wheel, ur_timer *timer) {
+    if (!timer_pending(timer)) return;
+    wheel_unlink(timer);
+    wheel->count--;
+}
+
+static void wheel_cascade(timer_wheel *wheel, int level) {
+    ur_timer *head = &wheel->slots[level][(wheel->now >> (TIMER_SLOT_BITS * level)) & TIMER_MASK];
+
+    while (head->next != head) {
+        ur_timer *timer = head->next;
+        wheel_unlink(timer);
+        wheel_place(wheel, timer);
+    }
+}
+
+void timer_wheel_advance(timer_wheel *wheel, uint64_t now_ms) {
+    uint64_t target = now_ms / TIMER_TICK_MS;
+
+    while (wheel->now < target) {
+        wheel->now++;
+
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if (wheel->now & (((uint64_t)1 << (TIMER_SLOT_BITS * level)) - 1)) break;
+            wheel_cascade(wheel, level);
+        }
+
+        ur_timer *head = &wheel->slots[0][wheel->now & TIMER_MASK];
+        while (head->next != head) {
+            ur_timer *timer = head->next;
+            wheel_unlink(timer);
+            wheel->count--;
+            timer->callback(timer);
+        }
+    }
+}
+
+int timer_wheel_timeout(const timer_wheel *wheel, uint64_t now_ms) {
+    if (wheel->count == 0) return -1;
+
+    uint64_t tick = wheel->now + 1;
+    for (; tick <= wheel->now + TIMER_SLOTS; tick++) {
+        const ur_timer *head = &wheel->slots[0][tick & TIMER_MASK];
+        if (head->next != head) break;
+        // Outer levels cascade on slot boundaries; wake up for those too
+        if ((tick & TIMER_MASK) == 0) break;
+    }
+
+    uint64_t due = tick * TIMER_TICK_MS;
+    return due > now_ms ? (int)(due - now_ms) : 0;
+}
@@ -0,0 +1,48 @@
+#ifndef UR_TIMER_H
+#define UR_TIMER_H
+
+#include <stdint.h>
+
+#define TIMER_TICK_MS 100
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+typedef struct ur_timer ur_timer;
+
+typedef void (*timer_callback)(ur_timer *timer);
+
+struct ur_timer {
+    ur_timer *next;
+    ur_timer *prev;
+    uint64_t expires;
+    timer_callback callback;
+    void *data;
+};
+
+typedef struct {
+    uint64_t now;
+    ur_timer slots[TIMER_LEVELS][TIMER_SLOTS];
+    int count;
+} timer_wheel;
+
+void timer_wheel_init(timer_wheel *wheel, uint64_t now_ms);
+
+void timer_init(ur_timer *timer, timer_callback callback, void *data);
+
+// (Re)arms the timer to fire after delay_ms; O(1)
+void timer_arm(timer_wheel *wheel, ur_timer *timer, uint64_t delay_ms);
+
+void timer_cancel(timer_wheel *wheel, ur_timer *timer);
+
+int timer_pending(const ur_timer *timer);
+
+// Fires every timer due at now_ms
+void timer_wheel_advance(timer_wheel *wheel, uint64_t now_ms);
+
+// Milliseconds until the next timer may fire, or -1 when none are armed
+int timer_wheel_timeout(const timer_wheel *wheel, uint64_t now_ms);
+
+uint64_t monotonic_ms(void);
+
+#endif
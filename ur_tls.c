@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include "ur_tls.h"
+
+#ifdef UR_HAVE_TLS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/*
+ * HTTPS on a second listener. Connections go through the same state
+ * machine as plain ones; ur_conn.c only trades read() and send() for the
+ * calls here. Once the handshake is done OpenSSL hands the keys to the
+ * kernel where it can (kTLS, the "tls" TCP ULP), and from then on what is
+ * written to the socket leaves encrypted, so responses take the ordinary
+ * sendmsg() and sendfile() paths again. Reads always go through the
+ * session, which deals with whatever records the kernel passes up.
+ *
+ * Returning clients resume with session tickets instead of a full
+ * handshake, and the server keeps nothing per session. The ticket key
+ * belongs to the context, which TLS_RELOAD_SIGNAL replaces along with the
+ * certificate: connections keep the context they started on, and tickets
+ * from before a reload just cost one full handshake.
+ */
+
+static SSL_CTX *context = NULL;
+static char *cert_path = NULL;
+static char *key_path = NULL;
+static int offload_reported = 0;
+
+static void print_errors(const char *what) {
+    unsigned long err;
+    char text[256];
+
+    while ((err = ERR_get_error())) {
+        ERR_error_string_n(err, text, sizeof(text));
+        fprintf(stderr, "tls: %s: %s\n", what, text);
+    }
+}
+
+static SSL_CTX* context_load(void) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        print_errors("context");
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_ENABLE_KTLS);
+    // Tickets carry the session; there is no cache to hold it as well
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_timeout(ctx, TLS_TICKET_LIFETIME);
+    // A write may stop after any record and is picked up again from where it
+    // stopped; idle connections give their buffers back
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+
+    const char *failed = NULL;
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1) {
+        failed = cert_path;
+    } else if (SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+               SSL_CTX_check_private_key(ctx) != 1) {
+        failed = key_path;
+    }
+    if (failed) {
+        print_errors(failed);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+int tls_init(const char *cert_file, const char *key_file) {
+    cert_path = strdup(cert_file);
+    key_path = strdup(key_file ? key_file : cert_file);
+    if (!cert_path || !key_path) return -1;
+
+    context = context_load();
+    return context ? 0 : -1;
+}
+
+/* Sessions */
+
+// Whether a call that returned ret is only waiting on the socket; *want says for what
+static int waiting(tls_conn *t, int ret, unsigned *want) {
+    int err = SSL_get_error(t, ret);
+
+    *want = err == SSL_ERROR_WANT_READ ? EVENT_READ : err == SSL_ERROR_WANT_WRITE ? EVENT_WRITE : 0;
+    // Nothing of a failed connection is left queued for the next one to trip over
+    if (!*want) ERR_clear_error();
+    return *want != 0;
+}
+
+tls_conn* tls_new(int fd) {
+    SSL *ssl = SSL_new(context);
+    if (!ssl) return NULL;
+
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+int tls_handshake(tls_conn *t, unsigned *want) {
+    int ret = SSL_do_handshake(t);
+
+    if (ret != 1) return waiting(t, ret, want) ? 0 : -1;
+
+    if (!offload_reported) {
+        offload_reported = 1;
+        printf(tls_offloaded(t) ? "TLS: sends offloaded to the kernel\n"
+                                : "TLS: kernel TLS unavailable, encrypting in userspace\n");
+    }
+    return 1;
+}
+
+ssize_t tls_read(tls_conn *t, void *buf, size_t len, unsigned *want) {
+    size_t n = 0;
+    int ret = SSL_read_ex(t, buf, len, &n);
+
+    *want = 0;
+    if (ret == 1) return n;
+    if (SSL_get_error(t, ret) == SSL_ERROR_ZERO_RETURN) return 0;
+    waiting(t, ret, want);
+    return -1;
+}
+
+ssize_t tls_write(tls_conn *t, const void *buf, size_t len, unsigned *want) {
+    size_t n = 0;
+    int ret = SSL_write_ex(t, buf, len, &n);
+
+    *want = 0;
+    if (ret == 1) return n;
+    waiting(t, ret, want);
+    return -1;
+}
+
+int tls_offloaded(tls_conn *t) {
+    return BIO_get_ktls_send(SSL_get_wbio(t));
+}
+
+void tls_close(tls_conn *t) {
+    if (!SSL_is_init_finished(t) || (SSL_get_shutdown(t) & SSL_SENT_SHUTDOWN)) return;
+    SSL_shutdown(t);
+    ERR_clear_error();
+}
+
+void tls_free(tls_conn *t) {
+    SSL_free(t);
+}
+
+/* Reload */
+
+static void tls_reload(void) {
+    SSL_CTX *ctx = context_load();
+    if (!ctx) {
+        fprintf(stderr, "tls: keeping the certificate already loaded\n");
+        return;
+    }
+
+    // Sessions still open hold a reference to the old one
+    SSL_CTX_free(context);
+    context = ctx;
+    printf("TLS: reloaded %s\n", cert_path);
+}
+
+static void on_reload_signal(int sig) {
+    (void)sig;
+    tls_reload();
+}
+
+void tls_watch(event_loop *loop) {
+    event_signal(loop, TLS_RELOAD_SIGNAL, on_reload_signal);
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef UR_TLS_H
+#define UR_TLS_H
+
+#include <sys/types.h>
+#include "ur_event.h"
+
+// Sent to the running server to load the certificate and key again
+#define TLS_RELOAD_SIGNAL SIGHUP
+// Seconds a session ticket is good for; a client back within it skips the full handshake
+#define TLS_TICKET_LIFETIME (4 * 3600)
+
+// One connection's session; OpenSSL's SSL underneath
+typedef struct ssl_st tls_conn;
+
+#ifdef UR_HAVE_TLS
+
+// Loads a PEM certificate chain and its key; key_file may be NULL when
+// cert_file holds both. Returns -1 when they cannot be used.
+int tls_init(const char *cert_file, const char *key_file);
+
+// Reloads the certificate and key on TLS_RELOAD_SIGNAL
+void tls_watch(event_loop *loop);
+
+// Starts a server session on an accepted socket, or NULL
+tls_conn* tls_new(int fd);
+
+// Moves the handshake on: 1 once it is done, 0 while it waits for the
+// socket to become ready for *want (EVENT_READ or EVENT_WRITE), -1 on failure
+int tls_handshake(tls_conn *t, unsigned *want);
+
+// Like read() and send() on the decrypted stream. -1 with *want set means
+// try again once the socket is ready for it, -1 with *want zero a failure.
+// Reads return 0 once the peer has closed.
+ssize_t tls_read(tls_conn *t, void *buf, size_t len, unsigned *want);
+ssize_t tls_write(tls_conn *t, const void *buf, size_t len, unsigned *want);
+
+// Whether the kernel encrypts what is written to the socket (kTLS), so that
+// plain send() and sendfile() on it can be used instead of tls_write()
+int tls_offloaded(tls_conn *t);
+
+// Sends close_notify if the socket takes it right away; only the first call does anything
+void tls_close(tls_conn *t);
+
+void tls_free(tls_conn *t);
+
+#endif
+
+#endif
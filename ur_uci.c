@@ -0,0 +1,588 @@
+#include "ur_uci.h"
+#include "ur_conn.h"
+#include "ur_crypto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+/*
+ * Read-only view of the UCI configuration in /etc/config, without forking
+ * uci or cat. A package is parsed the first time it is asked for and kept,
+ * rendered JSON and ETag included, until its file changes: an inotify watch
+ * on the directory marks just that package stale. Where inotify is not
+ * available every request compares the file's stat with the one parsed.
+ *
+ * The format is the one libuci reads:
+ *
+ *   config <type> ['<name>']
+ *       option <name> '<value>'
+ *       list <name> '<value>'
+ *
+ * with '#' comments, single quotes taken literally, double quotes and bare
+ * words with backslash escapes, and adjacent quoted parts joined together.
+ */
+
+typedef struct intern_str {
+    struct intern_str *next;
+    unsigned hash;
+    int refs;
+    size_t len;
+    char data[];
+} intern_str;
+
+static intern_str *interned[UCI_INTERN_BUCKETS];
+static char config_dir[PATH_MAX] = UCI_DEFAULT_DIR;
+static uci_package *packages[UCI_MAX_PACKAGES];
+static int package_count = 0;
+
+// 0 until the first request, then 1 while inotify watches the directory, -1 without
+static int watch_state = 0;
+static int watch_fd = -1;
+static event_handler watch_io;
+
+void uci_init(const char *dir) {
+    if (dir && *dir) snprintf(config_dir, sizeof(config_dir), "%s", dir);
+}
+
+/* String interning */
+
+static unsigned str_hash(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Returns the shared copy of s with one more reference, or NULL if out of memory
+static const char* intern(const char *s, size_t len) {
+    unsigned h = str_hash(s, len);
+    intern_str **bucket = &interned[h % UCI_INTERN_BUCKETS];
+
+    for (intern_str *e = *bucket; e; e = e->next) {
+        if (e->hash == h && e->len == len && memcmp(e->data, s, len) == 0) {
+            e->refs++;
+            return e->data;
+        }
+    }
+
+    intern_str *e = malloc(sizeof(intern_str) + len + 1);
+    if (!e) return NULL;
+    e->hash = h;
+    e->refs = 1;
+    e->len = len;
+    memcpy(e->data, s, len);
+    e->data[len] = '\0';
+    e->next = *bucket;
+    *bucket = e;
+    return e->data;
+}
+
+static void intern_release(const char *s) {
+    if (!s) return;
+
+    intern_str *e = (intern_str *)(s - offsetof(intern_str, data));
+    if (--e->refs > 0) return;
+
+    intern_str **p = &interned[e->hash % UCI_INTERN_BUCKETS];
+    while (*p != e) p = &(*p)->next;
+    *p = e->next;
+    free(e);
+}
+
+/* Model */
+
+static void package_clear(uci_package *pkg) {
+    for (int i = 0; i < pkg->section_count; i++) {
+        uci_section *sec = &pkg->sections[i];
+        for (int j = 0; j < sec->option_count; j++) {
+            uci_option *opt = &sec->options[j];
+            for (int k = 0; k < opt->value_count; k++) intern_release(opt->values[k]);
+            intern_release(opt->name);
+            free(opt->values);
+        }
+        intern_release(sec->type);
+        intern_release(sec->name);
+        free(sec->options);
+    }
+    free(pkg->sections);
+    free(pkg->json);
+    pkg->sections = NULL;
+    pkg->section_count = 0;
+    pkg->json = NULL;
+    pkg->json_len = 0;
+}
+
+static uci_section* section_add(uci_package *pkg, const char *type, const char *name) {
+    uci_section *grown = realloc(pkg->sections, (pkg->section_count + 1) * sizeof(uci_section));
+    if (!grown) return NULL;
+    pkg->sections = grown;
+
+    uci_section *sec = &pkg->sections[pkg->section_count++];
+    memset(sec, 0, sizeof(*sec));
+    sec->type = type;
+    sec->name = name;
+    return sec;
+}
+
+// Takes over the references to name and value
+static int option_set(uci_section *sec, const char *name, const char *value, int is_list) {
+    uci_option *opt = NULL;
+
+    // Interned names compare by address
+    for (int i = 0; i < sec->option_count; i++) {
+        if (sec->options[i].name == name) opt = &sec->options[i];
+    }
+
+    if (!opt) {
+        uci_option *grown = realloc(sec->options, (sec->option_count + 1) * sizeof(uci_option));
+        if (!grown) return -1;
+        sec->options = grown;
+        opt = &sec->options[sec->option_count++];
+        memset(opt, 0, sizeof(*opt));
+        opt->name = name;
+    } else {
+        intern_release(name);
+        // A later option replaces what came before, as with libuci
+        if (!is_list) {
+            for (int i = 0; i < opt->value_count; i++) intern_release(opt->values[i]);
+            opt->value_count = 0;
+        }
+    }
+
+    const char **values = realloc(opt->values, (opt->value_count + 1) * sizeof(char *));
+    if (!values) {
+        intern_release(value);
+        return -1;
+    }
+    opt->values = values;
+    opt->values[opt->value_count++] = value;
+    opt->is_list = is_list;
+    return 0;
+}
+
+/* Parser */
+
+typedef struct {
+    const char *p;
+    const char *end;
+    int line;
+    // One token at a time; no token is longer than the file
+    char *token;
+    size_t token_len;
+    char *error;
+    size_t error_len;
+} uci_parser;
+
+static int parse_error(uci_parser *ps, const char *message) {
+    snprintf(ps->error, ps->error_len, "line %d: %s", ps->line, message);
+    return -1;
+}
+
+// Reads the next word of the current statement; 1 if there was one, 0 at the end of the line
+static int next_token(uci_parser *ps) {
+    while (ps->p < ps->end && (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\r')) ps->p++;
+    if (ps->p < ps->end && *ps->p == '#') {
+        while (ps->p < ps->end && *ps->p != '\n') ps->p++;
+    }
+    if (ps->p == ps->end || *ps->p == '\n') return 0;
+
+    size_t n = 0;
+    while (ps->p < ps->end) {
+        char c = *ps->p;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') break;
+
+        if (c == '\'' || c == '"') {
+            ps->p++;
+            while (ps->p < ps->end && *ps->p != c) {
+                if (c == '"' && *ps->p == '\\' && ps->p + 1 < ps->end) ps->p++;
+                if (*ps->p == '\n') ps->line++;
+                ps->token[n++] = *ps->p++;
+            }
+            if (ps->p == ps->end) return parse_error(ps, "unterminated quote");
+            ps->p++;
+        } else if (c == '\\' && ps->p + 1 < ps->end) {
+            // A backslash before the newline continues the line
+            if (ps->p[1] == '\n') {
+                ps->line++;
+            } else {
+                ps->token[n++] = ps->p[1];
+            }
+            ps->p += 2;
+        } else {
+            ps->token[n++] = *ps->p++;
+        }
+    }
+    ps->token[n] = '\0';
+    ps->token_len = n;
+    return 1;
+}
+
+// The next word, interned; NULL with the error set if there is none
+static const char* next_word(uci_parser *ps, const char *what) {
+    int r = next_token(ps);
+    if (r == 0) parse_error(ps, what);
+    if (r <= 0) return NULL;
+
+    const char *word = intern(ps->token, ps->token_len);
+    if (!word) parse_error(ps, "out of memory");
+    return word;
+}
+
+static int parse_package(uci_package *pkg, uci_parser *ps) {
+    uci_section *sec = NULL;
+
+    while (ps->p < ps->end) {
+        int r = next_token(ps);
+        if (r < 0) return -1;
+        if (r == 0) {
+            if (ps->p < ps->end) ps->p++;
+            ps->line++;
+            continue;
+        }
+
+        char keyword[16];
+        snprintf(keyword, sizeof(keyword), "%s", ps->token);
+
+        if (strcmp(keyword, "package") == 0) {
+            // The file name is the package name
+            if (next_token(ps) <= 0) return parse_error(ps, "package without a name");
+        } else if (strcmp(keyword, "config") == 0) {
+            const char *type = next_word(ps, "section without a type");
+            if (!type) return -1;
+
+            const char *name = NULL;
+            r = next_token(ps);
+            if (r < 0 || (r > 0 && !(name = intern(ps->token, ps->token_len)))) {
+                intern_release(type);
+                return r < 0 ? -1 : parse_error(ps, "out of memory");
+            }
+
+            sec = section_add(pkg, type, name);
+            if (!sec) {
+                intern_release(type);
+                intern_release(name);
+                return parse_error(ps, "out of memory");
+            }
+        } else if (strcmp(keyword, "option") == 0 || strcmp(keyword, "list") == 0) {
+            if (!sec) return parse_error(ps, "option outside a section");
+
+            const char *name = next_word(ps, "option without a name");
+            if (!name) return -1;
+            const char *value = next_word(ps, "option without a value");
+            if (!value) {
+                intern_release(name);
+                return -1;
+            }
+            if (option_set(sec, name, value, keyword[0] == 'l') < 0) {
+                return parse_error(ps, "out of memory");
+            }
+        } else {
+            return parse_error(ps, "unknown keyword");
+        }
+
+        r = next_token(ps);
+        if (r < 0) return -1;
+        if (r > 0) return parse_error(ps, "unexpected text after statement");
+    }
+    return 0;
+}
+
+/* Rendering */
+
+static void put_json_string(FILE *out, const char *s) {
+    if (!s) {
+        fputs("null", out);
+        return;
+    }
+    char *escaped = json_escape_string(s);
+    fprintf(out, "\"%s\"", escaped);
+    free(escaped);
+}
+
+static int package_render(uci_package *pkg) {
+    FILE *out = open_memstream(&pkg->json, &pkg->json_len);
+    if (!out) return -1;
+
+    fprintf(out, "{\"package\": \"%s\", \"sections\": [", pkg->name);
+    for (int i = 0; i < pkg->section_count; i++) {
+        const uci_section *sec = &pkg->sections[i];
+
+        fprintf(out, "%s\n  {\"type\": ", i ? "," : "");
+        put_json_string(out, sec->type);
+        fputs(", \"name\": ", out);
+        put_json_string(out, sec->name);
+        fputs(", \"options\": {", out);
+
+        for (int j = 0; j < sec->option_count; j++) {
+            const uci_option *opt = &sec->options[j];
+
+            if (j) fputs(", ", out);
+            put_json_string(out, opt->name);
+            fputs(": ", out);
+            if (opt->is_list) fputc('[', out);
+            for (int k = 0; k < opt->value_count; k++) {
+                if (k) fputs(", ", out);
+                put_json_string(out, opt->values[k]);
+            }
+            if (opt->is_list) fputc(']', out);
+        }
+        fputs("}}", out);
+    }
+    fputs("\n]}", out);
+    if (fclose(out) != 0) return -1;
+
+    sha256_ctx sha;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    sha256_init(&sha);
+    sha256_update(&sha, pkg->json, pkg->json_len);
+    sha256_final(&sha, digest);
+    sha256_hex(digest, hex);
+    snprintf(pkg->etag, sizeof(pkg->etag), "\"%.20s\"", hex);
+    return 0;
+}
+
+/* Cache */
+
+static int package_load(uci_package *pkg, char *error, size_t error_len) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", config_dir, pkg->name);
+    package_clear(pkg);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        snprintf(error, error_len, "No such package");
+        return 404;
+    }
+    if (st.st_size > UCI_FILE_MAX) {
+        close(fd);
+        snprintf(error, error_len, "Package file too large");
+        return 500;
+    }
+
+    // Room for the file, then for the longest possible token
+    char *data = malloc(2 * (size_t)st.st_size + 2);
+    ssize_t len = data ? read(fd, data, st.st_size) : -1;
+    close(fd);
+    if (len < 0) {
+        free(data);
+        snprintf(error, error_len, "Cannot read package");
+        return 500;
+    }
+
+    uci_parser ps = {
+        .p = data, .end = data + len, .line = 1,
+        .token = data + len + 1, .error = error, .error_len = error_len
+    };
+    int failed = parse_package(pkg, &ps) < 0;
+    free(data);
+
+    if (failed || package_render(pkg) < 0) {
+        if (!failed) snprintf(error, error_len, "Out of memory");
+        package_clear(pkg);
+        return 500;
+    }
+
+    pkg->ino = st.st_ino;
+    pkg->size = st.st_size;
+    pkg->mtime = st.st_mtim;
+    pkg->stale = 0;
+    return 0;
+}
+
+static uci_package* package_find(const char *name) {
+    for (int i = 0; i < package_count; i++) {
+        if (strcmp(packages[i]->name, name) == 0) return packages[i];
+    }
+    return NULL;
+}
+
+// Without inotify a package is stale once its file is not the one parsed
+static int package_changed(const uci_package *pkg) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", config_dir, pkg->name);
+    return stat(path, &st) < 0 || st.st_ino != pkg->ino || st.st_size != pkg->size ||
+           st.st_mtim.tv_sec != pkg->mtime.tv_sec || st.st_mtim.tv_nsec != pkg->mtime.tv_nsec;
+}
+
+static void uci_watch_io(void *data, unsigned events) {
+    (void)data;
+    (void)events;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t n = read(watch_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED)) {
+                // Lost track: everything is suspect, and without the watch stat decides
+                for (int i = 0; i < package_count; i++) packages[i]->stale = 1;
+                if (ev->mask & IN_IGNORED) watch_state = -1;
+                continue;
+            }
+
+            uci_package *pkg = ev->len ? package_find(ev->name) : NULL;
+            if (pkg) pkg->stale = 1;
+        }
+    }
+
+    if (watch_state < 0) {
+        event_del(conn_server_loop(), watch_fd, &watch_io);
+        close(watch_fd);
+        watch_fd = -1;
+    }
+}
+
+// Started with the first request, once the server loop is running
+static void uci_watch(void) {
+    if (watch_state) return;
+    watch_state = -1;
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0) return;
+
+    watch_io.callback = uci_watch_io;
+    watch_io.data = NULL;
+    if (inotify_add_watch(watch_fd, config_dir,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE) < 0 ||
+        event_add(conn_server_loop(), watch_fd, EVENT_READ, &watch_io) < 0) {
+        close(watch_fd);
+        watch_fd = -1;
+        return;
+    }
+    watch_state = 1;
+}
+
+static int valid_package_name(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len >= UCI_NAME_MAX || name[0] == '.') return 0;
+    return strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.") == len;
+}
+
+int uci_get(const char *name, const uci_package **out, char *error, size_t error_len) {
+    if (!valid_package_name(name)) {
+        snprintf(error, error_len, "Invalid package name");
+        return 400;
+    }
+    uci_watch();
+
+    uci_package *pkg = package_find(name);
+    if (!pkg) {
+        if (package_count >= UCI_MAX_PACKAGES) {
+            snprintf(error, error_len, "Too many packages");
+            return 500;
+        }
+        pkg = calloc(1, sizeof(uci_package));
+        if (!pkg) {
+            snprintf(error, error_len, "Out of memory");
+            return 500;
+        }
+        snprintf(pkg->name, sizeof(pkg->name), "%s", name);
+        pkg->stale = 1;
+        packages[package_count++] = pkg;
+    }
+
+    if (!pkg->stale && watch_state < 0 && package_changed(pkg)) pkg->stale = 1;
+    if (pkg->stale) {
+        int status = package_load(pkg, error, error_len);
+        if (status) return status;
+    }
+
+    *out = pkg;
+    return 0;
+}
+
+/* Endpoints */
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static void api_config_list(http_request *req, http_response *res) {
+    (void)req;
+    DIR *dir = opendir(config_dir);
+    if (!dir) {
+        response_error(res, 404, "No configuration directory");
+        return;
+    }
+
+    char *names[UCI_MAX_PACKAGES];
+    int count = 0;
+    struct dirent *d;
+    while ((d = readdir(dir)) && count < UCI_MAX_PACKAGES) {
+        if (d->d_type != DT_REG && d->d_type != DT_UNKNOWN) continue;
+        if (!valid_package_name(d->d_name)) continue;
+        names[count] = strdup(d->d_name);
+        if (names[count]) count++;
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char *), by_name);
+
+    char *json = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&json, &len);
+    if (out) {
+        fputs("{\"packages\": [", out);
+        for (int i = 0; i < count; i++) fprintf(out, "%s\"%s\"", i ? ", " : "", names[i]);
+        fputs("]}", out);
+        fclose(out);
+    }
+    for (int i = 0; i < count; i++) free(names[i]);
+
+    response_json(res, 200, json);
+}
+
+static void api_config_package(http_request *req, http_response *res) {
+    const char *name = req->param_count > 0 ? req->params[0] : "";
+    const uci_package *pkg;
+    char error[128];
+
+    int status = uci_get(name, &pkg, error, sizeof(error));
+    if (status) {
+        response_error(res, status, error);
+        return;
+    }
+
+    response_header(res, "ETag: %s", pkg->etag);
+    const char *if_none_match = http_request_header(req, "If-None-Match", NULL);
+    if (if_none_match && strncmp(if_none_match, pkg->etag, strlen(pkg->etag)) == 0) {
+        res->status = 304;
+        return;
+    }
+
+    // The cached copy is replaced when the file changes, possibly mid-send
+    char *json = malloc(pkg->json_len + 1);
+    if (!json) {
+        response_error(res, 500, "Memory allocation error");
+        return;
+    }
+    memcpy(json, pkg->json, pkg->json_len + 1);
+    response_json(res, 200, json);
+}
+
+void uci_register_routes(router *r) {
+    router_add(r, HTTP_GET, "/api/config", api_config_list, CACHE_REVALIDATE);
+    router_add(r, HTTP_GET, "/api/config/:package", api_config_package, CACHE_REVALIDATE);
+    router_set_class(r, "/api/config", ROUTE_LIGHT);
+    router_set_class(r, "/api/config/:package", ROUTE_LIGHT);
+}
@@ -0,0 +1,57 @@
+#ifndef UR_UCI_H
+#define UR_UCI_H
+
+#include <sys/types.h>
+#include <time.h>
+#include "ur_router.h"
+
+#define UCI_DEFAULT_DIR "/etc/config"
+#define UCI_MAX_PACKAGES 64
+#define UCI_NAME_MAX 64
+// Larger files are not configuration
+#define UCI_FILE_MAX (1024 * 1024)
+#define UCI_INTERN_BUCKETS 1024
+
+typedef struct {
+    const char *name;
+    // One value for an option, any number for a list
+    const char **values;
+    int value_count;
+    int is_list;
+} uci_option;
+
+typedef struct {
+    const char *type;
+    // NULL for an anonymous section
+    const char *name;
+    uci_option *options;
+    int option_count;
+} uci_section;
+
+// One file under the config directory. Every string is interned, so the
+// names and values repeated across sections and packages are stored once.
+typedef struct {
+    char name[UCI_NAME_MAX];
+    uci_section *sections;
+    int section_count;
+    // Set by inotify (or a changed stat without it); parsed again on next use
+    int stale;
+    // Identity of the file parsed, for when inotify is not available
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    // Rendered once per parse and served from here
+    char *json;
+    size_t json_len;
+    char etag[24];
+} uci_package;
+
+void uci_init(const char *dir);
+
+// Finds the named package, parsed again only if its file changed. Returns 0,
+// or the HTTP status for the failure with error filled in.
+int uci_get(const char *name, const uci_package **out, char *error, size_t error_len);
+
+void uci_register_routes(router *r);
+
+#endif
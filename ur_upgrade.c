@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include "ur_upgrade.h"
+#include "ur_conn.h"
+#include "ur_metrics.h"
+#include "ur_history.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/*
+ * Replacing the server without dropping anybody. On UPGRADE_SIGNAL the
+ * running process forks and executes its binary again, which by then may
+ * be a new version. The child gets the listening sockets, so there is
+ * no moment where the port is unbound and nothing queued on it is lost, plus
+ * the metrics history in a memfd and a pipe to say it is up. Only when that
+ * byte arrives does the old process stop accepting and drain: requests in
+ * progress finish, keep-alive answers say Connection: close, and streams run
+ * on until UPGRADE_DRAIN_MS. A replacement that fails to start closes the
+ * pipe without writing and the old process simply carries on.
+ */
+
+extern char **environ;
+
+static char exe_path[4096];
+static char **exec_argv = NULL;
+static int inherited_listener = -1;
+static int inherited_tls_listener = -1;
+static int ready_fd = -1;
+
+static int listen_fd = -1;
+static int tls_listen_fd = -1;
+static event_handler ready_handler;
+static int child_ready = -1;
+static pid_t child = 0;
+
+// Takes a descriptor number out of the environment, so it is not passed on again
+static int env_fd(const char *name) {
+    const char *value = getenv(name);
+    int fd = value ? atoi(value) : -1;
+    unsetenv(name);
+
+    if (fd < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) return -1;
+    return fd;
+}
+
+void upgrade_init(char **argv) {
+    // Resolved now: once the binary is replaced the link names the deleted file
+    ssize_t n = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[n > 0 ? n : 0] = '\0';
+    exec_argv = argv;
+
+    inherited_listener = env_fd(UPGRADE_ENV_LISTEN);
+    inherited_tls_listener = env_fd(UPGRADE_ENV_TLS_LISTEN);
+    ready_fd = env_fd(UPGRADE_ENV_READY);
+
+    int metrics_fd = env_fd(UPGRADE_ENV_METRICS);
+    if (metrics_fd >= 0) {
+        if (metrics_restore(metrics_fd) < 0) fprintf(stderr, "upgrade: metrics history not carried over\n");
+        close(metrics_fd);
+    }
+}
+
+int upgrade_listener(void) {
+    int fd = inherited_listener;
+    inherited_listener = -1;
+    return fd;
+}
+
+int upgrade_tls_listener(void) {
+    int fd = inherited_tls_listener;
+    inherited_tls_listener = -1;
+    return fd;
+}
+
+void upgrade_ready(void) {
+    if (ready_fd < 0) return;
+    if (write(ready_fd, "", 1) != 1) perror("upgrade: ready");
+    close(ready_fd);
+    ready_fd = -1;
+}
+
+/* Replacement */
+
+static void child_done(void) {
+    event_del(conn_server_loop(), child_ready, &ready_handler);
+    close(child_ready);
+    child_ready = -1;
+}
+
+static void ready_io(void *data, unsigned events) {
+    (void)data;
+    (void)events;
+    char byte;
+    ssize_t n;
+
+    do {
+        n = read(child_ready, &byte, 1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    child_done();
+    if (n == 1) {
+        printf("Upgrade: process %d is serving, draining\n", (int)child);
+        // The history file is the replacement's to write now
+        history_stop();
+        conn_server_drain(UPGRADE_DRAIN_MS);
+        return;
+    }
+
+    // Exited, or never got as far as serving
+    fprintf(stderr, "upgrade: replacement failed to start, still serving\n");
+    waitpid(child, NULL, WNOHANG);
+}
+
+// A copy of the environment with the handover descriptors set
+static char** child_environ(int metrics_fd, int ready) {
+    size_t count = 0;
+    while (environ[count]) count++;
+
+    static char vars[4][32];
+    char **env = calloc(count + 5, sizeof(char *));
+    if (!env) return NULL;
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], "UR_", 3) != 0) env[n++] = environ[i];
+    }
+    snprintf(vars[0], sizeof(vars[0]), UPGRADE_ENV_LISTEN "=%d", listen_fd);
+    snprintf(vars[1], sizeof(vars[1]), UPGRADE_ENV_READY "=%d", ready);
+    env[n++] = vars[0];
+    env[n++] = vars[1];
+    if (metrics_fd >= 0) {
+        snprintf(vars[2], sizeof(vars[2]), UPGRADE_ENV_METRICS "=%d", metrics_fd);
+        env[n++] = vars[2];
+    }
+    if (tls_listen_fd >= 0) {
+        snprintf(vars[3], sizeof(vars[3]), UPGRADE_ENV_TLS_LISTEN "=%d", tls_listen_fd);
+        env[n++] = vars[3];
+    }
+    return env;
+}
+
+static void upgrade_start(void) {
+    int ready[2];
+
+    // A replacement that failed to start is reaped here at the latest
+    if (child && waitpid(child, NULL, WNOHANG) == 0) {
+        fprintf(stderr, "upgrade: already in progress\n");
+        return;
+    }
+    if (!exe_path[0] || pipe2(ready, O_CLOEXEC) < 0) {
+        perror("upgrade");
+        return;
+    }
+
+    // The history goes over in a memfd; the new process reads it before serving
+    int metrics_fd = memfd_create("ur_metrics", MFD_CLOEXEC);
+    if (metrics_fd >= 0 && metrics_save(metrics_fd) < 0) {
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+
+    char **env = child_environ(metrics_fd, ready[1]);
+    pid_t pid = env ? fork() : -1;
+    if (pid == 0) {
+        // Only async-signal-safe calls from here: other threads may hold locks
+        fcntl(listen_fd, F_SETFD, 0);
+        if (tls_listen_fd >= 0) fcntl(tls_listen_fd, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        if (metrics_fd >= 0) fcntl(metrics_fd, F_SETFD, 0);
+        execve(exe_path, exec_argv, env);
+        _exit(127);
+    }
+
+    free(env);
+    close(ready[1]);
+    if (metrics_fd >= 0) close(metrics_fd);
+    if (pid < 0) {
+        perror("upgrade: fork");
+        close(ready[0]);
+        return;
+    }
+
+    child = pid;
+    child_ready = ready[0];
+    fcntl(child_ready, F_SETFL, O_NONBLOCK);
+    ready_handler.callback = ready_io;
+    if (event_add(conn_server_loop(), child_ready, EVENT_READ, &ready_handler) < 0) {
+        // Cannot tell when it is up; keep serving alongside it rather than drop anything
+        perror("upgrade: watch");
+        close(child_ready);
+        child_ready = -1;
+    }
+    printf("Upgrade: started %s as process %d\n", exe_path, (int)pid);
+}
+
+/* Signal */
+
+static void on_upgrade_signal(int sig) {
+    (void)sig;
+    upgrade_start();
+}
+
+int upgrade_watch(event_loop *loop, int fd, int tls_fd) {
+    listen_fd = fd;
+    tls_listen_fd = tls_fd;
+    return event_signal(loop, UPGRADE_SIGNAL, on_upgrade_signal);
+}
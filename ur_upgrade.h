@@ -0,0 +1,32 @@
+#ifndef UR_UPGRADE_H
+#define UR_UPGRADE_H
+
+#include "ur_event.h"
+
+// Sent to the running server to replace it with the binary now on disk
+#define UPGRADE_SIGNAL SIGUSR2
+// How long the old process keeps finishing requests and streams
+#define UPGRADE_DRAIN_MS 20000
+
+// Descriptors the old process passes down, by number
+#define UPGRADE_ENV_LISTEN "UR_LISTEN_FD"
+#define UPGRADE_ENV_TLS_LISTEN "UR_TLS_LISTEN_FD"
+#define UPGRADE_ENV_READY "UR_READY_FD"
+#define UPGRADE_ENV_METRICS "UR_METRICS_FD"
+
+// Remembers how this process was started, for executing it again later,
+// and takes over the metrics history when it replaces an older process
+void upgrade_init(char **argv);
+
+// The listening sockets inherited from the process being replaced, or -1
+int upgrade_listener(void);
+int upgrade_tls_listener(void);
+
+// Tells the process being replaced that this one is serving; it then drains and exits
+void upgrade_ready(void);
+
+// Starts a replacement on UPGRADE_SIGNAL, handing it listen_fd and tls_fd,
+// which may be -1
+int upgrade_watch(event_loop *loop, int listen_fd, int tls_fd);
+
+#endif
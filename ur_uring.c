@@ -0,0 +1,283 @@
+#include "ur_uring.h"
+
+#ifdef UR_HAVE_IO_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/*
+ * Minimal io_uring driver on the raw system calls, so the server does not
+ * need liburing on the target. It only covers what the connection code
+ * uses: multishot accept and recv from a provided buffer ring, gathered
+ * sends, file reads and cancellation by descriptor.
+ *
+ * The required kernel is 6.0 (multishot recv). There is no feature bit for
+ * that, so we probe for IORING_OP_SEND_ZC, which arrived in the same
+ * release; anything older falls back to epoll.
+ */
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                     void *arg, size_t arg_size) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static int probe_opcode(uring *ring, int opcode) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = 0;
+
+    if (probe && sys_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        opcode <= probe->last_op) {
+        supported = (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+    return supported;
+}
+
+static int setup_buffers(uring *ring) {
+    ring->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)ring->buf_ring,
+        .ring_entries = URING_BUFFERS,
+        .bgid = URING_BUFFER_GROUP
+    };
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+
+    ring->buf_base = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (!ring->buf_base) return -1;
+
+    for (unsigned id = 0; id < URING_BUFFERS; id++) {
+        struct io_uring_buf *buf = &ring->buf_ring->bufs[id];
+        buf->addr = (uintptr_t)(ring->buf_base + (size_t)id * URING_BUFFER_SIZE);
+        buf->len = URING_BUFFER_SIZE;
+        buf->bid = id;
+    }
+    ring->buf_tail = URING_BUFFERS;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int uring_init(uring *ring) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+
+    ring->fd = sys_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0) return -1;
+
+    ring->features = params.features;
+    if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        goto fail;
+    }
+
+    // Both rings share one mapping (IORING_FEAT_SINGLE_MMAP)
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (cq_size > ring->sq_ring_size) ring->sq_ring_size = cq_size;
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    // Slot i of the index array always points at SQE i
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+
+    char *cq = ring->sq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (!probe_opcode(ring, IORING_OP_SEND_ZC)) goto fail;
+    if (setup_buffers(ring) < 0) goto fail;
+
+    return 0;
+
+fail:
+    uring_free(ring);
+    return -1;
+}
+
+void uring_free(uring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->buf_ring) munmap(ring->buf_ring, ring->buf_ring_size);
+    free(ring->buf_base);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static unsigned pending(uring *ring) {
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int uring_submit(uring *ring) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned count = pending(ring);
+    if (count == 0) return 0;
+
+    int ret;
+    do {
+        ret = sys_enter(ring->fd, count, 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+struct io_uring_sqe* uring_get_sqe(uring *ring, uring_op *op) {
+    if (pending(ring) >= ring->sq_entries) {
+        uring_submit(ring);
+        if (pending(ring) >= ring->sq_entries) return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)op;
+    return sqe;
+}
+
+int uring_wait(uring *ring, int timeout_ms) {
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long)(timeout_ms % 1000) * 1000000
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = timeout_ms >= 0 ? (uintptr_t)&ts : 0
+    };
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    int ret = sys_enter(ring->fd, pending(ring), 1,
+                        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY)) return 0;
+    return ret;
+}
+
+void uring_dispatch(uring *ring, void (*poll_hook)(void *ctx, uint64_t user_data, int res, unsigned flags),
+                    void *ctx) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+
+        // Release the slot before the callback, which may queue more work
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (user_data & 1) {
+            poll_hook(ctx, user_data, res, flags);
+        } else if (user_data) {
+            uring_op *op = (uring_op *)(uintptr_t)user_data;
+            op->callback(op, res, flags);
+        }
+
+        if (head == tail) tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+const char* uring_buffer(uring *ring, unsigned flags) {
+    unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+    return ring->buf_base + (size_t)id * URING_BUFFER_SIZE;
+}
+
+void uring_buffer_recycle(uring *ring, unsigned flags) {
+    if (!(flags & IORING_CQE_F_BUFFER)) return;
+
+    unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(ring->buf_base + (size_t)id * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = id;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    // A short send completes with what went out; the caller submits the rest
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, off_t offset) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+}
+
+void uring_prep_cancel_fd(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef UR_URING_H
+#define UR_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 128
+#define URING_BUFFER_SIZE 8192
+#define URING_BUFFER_GROUP 0
+
+typedef struct uring_op uring_op;
+
+// Completion callback; flags are the CQE flags (IORING_CQE_F_MORE, buffer id)
+typedef void (*uring_callback)(uring_op *op, int res, unsigned flags);
+
+// Embedded in whatever owns a request; its address is the request's user_data
+struct uring_op {
+    uring_callback callback;
+    void *data;
+};
+
+#ifdef UR_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+typedef struct {
+    int fd;
+    unsigned features;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    size_t sqes_size;
+
+    // Provided buffer ring that multishot receives pick from
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buf_base;
+    uint16_t buf_tail;
+} uring;
+
+// Returns -1 when the kernel lacks anything the server relies on
+int uring_init(uring *ring);
+
+void uring_free(uring *ring);
+
+// Flushes a full submission queue first; NULL only if the kernel takes nothing
+struct io_uring_sqe* uring_get_sqe(uring *ring, uring_op *op);
+
+int uring_submit(uring *ring);
+
+// Submits pending work and waits up to timeout_ms (-1 forever) for a completion
+int uring_wait(uring *ring, int timeout_ms);
+
+// Runs the callback of every completion that is ready. Tagged user_data
+// (low bit set) goes to the poll hook instead of a uring_op.
+void uring_dispatch(uring *ring, void (*poll_hook)(void *ctx, uint64_t user_data, int res, unsigned flags),
+                    void *ctx);
+
+const char* uring_buffer(uring *ring, unsigned flags);
+
+void uring_buffer_recycle(uring *ring, unsigned flags);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd);
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd);
+
+// msg and the iovec it points to must stay put until the completion
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg);
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, off_t offset);
+
+void uring_prep_cancel_fd(struct io_uring_sqe *sqe, int fd);
+
+#endif
+
+#endif